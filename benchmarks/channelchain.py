@@ -0,0 +1,54 @@
+#!/usr/bin/env python
+
+"""Create a chain of greenstacks connected by channels and send a sequence
+of values from one end to the other, where each greenstack increments a
+value before passing it along.
+"""
+
+import optparse
+import time
+
+import greenstack
+
+
+def link(src, dst):
+    for value in src:
+        dst.send(value + 1)
+    dst.close()
+
+
+def chain(n, count):
+    sched = greenstack.Scheduler()
+    first = ch = greenstack.channel()
+    for i in range(n):
+        next_ch = greenstack.channel()
+        sched.spawn(link, ch, next_ch)
+        ch = next_ch
+    results = []
+    sched.spawn(lambda: results.extend(ch))
+
+    def feed():
+        first.send_sequence(range(count))
+        first.close()
+    sched.spawn(feed)
+    sched.run()
+    return results[-1]
+
+if __name__ == '__main__':
+    p = optparse.OptionParser(
+        usage='%prog [-n NUM_GREENSTACKS] [-c COUNT]', description=__doc__)
+    p.add_option(
+        '-n', type='int', dest='num_greenstacks', default=1000,
+        help='The number of greenstacks in the chain.')
+    p.add_option(
+        '-c', type='int', dest='count', default=100,
+        help='The number of values sent down the chain.')
+    options, args = p.parse_args()
+
+    if len(args) != 0:
+        p.error('unexpected arguments: %s' % ', '.join(args))
+
+    start_time = time.time()
+    result = chain(options.num_greenstacks, options.count)
+    print('Result: %d' % result)
+    print('%f seconds' % (time.time() - start_time))
@@ -1,35 +1,8 @@
 /* vim:set noet ts=8 sw=8 : */
 
-#define GREENSTACK_MODULE
-
 /* explaination of everything would go here but i'm probably just going to delete this */
 
-#include "greenstack.h"
-#include "structmember.h"
-
-/* Python <= 2.5 support */
-#if PY_MAJOR_VERSION < 3
-#ifndef Py_REFCNT
-#  define Py_REFCNT(ob) (((PyObject *) (ob))->ob_refcnt)
-#endif
-#ifndef Py_TYPE
-#  define Py_TYPE(ob)   (((PyObject *) (ob))->ob_type)
-#endif
-#ifndef PyVarObject_HEAD_INIT
-#  define PyVarObject_HEAD_INIT(type, size) \
-	PyObject_HEAD_INIT(type) size,
-#endif
-#endif
-
-#if PY_VERSION_HEX < 0x02060000
-#define PyLong_FromSsize_t PyInt_FromLong
-#endif
-
-#if PY_VERSION_HEX < 0x02050000
-typedef int Py_ssize_t;
-#endif
-
-extern PyTypeObject PyGreenstack_Type;
+#include "greenstack_private.h"
 
 /* Defines that customize greenstack module behaviour */
 #ifndef GREENSTACK_USE_GC
@@ -60,7 +33,7 @@ static PyGreenstack* volatile ts_target = NULL;
 /* Strong reference to the switching from greenstack after the switch */
 static PyGreenstack* volatile ts_origin = NULL;
 /* Strong reference to the current greenstack in this thread state */
-static PyGreenstack* volatile ts_current = NULL;
+PyGreenstack* volatile ts_current = NULL;
 /* NULL if error, otherwise args tuple to pass around during coro switch */
 static PyObject* volatile ts_passaround_args = NULL;
 static PyObject* volatile ts_passaround_kwargs = NULL;
@@ -68,9 +41,6 @@ static PyObject* volatile ts_passaround_kwargs = NULL;
 /***********************************************************/
 /* Thread-aware routines, switching global variables when needed */
 
-#define STATE_OK    (ts_current->run_info == PyThreadState_GET()->dict \
-                     || !green_updatecurrent())
-
 static PyObject* ts_curkey;
 static PyObject* ts_delkey;
 #if GREENSTACK_USE_TRACING
@@ -78,9 +48,9 @@ static PyObject* ts_tracekey;
 static PyObject* ts_event_switch;
 static PyObject* ts_event_throw;
 #endif
-static PyObject* PyExc_GreenstackError;
-static PyObject* PyExc_GreenstackExit;
-static PyObject* ts_empty_tuple;
+PyObject* PyExc_GreenstackError;
+PyObject* PyExc_GreenstackExit;
+PyObject* ts_empty_tuple;
 static PyObject* ts_empty_dict;
 
 /* 
@@ -94,6 +64,19 @@ static PyObject* ts_empty_dict;
 static struct coro_stack stack_cache[STACK_CACHE_SIZE];
 static int stack_cache_top;
 
+#if GREENSTACK_USE_SWITCH_TIMING
+/* When the switch in progress, the greenstack being started and the one
+ * being torn down started, in gs_timing_now() ticks */
+static PY_UINT64_T ts_switch_started;
+static PY_UINT64_T ts_create_started;
+static PY_UINT64_T ts_teardown_started;
+#endif
+
+/* A dying greenstack is still running on its stack while it switches away,
+ * so the stack is parked here and only returned to the cache by whoever
+ * gets switched to next. */
+static struct coro_stack ts_dead_stack;
+
 /* State handlers are used by C extensions to save and restore custom state.
  * Switch wrappers are called by g_switch and state initializers are called
  * from g_trampoline. */
@@ -140,12 +123,13 @@ static PyGreenstack* green_create_main(void)
 	coro_create(&gmain->context, NULL, NULL, NULL, 0);
 	gmain->stack = (void *) 1;
 	gmain->stack_size = (size_t) -1;
+	gmain->started_at = gs_coarse_clock_ns();
 	gmain->run_info = dict;
 	Py_INCREF(dict);
 	return gmain;
 }
 
-static int green_updatecurrent(void)
+int green_updatecurrent(void)
 {
 	PyObject *exc, *val, *tb;
 	PyThreadState* tstate;
@@ -212,6 +196,8 @@ green_updatecurrent_retry:
 	/* release an extra reference */
 	Py_DECREF(current);
 
+	gs_stats_attach(tstate->dict);
+
 	/* restore current exception */
 	PyErr_Restore(exc, val, tb);
 
@@ -237,6 +223,19 @@ static PyObject* green_statedict(PyGreenstack* g)
 
 /***********************************************************/
 
+static void g_release_dead_stack(void)
+{
+	if (ts_dead_stack.sptr == NULL)
+		return;
+	if (STACK_CACHE_FULL) {
+		coro_stack_free(&ts_dead_stack);
+		ts_stats->stack_frees++;
+	} else {
+		stack_cache[stack_cache_top++] = ts_dead_stack;
+	}
+	ts_dead_stack.sptr = NULL;
+}
+
 static void g_realswitchstack(void *next)
 {
 	PyThreadState *tstate;
@@ -257,9 +256,37 @@ static void g_realswitchstack(void *next)
 	Py_INCREF(ts_target);
 	ts_current = ts_target;
 
+	/* charge the time since it was switched to, scaled up for the
+	 * switches that were not timed */
+	if (current->cpu_stamp != 0) {
+		current->cpu_time += (gs_cpu_now() - current->cpu_stamp) * gs_cpu_sample;
+		current->cpu_stamp = 0;
+	}
+	ts_target->switch_count++;
+	/* the coarse clock is read from the vDSO, without a system call */
+	current->last_switch = gs_coarse_clock_ns();
+	if (gs_cpu_sample != 0 && --gs_cpu_countdown == 0) {
+		gs_cpu_countdown = gs_cpu_next_sample();
+		ts_target->cpu_stamp = gs_cpu_now();
+	}
+
+#if GREENSTACK_USE_SWITCH_TIMING
+	ts_switch_started = gs_timing_now();
+#endif
 	coro_transfer(&current->context, &ts_target->context);
+#if GREENSTACK_USE_SWITCH_TIMING
+	if (ts_teardown_started != 0) {
+		gs_timing_record(&ts_timing[GS_TIMING_TEARDOWN],
+		                 gs_timing_now() - ts_teardown_started);
+		ts_teardown_started = 0;
+	} else {
+		gs_timing_record(&ts_timing[GS_TIMING_SWITCH],
+		                 gs_timing_now() - ts_switch_started);
+	}
+#endif
 
 	/* restore state */
+	g_release_dead_stack();
 	tstate = PyThreadState_GET();
 	tstate->recursion_depth = recursion_depth;
 	tstate->frame = current->top_frame;
@@ -268,7 +295,22 @@ static void g_realswitchstack(void *next)
 	tstate->exc_traceback = exc_traceback;
 }
 
+int gs_stack_cache(struct coro_stack** stacks)
+{
+	*stacks = stack_cache;
+	return stack_cache_top;
+}
+
+PyGreenstack* gs_thread_current(PyObject* dict)
+{
+	/* the other threads had theirs saved by green_updatecurrent() */
+	if (ts_current->run_info == dict)
+		return ts_current;
+	return (PyGreenstack*) PyDict_GetItem(dict, ts_curkey);
+}
+
 static void g_switchstack(PyGreenstack *target) {
+	ts_stats->switches++;
 	ts_target = target;
 	PyGreenstack_CALL_SWITCH(statehandlers);
 	ts_target = NULL;
@@ -307,7 +349,7 @@ g_calltrace(PyObject* tracefunc, PyObject* event, PyGreenstack* origin, PyGreens
 }
 #endif
 
-static PyObject *
+PyObject *
 g_switch(PyGreenstack* target, PyObject* args, PyObject* kwargs)
 {
 	/* _consumes_ a reference to the args tuple and kwargs dict,
@@ -468,6 +510,9 @@ static void g_trampoline(struct trampoline_data *data) {
 	PyGreenstack *parent;
 #if GREENSTACK_USE_TRACING
 	PyObject *tracefunc;
+#endif
+#if GREENSTACK_USE_SWITCH_TIMING
+	PY_UINT64_T now;
 #endif
 	statehandler *handler;
 
@@ -476,6 +521,8 @@ static void g_trampoline(struct trampoline_data *data) {
 	PyObject *args = data->args;
 	PyObject *kwargs = data->kwargs;
 
+	g_release_dead_stack();
+
 	/* now use run_info to store the statedict */
 	o = self->run_info;
 	self->run_info = green_statedict(self->parent);
@@ -512,6 +559,17 @@ static void g_trampoline(struct trampoline_data *data) {
 		handler = handler->next;
 	}
 
+#if GREENSTACK_USE_SWITCH_TIMING
+	now = gs_timing_now();
+	gs_timing_record(&ts_timing[GS_TIMING_CREATE], now - ts_create_started);
+	if (ts_teardown_started != 0) {
+		/* a dying greenstack handed over to this one */
+		gs_timing_record(&ts_timing[GS_TIMING_TEARDOWN],
+		                 now - ts_teardown_started);
+		ts_teardown_started = 0;
+	}
+#endif
+
 	if (args == NULL) {
 		/* pending exception */
 		result = NULL;
@@ -523,18 +581,25 @@ static void g_trampoline(struct trampoline_data *data) {
 		Py_XDECREF(kwargs);
 	}
 	Py_DECREF(run);
+#if GREENSTACK_USE_SWITCH_TIMING
+	ts_teardown_started = gs_timing_now();
+#endif
+	gs_list_remove(&self->live);
 	result = g_handle_exit(result);
+	ts_stats->deaths++;
+	ts_stats->stack_bytes_live -= self->stack_size;
 
-	/* free the stack */
-	if (STACK_CACHE_FULL) {
-		coro_stack_free(&stack_cache[stack_cache_top--]);
-	}
-	stack_cache[stack_cache_top].sptr = self->stack;
-	stack_cache[stack_cache_top].ssze = self->stack_size;
-	stack_cache_top++;
+	/* free the stack once we are off it */
+	ts_dead_stack.sptr = self->stack;
+	ts_dead_stack.ssze = self->stack_size;
 	self->stack = NULL;
 	/* leave stack_size where it is as an indication the greenstack was once alive */
 
+	if (self->sched != NULL) {
+		/* let the scheduler pick who runs next */
+		result = gs_sched_exit(self, result);
+	}
+
 	/* jump back to parent */
 	for (parent = self->parent; parent != NULL; parent = parent->parent) {
 		result = g_switch(parent, result, NULL);
@@ -598,15 +663,25 @@ static int g_create(PyGreenstack *self, PyObject *args, PyObject *kwargs)
 	}
 
 	/* start the greenstack */
+#if GREENSTACK_USE_SWITCH_TIMING
+	ts_create_started = gs_timing_now();
+#endif
 	/* default stack size is 256k * sizeof(void *) */
 	if (stack_cache_top != 0) {
 		stack = stack_cache[--stack_cache_top];
+		ts_stats->stack_cache_hits++;
 	} else {
+		ts_stats->stack_cache_misses++;
 		if (!coro_stack_alloc(&stack, 0)) {
 			Py_DECREF(run);
 			return -1;
 		}
+		ts_stats->stack_allocs++;
 	}
+	ts_stats->creations++;
+	ts_stats->stack_bytes_live += stack.ssze;
+	gs_list_append(ts_live, &self->live);
+	self->started_at = gs_coarse_clock_ns();
 	self->stack = stack.sptr;
 	self->stack_size = stack.ssze;
 	data.self = self;
@@ -718,6 +793,9 @@ green_traverse(PyGreenstack *self, visitproc visit, void *arg)
 	Py_VISIT((PyObject*)self->parent);
 	Py_VISIT(self->run_info);
 	Py_VISIT(self->dict);
+	Py_VISIT(self->sched);
+	Py_VISIT(self->nursery);
+	Py_VISIT(self->sched_cohort);
 	return 0;
 }
 
@@ -741,6 +819,9 @@ static int green_clear(PyGreenstack* self)
 	Py_CLEAR(self->parent);
 	Py_CLEAR(self->run_info);
 	Py_CLEAR(self->dict);
+	Py_CLEAR(self->sched);
+	Py_CLEAR(self->nursery);
+	Py_CLEAR(self->sched_cohort);
 	return 0;
 }
 #endif
@@ -798,11 +879,16 @@ static void green_dealloc_safe(PyGreenstack* self)
 			return;
 		}
 	}
+	if (self->live.next != NULL)
+		gs_list_remove(&self->live);
 	if (self->weakreflist != NULL)
 		PyObject_ClearWeakRefs((PyObject *) self);
 	Py_CLEAR(self->parent);
 	Py_CLEAR(self->run_info);
 	Py_CLEAR(self->dict);
+	Py_CLEAR(self->sched);
+	Py_CLEAR(self->nursery);
+	Py_CLEAR(self->sched_cohort);
 	Py_TYPE(self)->tp_free((PyObject*) self);
 }
 
@@ -823,7 +909,7 @@ static void green_dealloc(PyGreenstack* self)
 #define green_dealloc green_dealloc_safe
 #endif
 
-static PyObject* single_result(PyObject* results)
+PyObject* single_result(PyObject* results)
 {
 	if (results != NULL && PyTuple_Check(results) &&
 	    PyTuple_GET_SIZE(results) == 1) {
@@ -836,7 +922,7 @@ static PyObject* single_result(PyObject* results)
 		return results;
 }
 
-static PyObject *
+PyObject *
 throw_greenstack(PyGreenstack *self, PyObject *typ, PyObject *val, PyObject *tb)
 {
 	/* Note: _consumes_ a reference to typ, val, tb */
@@ -1022,6 +1108,39 @@ static PyObject* green_getdead(PyGreenstack* self, void* c)
 		Py_RETURN_TRUE;
 }
 
+static PyObject* green_getpreempted(PyGreenstack* self, void* c)
+{
+	return PyLong_FromUnsignedLong(self->sched_preempted);
+}
+
+static PyObject* green_getcputime(PyGreenstack* self, void* c)
+{
+	PY_UINT64_T t = self->cpu_time;
+	if (self == ts_current && self->cpu_stamp != 0)
+		t += (gs_cpu_now() - self->cpu_stamp) * gs_cpu_sample;
+	return PyFloat_FromDouble(t / 1e9);
+}
+
+static PyObject* green_getswitchcount(PyGreenstack* self, void* c)
+{
+	return PyLong_FromUnsignedLong(self->switch_count);
+}
+
+static PyObject* green_getage(PyGreenstack* self, void* c)
+{
+	if (self->started_at == 0)
+		return PyFloat_FromDouble(0.0);
+	return PyFloat_FromDouble((gs_coarse_clock_ns() - self->started_at) / 1e9);
+}
+
+static PyObject* green_getidle(PyGreenstack* self, void* c)
+{
+	if (self->last_switch == 0 || (PyGreenstack_ACTIVE(self) &&
+	    self == gs_thread_current(self->run_info)))
+		return PyFloat_FromDouble(0.0);
+	return PyFloat_FromDouble((gs_coarse_clock_ns() - self->last_switch) / 1e9);
+}
+
 static PyObject* green_getrun(PyGreenstack* self, void* c)
 {
 	if (PyGreenstack_STARTED(self) || self->run_info == NULL) {
@@ -1132,7 +1251,7 @@ PyGreenstack_SetParent(PyGreenstack *g, PyGreenstack *nparent)
 	return green_setparent((PyGreenstack*) g, (PyObject *) nparent, NULL);
 }
 
-static PyGreenstack *
+PyGreenstack *
 PyGreenstack_New(PyObject *run, PyGreenstack *parent)
 {
 	PyGreenstack* g = NULL;
@@ -1236,6 +1355,16 @@ static PyGetSetDef green_getsets[] = {
 	             NULL, /*XXX*/ NULL},
 	{"dead",     (getter)green_getdead,
 	             NULL, /*XXX*/ NULL},
+	{"preempted", (getter)green_getpreempted,
+	             NULL, "How many times the scheduler preempted it"},
+	{"cpu_time", (getter)green_getcputime,
+	             NULL, "Seconds of CPU time it used while CPU accounting was on"},
+	{"switch_count", (getter)green_getswitchcount,
+	             NULL, "How many times it was switched to"},
+	{"age",      (getter)green_getage,
+	             NULL, "Seconds since it started"},
+	{"idle",     (getter)green_getidle,
+	             NULL, "Seconds since it last ran, 0 while it runs"},
 	{NULL}
 };
 
@@ -1370,6 +1499,19 @@ static char* copy_on_greentype[] = {
 	NULL
 };
 
+int _greenstack_add_functions(PyObject* m, PyMethodDef* functions)
+{
+	PyMethodDef* def;
+	for (def = functions; def->ml_name != NULL; def++) {
+		PyObject* f = PyCFunction_NewEx(def, NULL, NULL);
+		if (f == NULL || PyModule_AddObject(m, def->ml_name, f) < 0) {
+			Py_XDECREF(f);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 #if PY_MAJOR_VERSION >= 3
 #define INITERROR return NULL
 
@@ -1478,6 +1620,72 @@ initgreenstack(void)
 	PyModule_AddObject(m, "GreenstackExit", PyExc_GreenstackExit);
 	PyModule_AddObject(m, "GREENSTACK_USE_GC", PyBool_FromLong(GREENSTACK_USE_GC));
 	PyModule_AddObject(m, "GREENSTACK_USE_TRACING", PyBool_FromLong(GREENSTACK_USE_TRACING));
+	PyModule_AddObject(m, "GREENSTACK_USE_SWITCH_TIMING", PyBool_FromLong(GREENSTACK_USE_SWITCH_TIMING));
+
+	if (_greenstack_sched_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_timer_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_io_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_uring_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_channel_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_lock_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_queue_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_thread_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_nursery_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_preempt_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_asyncio_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_socket_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_shm_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_stats_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_profile_init(m) < 0)
+	{
+		INITERROR;
+	}
+	if (_greenstack_watchdog_init(m) < 0)
+	{
+		INITERROR;
+	}
 
 	/* also publish module-level data as attributes of the greentype. */
 	for (p=copy_on_greentype; *p; p++) {
@@ -1508,6 +1716,7 @@ initgreenstack(void)
 		(void *) PyGreenstack_SetParent;
 	_PyGreenstack_API[PyGreenstack_AddStateHandler_NUM] =
 		(void *) PyGreenstack_AddStateHandler;
+	_PyGreenstack_API[PyGreenstack_GetStats_NUM] = (void *) PyGreenstack_GetStats;
 
 #ifdef GREENSTACK_USE_PYCAPSULE
 	c_api_object = PyCapsule_New((void *) _PyGreenstack_API, "greenstack._C_API", NULL);
@@ -15,6 +15,14 @@
 extern "C" {
 #endif
 
+#ifdef GREENSTACK_MODULE
+/* A link of an intrusive doubly linked list; see greenstack_private.h */
+struct _gs_link {
+	struct _gs_link* next;
+	struct _gs_link* prev;
+};
+#endif
+
 #define GREENSTACK_VERSION "0.6"
 
 typedef struct _greenstack {
@@ -31,6 +39,31 @@ typedef struct _greenstack {
 	 * platform-dependent and require a bunch of macros to be defined,
 	 * which I don't want to make anyone do. */
 	coro_context context;
+	/* The scheduler that spawned this greenstack, if any, and its
+	 * bookkeeping flags; see greenstack_sched.c. */
+	PyObject *sched;
+	unsigned int sched_flags;
+	/* The nursery it was spawned in, if any, until it finishes */
+	PyObject *nursery;
+	/* Its priority class, and its deadline if it has one */
+	int sched_priority;
+	PY_UINT64_T sched_deadline;
+	/* How many times it was preempted */
+	unsigned long sched_preempted;
+	/* Its cohort key if one was set; see greenstack_sched.c */
+	PyObject *sched_cohort;
+	/* Time spent running in nanoseconds, when it was last switched to
+	 * if that switch was timed, and how many times it was switched to;
+	 * see greenstack_stats.c */
+	PY_UINT64_T cpu_time;
+	PY_UINT64_T cpu_stamp;
+	unsigned long switch_count;
+	/* Its link in the list of live greenstacks of its thread, NULL if it
+	 * was never in one, and when it started and last switched away on
+	 * the coarse clock; see greenstack_stats.c */
+	struct _gs_link live;
+	PY_UINT64_T started_at;
+	PY_UINT64_T last_switch;
 #endif
 } PyGreenstack;
 
@@ -53,6 +86,25 @@ struct _statehandler {
 	struct _statehandler *next;
 };
 
+/* Counters kept for each thread; see PyGreenstack_GetStats() */
+typedef struct {
+	PY_UINT64_T switches;           /* transfers between greenstacks */
+	PY_UINT64_T creations;          /* greenstacks started */
+	PY_UINT64_T deaths;             /* greenstacks that finished */
+	PY_UINT64_T stack_cache_hits;   /* stacks reused from the cache */
+	PY_UINT64_T stack_cache_misses; /* stacks that had to be allocated */
+	PY_UINT64_T stack_allocs;       /* mmap() calls for stacks */
+	PY_UINT64_T stack_frees;        /* munmap() calls for stacks */
+	size_t stack_bytes_live;        /* reserved by running greenstacks */
+	/* The rest is shared by all threads */
+	size_t stack_bytes_cached;      /* reserved by the stack cache */
+	size_t stacks_cached;
+	/* Only filled in on request, as it takes a system call per stack;
+	 * the live bytes only count the stacks of this thread */
+	size_t resident_bytes_live;
+	size_t resident_bytes_cached;
+} PyGreenstack_Stats;
+
 #define PyGreenstack_CALL_SWITCH(next_void) { \
 	struct _statehandler *next = (struct _statehandler *) next_void; \
 	next->wrapper(next->next); \
@@ -73,6 +125,7 @@ struct _statehandler {
 #define PyGreenstack_Switch_NUM     6
 #define PyGreenstack_SetParent_NUM  7
 #define PyGreenstack_AddStateHandler_NUM 8
+#define PyGreenstack_GetStats_NUM   9
 
 #ifndef GREENSTACK_MODULE
 /* This section is used by modules that uses the greenstack C API */
@@ -142,6 +195,16 @@ static void **_PyGreenstack_API = NULL;
 	(* (int (*)(switchwrapperfunc wrapper, stateinitfunc stateinit)) \
 	_PyGreenstack_API[PyGreenstack_AddStateHandler_NUM])
 
+/*
+ * PyGreenstack_GetStats(PyGreenstack_Stats *stats, int resident)
+ *
+ * greenstack.stats(resident): fills in stats for the calling thread.
+ * Returns 0, or -1 with an exception.
+ */
+#define PyGreenstack_GetStats \
+	(* (int (*)(PyGreenstack_Stats *stats, int resident)) \
+	_PyGreenstack_API[PyGreenstack_GetStats_NUM])
+
 /* Macro that imports greenstack and initializes C API */
 #ifdef GREENSTACK_USE_PYCAPSULE
 #define PyGreenstack_Import() \
@@ -0,0 +1,389 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Bridging greenstacks and asyncio: as_awaitable() and await_().
+
+   as_awaitable(g) returns an asyncio future for the result of g, and
+   schedules a bridge to start g from a callback of the event loop.  The
+   bridge makes the greenstack running the loop the parent of g each time
+   it switches to it, so g comes back to the callback when it finishes,
+   dies or calls await_().  await_() turns its argument into a future and
+   switches it to the parent with a marker; the bridge then adds itself as
+   a done callback of that future, and when the future completes switches
+   back into g with its result, or throws its exception into it.  So every
+   step is a single switch between the loop's greenstack and g, with no
+   threads involved, and the loop runs its other callbacks in between.
+
+   Cancelling the future of as_awaitable() cancels the future g is
+   waiting for, which raises CancelledError from await_().
+*/
+
+#include "greenstack_private.h"
+
+typedef struct {
+	PyObject_HEAD
+	PyGreenstack* g;
+	PyObject* outer;        /* future for the result of g */
+	PyObject* inner;        /* future g is waiting for, or NULL */
+	PyObject* args;         /* to start g with, until it starts */
+	PyObject* kwargs;
+} GSBridge;
+
+static PyTypeObject GSBridge_Type;
+
+static PyObject* asyncio_module;
+/* what await_() switches to the loop with, along with the future */
+static PyObject* await_marker;
+
+static PyObject* asyncio_call(const char* name, PyObject* arg)
+{
+	PyObject* func;
+	PyObject* result;
+	if (asyncio_module == NULL) {
+		asyncio_module = PyImport_ImportModule("asyncio");
+		if (asyncio_module == NULL)
+			return NULL;
+	}
+	func = PyObject_GetAttrString(asyncio_module, name);
+	if (func == NULL)
+		return NULL;
+	result = PyObject_CallFunctionObjArgs(func, arg, NULL);
+	Py_DECREF(func);
+	return result;
+}
+
+/* Calls fut.name(arg), or fut.name() if arg is NULL, and drops the result */
+static int future_call(PyObject* fut, const char* name, PyObject* arg)
+{
+	PyObject* result = arg == NULL
+		? PyObject_CallMethod(fut, (char*) name, NULL)
+		: PyObject_CallMethod(fut, (char*) name, "O", arg);
+	if (result == NULL)
+		return -1;
+	Py_DECREF(result);
+	return 0;
+}
+
+static int future_done(PyObject* fut)
+{
+	PyObject* done = PyObject_CallMethod(fut, "done", NULL);
+	int r;
+	if (done == NULL)
+		return -1;
+	r = PyObject_IsTrue(done);
+	Py_DECREF(done);
+	return r;
+}
+
+/* Hands what g switched back to the loop with, or its death, to the
+ * futures */
+static int bridge_handle(GSBridge* b, PyObject* result)
+{
+	PyGreenstack* g = b->g;
+	PyObject *typ, *val, *tb;
+	PyObject* fut;
+	int done;
+
+	if (!PyGreenstack_ACTIVE(g)) {
+		g->sched_flags &= ~GS_BRIDGED;
+		if (result == NULL)
+			PyErr_Fetch(&typ, &val, &tb);
+		done = future_done(b->outer);
+		if (done != 0) {
+			/* cancelled meanwhile */
+			if (result == NULL) {
+				Py_XDECREF(typ);
+				Py_XDECREF(val);
+				Py_XDECREF(tb);
+			}
+			Py_XDECREF(result);
+			return done < 0 ? -1 : 0;
+		}
+		if (result != NULL) {
+			done = future_call(b->outer, "set_result", result);
+			Py_DECREF(result);
+			return done;
+		}
+		PyErr_NormalizeException(&typ, &val, &tb);
+		done = future_call(b->outer, "set_exception", val);
+		Py_XDECREF(typ);
+		Py_XDECREF(val);
+		Py_XDECREF(tb);
+		return done;
+	}
+	if (result == NULL)
+		return -1;
+	if (!PyTuple_CheckExact(result) || PyTuple_GET_SIZE(result) != 2 ||
+	    PyTuple_GET_ITEM(result, 0) != await_marker) {
+		Py_DECREF(result);
+		PyErr_SetString(PyExc_GreenstackError,
+		                "a greenstack run by as_awaitable() switched to "
+		                "the event loop without await_()");
+		return -1;
+	}
+	fut = PyTuple_GET_ITEM(result, 1);
+	Py_INCREF(fut);
+	Py_DECREF(result);
+	b->inner = fut;
+	return future_call(fut, "add_done_callback", (PyObject*) b);
+}
+
+/* Fails the future for the result of g with the current exception, which
+ * would otherwise only reach the exception handler of the loop and leave
+ * the future pending forever */
+static PyObject* bridge_fail(GSBridge* b)
+{
+	PyObject *typ, *val, *tb;
+	int r;
+
+	b->g->sched_flags &= ~GS_BRIDGED;
+	PyErr_Fetch(&typ, &val, &tb);
+	PyErr_NormalizeException(&typ, &val, &tb);
+	r = future_done(b->outer);
+	if (r == 0)
+		r = future_call(b->outer, "set_exception", val);
+	Py_XDECREF(typ);
+	Py_XDECREF(val);
+	Py_XDECREF(tb);
+	if (r < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+/* Runs g until it is back in the loop.  With fut NULL this starts it;
+ * otherwise it resumes it with the outcome of fut. */
+static PyObject* bridge_call(GSBridge* b, PyObject* args, PyObject* kwargs)
+{
+	PyGreenstack* g = b->g;
+	PyObject* fut = NULL;
+	PyObject* result;
+	PyObject *typ, *val, *tb;
+
+	if (!PyArg_UnpackTuple(args, "bridge", 0, 1, &fut))
+		return NULL;
+	if (!STATE_OK)
+		return NULL;
+	if (PyObject_SetAttrString((PyObject*) g, "parent", (PyObject*) ts_current) < 0)
+		return NULL;
+	if (fut == NULL) {
+		int done = future_done(b->outer);
+		if (done < 0)
+			return NULL;
+		if (done)
+			Py_RETURN_NONE;
+		g->sched_flags |= GS_BRIDGED;
+		args = b->args;
+		kwargs = b->kwargs;
+		b->args = NULL;
+		b->kwargs = NULL;
+		result = single_result(g_switch(g, args, kwargs));
+	} else {
+		Py_CLEAR(b->inner);
+		result = PyObject_CallMethod(fut, "result", NULL);
+		if (result == NULL) {
+			PyErr_Fetch(&typ, &val, &tb);
+			result = throw_greenstack(g, typ, val, tb);
+		} else {
+			args = PyTuple_Pack(1, result);
+			Py_DECREF(result);
+			result = args ? single_result(g_switch(g, args, NULL)) : NULL;
+		}
+	}
+	if (bridge_handle(b, result) < 0)
+		return bridge_fail(b);
+	Py_RETURN_NONE;
+}
+
+static PyObject* bridge_outer_done(GSBridge* b, PyObject* fut)
+{
+	PyObject* cancelled = PyObject_CallMethod(fut, "cancelled", NULL);
+	int r;
+	if (cancelled == NULL)
+		return NULL;
+	r = PyObject_IsTrue(cancelled);
+	Py_DECREF(cancelled);
+	if (r < 0)
+		return NULL;
+	if (r && b->inner != NULL && future_call(b->inner, "cancel", NULL) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static int bridge_traverse(GSBridge* b, visitproc visit, void* arg)
+{
+	Py_VISIT((PyObject*) b->g);
+	Py_VISIT(b->outer);
+	Py_VISIT(b->inner);
+	Py_VISIT(b->args);
+	Py_VISIT(b->kwargs);
+	return 0;
+}
+
+static int bridge_clear(GSBridge* b)
+{
+	Py_CLEAR(b->g);
+	Py_CLEAR(b->outer);
+	Py_CLEAR(b->inner);
+	Py_CLEAR(b->args);
+	Py_CLEAR(b->kwargs);
+	return 0;
+}
+
+static void bridge_dealloc(GSBridge* b)
+{
+	PyObject_GC_UnTrack(b);
+	bridge_clear(b);
+	Py_TYPE(b)->tp_free((PyObject*) b);
+}
+
+static PyMethodDef bridge_methods[] = {
+	{"_outer_done", (PyCFunction)bridge_outer_done, METH_O, NULL},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyTypeObject GSBridge_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack._Bridge",                   /* tp_name */
+	sizeof(GSBridge),                       /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)bridge_dealloc,             /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	(ternaryfunc)bridge_call,               /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	0,                                      /* tp_doc */
+	(traverseproc)bridge_traverse,          /* tp_traverse */
+	(inquiry)bridge_clear,                  /* tp_clear */
+	0,                                      /* tp_richcompare */
+	0,                                      /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	bridge_methods,                         /* tp_methods */
+};
+
+/***********************************************************/
+/* Module functions */
+
+PyDoc_STRVAR(mod_as_awaitable_doc,
+"as_awaitable(g, *args, **kwargs) -> asyncio.Future\n"
+"\n"
+"Return a future for the result of the greenstack g, which is started\n"
+"with args and kwargs from a callback of the current event loop.  g can\n"
+"wait for awaitables with await_().  Cancelling the future cancels what\n"
+"g is waiting for.\n");
+
+static PyObject* mod_as_awaitable(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	PyGreenstack* g;
+	GSBridge* b;
+	PyObject* loop;
+	PyObject* outer_done;
+	PyObject* r;
+
+	if (PyTuple_GET_SIZE(args) < 1 || !PyGreenstack_Check(PyTuple_GET_ITEM(args, 0))) {
+		PyErr_SetString(PyExc_TypeError,
+		                "as_awaitable() takes a greenstack as its first argument");
+		return NULL;
+	}
+	g = (PyGreenstack*) PyTuple_GET_ITEM(args, 0);
+	if (PyGreenstack_STARTED(g)) {
+		PyErr_SetString(PyExc_GreenstackError, "greenstack already started");
+		return NULL;
+	}
+	loop = asyncio_call("get_event_loop", NULL);
+	if (loop == NULL)
+		return NULL;
+	b = PyObject_GC_New(GSBridge, &GSBridge_Type);
+	if (b == NULL) {
+		Py_DECREF(loop);
+		return NULL;
+	}
+	Py_INCREF(g);
+	b->g = g;
+	b->inner = NULL;
+	b->args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+	Py_XINCREF(kwargs);
+	b->kwargs = kwargs;
+	b->outer = PyObject_CallMethod(loop, "create_future", NULL);
+	PyObject_GC_Track(b);
+	if (b->args == NULL || b->outer == NULL)
+		goto error;
+	outer_done = PyObject_GetAttrString((PyObject*) b, "_outer_done");
+	if (outer_done == NULL)
+		goto error;
+	r = future_call(b->outer, "add_done_callback", outer_done) < 0 ? NULL
+		: PyObject_CallMethod(loop, "call_soon", "O", (PyObject*) b);
+	Py_DECREF(outer_done);
+	if (r == NULL)
+		goto error;
+	Py_DECREF(r);
+	Py_DECREF(loop);
+	r = b->outer;
+	Py_INCREF(r);
+	Py_DECREF(b);
+	return r;
+
+error:
+	Py_DECREF(loop);
+	Py_DECREF(b);
+	return NULL;
+}
+
+PyDoc_STRVAR(mod_await_doc,
+"await_(awaitable) -> value\n"
+"\n"
+"Suspend the current greenstack, which must be run by as_awaitable(),\n"
+"until awaitable completes on the event loop, and return its result or\n"
+"raise its exception.\n");
+
+static PyObject* mod_await(PyObject* self, PyObject* awaitable)
+{
+	PyGreenstack* g;
+	PyObject* fut;
+	PyObject* args;
+
+	if (!STATE_OK)
+		return NULL;
+	g = ts_current;
+	if (!(g->sched_flags & GS_BRIDGED)) {
+		PyErr_SetString(PyExc_GreenstackError,
+		                "await_() must be called from a greenstack run "
+		                "by as_awaitable()");
+		return NULL;
+	}
+	fut = asyncio_call("ensure_future", awaitable);
+	if (fut == NULL)
+		return NULL;
+	args = Py_BuildValue("((ON))", await_marker, fut);
+	if (args == NULL)
+		return NULL;
+	return single_result(g_switch(g->parent, args, NULL));
+}
+
+static PyMethodDef asyncio_functions[] = {
+	{"as_awaitable", (PyCFunction)mod_as_awaitable,
+	 METH_VARARGS | METH_KEYWORDS, mod_as_awaitable_doc},
+	{"await_", (PyCFunction)mod_await, METH_O, mod_await_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_asyncio_init(PyObject* m)
+{
+	if (PyType_Ready(&GSBridge_Type) < 0)
+		return -1;
+	await_marker = PyObject_CallObject((PyObject*) &PyBaseObject_Type, NULL);
+	if (await_marker == NULL)
+		return -1;
+	return _greenstack_add_functions(m, asyncio_functions);
+}
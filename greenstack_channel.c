@@ -0,0 +1,924 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Channels: rendezvous between a sending and a receiving greenstack.
+
+   A channel has no buffer.  Whichever side comes first parks on the
+   channel with a waiter that lives on its C stack, and the other side
+   finds it there, hands the value over through the waiter and resumes it.
+   When a receiver is waiting, send() switches straight into it with a
+   single g_switch() by default, queueing itself behind whatever else is
+   ready, so a value going down a chain of greenstacks never touches the
+   ready queue on the way.
+
+   select() parks a greenstack on several channels at once, with one waiter
+   per case kept on its C stack.  Whoever fires one of them takes all the
+   others off their channels at the same time, so the greenstack is resumed
+   once, by a single switch, and nothing is left to clean up lazily.
+
+   The balance and preference attributes follow Stackless Python: the
+   balance is the number of senders waiting, or minus the number of
+   receivers waiting, and the preference says which side keeps running
+   after a handoff.
+*/
+
+#include "greenstack_private.h"
+
+struct _chan_select;
+struct _gs_channel;
+
+typedef struct _chan_waiter {
+	gs_link link;
+	PyGreenstack* g;        /* strong reference while waiting */
+	GSScheduler* sched;     /* the one g is parked in, kept alive by g */
+	struct _gs_channel* ch; /* kept alive by the caller */
+	struct _chan_select* sel; /* NULL unless waiting in select() */
+	PyObject* value;        /* what is being sent or was received */
+	int dir;                /* CHAN_SEND or CHAN_RECV */
+	int kind;               /* GS_ENTRY_RESUME, GS_ENTRY_THROW or CHAN_KIND_CLOSED */
+	int fired;              /* set once the other side has taken or given a value */
+} chan_waiter;
+
+/* The waiters of a select(), one per case, all for the same greenstack */
+typedef struct _chan_select {
+	chan_waiter* cases;
+	Py_ssize_t n;
+} chan_select;
+
+typedef struct _gs_channel {
+	PyObject_HEAD
+	gs_link senders;
+	gs_link receivers;
+	Py_ssize_t balance;
+	int preference;
+	int closing;
+	PyObject* weakreflist;
+} GSChannel;
+
+/* directions, which are also what a waiter adds to the balance */
+#define CHAN_SEND  1
+#define CHAN_RECV -1
+
+/* preference values */
+#define PREFER_RECEIVER -1
+#define PREFER_NEITHER   0
+#define PREFER_SENDER    1
+
+#define CHAN_CLOSED(ch) ((ch)->closing && (ch)->balance == 0)
+
+/* kind of a receiver woken by close() */
+#define CHAN_KIND_CLOSED -1
+
+#define WAITER_LINKED(w) ((w)->link.next != &(w)->link)
+
+static PyTypeObject GSChannel_Type;
+
+/* Returns the first waiter of a list that can take part in a handoff.  A
+ * greenstack that is already in the ready queue has been interrupted (by a
+ * Timeout for example) and is left alone: it unlinks itself once it runs,
+ * and giving it a value now would lose the value. */
+static chan_waiter* chan_first(gs_link* head)
+{
+	gs_link* l;
+	for (l = head->next; l != head; l = l->next) {
+		chan_waiter* w = (chan_waiter*) l;
+		if (!(w->g->sched_flags & GS_READY))
+			return w;
+	}
+	return NULL;
+}
+
+static int chan_check_waiter(chan_waiter* w)
+{
+	if (w->g->run_info != ts_current->run_info) {
+		PyErr_SetString(PyExc_GreenstackError,
+		                "cannot use a channel from a different thread");
+		return -1;
+	}
+	return 0;
+}
+
+static void chan_link(chan_waiter* w)
+{
+	gs_list_append(w->dir == CHAN_SEND ? &w->ch->senders : &w->ch->receivers,
+	               &w->link);
+	w->ch->balance += w->dir;
+}
+
+static void chan_unlink(chan_waiter* w)
+{
+	if (WAITER_LINKED(w)) {
+		gs_list_remove(&w->link);
+		w->ch->balance -= w->dir;
+	}
+}
+
+/* Marks w as fired and takes it off its channel, along with the other
+ * cases of its select() so that nobody else can fire them. */
+static void chan_take(chan_waiter* w)
+{
+	Py_ssize_t i;
+	w->fired = 1;
+	if (w->sel == NULL) {
+		chan_unlink(w);
+		return;
+	}
+	for (i = 0; i < w->sel->n; i++)
+		chan_unlink(&w->sel->cases[i]);
+}
+
+/* Resumes the greenstack of a waiter that was just handed a value.  With
+ * switch_now set, the current greenstack is queued and g runs straight
+ * away; otherwise g is queued and the current greenstack carries on. */
+static int chan_handoff(GSScheduler* s, chan_waiter* w, int switch_now)
+{
+	PyGreenstack* g = w->g;
+	PyObject* r;
+	if (w->sched != s) {
+		/* parked under another scheduler, which has to resume it */
+		return gs_sched_wake(w->sched, g, Py_None, GS_ENTRY_RESUME) < 0 ? -1 : 0;
+	}
+	if (switch_now && s->hub != NULL && s->hub != ts_current && g != s->hub) {
+		if (gs_sched_wake(s, ts_current, Py_None, GS_ENTRY_RESUME) < 0)
+			return -1;
+		r = gs_sched_switch(s, g, Py_None);
+	} else {
+		if (gs_sched_wake(s, g, Py_None, GS_ENTRY_RESUME) < 0)
+			return -1;
+		if (!switch_now)
+			return 0;
+		/* g can only be resumed by the loop */
+		if (gs_sched_wake(s, ts_current, Py_None, GS_ENTRY_RESUME) < 0)
+			return -1;
+		r = gs_sched_park(s);
+	}
+	if (r == NULL)
+		return -1;
+	Py_DECREF(r);
+	return 0;
+}
+
+/* If a receiver is waiting, hands it value and resumes it.  Returns 1 if
+ * so, 0 if there is no receiver and -1 on error. */
+static int chan_try_send(GSScheduler* s, GSChannel* ch, PyObject* value, int kind)
+{
+	chan_waiter* w = chan_first(&ch->receivers);
+	if (w == NULL)
+		return 0;
+	if (chan_check_waiter(w) < 0)
+		return -1;
+	chan_take(w);
+	Py_INCREF(value);
+	w->value = value;
+	w->kind = kind;
+	if (chan_handoff(s, w, ch->preference == PREFER_RECEIVER) < 0)
+		return -1;
+	return 1;
+}
+
+/* If a sender is waiting, takes its value and resumes it.  Returns 1 with
+ * a new reference in *value if so, 0 if there is no sender and -1 on
+ * error. */
+static int chan_try_receive(GSScheduler* s, GSChannel* ch, PyObject** value, int* kind)
+{
+	chan_waiter* w = chan_first(&ch->senders);
+	if (w == NULL)
+		return 0;
+	if (chan_check_waiter(w) < 0)
+		return -1;
+	chan_take(w);
+	*value = w->value;
+	*kind = w->kind;
+	w->value = NULL;
+	if (chan_handoff(s, w, ch->preference == PREFER_SENDER) < 0) {
+		Py_CLEAR(*value);
+		return -1;
+	}
+	return 1;
+}
+
+static void chan_waiter_init(chan_waiter* w, GSScheduler* s, GSChannel* ch,
+                             int dir, PyObject* value, int kind)
+{
+	Py_INCREF(ts_current);
+	w->g = ts_current;
+	w->sched = s;
+	w->ch = ch;
+	w->sel = NULL;
+	Py_XINCREF(value);
+	w->value = value;
+	w->dir = dir;
+	w->kind = kind;
+	w->fired = 0;
+	w->link.next = w->link.prev = &w->link;
+}
+
+/* Parks the current greenstack with its n waiters linked until one of
+ * them fires or t, if given, expires.  Every waiter is unlinked and has
+ * dropped its greenstack on return, and the unsent values of those that
+ * did not fire are dropped too. */
+static int chan_wait(GSScheduler* s, chan_waiter* ws, Py_ssize_t n, gs_timer* t)
+{
+	PyObject* r;
+	Py_ssize_t i;
+	int fired = 0;
+
+	for (i = 0; i < n; i++)
+		chan_link(&ws[i]);
+	for (;;) {
+		r = gs_sched_park(s);
+		if (r == NULL)
+			break;
+		Py_DECREF(r);
+		for (i = 0; i < n && !fired; i++)
+			fired = ws[i].fired;
+		if (fired || (t != NULL && !GS_TIMER_ARMED(t)))
+			break;
+		/* woken by someone else; keep waiting */
+	}
+	for (i = 0; i < n; i++) {
+		chan_unlink(&ws[i]);
+		Py_CLEAR(ws[i].g);
+		if (ws[i].dir == CHAN_SEND && !ws[i].fired)
+			Py_CLEAR(ws[i].value);
+	}
+	return r == NULL ? -1 : 0;
+}
+
+static int chan_recv_closed(void)
+{
+	PyErr_SetString(PyExc_ValueError, "receive on a closed channel");
+	return -1;
+}
+
+static int chan_send_closed(void)
+{
+	PyErr_SetString(PyExc_ValueError, "send on a closed channel");
+	return -1;
+}
+
+/* Returns a value that arrived through a channel, consuming it.  When the
+ * channel was closed instead, raises ValueError unless iterating, in which
+ * case NULL is returned without an exception. */
+static PyObject* chan_deliver(PyObject* value, int kind, int iterating)
+{
+	if (kind == CHAN_KIND_CLOSED) {
+		if (!iterating)
+			chan_recv_closed();
+		return NULL;
+	}
+	if (kind == GS_ENTRY_THROW) {
+		PyErr_SetObject((PyObject*) Py_TYPE(value), value);
+		Py_DECREF(value);
+		return NULL;
+	}
+	return value;
+}
+
+static int chan_send(GSChannel* ch, PyObject* value, int kind)
+{
+	GSScheduler* s;
+	chan_waiter self;
+	int err;
+
+	if (ch->closing)
+		return chan_send_closed();
+	s = gs_sched_current();
+	if (s == NULL)
+		return -1;
+	err = chan_try_send(s, ch, value, kind);
+	if (err == 0) {
+		chan_waiter_init(&self, s, ch, CHAN_SEND, value, kind);
+		err = chan_wait(s, &self, 1, NULL);
+	}
+	Py_DECREF(s);
+	return err < 0 ? -1 : 0;
+}
+
+static PyObject* chan_receive(GSChannel* ch, int iterating)
+{
+	GSScheduler* s;
+	chan_waiter self;
+	PyObject* value;
+	int kind;
+	int err;
+
+	s = gs_sched_current();
+	if (s == NULL)
+		return NULL;
+	err = chan_try_receive(s, ch, &value, &kind);
+	if (err == 0 && ch->closing) {
+		value = NULL;
+		kind = CHAN_KIND_CLOSED;
+		err = 1;
+	} else if (err == 0) {
+		chan_waiter_init(&self, s, ch, CHAN_RECV, NULL, GS_ENTRY_RESUME);
+		err = chan_wait(s, &self, 1, NULL);
+		value = self.value;
+		kind = self.kind;
+		if (err < 0)
+			Py_XDECREF(value);
+	}
+	Py_DECREF(s);
+	if (err < 0)
+		return NULL;
+	return chan_deliver(value, kind, iterating);
+}
+
+/***********************************************************/
+/* Channel operations */
+
+/* One case of a select(), made by recv_op() and send_op() */
+typedef struct {
+	PyObject_HEAD
+	GSChannel* ch;
+	PyObject* value;        /* what to send, NULL for a receive */
+} GSChannelOp;
+
+static PyTypeObject GSChannelOp_Type;
+
+static PyObject* chan_op_new(GSChannel* ch, PyObject* value)
+{
+	GSChannelOp* op = PyObject_GC_New(GSChannelOp, &GSChannelOp_Type);
+	if (op == NULL)
+		return NULL;
+	Py_INCREF(ch);
+	op->ch = ch;
+	Py_XINCREF(value);
+	op->value = value;
+	PyObject_GC_Track(op);
+	return (PyObject*) op;
+}
+
+static int chan_op_traverse(GSChannelOp* op, visitproc visit, void* arg)
+{
+	Py_VISIT((PyObject*) op->ch);
+	Py_VISIT(op->value);
+	return 0;
+}
+
+static int chan_op_clear(GSChannelOp* op)
+{
+	Py_CLEAR(op->ch);
+	Py_CLEAR(op->value);
+	return 0;
+}
+
+static void chan_op_dealloc(GSChannelOp* op)
+{
+	PyObject_GC_UnTrack((PyObject*) op);
+	chan_op_clear(op);
+	PyObject_GC_Del(op);
+}
+
+static PyObject* chan_op_getchannel(GSChannelOp* op, void* c)
+{
+	Py_INCREF(op->ch);
+	return (PyObject*) op->ch;
+}
+
+static PyObject* chan_op_getissend(GSChannelOp* op, void* c)
+{
+	return PyBool_FromLong(op->value != NULL);
+}
+
+static PyGetSetDef chan_op_getsets[] = {
+	{"channel", (getter)chan_op_getchannel, NULL,
+	 "The channel this operation is on."},
+	{"is_send", (getter)chan_op_getissend, NULL,
+	 "Whether this is a send rather than a receive."},
+	{NULL}
+};
+
+static PyTypeObject GSChannelOp_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.channel_op",                /* tp_name */
+	sizeof(GSChannelOp),                    /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)chan_op_dealloc,            /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"A send or receive on a channel, to be passed to select().", /* tp_doc */
+	(traverseproc)chan_op_traverse,         /* tp_traverse */
+	(inquiry)chan_op_clear,                 /* tp_clear */
+	0,                                      /* tp_richcompare */
+	0,                                      /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	0,                                      /* tp_methods */
+	0,                                      /* tp_members */
+	chan_op_getsets,                        /* tp_getset */
+};
+
+/***********************************************************/
+/* Channel type */
+
+static PyObject* channel_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSChannel* ch;
+	static char* kwlist[] = {0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":channel", kwlist))
+		return NULL;
+	ch = (GSChannel*) type->tp_alloc(type, 0);
+	if (ch == NULL)
+		return NULL;
+	GS_LIST_INIT(&ch->senders);
+	GS_LIST_INIT(&ch->receivers);
+	ch->preference = PREFER_RECEIVER;
+	return (PyObject*) ch;
+}
+
+static int channel_traverse(GSChannel* ch, visitproc visit, void* arg)
+{
+	gs_link* l;
+	for (l = ch->senders.next; l != &ch->senders; l = l->next) {
+		Py_VISIT((PyObject*) ((chan_waiter*) l)->g);
+		Py_VISIT(((chan_waiter*) l)->value);
+	}
+	for (l = ch->receivers.next; l != &ch->receivers; l = l->next)
+		Py_VISIT((PyObject*) ((chan_waiter*) l)->g);
+	return 0;
+}
+
+/* Unlinks every waiter.  Only reached when the waiting greenstacks are
+ * garbage themselves, so they will never look at their waiters again. */
+static void channel_unlink_all(gs_link* head)
+{
+	while (!GS_LIST_EMPTY(head)) {
+		chan_waiter* w = (chan_waiter*) head->next;
+		gs_list_remove(&w->link);
+		Py_CLEAR(w->g);
+	}
+}
+
+static int channel_clear(GSChannel* ch)
+{
+	channel_unlink_all(&ch->senders);
+	channel_unlink_all(&ch->receivers);
+	ch->balance = 0;
+	return 0;
+}
+
+static void channel_dealloc(GSChannel* ch)
+{
+	PyObject_GC_UnTrack((PyObject*) ch);
+	if (ch->weakreflist != NULL)
+		PyObject_ClearWeakRefs((PyObject*) ch);
+	channel_clear(ch);
+	Py_TYPE(ch)->tp_free((PyObject*) ch);
+}
+
+PyDoc_STRVAR(channel_send_doc,
+"send(value)\n"
+"\n"
+"Hand value to a receiver, blocking until there is one.\n");
+
+static PyObject* channel_send(GSChannel* ch, PyObject* value)
+{
+	if (chan_send(ch, value, GS_ENTRY_RESUME) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(channel_receive_doc,
+"receive() -> value\n"
+"\n"
+"Take a value from a sender, blocking until there is one.\n");
+
+static PyObject* channel_receive(GSChannel* ch)
+{
+	return chan_receive(ch, 0);
+}
+
+PyDoc_STRVAR(channel_send_exception_doc,
+"send_exception(exc, *args)\n"
+"\n"
+"Like send(), but have the receiver raise exc(*args) instead of\n"
+"returning a value.\n");
+
+static PyObject* channel_send_exception(GSChannel* ch, PyObject* args)
+{
+	PyObject* typ;
+	PyObject* rest;
+	PyObject* exc;
+	int err;
+
+	if (PyTuple_GET_SIZE(args) < 1) {
+		PyErr_SetString(PyExc_TypeError,
+		                "send_exception() takes at least 1 argument");
+		return NULL;
+	}
+	typ = PyTuple_GET_ITEM(args, 0);
+	if (!PyExceptionClass_Check(typ)) {
+		PyErr_SetString(PyExc_TypeError,
+		                "send_exception() needs an exception class");
+		return NULL;
+	}
+	rest = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+	if (rest == NULL)
+		return NULL;
+	exc = PyObject_Call(typ, rest, NULL);
+	Py_DECREF(rest);
+	if (exc == NULL)
+		return NULL;
+	err = chan_send(ch, exc, GS_ENTRY_THROW);
+	Py_DECREF(exc);
+	if (err < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(channel_send_sequence_doc,
+"send_sequence(iterable) -> int\n"
+"\n"
+"Send every item of iterable in turn and return how many were sent.\n");
+
+static PyObject* channel_send_sequence(GSChannel* ch, PyObject* seq)
+{
+	PyObject* it;
+	PyObject* item;
+	Py_ssize_t n = 0;
+
+	it = PyObject_GetIter(seq);
+	if (it == NULL)
+		return NULL;
+	while ((item = PyIter_Next(it)) != NULL) {
+		int err = chan_send(ch, item, GS_ENTRY_RESUME);
+		Py_DECREF(item);
+		if (err < 0) {
+			Py_DECREF(it);
+			return NULL;
+		}
+		n++;
+	}
+	Py_DECREF(it);
+	if (PyErr_Occurred())
+		return NULL;
+	return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(channel_recv_op_doc,
+"recv_op() -> channel_op\n"
+"\n"
+"Return a receive from this channel, as a case for select().\n");
+
+static PyObject* channel_recv_op(GSChannel* ch)
+{
+	return chan_op_new(ch, NULL);
+}
+
+PyDoc_STRVAR(channel_send_op_doc,
+"send_op(value) -> channel_op\n"
+"\n"
+"Return a send of value on this channel, as a case for select().\n");
+
+static PyObject* channel_send_op(GSChannel* ch, PyObject* value)
+{
+	return chan_op_new(ch, value);
+}
+
+PyDoc_STRVAR(channel_close_doc,
+"close()\n"
+"\n"
+"Refuse any further send().  Senders already waiting are still served;\n"
+"once they are gone, receive() raises ValueError and iteration stops.\n"
+"Receivers that are waiting already are woken up to see that.\n");
+
+static PyObject* channel_close(GSChannel* ch)
+{
+	chan_waiter* w;
+
+	ch->closing = 1;
+	while (!GS_LIST_EMPTY(&ch->receivers)) {
+		w = (chan_waiter*) ch->receivers.next;
+		if (chan_check_waiter(w) < 0
+		    || gs_sched_wake(w->sched, w->g, Py_None, GS_ENTRY_RESUME) < 0)
+			return NULL;
+		chan_take(w);
+		w->value = NULL;
+		w->kind = CHAN_KIND_CLOSED;
+	}
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(channel_open_doc,
+"open()\n"
+"\n"
+"Undo close().\n");
+
+static PyObject* channel_open(GSChannel* ch)
+{
+	ch->closing = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject* channel_iternext(GSChannel* ch)
+{
+	return chan_receive(ch, 1);
+}
+
+static PyObject* channel_getbalance(GSChannel* ch, void* c)
+{
+	return PyLong_FromSsize_t(ch->balance);
+}
+
+static PyObject* channel_getclosing(GSChannel* ch, void* c)
+{
+	return PyBool_FromLong(ch->closing);
+}
+
+static PyObject* channel_getclosed(GSChannel* ch, void* c)
+{
+	return PyBool_FromLong(CHAN_CLOSED(ch));
+}
+
+static PyObject* channel_getpreference(GSChannel* ch, void* c)
+{
+	return PyLong_FromLong(ch->preference);
+}
+
+static int channel_setpreference(GSChannel* ch, PyObject* value, void* c)
+{
+	long pref;
+	if (value == NULL) {
+		PyErr_SetString(PyExc_AttributeError, "can't delete attribute");
+		return -1;
+	}
+	pref = PyLong_AsLong(value);
+	if (pref == -1 && PyErr_Occurred())
+		return -1;
+	ch->preference = pref < 0 ? PREFER_RECEIVER
+	               : pref > 0 ? PREFER_SENDER : PREFER_NEITHER;
+	return 0;
+}
+
+static PyMethodDef channel_methods[] = {
+	{"send", (PyCFunction)channel_send, METH_O, channel_send_doc},
+	{"receive", (PyCFunction)channel_receive, METH_NOARGS, channel_receive_doc},
+	{"send_exception", (PyCFunction)channel_send_exception, METH_VARARGS, channel_send_exception_doc},
+	{"send_sequence", (PyCFunction)channel_send_sequence, METH_O, channel_send_sequence_doc},
+	{"recv_op", (PyCFunction)channel_recv_op, METH_NOARGS, channel_recv_op_doc},
+	{"send_op", (PyCFunction)channel_send_op, METH_O, channel_send_op_doc},
+	{"close", (PyCFunction)channel_close, METH_NOARGS, channel_close_doc},
+	{"open", (PyCFunction)channel_open, METH_NOARGS, channel_open_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef channel_getsets[] = {
+	{"balance", (getter)channel_getbalance, NULL,
+	 "The number of senders waiting, or minus the number of receivers\n"
+	 "waiting."},
+	{"closing", (getter)channel_getclosing, NULL,
+	 "Whether close() has been called."},
+	{"closed", (getter)channel_getclosed, NULL,
+	 "Whether the channel is closing and no sender is left."},
+	{"preference", (getter)channel_getpreference, (setter)channel_setpreference,
+	 "Which side keeps running after a handoff: -1 (the default) switches\n"
+	 "to the receiver, 1 to the sender and 0 leaves the woken side in the\n"
+	 "ready queue."},
+	{NULL}
+};
+
+static PyTypeObject GSChannel_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.channel",                   /* tp_name */
+	sizeof(GSChannel),                      /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)channel_dealloc,            /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"channel() -> channel\n\n"
+	"A rendezvous point where send() blocks until a receive() takes the\n"
+	"value, and the other way round.  Iterating over a channel receives\n"
+	"until it is closed.", /* tp_doc */
+	(traverseproc)channel_traverse,         /* tp_traverse */
+	(inquiry)channel_clear,                 /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSChannel, weakreflist),       /* tp_weaklistoffset */
+	PyObject_SelfIter,                      /* tp_iter */
+	(iternextfunc)channel_iternext,         /* tp_iternext */
+	channel_methods,                        /* tp_methods */
+	0,                                      /* tp_members */
+	channel_getsets,                        /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	channel_new,                            /* tp_new */
+};
+
+/***********************************************************/
+/* Module functions */
+
+/* select() keeps the waiters of this many cases on the C stack */
+#define SELECT_STACK_CASES 8
+
+/* Tries every case in order without blocking.  Returns 1 and sets *result
+ * to the index and value of the first one that could go ahead, 0 if none
+ * could and -1 on error. */
+static int select_try(GSScheduler* s, PyObject** items, Py_ssize_t n,
+                      PyObject** result)
+{
+	Py_ssize_t i;
+	PyObject* value;
+	int kind;
+	int err;
+
+	for (i = 0; i < n; i++) {
+		GSChannelOp* op = (GSChannelOp*) items[i];
+		if (op->value != NULL) {
+			if (op->ch->closing)
+				return chan_send_closed();
+			err = chan_try_send(s, op->ch, op->value, GS_ENTRY_RESUME);
+			value = Py_None;
+			Py_INCREF(value);
+		} else {
+			err = chan_try_receive(s, op->ch, &value, &kind);
+			if (err == 0 && op->ch->closing)
+				return chan_recv_closed();
+			if (err > 0) {
+				value = chan_deliver(value, kind, 0);
+				if (value == NULL)
+					return -1;
+			}
+		}
+		if (err < 0)
+			return -1;
+		if (err > 0) {
+			*result = Py_BuildValue("(nN)", i, value);
+			return *result == NULL ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+PyDoc_STRVAR(mod_select_doc,
+"select(cases, timeout=None) -> (index, value) or None\n"
+"\n"
+"Wait for the first of several channel operations, made with recv_op()\n"
+"and send_op(), that can go ahead, and perform only that one.  Returns\n"
+"its index in cases and the value received, or None for a send.\n"
+"Returns None if timeout seconds pass first; a timeout of 0 only checks\n"
+"for a case that is ready.\n");
+
+static PyObject* mod_select(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	PyObject* cases;
+	PyObject* timeout_obj = Py_None;
+	double timeout = -1;
+	PyObject* seq;
+	PyObject** items;
+	Py_ssize_t n, i;
+	GSScheduler* s;
+	chan_waiter stack_cases[SELECT_STACK_CASES];
+	chan_select sel;
+	gs_timer t;
+	PyObject* result = NULL;
+	int err;
+	static char* kwlist[] = {"cases", "timeout", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:select", kwlist,
+	                                 &cases, &timeout_obj))
+		return NULL;
+	if (timeout_obj != Py_None) {
+		timeout = PyFloat_AsDouble(timeout_obj);
+		if (timeout == -1 && PyErr_Occurred())
+			return NULL;
+		if (timeout < 0)
+			timeout = 0;
+	}
+	seq = PySequence_Fast(cases, "select() needs a sequence of channel operations");
+	if (seq == NULL)
+		return NULL;
+	n = PySequence_Fast_GET_SIZE(seq);
+	items = PySequence_Fast_ITEMS(seq);
+	for (i = 0; i < n; i++) {
+		if (!PyObject_TypeCheck(items[i], &GSChannelOp_Type)) {
+			PyErr_SetString(PyExc_TypeError,
+			                "select() cases must come from recv_op() or send_op()");
+			Py_DECREF(seq);
+			return NULL;
+		}
+	}
+	s = gs_sched_current();
+	if (s == NULL) {
+		Py_DECREF(seq);
+		return NULL;
+	}
+
+	err = select_try(s, items, n, &result);
+	if (err != 0 || timeout == 0)
+		goto done;
+	if (n == 0 && timeout < 0) {
+		PyErr_SetString(PyExc_ValueError,
+		                "select() with no cases and no timeout would block forever");
+		err = -1;
+		goto done;
+	}
+
+	sel.n = n;
+	sel.cases = n <= SELECT_STACK_CASES ? stack_cases : PyMem_New(chan_waiter, n);
+	if (sel.cases == NULL) {
+		PyErr_NoMemory();
+		err = -1;
+		goto done;
+	}
+	for (i = 0; i < n; i++) {
+		GSChannelOp* op = (GSChannelOp*) items[i];
+		chan_waiter_init(&sel.cases[i], s, op->ch,
+		                 op->value != NULL ? CHAN_SEND : CHAN_RECV,
+		                 op->value, GS_ENTRY_RESUME);
+		sel.cases[i].sel = &sel;
+	}
+	gs_timer_init(&t);
+	if (timeout > 0)
+		gs_timer_arm(s, &t, timeout, ts_current, Py_None, GS_ENTRY_RESUME);
+	err = chan_wait(s, sel.cases, n, timeout > 0 ? &t : NULL);
+	gs_timer_cancel(s, &t);
+
+	for (i = 0; i < n; i++) {
+		chan_waiter* w = &sel.cases[i];
+		PyObject* value;
+		if (!w->fired)
+			continue;
+		if (w->dir == CHAN_SEND) {
+			value = Py_None;
+			Py_INCREF(value);
+		} else if (err < 0) {
+			Py_XDECREF(w->value);
+			break;
+		} else {
+			value = chan_deliver(w->value, w->kind, 0);
+			if (value == NULL) {
+				err = -1;
+				break;
+			}
+		}
+		if (err == 0) {
+			result = Py_BuildValue("(nN)", i, value);
+			if (result == NULL)
+				err = -1;
+		} else {
+			Py_DECREF(value);
+		}
+		break;
+	}
+	if (sel.cases != stack_cases)
+		PyMem_Free(sel.cases);
+
+done:
+	Py_DECREF(s);
+	Py_DECREF(seq);
+	if (err < 0)
+		return NULL;
+	if (result == NULL)
+		Py_RETURN_NONE;
+	return result;
+}
+
+static PyMethodDef channel_functions[] = {
+	{"select", (PyCFunction)mod_select, METH_VARARGS | METH_KEYWORDS, mod_select_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_channel_init(PyObject* m)
+{
+	if (PyType_Ready(&GSChannel_Type) < 0)
+		return -1;
+	if (PyType_Ready(&GSChannelOp_Type) < 0)
+		return -1;
+	Py_INCREF(&GSChannel_Type);
+	if (PyModule_AddObject(m, "channel", (PyObject*) &GSChannel_Type) < 0)
+		return -1;
+	return _greenstack_add_functions(m, channel_functions);
+}
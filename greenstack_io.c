@@ -0,0 +1,784 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Waiting for file descriptors: wait_readable() and wait_writable().
+
+   Each scheduler has its own epoll instance.  A descriptor is registered
+   the first time something waits on it, edge-triggered for both reading
+   and writing, and is then left registered, so a busy socket costs no
+   epoll_ctl() calls at all.  Edges that arrive while nobody is waiting
+   are remembered in the descriptor's record and consumed by the next wait,
+   which returns immediately.  As always with edge triggering, callers must
+   only wait after an operation has failed with EAGAIN, and the descriptor
+   must be passed to notify_close() before it is closed so that a new one
+   with the same number does not inherit the registration.
+
+   The scheduler polls epoll between passes over the ready queue, and
+   blocks in epoll_wait() instead of sleeping when nothing is ready.
+
+   sendfile() and splice() are built on the same waits: they loop over the
+   system call with the GIL released and park the greenstack whenever it
+   fails with EAGAIN, so the data never passes through Python objects.
+   A descriptor that could block the thread instead, such as a socket in
+   blocking mode, is refused.
+
+   A child forked after the scheduler used epoll would share the epoll
+   instance, the eventfd and the io_uring with its parent, and the two
+   processes would take each other's edges.  So each scheduler remembers
+   the process it set them up in, and the first call after a fork closes
+   the child's copies, sets up new ones on demand and wakes the waiters,
+   which register their descriptors again when they retry.
+*/
+
+#include "greenstack_private.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define IO_MAX_EVENTS 128
+
+/* Edges that mean each direction may be ready */
+#define IO_READ_EVENTS  (EPOLLIN | EPOLLPRI | EPOLLRDHUP | EPOLLHUP | EPOLLERR)
+#define IO_WRITE_EVENTS (EPOLLOUT | EPOLLHUP | EPOLLERR)
+
+typedef struct _gs_fd {
+	gs_link waiters[2];     /* indexed by GS_IO_* */
+	unsigned int ready;     /* edges seen while nobody was waiting */
+} gs_fd;
+
+/* Lives on the C stack of the parked greenstack */
+typedef struct {
+	gs_link link;
+	PyGreenstack* g;        /* strong reference while linked */
+	int fired;
+} io_waiter;
+
+/* The current process, kept up to date in forked children */
+static long io_pid;
+
+static void io_atfork_child(void)
+{
+	io_pid = (long) getpid();
+}
+
+void gs_io_init(gs_io* io)
+{
+	io->epfd = -1;
+	io->fds = NULL;
+	io->nfds = 0;
+	io->waiting = 0;
+	io->ring = NULL;
+	io->ring_state = GS_URING_UNTRIED;
+	io->inflight = 0;
+	io->wakefd = -1;
+	io->remote = 0;
+	io->pid = io_pid;
+}
+
+static int io_epoll(gs_io* io)
+{
+	if (io->epfd < 0) {
+		io->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (io->epfd < 0) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static gs_fd* io_lookup(gs_io* io, int fd)
+{
+	if (fd < 0 || fd >= io->nfds)
+		return NULL;
+	return io->fds[fd];
+}
+
+/* Unlinks a waiter and drops its reference */
+static void io_unlink(gs_io* io, io_waiter* w)
+{
+	PyGreenstack* g = w->g;
+	gs_list_remove(&w->link);
+	w->g = NULL;
+	io->waiting--;
+	Py_XDECREF(g);
+}
+
+/* Wakes everything waiting for one direction of f.  If nobody took the
+ * edge, it is kept for the next wait. */
+static int io_fire(GSScheduler* s, gs_fd* f, int dir)
+{
+	gs_link* head = &f->waiters[dir];
+	int taken = 0;
+	int err;
+
+	while (!GS_LIST_EMPTY(head)) {
+		io_waiter* w = (io_waiter*) head->next;
+		err = gs_sched_wake(s, w->g, Py_None, GS_ENTRY_RESUME);
+		if (err < 0)
+			return -1;
+		w->fired = 1;
+		taken |= err;
+		io_unlink(&s->io, w);
+	}
+	if (!taken)
+		f->ready |= 1 << dir;
+	return 0;
+}
+
+/* Returns the record for fd, registering it with epoll if it is new.
+ * Returns NULL with *always_ready set for descriptors epoll does not
+ * support, such as regular files. */
+static gs_fd* io_register(gs_io* io, int fd, int* always_ready)
+{
+	struct epoll_event ev;
+	gs_fd* f;
+
+	*always_ready = 0;
+	if (fd < 0) {
+		PyErr_SetString(PyExc_ValueError, "file descriptor cannot be a negative integer");
+		return NULL;
+	}
+	f = io_lookup(io, fd);
+	if (f != NULL)
+		return f;
+
+	if (io_epoll(io) < 0)
+		return NULL;
+	if (fd >= io->nfds) {
+		int n = io->nfds ? io->nfds : 64;
+		gs_fd** fds;
+		while (n <= fd)
+			n *= 2;
+		fds = (gs_fd**) PyMem_Realloc(io->fds, n * sizeof(gs_fd*));
+		if (fds == NULL) {
+			PyErr_NoMemory();
+			return NULL;
+		}
+		memset(fds + io->nfds, 0, (n - io->nfds) * sizeof(gs_fd*));
+		io->fds = fds;
+		io->nfds = n;
+	}
+
+	f = (gs_fd*) PyMem_Malloc(sizeof(gs_fd));
+	if (f == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	GS_LIST_INIT(&f->waiters[GS_IO_READ]);
+	GS_LIST_INIT(&f->waiters[GS_IO_WRITE]);
+	f->ready = 0;
+
+	ev.events = EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.u64 = 0;
+	ev.data.fd = fd;
+	if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev) < 0
+	    && (errno != EEXIST || epoll_ctl(io->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)) {
+		/* EEXIST is left over from a descriptor closed without
+		 * notify_close(), which is dealt with by MOD */
+		int err = errno;
+		PyMem_Free(f);
+		if (err == EPERM) {
+			*always_ready = 1;
+			return NULL;
+		}
+		errno = err;
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+	io->fds[fd] = f;
+	return f;
+}
+
+int gs_io_wait(GSScheduler* s, int fd, int dir, double timeout)
+{
+	gs_io* io = &s->io;
+	io_waiter w;
+	gs_timer t;
+	gs_fd* f;
+	PyObject* r;
+	int always_ready, timed_out;
+
+	if (gs_io_check_fork(s) < 0)
+		return -1;
+	f = io_register(io, fd, &always_ready);
+	if (f == NULL)
+		return always_ready ? 1 : -1;
+	if (f->ready & (1 << dir)) {
+		f->ready &= ~(1 << dir);
+		return 1;
+	}
+
+	Py_INCREF(ts_current);
+	w.g = ts_current;
+	w.fired = 0;
+	gs_list_append(&f->waiters[dir], &w.link);
+	io->waiting++;
+	gs_timer_init(&t);
+	if (timeout >= 0)
+		gs_timer_arm(s, &t, timeout, ts_current, Py_None, GS_ENTRY_RESUME);
+
+	r = gs_sched_park(s);
+
+	timed_out = timeout >= 0 && !w.fired && !GS_TIMER_ARMED(&t);
+	gs_timer_cancel(s, &t);
+	if (w.g != NULL)
+		io_unlink(io, &w);
+	if (r == NULL)
+		return -1;
+	Py_DECREF(r);
+	return !timed_out;
+}
+
+static void io_forget(gs_io* io, int fd)
+{
+	gs_fd* f = io_lookup(io, fd);
+	if (f == NULL)
+		return;
+	io->fds[fd] = NULL;
+	epoll_ctl(io->epfd, EPOLL_CTL_DEL, fd, NULL);
+	PyMem_Free(f);
+}
+
+int gs_io_notify_close(GSScheduler* s, int fd)
+{
+	gs_fd* f;
+	if (gs_io_check_fork(s) < 0)
+		return -1;
+	f = io_lookup(&s->io, fd);
+	if (f == NULL)
+		return 0;
+	/* the waiters will see the descriptor is gone when they retry */
+	if (io_fire(s, f, GS_IO_READ) < 0 || io_fire(s, f, GS_IO_WRITE) < 0)
+		return -1;
+	io_forget(&s->io, fd);
+	return 0;
+}
+
+int gs_io_check_fork(GSScheduler* s)
+{
+	gs_io* io = &s->io;
+	int fd;
+
+	if (io->pid == io_pid)
+		return 0;
+	/* only close our copies, the parent goes on using them */
+	if (io->wakefd >= 0) {
+		close(io->wakefd);
+		__atomic_store_n(&io->wakefd, -1, __ATOMIC_SEQ_CST);
+	}
+	if (io->epfd >= 0) {
+		close(io->epfd);
+		io->epfd = -1;
+	}
+	if (gs_uring_forked(s) < 0)
+		return -1;
+	for (fd = 0; fd < io->nfds; fd++) {
+		gs_fd* f = io->fds[fd];
+		if (f == NULL)
+			continue;
+		if (io_fire(s, f, GS_IO_READ) < 0 || io_fire(s, f, GS_IO_WRITE) < 0)
+			return -1;
+		io->fds[fd] = NULL;
+		PyMem_Free(f);
+	}
+	io->pid = io_pid;
+	return 1;
+}
+
+int gs_io_poll(GSScheduler* s, long timeout)
+{
+	gs_io* io = &s->io;
+	struct epoll_event events[IO_MAX_EVENTS];
+	int n, i;
+
+	if (io->inflight > 0) {
+		if (io->waiting == 0 && io->wakefd < 0)
+			return gs_uring_poll(s, timeout);
+		/* wait for both, in epoll */
+		if (gs_uring_submit(s) < 0)
+			return -1;
+		n = gs_uring_watch(s, io->epfd);
+		if (n < 0)
+			return -1;
+		if (n > 0)
+			timeout = 0;
+	}
+	if (io->epfd < 0)
+		return 0;
+	if (timeout == 0) {
+		/* not worth dropping the GIL for */
+		n = epoll_wait(io->epfd, events, IO_MAX_EVENTS, 0);
+	} else {
+		Py_BEGIN_ALLOW_THREADS
+		n = epoll_wait(io->epfd, events, IO_MAX_EVENTS,
+		               timeout < 0 ? -1 : (timeout > INT_MAX ? INT_MAX : (int) timeout));
+		Py_END_ALLOW_THREADS
+	}
+	if (n < 0) {
+		if (errno == EINTR)
+			return PyErr_CheckSignals();
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		gs_fd* f;
+		if (events[i].data.fd == io->wakefd) {
+			eventfd_t value;
+			eventfd_read(io->wakefd, &value);
+			continue;
+		}
+		f = io_lookup(io, events[i].data.fd);
+		if (f == NULL)
+			continue;
+		if ((events[i].events & IO_READ_EVENTS) && io_fire(s, f, GS_IO_READ) < 0)
+			return -1;
+		if ((events[i].events & IO_WRITE_EVENTS) && io_fire(s, f, GS_IO_WRITE) < 0)
+			return -1;
+	}
+	if (io->inflight > 0)
+		return gs_uring_reap(s);
+	return 0;
+}
+
+int gs_io_wake_init(GSScheduler* s)
+{
+	gs_io* io = &s->io;
+	struct epoll_event ev;
+	int fd;
+	if (gs_io_check_fork(s) < 0)
+		return -1;
+	if (io->wakefd >= 0)
+		return 0;
+	if (io_epoll(io) < 0)
+		return -1;
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	ev.data.fd = fd;
+	if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		close(fd);
+		return -1;
+	}
+	/* only now can gs_io_wake() use it; ordered with the inbox, see
+	 * sched_poll() */
+	__atomic_store_n(&io->wakefd, fd, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void gs_io_wake(gs_io* io)
+{
+	int fd = __atomic_load_n(&io->wakefd, __ATOMIC_SEQ_CST);
+	if (fd >= 0)
+		eventfd_write(fd, 1);
+}
+
+void gs_io_clear(gs_io* io)
+{
+	int fd, dir;
+	for (fd = 0; fd < io->nfds; fd++) {
+		gs_fd* f = io->fds[fd];
+		if (f == NULL)
+			continue;
+		for (dir = GS_IO_READ; dir <= GS_IO_WRITE; dir++) {
+			while (!GS_LIST_EMPTY(&f->waiters[dir]))
+				io_unlink(io, (io_waiter*) f->waiters[dir].next);
+		}
+		PyMem_Free(f);
+	}
+	PyMem_Free(io->fds);
+	gs_uring_clear(io);
+	if (io->wakefd >= 0)
+		close(io->wakefd);
+	if (io->epfd >= 0)
+		close(io->epfd);
+	gs_io_init(io);
+}
+
+int gs_io_traverse(gs_io* io, visitproc visit, void* arg)
+{
+	int fd, dir;
+	gs_link* l;
+	for (fd = 0; fd < io->nfds; fd++) {
+		gs_fd* f = io->fds[fd];
+		if (f == NULL)
+			continue;
+		for (dir = GS_IO_READ; dir <= GS_IO_WRITE; dir++) {
+			for (l = f->waiters[dir].next; l != &f->waiters[dir]; l = l->next)
+				Py_VISIT((PyObject*) ((io_waiter*) l)->g);
+		}
+	}
+	return gs_uring_traverse(io, visit, arg);
+}
+
+/***********************************************************/
+/* Module functions */
+
+static PyObject* io_wait(PyObject* args, PyObject* kwargs, int dir, const char* format)
+{
+	PyObject* file;
+	PyObject* timeout = Py_None;
+	GSScheduler* s;
+	double seconds = -1;
+	int fd, err;
+	static char* kwlist[] = {"fd", "timeout", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, format, kwlist, &file, &timeout))
+		return NULL;
+	fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0)
+		return NULL;
+	if (timeout != Py_None) {
+		seconds = PyFloat_AsDouble(timeout);
+		if (seconds == -1 && PyErr_Occurred())
+			return NULL;
+		if (seconds < 0)
+			seconds = 0;
+	}
+	s = gs_sched_current();
+	if (s == NULL)
+		return NULL;
+	err = gs_io_wait(s, fd, dir, seconds);
+	Py_DECREF(s);
+	if (err < 0)
+		return NULL;
+	return PyBool_FromLong(err);
+}
+
+PyDoc_STRVAR(mod_wait_readable_doc,
+"wait_readable(fd, timeout=None) -> bool\n"
+"\n"
+"Suspend the current greenstack until fd (a file descriptor or an object\n"
+"with a fileno() method) may be readable.  Returns False if timeout\n"
+"seconds passed first.  Only call this after a read failed with EAGAIN:\n"
+"descriptors are watched edge-triggered.\n");
+
+static PyObject* mod_wait_readable(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	return io_wait(args, kwargs, GS_IO_READ, "O|O:wait_readable");
+}
+
+PyDoc_STRVAR(mod_wait_writable_doc,
+"wait_writable(fd, timeout=None) -> bool\n"
+"\n"
+"Like wait_readable(), but waits for fd to be writable.\n");
+
+static PyObject* mod_wait_writable(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	return io_wait(args, kwargs, GS_IO_WRITE, "O|O:wait_writable");
+}
+
+PyDoc_STRVAR(mod_notify_close_doc,
+"notify_close(fd)\n"
+"\n"
+"Tell the scheduler that fd is about to be closed.  Greenstacks waiting\n"
+"on it are woken up.\n");
+
+static PyObject* mod_notify_close(PyObject* self, PyObject* file)
+{
+	GSScheduler* s;
+	int fd, err;
+
+	fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0)
+		return NULL;
+	s = gs_sched_current();
+	if (s == NULL)
+		return NULL;
+	err = gs_io_notify_close(s, fd);
+	Py_DECREF(s);
+	if (err < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+/* The most a single sendfile() or splice() call is asked to move, so that
+ * the GIL is taken back now and then during a large transfer. */
+#define IO_MAX_CHUNK ((size_t) 1 << 24)
+
+/* Waits until a transfer from in_fd to out_fd that failed with EAGAIN may
+ * make progress: for the input if it has nothing to read, else for the
+ * output.  Returns 0, or -1 with an exception. */
+static int transfer_wait(GSScheduler* s, int in_fd, int out_fd)
+{
+	struct pollfd p;
+	int n;
+
+	p.fd = in_fd;
+	p.events = POLLIN;
+	p.revents = 0;
+	n = poll(&p, 1, 0);
+	if (n < 0 && errno != EINTR) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	if (n == 0)
+		return gs_io_wait(s, in_fd, GS_IO_READ, -1) < 0 ? -1 : 0;
+	return gs_io_wait(s, out_fd, GS_IO_WRITE, -1) < 0 ? -1 : 0;
+}
+
+/* Raises ValueError and returns -1 if a transfer could block the thread on
+ * fd.  Regular files never wait for long, and splice() does not block on
+ * pipes with SPLICE_F_NONBLOCK; anything else must be non-blocking. */
+static int transfer_check(int fd, int use_splice)
+{
+	struct stat st;
+	int flags;
+
+	if (fstat(fd, &st) < 0 || (flags = fcntl(fd, F_GETFL)) < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	if (S_ISREG(st.st_mode) || (use_splice && S_ISFIFO(st.st_mode)) ||
+	    (flags & O_NONBLOCK))
+		return 0;
+	PyErr_Format(PyExc_ValueError,
+	             "file descriptor %d must be in non-blocking mode", fd);
+	return -1;
+}
+
+/* Moves up to count bytes from in_fd to out_fd with splice() if use_splice
+ * is set, else with sendfile(), which advances offset if it is given.
+ * Returns the number of bytes moved, which is less than count only at the
+ * end of the input, or -1 with an exception. */
+static Py_ssize_t transfer(int out_fd, int in_fd, off_t* offset,
+                           Py_ssize_t count, int use_splice)
+{
+	GSScheduler* s;
+	Py_ssize_t total = 0;
+	ssize_t n;
+	size_t len;
+	int err;
+
+	if (count < 0) {
+		PyErr_SetString(PyExc_ValueError, "count must not be negative");
+		return -1;
+	}
+	if (transfer_check(in_fd, use_splice) < 0 ||
+	    transfer_check(out_fd, use_splice) < 0)
+		return -1;
+	s = gs_sched_current();
+	if (s == NULL)
+		return -1;
+	while (total < count) {
+		len = (size_t) (count - total);
+		if (len > IO_MAX_CHUNK)
+			len = IO_MAX_CHUNK;
+		Py_BEGIN_ALLOW_THREADS
+		if (use_splice)
+			n = splice(in_fd, NULL, out_fd, NULL, len,
+			           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		else
+			n = sendfile(out_fd, in_fd, offset, len);
+		err = errno;
+		Py_END_ALLOW_THREADS
+		if (n > 0) {
+			total += n;
+			continue;
+		}
+		if (n == 0)
+			break;
+		if (err == EINTR) {
+			if (PyErr_CheckSignals() < 0)
+				goto fail;
+			continue;
+		}
+		if (err != EAGAIN && err != EWOULDBLOCK) {
+			errno = err;
+			PyErr_SetFromErrno(PyExc_OSError);
+			goto fail;
+		}
+		if (use_splice)
+			err = transfer_wait(s, in_fd, out_fd);
+		else
+			err = gs_io_wait(s, out_fd, GS_IO_WRITE, -1);
+		if (err < 0)
+			goto fail;
+	}
+	Py_DECREF(s);
+	return total;
+fail:
+	Py_DECREF(s);
+	return -1;
+}
+
+PyDoc_STRVAR(mod_sendfile_doc,
+"sendfile(out_fd, in_fd, offset, count) -> int\n"
+"\n"
+"Copy count bytes from in_fd, starting at offset, to out_fd with\n"
+"sendfile(2), suspending the current greenstack whenever out_fd is not\n"
+"ready for more.  If offset is None, in_fd's file position is used and\n"
+"advanced.  Returns the number of bytes sent, which is less than count\n"
+"only if the end of the file was reached.  Raises ValueError if out_fd\n"
+"is not a regular file and not in non-blocking mode.\n");
+
+static PyObject* mod_sendfile(PyObject* self, PyObject* args)
+{
+	PyObject* out_file;
+	PyObject* in_file;
+	PyObject* offset_obj;
+	PY_LONG_LONG offset_ll;
+	off_t offset;
+	Py_ssize_t count, n;
+	int out_fd, in_fd;
+
+	if (!PyArg_ParseTuple(args, "OOOn:sendfile",
+	                      &out_file, &in_file, &offset_obj, &count))
+		return NULL;
+	out_fd = PyObject_AsFileDescriptor(out_file);
+	if (out_fd < 0)
+		return NULL;
+	in_fd = PyObject_AsFileDescriptor(in_file);
+	if (in_fd < 0)
+		return NULL;
+	if (offset_obj == Py_None) {
+		n = transfer(out_fd, in_fd, NULL, count, 0);
+	} else {
+		offset_ll = PyLong_AsLongLong(offset_obj);
+		if (offset_ll == -1 && PyErr_Occurred())
+			return NULL;
+		if (offset_ll < 0) {
+			PyErr_SetString(PyExc_ValueError, "offset must not be negative");
+			return NULL;
+		}
+		offset = (off_t) offset_ll;
+		n = transfer(out_fd, in_fd, &offset, count, 0);
+	}
+	if (n < 0)
+		return NULL;
+	return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(mod_splice_doc,
+"splice(in_fd, out_fd, count) -> int\n"
+"\n"
+"Move count bytes from in_fd to out_fd with splice(2), one of which must\n"
+"be a pipe, suspending the current greenstack whenever in_fd has nothing\n"
+"to read or out_fd is full.  Returns the number of bytes moved, which is\n"
+"less than count only if the end of the input was reached.  Raises\n"
+"ValueError if the other descriptor is not a regular file and not in\n"
+"non-blocking mode.\n");
+
+static PyObject* mod_splice(PyObject* self, PyObject* args)
+{
+	PyObject* in_file;
+	PyObject* out_file;
+	Py_ssize_t count, n;
+	int in_fd, out_fd;
+
+	if (!PyArg_ParseTuple(args, "OOn:splice", &in_file, &out_file, &count))
+		return NULL;
+	in_fd = PyObject_AsFileDescriptor(in_file);
+	if (in_fd < 0)
+		return NULL;
+	out_fd = PyObject_AsFileDescriptor(out_file);
+	if (out_fd < 0)
+		return NULL;
+	n = transfer(out_fd, in_fd, NULL, count, 1);
+	if (n < 0)
+		return NULL;
+	return PyLong_FromSsize_t(n);
+}
+
+static PyMethodDef io_functions[] = {
+	{"wait_readable", (PyCFunction)mod_wait_readable,
+	 METH_VARARGS | METH_KEYWORDS, mod_wait_readable_doc},
+	{"wait_writable", (PyCFunction)mod_wait_writable,
+	 METH_VARARGS | METH_KEYWORDS, mod_wait_writable_doc},
+	{"notify_close", (PyCFunction)mod_notify_close, METH_O, mod_notify_close_doc},
+	{"sendfile", (PyCFunction)mod_sendfile, METH_VARARGS, mod_sendfile_doc},
+	{"splice", (PyCFunction)mod_splice, METH_VARARGS, mod_splice_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_io_init(PyObject* m)
+{
+	io_pid = (long) getpid();
+	if (pthread_atfork(NULL, NULL, io_atfork_child) != 0) {
+		PyErr_SetString(PyExc_RuntimeError, "pthread_atfork() failed");
+		return -1;
+	}
+	return _greenstack_add_functions(m, io_functions);
+}
+
+#else /* !__linux__ */
+
+/* Not supported elsewhere yet; the scheduler never has waiters to poll,
+ * and it checks for wakeups from other threads every millisecond while
+ * some are expected. */
+
+void gs_io_init(gs_io* io)
+{
+	io->epfd = -1;
+	io->fds = NULL;
+	io->nfds = 0;
+	io->waiting = 0;
+	io->ring = NULL;
+	io->ring_state = GS_URING_UNTRIED;
+	io->inflight = 0;
+	io->wakefd = -1;
+	io->remote = 0;
+	io->pid = 0;
+}
+
+int gs_io_wake_init(GSScheduler* s)
+{
+	return 0;
+}
+
+void gs_io_wake(gs_io* io)
+{
+}
+
+void gs_io_clear(gs_io* io)
+{
+}
+
+int gs_io_traverse(gs_io* io, visitproc visit, void* arg)
+{
+	return 0;
+}
+
+int gs_io_wait(GSScheduler* s, int fd, int dir, double timeout)
+{
+	PyErr_SetString(PyExc_NotImplementedError,
+	                "waiting for file descriptors is not supported on this platform");
+	return -1;
+}
+
+int gs_io_notify_close(GSScheduler* s, int fd)
+{
+	return 0;
+}
+
+int gs_io_check_fork(GSScheduler* s)
+{
+	return 0;
+}
+
+int gs_io_poll(GSScheduler* s, long timeout)
+{
+	if (s->io.remote > 0 && timeout != 0)
+		return gs_timers_sleep(1);
+	return 0;
+}
+
+int _greenstack_io_init(PyObject* m)
+{
+	return 0;
+}
+
+#endif /* __linux__ */
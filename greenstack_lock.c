@@ -0,0 +1,729 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Synchronization primitives for greenstacks run by the scheduler: Lock,
+   RLock, Semaphore and Event.
+
+   Each object keeps a FIFO list of waiters that live on the C stacks of
+   the parked greenstacks, so blocking does not allocate.  Releasing a lock
+   or semaphore that has waiters does not make it available: ownership goes
+   straight to the first waiter, which is queued to run, so nobody else can
+   barge in and the other waiters are not woken for nothing.  Event.set()
+   wakes every waiter in a single pass over the list.
+
+   A waiter that is handed ownership but interrupted (by a Timeout for
+   example) before it gets to run passes it on again.
+*/
+
+#include "greenstack_private.h"
+
+typedef struct {
+	gs_link link;
+	PyGreenstack* g;        /* strong reference while waiting */
+	GSScheduler* sched;     /* the one g is parked in, kept alive by g */
+	int fired;              /* set once ownership was handed over */
+} lock_waiter;
+
+/* The state of every type here; each uses the fields it needs */
+typedef struct {
+	PyObject_HEAD
+	gs_link waiters;
+	Py_ssize_t value;       /* available units of a Lock or Semaphore */
+	PyGreenstack* owner;    /* owner of an RLock */
+	Py_ssize_t count;       /* recursion level of an RLock */
+	int flag;               /* whether an Event is set */
+	PyObject* weakreflist;
+} GSLock;
+
+static PyTypeObject GSLock_Type;
+static PyTypeObject GSRLock_Type;
+static PyTypeObject GSSemaphore_Type;
+static PyTypeObject GSEvent_Type;
+
+/* Parks the current greenstack at the end of the waiters until it is
+ * handed ownership or timeout seconds pass, if timeout is not negative.
+ * Returns 1 if it was handed ownership, 0 on timeout and -1 on error, in
+ * which case *fired tells whether it owns the thing anyway. */
+static int lock_wait(GSLock* self, double timeout, int* fired)
+{
+	GSScheduler* s;
+	lock_waiter w;
+	gs_timer t;
+	PyObject* r;
+
+	s = gs_sched_current();
+	if (s == NULL)
+		return -1;
+	Py_INCREF(ts_current);
+	w.g = ts_current;
+	w.sched = s;
+	w.fired = 0;
+	gs_list_append(&self->waiters, &w.link);
+	gs_timer_init(&t);
+	if (timeout >= 0)
+		gs_timer_arm(s, &t, timeout, ts_current, Py_None, GS_ENTRY_RESUME);
+	for (;;) {
+		r = gs_sched_park(s);
+		if (r == NULL)
+			break;
+		Py_DECREF(r);
+		if (w.fired || (timeout >= 0 && !GS_TIMER_ARMED(&t)))
+			break;
+		/* woken by someone else; keep waiting */
+	}
+	gs_timer_cancel(s, &t);
+	if (!w.fired)
+		gs_list_remove(&w.link);
+	Py_CLEAR(w.g);
+	Py_DECREF(s);
+	*fired = w.fired;
+	return r == NULL ? -1 : w.fired;
+}
+
+/* Takes the first waiter off the list, queues it to run and returns its
+ * greenstack, which owns whatever is being released from now on. */
+static PyGreenstack* lock_wake_first(GSLock* self)
+{
+	lock_waiter* w = (lock_waiter*) self->waiters.next;
+	if (w->g->run_info != ts_current->run_info) {
+		PyErr_SetString(PyExc_GreenstackError,
+		                "cannot release a lock for a different thread");
+		return NULL;
+	}
+	if (gs_sched_wake(w->sched, w->g, Py_None, GS_ENTRY_RESUME) < 0)
+		return NULL;
+	gs_list_remove(&w->link);
+	w->fired = 1;
+	return w->g;
+}
+
+static int lock_parse_acquire(PyObject* args, PyObject* kwargs, double* timeout)
+{
+	int blocking = 1;
+	PyObject* timeout_obj = Py_None;
+	static char* kwlist[] = {"blocking", "timeout", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iO:acquire", kwlist,
+	                                 &blocking, &timeout_obj))
+		return -1;
+	*timeout = -1;
+	if (timeout_obj != Py_None) {
+		*timeout = PyFloat_AsDouble(timeout_obj);
+		if (*timeout == -1 && PyErr_Occurred())
+			return -1;
+		/* -1 means forever, as for threading.Lock */
+		if (*timeout < 0 && *timeout != -1) {
+			PyErr_SetString(PyExc_ValueError,
+			                "timeout value must be positive");
+			return -1;
+		}
+	}
+	if (!blocking)
+		*timeout = 0;
+	return 0;
+}
+
+static int lock_traverse(GSLock* self, visitproc visit, void* arg)
+{
+	gs_link* l;
+	for (l = self->waiters.next; l != &self->waiters; l = l->next)
+		Py_VISIT((PyObject*) ((lock_waiter*) l)->g);
+	Py_VISIT((PyObject*) self->owner);
+	return 0;
+}
+
+/* Only reached when the waiting greenstacks are garbage themselves */
+static int lock_clear(GSLock* self)
+{
+	while (!GS_LIST_EMPTY(&self->waiters)) {
+		lock_waiter* w = (lock_waiter*) self->waiters.next;
+		gs_list_remove(&w->link);
+		Py_CLEAR(w->g);
+	}
+	Py_CLEAR(self->owner);
+	return 0;
+}
+
+static void lock_dealloc(GSLock* self)
+{
+	PyObject_GC_UnTrack((PyObject*) self);
+	if (self->weakreflist != NULL)
+		PyObject_ClearWeakRefs((PyObject*) self);
+	lock_clear(self);
+	Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static GSLock* lock_alloc(PyTypeObject* type)
+{
+	GSLock* self = (GSLock*) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+	GS_LIST_INIT(&self->waiters);
+	return self;
+}
+
+/***********************************************************/
+/* Lock and Semaphore */
+
+static int sem_release(GSLock* self)
+{
+	if (GS_LIST_EMPTY(&self->waiters)) {
+		self->value++;
+		return 0;
+	}
+	return lock_wake_first(self) != NULL ? 0 : -1;
+}
+
+static PyObject* sem_acquire(GSLock* self, PyObject* args, PyObject* kwargs)
+{
+	double timeout;
+	int err, fired;
+
+	if (lock_parse_acquire(args, kwargs, &timeout) < 0)
+		return NULL;
+	if (self->value > 0) {
+		self->value--;
+		Py_RETURN_TRUE;
+	}
+	if (timeout == 0)
+		Py_RETURN_FALSE;
+	err = lock_wait(self, timeout, &fired);
+	if (err < 0) {
+		if (fired) {
+			/* pass on what we were given */
+			PyObject *typ, *val, *tb;
+			PyErr_Fetch(&typ, &val, &tb);
+			if (sem_release(self) < 0)
+				PyErr_WriteUnraisable((PyObject*) self);
+			PyErr_Restore(typ, val, tb);
+		}
+		return NULL;
+	}
+	return PyBool_FromLong(err);
+}
+
+static PyObject* sem_enter(GSLock* self)
+{
+	return sem_acquire(self, ts_empty_tuple, NULL);
+}
+
+static PyObject* lock_release(GSLock* self)
+{
+	if (self->value > 0) {
+		PyErr_SetString(PyExc_RuntimeError, "release unlocked lock");
+		return NULL;
+	}
+	if (sem_release(self) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject* lock_exit(GSLock* self, PyObject* args)
+{
+	PyObject* r = lock_release(self);
+	if (r == NULL)
+		return NULL;
+	Py_DECREF(r);
+	Py_RETURN_FALSE;
+}
+
+static PyObject* lock_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSLock* self;
+	static char* kwlist[] = {0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":Lock", kwlist))
+		return NULL;
+	self = lock_alloc(type);
+	if (self != NULL)
+		self->value = 1;
+	return (PyObject*) self;
+}
+
+PyDoc_STRVAR(lock_acquire_doc,
+"acquire(blocking=True, timeout=None) -> bool\n"
+"\n"
+"Acquire the lock, waiting behind the greenstacks that are already\n"
+"waiting if it is taken.  Returns False if the lock could not be\n"
+"acquired without blocking, when blocking is false, or within timeout\n"
+"seconds.\n");
+
+PyDoc_STRVAR(lock_release_doc,
+"release()\n"
+"\n"
+"Release the lock, handing it straight to the first greenstack waiting\n"
+"for it if there is one.\n");
+
+PyDoc_STRVAR(lock_locked_doc,
+"locked() -> bool\n"
+"\n"
+"Whether the lock is held.\n");
+
+static PyObject* lock_locked(GSLock* self)
+{
+	return PyBool_FromLong(self->value == 0);
+}
+
+static PyMethodDef lock_methods[] = {
+	{"acquire", (PyCFunction)sem_acquire, METH_VARARGS | METH_KEYWORDS, lock_acquire_doc},
+	{"release", (PyCFunction)lock_release, METH_NOARGS, lock_release_doc},
+	{"locked", (PyCFunction)lock_locked, METH_NOARGS, lock_locked_doc},
+	{"__enter__", (PyCFunction)sem_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)lock_exit, METH_VARARGS, NULL},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyTypeObject GSLock_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Lock",                      /* tp_name */
+	sizeof(GSLock),                         /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)lock_dealloc,               /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Lock() -> Lock\n\n"
+	"A mutual exclusion lock for greenstacks, which waiters get in the\n"
+	"order they asked for it.", /* tp_doc */
+	(traverseproc)lock_traverse,            /* tp_traverse */
+	(inquiry)lock_clear,                    /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSLock, weakreflist),          /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	lock_methods,                           /* tp_methods */
+	0,                                      /* tp_members */
+	0,                                      /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	lock_new,                               /* tp_new */
+};
+
+static PyObject* sem_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSLock* self;
+	Py_ssize_t value = 1;
+	static char* kwlist[] = {"value", 0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n:Semaphore", kwlist, &value))
+		return NULL;
+	if (value < 0) {
+		PyErr_SetString(PyExc_ValueError,
+		                "semaphore initial value must be >= 0");
+		return NULL;
+	}
+	self = lock_alloc(type);
+	if (self != NULL)
+		self->value = value;
+	return (PyObject*) self;
+}
+
+PyDoc_STRVAR(sem_acquire_doc,
+"acquire(blocking=True, timeout=None) -> bool\n"
+"\n"
+"Take one unit, waiting behind the greenstacks that are already waiting\n"
+"if there is none left.  Returns False if no unit could be taken without\n"
+"blocking, when blocking is false, or within timeout seconds.\n");
+
+PyDoc_STRVAR(sem_release_doc,
+"release()\n"
+"\n"
+"Give back one unit, handing it straight to the first greenstack waiting\n"
+"for one if there is one.\n");
+
+static PyObject* sem_release_method(GSLock* self)
+{
+	if (sem_release(self) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject* sem_exit(GSLock* self, PyObject* args)
+{
+	if (sem_release(self) < 0)
+		return NULL;
+	Py_RETURN_FALSE;
+}
+
+static PyObject* sem_getvalue(GSLock* self, void* c)
+{
+	return PyLong_FromSsize_t(self->value);
+}
+
+static PyMethodDef sem_methods[] = {
+	{"acquire", (PyCFunction)sem_acquire, METH_VARARGS | METH_KEYWORDS, sem_acquire_doc},
+	{"release", (PyCFunction)sem_release_method, METH_NOARGS, sem_release_doc},
+	{"__enter__", (PyCFunction)sem_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)sem_exit, METH_VARARGS, NULL},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef sem_getsets[] = {
+	{"value", (getter)sem_getvalue, NULL,
+	 "The number of units that can be taken without blocking."},
+	{NULL}
+};
+
+static PyTypeObject GSSemaphore_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Semaphore",                 /* tp_name */
+	sizeof(GSLock),                         /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)lock_dealloc,               /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Semaphore(value=1) -> Semaphore\n\n"
+	"A counter of available units for greenstacks, which waiters get in\n"
+	"the order they asked for one.", /* tp_doc */
+	(traverseproc)lock_traverse,            /* tp_traverse */
+	(inquiry)lock_clear,                    /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSLock, weakreflist),          /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	sem_methods,                            /* tp_methods */
+	0,                                      /* tp_members */
+	sem_getsets,                            /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	sem_new,                                /* tp_new */
+};
+
+/***********************************************************/
+/* RLock */
+
+/* Releases the RLock completely, handing it to the first waiter */
+static int rlock_release_all(GSLock* self)
+{
+	PyGreenstack* owner = self->owner;
+	PyGreenstack* next = NULL;
+	if (!GS_LIST_EMPTY(&self->waiters)) {
+		next = lock_wake_first(self);
+		if (next == NULL)
+			return -1;
+		Py_INCREF(next);
+	}
+	self->owner = next;
+	self->count = next != NULL ? 1 : 0;
+	Py_XDECREF(owner);
+	return 0;
+}
+
+static PyObject* rlock_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	static char* kwlist[] = {0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":RLock", kwlist))
+		return NULL;
+	return (PyObject*) lock_alloc(type);
+}
+
+PyDoc_STRVAR(rlock_acquire_doc,
+"acquire(blocking=True, timeout=None) -> bool\n"
+"\n"
+"Acquire the lock, or acquire it once more if the current greenstack\n"
+"holds it already.  Otherwise works like Lock.acquire().\n");
+
+static PyObject* rlock_acquire(GSLock* self, PyObject* args, PyObject* kwargs)
+{
+	double timeout;
+	int err, fired;
+
+	if (lock_parse_acquire(args, kwargs, &timeout) < 0)
+		return NULL;
+	if (!STATE_OK)
+		return NULL;
+	if (self->owner == ts_current) {
+		self->count++;
+		Py_RETURN_TRUE;
+	}
+	if (self->owner == NULL) {
+		Py_INCREF(ts_current);
+		self->owner = ts_current;
+		self->count = 1;
+		Py_RETURN_TRUE;
+	}
+	if (timeout == 0)
+		Py_RETURN_FALSE;
+	err = lock_wait(self, timeout, &fired);
+	if (err < 0) {
+		if (fired) {
+			PyObject *typ, *val, *tb;
+			PyErr_Fetch(&typ, &val, &tb);
+			if (rlock_release_all(self) < 0)
+				PyErr_WriteUnraisable((PyObject*) self);
+			PyErr_Restore(typ, val, tb);
+		}
+		return NULL;
+	}
+	return PyBool_FromLong(err);
+}
+
+static PyObject* rlock_enter(GSLock* self)
+{
+	return rlock_acquire(self, ts_empty_tuple, NULL);
+}
+
+PyDoc_STRVAR(rlock_release_doc,
+"release()\n"
+"\n"
+"Undo one acquire().  The last one hands the lock straight to the first\n"
+"greenstack waiting for it if there is one.\n");
+
+static PyObject* rlock_release(GSLock* self)
+{
+	if (!STATE_OK)
+		return NULL;
+	if (self->owner != ts_current) {
+		PyErr_SetString(PyExc_RuntimeError,
+		                "cannot release un-acquired lock");
+		return NULL;
+	}
+	if (--self->count == 0 && rlock_release_all(self) < 0) {
+		self->count++;
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* rlock_exit(GSLock* self, PyObject* args)
+{
+	PyObject* r = rlock_release(self);
+	if (r == NULL)
+		return NULL;
+	Py_DECREF(r);
+	Py_RETURN_FALSE;
+}
+
+static PyMethodDef rlock_methods[] = {
+	{"acquire", (PyCFunction)rlock_acquire, METH_VARARGS | METH_KEYWORDS, rlock_acquire_doc},
+	{"release", (PyCFunction)rlock_release, METH_NOARGS, rlock_release_doc},
+	{"__enter__", (PyCFunction)rlock_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)rlock_exit, METH_VARARGS, NULL},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyTypeObject GSRLock_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.RLock",                     /* tp_name */
+	sizeof(GSLock),                         /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)lock_dealloc,               /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"RLock() -> RLock\n\n"
+	"A lock that the greenstack holding it can acquire again, and must\n"
+	"then release as many times.", /* tp_doc */
+	(traverseproc)lock_traverse,            /* tp_traverse */
+	(inquiry)lock_clear,                    /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSLock, weakreflist),          /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	rlock_methods,                          /* tp_methods */
+	0,                                      /* tp_members */
+	0,                                      /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	rlock_new,                              /* tp_new */
+};
+
+/***********************************************************/
+/* Event */
+
+static PyObject* event_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	static char* kwlist[] = {0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":Event", kwlist))
+		return NULL;
+	return (PyObject*) lock_alloc(type);
+}
+
+PyDoc_STRVAR(event_set_doc,
+"set()\n"
+"\n"
+"Set the flag and wake every greenstack waiting for it.\n");
+
+static PyObject* event_set(GSLock* self)
+{
+	self->flag = 1;
+	while (!GS_LIST_EMPTY(&self->waiters)) {
+		if (lock_wake_first(self) == NULL)
+			return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(event_clear_doc,
+"clear()\n"
+"\n"
+"Reset the flag.\n");
+
+static PyObject* event_clear(GSLock* self)
+{
+	self->flag = 0;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(event_is_set_doc,
+"is_set() -> bool\n"
+"\n"
+"Whether the flag is set.\n");
+
+static PyObject* event_is_set(GSLock* self)
+{
+	return PyBool_FromLong(self->flag);
+}
+
+PyDoc_STRVAR(event_wait_doc,
+"wait(timeout=None) -> bool\n"
+"\n"
+"Block until the flag is set, or until timeout seconds have passed.\n"
+"Returns False only if it timed out.\n");
+
+static PyObject* event_wait(GSLock* self, PyObject* args, PyObject* kwargs)
+{
+	PyObject* timeout_obj = Py_None;
+	double timeout = -1;
+	int fired = 0;
+	static char* kwlist[] = {"timeout", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:wait", kwlist, &timeout_obj))
+		return NULL;
+	if (timeout_obj != Py_None) {
+		timeout = PyFloat_AsDouble(timeout_obj);
+		if (timeout == -1 && PyErr_Occurred())
+			return NULL;
+		if (timeout < 0)
+			timeout = 0;
+	}
+	if (!self->flag && timeout != 0 && lock_wait(self, timeout, &fired) < 0)
+		return NULL;
+	/* the flag may have been cleared again before this ran */
+	return PyBool_FromLong(self->flag || fired);
+}
+
+static PyMethodDef event_methods[] = {
+	{"set", (PyCFunction)event_set, METH_NOARGS, event_set_doc},
+	{"clear", (PyCFunction)event_clear, METH_NOARGS, event_clear_doc},
+	{"is_set", (PyCFunction)event_is_set, METH_NOARGS, event_is_set_doc},
+	{"wait", (PyCFunction)event_wait, METH_VARARGS | METH_KEYWORDS, event_wait_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyTypeObject GSEvent_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Event",                     /* tp_name */
+	sizeof(GSLock),                         /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)lock_dealloc,               /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Event() -> Event\n\n"
+	"A flag that greenstacks can wait for.", /* tp_doc */
+	(traverseproc)lock_traverse,            /* tp_traverse */
+	(inquiry)lock_clear,                    /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSLock, weakreflist),          /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	event_methods,                          /* tp_methods */
+	0,                                      /* tp_members */
+	0,                                      /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	event_new,                              /* tp_new */
+};
+
+int _greenstack_lock_init(PyObject* m)
+{
+	static struct {
+		const char* name;
+		PyTypeObject* type;
+	} types[] = {
+		{"Lock", &GSLock_Type},
+		{"RLock", &GSRLock_Type},
+		{"Semaphore", &GSSemaphore_Type},
+		{"Event", &GSEvent_Type},
+	};
+	size_t i;
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (PyType_Ready(types[i].type) < 0)
+			return -1;
+		Py_INCREF(types[i].type);
+		if (PyModule_AddObject(m, types[i].name, (PyObject*) types[i].type) < 0)
+			return -1;
+	}
+	return 0;
+}
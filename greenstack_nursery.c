@@ -0,0 +1,381 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Nurseries: scopes that own the greenstacks spawned in them.
+
+   Every child points back at its nursery until it finishes, and
+   gs_sched_exit() tells the nursery when it does, so the nursery only has
+   to keep a count of the live ones.  The greenstack joining the nursery
+   is woken once, when the count drops to zero.  The list of children is
+   only used to cancel them, so finished ones are dropped from it lazily,
+   whenever it gets to twice the size it needs to be.
+
+   A child that dies of an exception cancels its siblings, and the
+   exception is raised from join() instead of reaching the scheduler.
+   Cancelling throws GreenstackExit into every live child in one pass over
+   the ready queue; see gs_sched_throw_all().
+*/
+
+#include "greenstack_private.h"
+
+typedef struct {
+	PyObject_HEAD
+	GSScheduler* sched;
+	PyObject* children;     /* list, including some finished ones */
+	Py_ssize_t live;
+	PyGreenstack* joiner;   /* parked in join(), or NULL */
+	/* the first exception a child died of */
+	PyObject* exc_type;
+	PyObject* exc_value;
+	PyObject* exc_tb;
+	int cancelled;
+	int closed;
+	PyObject* weakreflist;
+} GSNursery;
+
+static PyTypeObject GSNursery_Type;
+
+#define CHILD_OF(g, n) (((PyGreenstack*) (g))->nursery == (PyObject*) (n))
+
+static int nursery_cancel(GSNursery* n)
+{
+	PyObject* children;
+	PyObject* exc;
+	int err;
+
+	n->cancelled = 1;
+	if (n->live == 0 || n->children == NULL)
+		return 0;
+	/* a copy, since dropping the old entries can run arbitrary code */
+	children = PyList_GetSlice(n->children, 0, PyList_GET_SIZE(n->children));
+	if (children == NULL)
+		return -1;
+	exc = PyObject_CallObject(PyExc_GreenstackExit, NULL);
+	if (exc == NULL) {
+		Py_DECREF(children);
+		return -1;
+	}
+	err = gs_sched_throw_all(n->sched, PySequence_Fast_ITEMS(children),
+	                         PyList_GET_SIZE(children), exc);
+	Py_DECREF(exc);
+	Py_DECREF(children);
+	return err;
+}
+
+/* Drops the finished children from the list */
+static int nursery_compact(GSNursery* n)
+{
+	PyObject* children = PyList_New(0);
+	Py_ssize_t i;
+	if (children == NULL)
+		return -1;
+	for (i = 0; i < PyList_GET_SIZE(n->children); i++) {
+		PyObject* g = PyList_GET_ITEM(n->children, i);
+		if (CHILD_OF(g, n) && PyList_Append(children, g) < 0) {
+			Py_DECREF(children);
+			return -1;
+		}
+	}
+	Py_DECREF(n->children);
+	n->children = children;
+	return 0;
+}
+
+/***********************************************************/
+/* Interface for other modules */
+
+PyObject* gs_nursery_exit(PyGreenstack* g, PyObject* result)
+{
+	/* takes over the child's reference */
+	GSNursery* n = (GSNursery*) g->nursery;
+	g->nursery = NULL;
+	n->live--;
+	if (n->children == NULL) {
+		/* cleared by the garbage collector */
+		Py_DECREF(n);
+		return result;
+	}
+
+	if (result == NULL) {
+		if (n->exc_type == NULL)
+			PyErr_Fetch(&n->exc_type, &n->exc_value, &n->exc_tb);
+		else
+			PyErr_WriteUnraisable((PyObject*) g);
+		if (nursery_cancel(n) < 0)
+			PyErr_WriteUnraisable((PyObject*) n);
+		Py_INCREF(Py_None);
+		result = Py_None;
+	}
+	if (n->live == 0 && n->joiner != NULL) {
+		if (gs_sched_wake(n->sched, n->joiner, Py_None, GS_ENTRY_RESUME) < 0)
+			PyErr_WriteUnraisable((PyObject*) n);
+	} else if (PyList_GET_SIZE(n->children) >= 2 * n->live + 16) {
+		if (nursery_compact(n) < 0)
+			PyErr_WriteUnraisable((PyObject*) n);
+	}
+	Py_DECREF(n);
+	return result;
+}
+
+/***********************************************************/
+/* Nursery type */
+
+static PyObject* nursery_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSNursery* n;
+	static char* kwlist[] = {0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":Nursery", kwlist))
+		return NULL;
+	n = (GSNursery*) type->tp_alloc(type, 0);
+	if (n == NULL)
+		return NULL;
+	n->children = PyList_New(0);
+	n->sched = gs_sched_current();
+	if (n->children == NULL || n->sched == NULL) {
+		Py_DECREF(n);
+		return NULL;
+	}
+	return (PyObject*) n;
+}
+
+static int nursery_traverse(GSNursery* n, visitproc visit, void* arg)
+{
+	Py_VISIT((PyObject*) n->sched);
+	Py_VISIT(n->children);
+	Py_VISIT((PyObject*) n->joiner);
+	Py_VISIT(n->exc_type);
+	Py_VISIT(n->exc_value);
+	Py_VISIT(n->exc_tb);
+	return 0;
+}
+
+static int nursery_clear(GSNursery* n)
+{
+	Py_CLEAR(n->sched);
+	Py_CLEAR(n->children);
+	Py_CLEAR(n->joiner);
+	Py_CLEAR(n->exc_type);
+	Py_CLEAR(n->exc_value);
+	Py_CLEAR(n->exc_tb);
+	return 0;
+}
+
+static void nursery_dealloc(GSNursery* n)
+{
+	PyObject_GC_UnTrack((PyObject*) n);
+	if (n->weakreflist != NULL)
+		PyObject_ClearWeakRefs((PyObject*) n);
+	nursery_clear(n);
+	Py_TYPE(n)->tp_free((PyObject*) n);
+}
+
+PyDoc_STRVAR(nursery_spawn_doc,
+"spawn(run, *args, **kwargs) -> greenstack\n"
+"\n"
+"Like Scheduler.spawn(), with the new greenstack a child of the nursery.\n"
+"Raises RuntimeError once the nursery is closed or cancelled.\n");
+
+static PyObject* nursery_spawn(GSNursery* n, PyObject* args, PyObject* kwargs)
+{
+	PyGreenstack* g;
+
+	if (PyTuple_GET_SIZE(args) < 1) {
+		PyErr_SetString(PyExc_TypeError, "spawn() takes at least 1 argument");
+		return NULL;
+	}
+	if (gs_sched_check_thread(n->sched) < 0)
+		return NULL;
+	if (n->closed || n->cancelled) {
+		PyErr_SetString(PyExc_RuntimeError, n->closed ?
+		                "nursery is closed" : "nursery is cancelled");
+		return NULL;
+	}
+	g = gs_sched_spawn(n->sched, args, kwargs);
+	if (g == NULL)
+		return NULL;
+	if (PyList_Append(n->children, (PyObject*) g) < 0) {
+		/* it is harmless to let it run */
+		Py_DECREF(g);
+		return NULL;
+	}
+	Py_INCREF(n);
+	g->nursery = (PyObject*) n;
+	n->live++;
+	return (PyObject*) g;
+}
+
+PyDoc_STRVAR(nursery_join_doc,
+"join()\n"
+"\n"
+"Wait until every child has finished.  If one died of an exception, the\n"
+"others are cancelled and the exception is raised here.  If the waiting\n"
+"greenstack is interrupted, the children are cancelled too.\n");
+
+static PyObject* nursery_join(GSNursery* n)
+{
+	PyObject* r;
+	PyObject *typ, *val, *tb;
+
+	if (gs_sched_check_thread(n->sched) < 0)
+		return NULL;
+	if (CHILD_OF(ts_current, n)) {
+		PyErr_SetString(PyExc_RuntimeError,
+		                "cannot join a nursery from one of its children");
+		return NULL;
+	}
+	if (n->joiner != NULL) {
+		PyErr_SetString(PyExc_RuntimeError,
+		                "another greenstack is already joining the nursery");
+		return NULL;
+	}
+	while (n->live > 0) {
+		Py_INCREF(ts_current);
+		n->joiner = ts_current;
+		r = gs_sched_park(n->sched);
+		Py_CLEAR(n->joiner);
+		if (r == NULL) {
+			PyErr_Fetch(&typ, &val, &tb);
+			if (nursery_cancel(n) < 0)
+				PyErr_WriteUnraisable((PyObject*) n);
+			PyErr_Restore(typ, val, tb);
+			return NULL;
+		}
+		/* woken by someone else; keep waiting */
+		Py_DECREF(r);
+	}
+	if (n->exc_type != NULL) {
+		PyErr_Restore(n->exc_type, n->exc_value, n->exc_tb);
+		n->exc_type = n->exc_value = n->exc_tb = NULL;
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nursery_cancel_doc,
+"cancel()\n"
+"\n"
+"Throw GreenstackExit into every child that has not finished, and refuse\n"
+"to spawn more.  The children die the next time they run.\n");
+
+static PyObject* nursery_cancel_method(GSNursery* n)
+{
+	if (gs_sched_check_thread(n->sched) < 0)
+		return NULL;
+	if (nursery_cancel(n) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject* nursery_enter(GSNursery* n)
+{
+	Py_INCREF(n);
+	return (PyObject*) n;
+}
+
+static PyObject* nursery_exit(GSNursery* n, PyObject* args)
+{
+	PyObject *typ, *val, *tb;
+	PyObject* r;
+	if (!PyArg_ParseTuple(args, "OOO:__exit__", &typ, &val, &tb))
+		return NULL;
+	if (gs_sched_check_thread(n->sched) < 0)
+		return NULL;
+	if (typ != Py_None && nursery_cancel(n) < 0)
+		return NULL;
+	r = nursery_join(n);
+	n->closed = 1;
+	if (r == NULL)
+		return NULL;
+	Py_DECREF(r);
+	Py_RETURN_FALSE;
+}
+
+static PyObject* nursery_getchildren(GSNursery* n, void* c)
+{
+	PyObject* children = PyList_New(0);
+	Py_ssize_t i;
+	if (children == NULL)
+		return NULL;
+	for (i = 0; i < PyList_GET_SIZE(n->children); i++) {
+		PyObject* g = PyList_GET_ITEM(n->children, i);
+		if (CHILD_OF(g, n) && PyList_Append(children, g) < 0) {
+			Py_DECREF(children);
+			return NULL;
+		}
+	}
+	return children;
+}
+
+static PyObject* nursery_getcancelled(GSNursery* n, void* c)
+{
+	return PyBool_FromLong(n->cancelled);
+}
+
+static PyMethodDef nursery_methods[] = {
+	{"spawn", (PyCFunction)nursery_spawn, METH_VARARGS | METH_KEYWORDS, nursery_spawn_doc},
+	{"join", (PyCFunction)nursery_join, METH_NOARGS, nursery_join_doc},
+	{"cancel", (PyCFunction)nursery_cancel_method, METH_NOARGS, nursery_cancel_doc},
+	{"__enter__", (PyCFunction)nursery_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)nursery_exit, METH_VARARGS, NULL},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef nursery_getsets[] = {
+	{"children", (getter)nursery_getchildren, NULL,
+	 "The children that have not finished yet."},
+	{"cancelled", (getter)nursery_getcancelled, NULL,
+	 "Whether the children have been cancelled."},
+	{NULL}
+};
+
+static PyTypeObject GSNursery_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Nursery",                   /* tp_name */
+	sizeof(GSNursery),                      /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)nursery_dealloc,            /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Nursery() -> Nursery\n\n"
+	"A scope for greenstacks spawned on the current scheduler.  Used in a\n"
+	"with statement, it waits for its children at the end of the block,\n"
+	"or cancels them if the block raises.", /* tp_doc */
+	(traverseproc)nursery_traverse,         /* tp_traverse */
+	(inquiry)nursery_clear,                 /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSNursery, weakreflist),       /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	nursery_methods,                        /* tp_methods */
+	0,                                      /* tp_members */
+	nursery_getsets,                        /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	nursery_new,                            /* tp_new */
+};
+
+int _greenstack_nursery_init(PyObject* m)
+{
+	if (PyType_Ready(&GSNursery_Type) < 0)
+		return -1;
+	Py_INCREF(&GSNursery_Type);
+	return PyModule_AddObject(m, "Nursery", (PyObject*) &GSNursery_Type);
+}
@@ -0,0 +1,195 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Preemption of greenstacks that run too long without switching.
+
+   A scheduler with a time slice starts a new slice every time it resumes
+   a greenstack, by stamping the time and bumping a serial number.  A
+   native monitor thread, which never takes the GIL while preemption is
+   on, looks at them a few times per slice.  When the same slice has gone
+   on for too long it asks the interpreter to call preempt_call() at its
+   next chance through Py_AddPendingCall(), which is what signal handlers
+   use and is safe to call from any thread.
+
+   Switching away from inside a pending call would stop the interpreter
+   from running other pending calls, signal handlers included, until the
+   greenstack is resumed.  So preempt_call() only installs a one-shot trace
+   function, and the greenstack yields from there at the start of the next
+   line of Python code.  Code that never gets back to the interpreter, like
+   a long call into C, cannot be preempted, and neither can anything while
+   a debugger or another trace function is installed.
+
+   The interpreter only runs pending calls on the main thread, so only a
+   scheduler of the main thread can be preemptive.  The fields the monitor
+   reads are written without locking; a torn read can at worst preempt a
+   greenstack early or late by one slice.
+*/
+
+#include "greenstack_private.h"
+#include "pythread.h"
+#include "frameobject.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/select.h>
+#endif
+
+static struct {
+	/* published for the monitor */
+	volatile PY_UINT64_T slice;     /* nanoseconds, 0 when off */
+	volatile PY_UINT64_T started;   /* when the current slice started */
+	volatile unsigned long serial;  /* bumped for every slice */
+	volatile unsigned long requested; /* serial preempt_call() was added for */
+	/* only touched with the GIL held */
+	int enabled;                    /* schedulers with a time slice */
+	int running;                    /* whether the monitor is */
+	unsigned long main_thread;
+} preempt;
+
+void gs_sleep_nogil(PY_UINT64_T ns)
+{
+#ifdef _WIN32
+	Sleep((DWORD) (ns / 1000000));
+#else
+	struct timeval tv;
+	tv.tv_sec = (long) (ns / 1000000000);
+	tv.tv_usec = (long) (ns % 1000000000 / 1000);
+	select(0, NULL, NULL, NULL, &tv);
+#endif
+}
+
+static int preempt_call(void* arg);
+
+static void preempt_monitor(void* arg)
+{
+	PyGILState_STATE state;
+	PY_UINT64_T slice, started;
+	unsigned long serial;
+
+	for (;;) {
+		slice = preempt.slice;
+		if (slice == 0) {
+			/* it is turned back on with the GIL held */
+			state = PyGILState_Ensure();
+			if (preempt.slice == 0) {
+				preempt.running = 0;
+				PyGILState_Release(state);
+				return;
+			}
+			PyGILState_Release(state);
+			continue;
+		}
+		gs_sleep_nogil(slice / 2 > 1000000 ? slice / 2 : 1000000);
+		serial = preempt.serial;
+		started = preempt.started;
+		if (serial == preempt.requested || serial != preempt.serial)
+			continue;
+		if (gs_clock_ns() - started < preempt.slice)
+			continue;
+		preempt.requested = serial;
+		Py_AddPendingCall(preempt_call, (void*) (size_t) serial);
+	}
+}
+
+/* Returns the scheduler g can be preempted by, or NULL */
+static GSScheduler* preempt_sched(PyGreenstack* g)
+{
+	GSScheduler* s = (GSScheduler*) g->sched;
+	if (g->run_info != PyThreadState_GET()->dict || s == NULL)
+		return NULL;
+	if (s->time_slice == 0 || s->hub == NULL || g == s->hub)
+		return NULL;
+	/* a pending wakeup belongs to whatever it parks in next */
+	if (g->sched_flags & GS_READY)
+		return NULL;
+	return s;
+}
+
+static int preempt_trace(PyObject* obj, PyFrameObject* frame, int what, PyObject* arg)
+{
+	PyThreadState* tstate = PyThreadState_GET();
+	PyGreenstack* g = ts_current;
+	GSScheduler* s;
+	PyObject* result = NULL;
+	int tracing;
+
+	/* the exception state of the other events is not saved by switches */
+	if (what != PyTrace_LINE && what != PyTrace_CALL)
+		return 0;
+	PyEval_SetTrace(NULL, NULL);
+	s = preempt_sched(g);
+	if (s == NULL)
+		return 0;
+
+	/* let the other greenstacks be traced while this one waits */
+	tracing = tstate->tracing;
+	tstate->tracing = 0;
+	tstate->use_tracing = tstate->c_profilefunc != NULL;
+	g->sched_preempted++;
+	Py_INCREF(s);
+	if (gs_sched_wake(s, g, Py_None, GS_ENTRY_RESUME) >= 0)
+		result = gs_sched_park(s);
+	Py_DECREF(s);
+	tstate = PyThreadState_GET();
+	tstate->tracing = tracing;
+	tstate->use_tracing = 0;
+	if (result == NULL)
+		return -1;
+	Py_DECREF(result);
+	return 0;
+}
+
+static int preempt_call(void* arg)
+{
+	/* it may have switched since the monitor looked */
+	if ((unsigned long) (size_t) arg != preempt.serial)
+		return 0;
+	if (preempt_sched(ts_current) == NULL)
+		return 0;
+	if (PyThreadState_GET()->c_tracefunc != NULL)
+		return 0;
+	PyEval_SetTrace(preempt_trace, NULL);
+	return 0;
+}
+
+void gs_preempt_resumed(GSScheduler* s)
+{
+	preempt.slice = s->time_slice;
+	preempt.started = gs_clock_ns();
+	preempt.serial++;
+}
+
+int gs_preempt_set_slice(GSScheduler* s, PY_UINT64_T slice)
+{
+	if (slice != 0 &&
+	    (unsigned long) PyThread_get_thread_ident() != preempt.main_thread) {
+		PyErr_SetString(PyExc_GreenstackError,
+		                "only the main thread can be preempted");
+		return -1;
+	}
+	if (slice != 0 && !preempt.running) {
+		PyEval_InitThreads();
+		if ((unsigned long) PyThread_start_new_thread(preempt_monitor, NULL)
+		    == (unsigned long) -1) {
+			PyErr_SetString(PyExc_RuntimeError, "can't start new thread");
+			return -1;
+		}
+		preempt.running = 1;
+	}
+	if (s->time_slice == 0 && slice != 0)
+		preempt.enabled++;
+	else if (s->time_slice != 0 && slice == 0)
+		preempt.enabled--;
+	s->time_slice = slice;
+	if (slice != 0)
+		preempt.slice = slice;
+	else if (preempt.enabled == 0)
+		preempt.slice = 0;
+	return 0;
+}
+
+int _greenstack_preempt_init(PyObject* m)
+{
+	preempt.main_thread = (unsigned long) PyThread_get_thread_ident();
+	return 0;
+}
@@ -0,0 +1,547 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Declarations shared between the translation units of the greenstack
+ * module.  Nothing in here is part of the public C API. */
+
+#ifndef GREENSTACK_PRIVATE_H
+#define GREENSTACK_PRIVATE_H
+
+#define GREENSTACK_MODULE
+
+#include "greenstack.h"
+#include "structmember.h"
+
+/* Python <= 2.5 support */
+#if PY_MAJOR_VERSION < 3
+#ifndef Py_REFCNT
+#  define Py_REFCNT(ob) (((PyObject *) (ob))->ob_refcnt)
+#endif
+#ifndef Py_TYPE
+#  define Py_TYPE(ob)   (((PyObject *) (ob))->ob_type)
+#endif
+#ifndef PyVarObject_HEAD_INIT
+#  define PyVarObject_HEAD_INIT(type, size) \
+	PyObject_HEAD_INIT(type) size,
+#endif
+#endif
+
+#if PY_VERSION_HEX < 0x02060000
+#define PyLong_FromSsize_t PyInt_FromLong
+#endif
+
+#if PY_VERSION_HEX < 0x02050000
+typedef int Py_ssize_t;
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+#define GS_InternFromString PyUnicode_InternFromString
+#else
+#define GS_InternFromString PyString_InternFromString
+#endif
+
+/* Compile with this set to keep latency histograms of switches; see
+ * greenstack_stats.c */
+#ifndef GREENSTACK_USE_SWITCH_TIMING
+#define GREENSTACK_USE_SWITCH_TIMING 0
+#endif
+
+/*** greenstack.c ***/
+
+extern PyTypeObject PyGreenstack_Type;
+extern PyObject* PyExc_GreenstackError;
+extern PyObject* PyExc_GreenstackExit;
+extern PyObject* ts_empty_tuple;
+
+/* Strong reference to the current greenstack in this thread state */
+extern PyGreenstack* volatile ts_current;
+
+int green_updatecurrent(void);
+
+#define STATE_OK    (ts_current->run_info == PyThreadState_GET()->dict \
+                     || !green_updatecurrent())
+
+PyObject* g_switch(PyGreenstack* target, PyObject* args, PyObject* kwargs);
+PyObject* throw_greenstack(PyGreenstack* self, PyObject* typ, PyObject* val, PyObject* tb);
+PyObject* single_result(PyObject* results);
+PyGreenstack* PyGreenstack_New(PyObject* run, PyGreenstack* parent);
+
+/* Stores the array of stacks kept for reuse in *stacks and returns how
+ * many there are */
+int gs_stack_cache(struct coro_stack** stacks);
+
+/* The greenstack running in the thread whose state dict is given, or NULL
+ * if it has none; works from any thread.  Borrowed. */
+PyGreenstack* gs_thread_current(PyObject* dict);
+
+/* Adds a NULL-terminated table of functions to the module */
+int _greenstack_add_functions(PyObject* m, PyMethodDef* functions);
+
+/* Intrusive doubly linked lists.  A list is a gs_link head whose next and
+ * prev point back to itself when it is empty. */
+typedef struct _gs_link gs_link;
+
+#define GS_LIST_INIT(head)   ((head)->next = (head)->prev = (head))
+#define GS_LIST_EMPTY(head)  ((head)->next == (head))
+
+#define gs_list_append(head, l) do { \
+	gs_link* _h = (head); \
+	gs_link* _l = (l); \
+	_l->prev = _h->prev; \
+	_l->next = _h; \
+	_h->prev->next = _l; \
+	_h->prev = _l; \
+} while (0)
+
+#define gs_list_remove(l) do { \
+	gs_link* _l = (l); \
+	_l->prev->next = _l->next; \
+	_l->next->prev = _l->prev; \
+	_l->next = _l->prev = _l; \
+} while (0)
+
+/*** greenstack_timer.c ***/
+
+struct _gs_scheduler;
+struct _gs_timer;
+
+/* Called instead of waking the greenstack when a timer with a fire function
+ * expires.  Returns -1 on error. */
+typedef int (*gs_timerfunc)(struct _gs_scheduler* s, struct _gs_timer* t, PyGreenstack* g);
+
+typedef struct _gs_timer {
+	gs_link link;
+	PY_UINT64_T deadline;   /* in ticks */
+	int slot;               /* position in the wheel, or a GS_TIMER_* value */
+	PyGreenstack* g;        /* strong reference while armed */
+	PyObject* value;        /* passed to gs_sched_wake(), strong while armed */
+	int kind;
+	gs_timerfunc fire;
+} gs_timer;
+
+#define GS_TIMER_IDLE  -1
+#define GS_TIMER_DUE   -2
+
+/* A hierarchical timing wheel with 1ms ticks.  Each level has 64 slots
+ * that each cover 64 times as much time as a slot of the level below; a
+ * slot of level 0 holds the timers due at exactly one tick. */
+#define GS_WHEEL_BITS   6
+#define GS_WHEEL_SLOTS  (1 << GS_WHEEL_BITS)
+#define GS_WHEEL_LEVELS 4
+#define GS_TICK_NS      1000000
+
+typedef struct _gs_wheel {
+	gs_link slots[GS_WHEEL_LEVELS][GS_WHEEL_SLOTS];
+	PY_UINT64_T occupied[GS_WHEEL_LEVELS];
+	gs_link due;            /* armed with a deadline already passed */
+	PY_UINT64_T now;        /* every tick up to this one has expired */
+	Py_ssize_t count;       /* number of armed timers */
+	int virtual_time;       /* whether it runs on vclock */
+	PY_UINT64_T vclock;     /* virtual nanoseconds */
+} gs_wheel;
+
+/* Nanoseconds on the monotonic clock */
+PY_UINT64_T gs_clock_ns(void);
+
+/* The same clock, cheaper to read but only as precise as the timer tick
+ * of the system */
+PY_UINT64_T gs_coarse_clock_ns(void);
+
+void gs_timer_init(gs_timer* t);
+
+/* Arms t to wake g after the given number of seconds */
+void gs_timer_arm(struct _gs_scheduler* s, gs_timer* t, double seconds,
+                  PyGreenstack* g, PyObject* value, int kind);
+void gs_timer_cancel(struct _gs_scheduler* s, gs_timer* t);
+#define GS_TIMER_ARMED(t) ((t)->slot != GS_TIMER_IDLE)
+
+void gs_wheel_init(gs_wheel* w);
+void gs_wheel_clear(gs_wheel* w);
+
+/* Makes w run on a virtual clock starting at 0, which only moves when
+ * gs_timers_jump() is called */
+void gs_wheel_set_virtual(gs_wheel* w);
+
+/* Nanoseconds on the clock of the timers of s */
+PY_UINT64_T gs_timers_now(struct _gs_scheduler* s);
+
+/* Moves the virtual clock of s forward to when the next timer may be due */
+void gs_timers_jump(struct _gs_scheduler* s);
+
+/* Milliseconds until the next timer may be due, or -1 if none is armed */
+long gs_timers_timeout(struct _gs_scheduler* s);
+
+/* Wakes everything that has expired, in one batch */
+int gs_timers_expire(struct _gs_scheduler* s);
+
+/* Blocks the thread for the given milliseconds with the GIL released */
+int gs_timers_sleep(long ms);
+
+int _greenstack_timer_init(PyObject* m);
+
+/*** greenstack_io.c ***/
+
+struct _gs_fd;
+
+#define GS_IO_READ   0
+#define GS_IO_WRITE  1
+
+/* File descriptors waited on by a scheduler.  Each one is registered with
+ * epoll once, edge-triggered, and stays registered until notify_close(). */
+typedef struct _gs_io {
+	int epfd;               /* -1 until first used */
+	struct _gs_fd** fds;    /* indexed by fd */
+	int nfds;
+	Py_ssize_t waiting;     /* number of parked waiters */
+	/* io_uring, see greenstack_uring.c */
+	struct _gs_uring* ring;
+	int ring_state;         /* GS_URING_* */
+	Py_ssize_t inflight;    /* operations queued or submitted to the ring */
+	/* wakeups from other threads, see greenstack_thread.c */
+	int wakefd;             /* eventfd in epfd, -1 until first blocked */
+	Py_ssize_t remote;      /* number of wakeups expected */
+	/* the process the descriptors above belong to, see gs_io_check_fork() */
+	long pid;
+} gs_io;
+
+#define GS_IO_PENDING(io) \
+	((io)->waiting > 0 || (io)->inflight > 0 || (io)->remote > 0)
+
+void gs_io_init(gs_io* io);
+void gs_io_clear(gs_io* io);
+int gs_io_traverse(gs_io* io, visitproc visit, void* arg);
+
+/* Parks the current greenstack until fd is ready for dir (a GS_IO_* value)
+ * or timeout seconds have passed, if timeout is not negative.  Returns 1 if
+ * ready, 0 on timeout and -1 on error. */
+int gs_io_wait(struct _gs_scheduler* s, int fd, int dir, double timeout);
+
+/* Sets up the eventfd that makes gs_io_poll() return when another thread
+ * calls gs_io_wake(), which is safe without the GIL and does nothing until
+ * the eventfd is set up.  Only the thread of the scheduler sets it up. */
+int gs_io_wake_init(struct _gs_scheduler* s);
+void gs_io_wake(gs_io* io);
+
+/* Forgets about fd, which is about to be closed, waking its waiters */
+int gs_io_notify_close(struct _gs_scheduler* s, int fd);
+
+/* In a child forked after s used its descriptors, replaces them with ones
+ * of its own and wakes what waited on the old ones.  Returns 1 if it did,
+ * 0 if there was nothing to do and -1 on error. */
+int gs_io_check_fork(struct _gs_scheduler* s);
+
+/* Wakes the greenstacks whose descriptors are ready, waiting up to timeout
+ * milliseconds (forever if negative) for one to become ready. */
+int gs_io_poll(struct _gs_scheduler* s, long timeout);
+
+int _greenstack_io_init(PyObject* m);
+
+/*** greenstack_uring.c ***/
+
+#define GS_URING_UNTRIED     0
+#define GS_URING_AVAILABLE   1
+#define GS_URING_UNAVAILABLE 2
+
+/* Submits the queued operations and reaps completions, waiting up to
+ * timeout milliseconds (forever if negative) for one if nothing else needs
+ * to be polled. */
+int gs_uring_poll(struct _gs_scheduler* s, long timeout);
+/* Submits the queued operations without waiting */
+int gs_uring_submit(struct _gs_scheduler* s);
+/* Wakes the greenstacks whose operations have completed */
+int gs_uring_reap(struct _gs_scheduler* s);
+/* Adds the ring to epoll so that epoll_wait() returns on completions, and
+ * returns 1 if some are already waiting to be reaped. */
+int gs_uring_watch(struct _gs_scheduler* s, int epfd);
+void gs_uring_clear(gs_io* io);
+int gs_uring_traverse(gs_io* io, visitproc visit, void* arg);
+/* Lets go of a ring inherited from the parent, failing its operations */
+int gs_uring_forked(struct _gs_scheduler* s);
+
+int _greenstack_uring_init(PyObject* m);
+
+/*** greenstack_thread.c ***/
+
+struct _gs_job;
+
+/* Jobs that other threads have finished for a scheduler, and wakeups they
+ * have sent to its greenstacks: a lock-free stack that any thread pushes
+ * to and the scheduler takes whole, newest first. */
+typedef struct _gs_inbox {
+	struct _gs_job* head;
+} gs_inbox;
+
+/* Whether anything is in the inbox, without taking it */
+int gs_inbox_pending(struct _gs_scheduler* s);
+/* Hands the results of the finished jobs to their greenstacks and wakes
+ * them, in the order they were pushed */
+int gs_inbox_drain(struct _gs_scheduler* s);
+
+int _greenstack_thread_init(PyObject* m);
+
+/*** greenstack_sched.c ***/
+
+/* Values of PyGreenstack.sched_flags */
+#define GS_READY    0x1     /* has an entry in its scheduler's ready queue */
+#define GS_THROWING 0x2     /* used by gs_sched_throw_all() and gs_sched_throw() */
+#define GS_DEADLINE 0x4     /* sched_deadline is set */
+#define GS_BRIDGED  0x8     /* run by as_awaitable(); see greenstack_asyncio.c */
+
+/* Values of PyGreenstack.sched_priority.  Each has a ready queue of its
+ * own, and there is one more for greenstacks with a deadline; these are
+ * numbered in the order they are served. */
+#define GS_PRIORITY_HIGH   -1
+#define GS_PRIORITY_NORMAL  0
+#define GS_PRIORITY_LOW     1
+#define GS_PRIORITIES       3
+#define GS_CLASS_DEADLINE   GS_PRIORITIES
+#define GS_CLASS(priority)  ((priority) - GS_PRIORITY_HIGH)
+#define GS_CLASSES          (GS_PRIORITIES + 1)
+
+/* What to do with a greenstack when its ready queue entry is popped */
+#define GS_ENTRY_RESUME 0   /* switch to it, passing value */
+#define GS_ENTRY_THROW  1   /* raise value (an exception instance) in it */
+#define GS_ENTRY_START  2   /* start it with value as args and kwargs */
+
+typedef struct _gs_entry {
+	PyGreenstack* g;
+	PyObject* value;
+	PyObject* kwargs;
+	int kind;
+	int cls;                /* queue it is in, -1 if it was never queued */
+	PY_UINT64_T queued;     /* when it was queued */
+	PY_UINT64_T deadline;   /* for the deadline queue */
+} gs_entry;
+
+/* A ring buffer of entries.  head and tail run freely and are masked on
+ * access, so the queue is empty when they are equal. */
+typedef struct _gs_readyq {
+	gs_entry* buf;
+	size_t mask;
+	size_t head;
+	size_t tail;
+} gs_readyq;
+
+/* A binary heap of entries, earliest deadline first */
+typedef struct _gs_deadlineq {
+	gs_entry* heap;
+	size_t n;
+	size_t size;
+} gs_deadlineq;
+
+/* How long the entries of a class waited in the queue, in nanoseconds */
+typedef struct _gs_waitstats {
+	PY_UINT64_T count;
+	PY_UINT64_T total;
+	PY_UINT64_T max;
+} gs_waitstats;
+
+typedef struct _gs_scheduler {
+	PyObject_HEAD
+	/* thread state dict of the thread this scheduler belongs to */
+	PyObject* run_info;
+	/* greenstack currently running the loop, or NULL */
+	PyGreenstack* hub;
+	/* reference to the last greenstack switched to; see sched_resume() */
+	PyGreenstack* resumed;
+	gs_readyq ready[GS_PRIORITIES];
+	gs_deadlineq deadlines;
+	/* number of entries in all the queues */
+	size_t nready;
+	/* entries left to pop before checking timers again */
+	size_t pass_left;
+	gs_waitstats waits[GS_CLASSES];
+	/* in nanoseconds, 0 unless it preempts greenstacks */
+	PY_UINT64_T time_slice;
+	/* how many of a cohort run in a row, 0 for plain FIFO order */
+	size_t cohort_window;
+	/* state of the generator that shuffles each pass, 0 for none */
+	PY_UINT64_T shuffle;
+	gs_wheel timers;
+	gs_io io;
+	gs_inbox inbox;
+	PyObject* weakreflist;
+} GSScheduler;
+
+extern PyTypeObject GSScheduler_Type;
+
+/* Returns a new reference to the scheduler of the current thread, that is
+ * the one whose loop is running or else a default one created on first
+ * use. */
+GSScheduler* gs_sched_current(void);
+
+/* Raises GreenstackError and returns -1 unless s belongs to the current
+ * thread */
+int gs_sched_check_thread(GSScheduler* s);
+
+/* Queue g to be resumed with value (or to have value raised in it, for
+ * GS_ENTRY_THROW).  Returns 1 if queued, 0 if g was already ready and
+ * -1 on error.  Does not steal references. */
+int gs_sched_wake(GSScheduler* s, PyGreenstack* g, PyObject* value, int kind);
+
+/* Creates a greenstack that calls args[0](*args[1:], **kwargs) and queues
+ * it to start.  args must not be empty.  Returns a new reference. */
+PyGreenstack* gs_sched_spawn(GSScheduler* s, PyObject* args, PyObject* kwargs);
+
+/* Raises exc in each of the n greenstacks of gs that is still alive, other
+ * than the current one, in a single pass over the ready queue: ready ones
+ * get their entries replaced, parked ones are queued. */
+int gs_sched_throw_all(GSScheduler* s, PyObject** gs, Py_ssize_t n, PyObject* exc);
+
+/* Raises exc in g the next time it runs, even if it is the current one:
+ * if it is ready its entry is replaced, else it is queued. */
+int gs_sched_throw(GSScheduler* s, PyGreenstack* g, PyObject* exc);
+
+/* Switches straight to g, which must be parked and must not be the hub, as
+ * if it had been woken with value and popped from the ready queue.  The
+ * current greenstack has to be woken by someone to continue, so it should
+ * normally be queued first.  Returns what it is resumed with. */
+PyObject* gs_sched_switch(GSScheduler* s, PyGreenstack* g, PyObject* value);
+
+/* Suspend the current greenstack until it is woken.  Returns a new
+ * reference to the value it was woken with, or NULL with an exception. */
+PyObject* gs_sched_park(GSScheduler* s);
+
+/* Whether the thread whose state dict is given is in the loop of a
+ * scheduler with nothing ready, so it waits for I/O or timers */
+int gs_sched_idle(PyObject* dict);
+
+/* The scheduler the thread whose state dict is given is running, or its
+ * default one, as a borrowed reference, or NULL if it has none */
+GSScheduler* gs_sched_of_thread(PyObject* dict);
+
+/* Called by g_trampoline when a scheduler-owned greenstack finishes, with
+ * the result of its run function.  Only returns if control could not be
+ * handed to the scheduler, with the result to pass on to the parent. */
+PyObject* gs_sched_exit(PyGreenstack* self, PyObject* result);
+
+int _greenstack_sched_init(PyObject* m);
+
+/*** greenstack_channel.c ***/
+
+int _greenstack_channel_init(PyObject* m);
+
+/*** greenstack_lock.c ***/
+
+int _greenstack_lock_init(PyObject* m);
+
+/*** greenstack_queue.c ***/
+
+int _greenstack_queue_init(PyObject* m);
+
+/*** greenstack_nursery.c ***/
+
+/* Called when g, a child of a nursery, finishes with result, which is NULL
+ * if it died of an exception.  The nursery keeps the exception, so this
+ * returns the result for the scheduler to go on with. */
+PyObject* gs_nursery_exit(PyGreenstack* g, PyObject* result);
+
+int _greenstack_nursery_init(PyObject* m);
+
+/*** greenstack_preempt.c ***/
+
+/* Starts a new time slice; called when s, which has one, resumes a
+ * greenstack */
+void gs_preempt_resumed(GSScheduler* s);
+
+/* Sets the time slice of s in nanoseconds, 0 to turn preemption off */
+int gs_preempt_set_slice(GSScheduler* s, PY_UINT64_T slice);
+
+/* Sleeps for ns nanoseconds; for native threads, which do not hold the GIL */
+void gs_sleep_nogil(PY_UINT64_T ns);
+
+int _greenstack_preempt_init(PyObject* m);
+
+/*** greenstack_asyncio.c ***/
+
+int _greenstack_asyncio_init(PyObject* m);
+
+/*** greenstack_socket.c ***/
+
+int _greenstack_socket_init(PyObject* m);
+
+/*** greenstack_shm.c ***/
+
+int _greenstack_shm_init(PyObject* m);
+
+/*** greenstack_stats.c ***/
+
+/* The counters of the thread ts_current belongs to */
+extern PyGreenstack_Stats* ts_stats;
+
+/* Returns a new reference to what keeps the counters of the thread whose
+ * state dict is given alive, and stores them in *stats; NULL without an
+ * exception if it has none */
+PyObject* gs_stats_of(PyObject* dict, PyGreenstack_Stats** stats);
+
+/* Points ts_stats at the counters of the thread with the given dict,
+ * creating them if needed; called when ts_current changes threads */
+void gs_stats_attach(PyObject* dict);
+
+int PyGreenstack_GetStats(PyGreenstack_Stats* stats, int resident);
+
+/* One switch in gs_cpu_sample is timed for CPU accounting, or none if it
+ * is 0; gs_cpu_countdown counts down to the next one */
+extern unsigned int gs_cpu_sample;
+extern unsigned int gs_cpu_countdown;
+
+/* How many switches until the next timed one */
+unsigned int gs_cpu_next_sample(void);
+
+/* The started and unfinished greenstacks of the thread ts_current belongs
+ * to, and its main greenstack, linked through their live fields */
+extern gs_link* ts_live;
+
+#define GS_LIVE_GREENSTACK(l) \
+	((PyGreenstack*) ((char*) (l) - offsetof(PyGreenstack, live)))
+
+/* The list of live greenstacks of the thread whose state dict is given,
+ * or NULL if it has none */
+gs_link* gs_live_list(PyObject* dict);
+
+/* Stores new references to the greenstacks of a list of live ones in a
+ * new array, to be freed with PyMem_Free(), and returns how many there
+ * are; -1 with an exception if memory runs out */
+Py_ssize_t gs_live_greenstacks(gs_link* head, PyGreenstack*** greenstacks);
+
+/* The CPU time of the calling thread in nanoseconds */
+PY_UINT64_T gs_cpu_now(void);
+
+#if GREENSTACK_USE_SWITCH_TIMING
+
+/* Log-bucketed histogram of clock ticks: four buckets per power of two */
+#define GS_TIMING_BUCKETS 256
+
+typedef struct {
+	PY_UINT64_T count;
+	PY_UINT64_T total;
+	PY_UINT64_T max;
+	PY_UINT64_T buckets[GS_TIMING_BUCKETS];
+} gs_histogram;
+
+/* What is timed */
+#define GS_TIMING_SWITCH   0    /* from one greenstack to another */
+#define GS_TIMING_CREATE   1    /* from g_create() to running the new one */
+#define GS_TIMING_TEARDOWN 2    /* from the end of run() to the parent */
+#define GS_TIMING_KINDS    3
+
+/* The histograms of the thread ts_current belongs to, by GS_TIMING_* */
+extern gs_histogram* ts_timing;
+
+/* A clock in ticks: the time stamp counter where there is one */
+PY_UINT64_T gs_timing_now(void);
+
+void gs_timing_record(gs_histogram* h, PY_UINT64_T ticks);
+
+#endif /* GREENSTACK_USE_SWITCH_TIMING */
+
+int _greenstack_stats_init(PyObject* m);
+
+/*** greenstack_profile.c ***/
+
+int _greenstack_profile_init(PyObject* m);
+
+/*** greenstack_watchdog.c ***/
+
+int _greenstack_watchdog_init(PyObject* m);
+
+#endif /* !GREENSTACK_PRIVATE_H */
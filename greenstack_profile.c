@@ -0,0 +1,444 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* A sampling profiler that sees every greenstack, not just running ones.
+
+   A profiler samples from a native thread of its own, which sleeps for its
+   interval without the GIL and then takes it to look at the interpreter.
+   Each thread that is running Python code counts as running, with the
+   frames from its thread state.  Every other live greenstack is parked,
+   suspended in a switch with its frames saved in top_frame.  For each
+   one a sample adds one to the count of its stack, kept as a string in
+   the collapsed format flame graph tools read: "running" or "parked",
+   then the frames from the outermost in, all separated by semicolons.
+   Only the innermost frames of a deep stack are kept, with a
+   "[truncated]" frame between the root and them in place of the rest.
+
+   Parked greenstacks are found in the lists of live greenstacks of the
+   threads, so a sample takes time in proportion to their number.  The
+   frames of a stack are kept alive while it is walked, since building the
+   strings can run a collection.
+*/
+
+#include "greenstack_private.h"
+#include "pythread.h"
+#include "frameobject.h"
+
+/* Deeper stacks lose their outermost frames */
+#define PROF_MAX_DEPTH 256
+
+typedef struct {
+	PyObject_HEAD
+	PyObject* stacks;         /* collapsed stack -> number of samples */
+	PY_UINT64_T interval;     /* nanoseconds */
+	unsigned long samples;
+	/* only touched with the GIL held */
+	int running;              /* whether the sampler should go on */
+	int thread_alive;         /* whether there is a sampler thread */
+} GSProfiler;
+
+static PyTypeObject GSProfiler_Type;
+
+static PyObject* prof_running;
+static PyObject* prof_parked;
+static PyObject* prof_separator;
+static PyObject* prof_empty;
+static PyObject* prof_truncated;
+
+static PyObject* frame_label(PyFrameObject* f)
+{
+	PyCodeObject* co = f->f_code;
+#if PY_MAJOR_VERSION >= 3
+	return PyUnicode_FromFormat("%U (%U:%d)", co->co_name, co->co_filename,
+	                            PyFrame_GetLineNumber(f));
+#else
+	return PyString_FromFormat("%s (%s:%d)", PyString_AS_STRING(co->co_name),
+	                           PyString_AS_STRING(co->co_filename),
+	                           PyFrame_GetLineNumber(f));
+#endif
+}
+
+/* Counts one sample of the stack that f is the innermost frame of */
+static int prof_add(GSProfiler* p, PyObject* root, PyFrameObject* f)
+{
+	PyObject* frames;
+	PyObject* label;
+	PyObject* key;
+	PyObject* count;
+	PyFrameObject* next;
+	int depth, err;
+
+	frames = PyList_New(0);
+	if (frames == NULL)
+		return -1;
+	/* each frame keeps the ones it was called from alive */
+	Py_INCREF(f);
+	for (depth = 0; f != NULL && depth < PROF_MAX_DEPTH; depth++) {
+		label = frame_label(f);
+		if (label == NULL || PyList_Append(frames, label) < 0) {
+			Py_XDECREF(label);
+			Py_DECREF(frames);
+			Py_DECREF(f);
+			return -1;
+		}
+		Py_DECREF(label);
+		next = f->f_back;
+		Py_XINCREF(next);
+		Py_DECREF(f);
+		f = next;
+	}
+	/* the frames left over would be counted under the wrong root */
+	err = f != NULL ? PyList_Append(frames, prof_truncated) : 0;
+	Py_XDECREF(f);
+	if (err < 0 || PyList_Append(frames, root) < 0 ||
+	    PyList_Reverse(frames) < 0) {
+		Py_DECREF(frames);
+		return -1;
+	}
+	key = PyObject_CallMethod(prof_separator, "join", "(O)", frames);
+	Py_DECREF(frames);
+	if (key == NULL)
+		return -1;
+	count = PyDict_GetItem(p->stacks, key);
+	count = PyLong_FromLong(count != NULL ? PyLong_AsLong(count) + 1 : 1);
+	if (count == NULL) {
+		Py_DECREF(key);
+		return -1;
+	}
+	err = PyDict_SetItem(p->stacks, key, count);
+	Py_DECREF(key);
+	Py_DECREF(count);
+	return err;
+}
+
+static int prof_sample(GSProfiler* p)
+{
+	PyInterpreterState* interp = PyThreadState_GET()->interp;
+	PyThreadState* t;
+	PyFrameObject** running;
+	PyGreenstack** parked;
+	PyGreenstack* g;
+	PyObject** dicts;
+	gs_link* head;
+	Py_ssize_t n = 0, count, i, j;
+	int err = 0;
+
+	/* take the frames of the threads before anything can run and make
+	 * them go away */
+	for (t = PyInterpreterState_ThreadHead(interp); t != NULL; t = PyThreadState_Next(t))
+		n++;
+	running = PyMem_New(PyFrameObject*, n + 1);
+	dicts = PyMem_New(PyObject*, n + 1);
+	if (running == NULL || dicts == NULL) {
+		PyMem_Free(running);
+		PyMem_Free(dicts);
+		PyErr_NoMemory();
+		return -1;
+	}
+	n = 0;
+	for (t = PyInterpreterState_ThreadHead(interp); t != NULL; t = PyThreadState_Next(t)) {
+		Py_XINCREF(t->frame);
+		running[n] = t->frame;
+		Py_XINCREF(t->dict);
+		dicts[n] = t->dict;
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		if (err == 0 && running[i] != NULL &&
+		    prof_add(p, prof_running, running[i]) < 0)
+			err = -1;
+		Py_XDECREF(running[i]);
+	}
+	for (i = 0; i < n; i++) {
+		head = err == 0 && dicts[i] != NULL ? gs_live_list(dicts[i]) : NULL;
+		parked = NULL;
+		count = head != NULL ? gs_live_greenstacks(head, &parked) : 0;
+		if (count < 0)
+			err = -1;
+		for (j = 0; j < count; j++) {
+			g = parked[j];
+			if (err == 0 && g->top_frame != NULL &&
+			    PyGreenstack_ACTIVE(g) && g != gs_thread_current(dicts[i]) &&
+			    prof_add(p, prof_parked, g->top_frame) < 0)
+				err = -1;
+			Py_DECREF(g);
+		}
+		PyMem_Free(parked);
+		Py_XDECREF(dicts[i]);
+	}
+	PyMem_Free(running);
+	PyMem_Free(dicts);
+	if (err < 0)
+		return -1;
+	p->samples++;
+	return 0;
+}
+
+static void prof_thread(void* arg)
+{
+	GSProfiler* p = (GSProfiler*) arg;
+	PyGILState_STATE state;
+
+	for (;;) {
+		gs_sleep_nogil(p->interval);
+		state = PyGILState_Ensure();
+		if (!p->running) {
+			p->thread_alive = 0;
+			Py_DECREF(p);
+			PyGILState_Release(state);
+			return;
+		}
+		if (prof_sample(p) < 0)
+			PyErr_WriteUnraisable((PyObject*) p);
+		PyGILState_Release(state);
+	}
+}
+
+/***********************************************************/
+
+static PyObject* prof_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSProfiler* p;
+	double interval = 0.01;
+	static char* kwlist[] = {"interval", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|d:Profiler", kwlist, &interval))
+		return NULL;
+	if (!(interval >= 0.0001 && interval <= 3600)) {
+		PyErr_SetString(PyExc_ValueError,
+		                "interval must be between 0.0001 and 3600 seconds");
+		return NULL;
+	}
+	p = (GSProfiler*) type->tp_alloc(type, 0);
+	if (p == NULL)
+		return NULL;
+	p->stacks = PyDict_New();
+	if (p->stacks == NULL) {
+		Py_DECREF(p);
+		return NULL;
+	}
+	p->interval = (PY_UINT64_T) (interval * 1e9);
+	return (PyObject*) p;
+}
+
+static void prof_dealloc(GSProfiler* p)
+{
+	Py_XDECREF(p->stacks);
+	Py_TYPE(p)->tp_free((PyObject*) p);
+}
+
+PyDoc_STRVAR(prof_start_doc,
+"start()\n"
+"\n"
+"Start taking a sample every interval seconds, from a thread of its own.\n");
+
+static PyObject* prof_start(GSProfiler* p)
+{
+	if (p->running)
+		Py_RETURN_NONE;
+	p->running = 1;
+	/* a sampler that was stopped but has not noticed yet goes on */
+	if (p->thread_alive)
+		Py_RETURN_NONE;
+	PyEval_InitThreads();
+	Py_INCREF(p);
+	if ((unsigned long) PyThread_start_new_thread(prof_thread, p)
+	    == (unsigned long) -1) {
+		p->running = 0;
+		Py_DECREF(p);
+		PyErr_SetString(PyExc_RuntimeError, "can't start new thread");
+		return NULL;
+	}
+	p->thread_alive = 1;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(prof_stop_doc,
+"stop()\n"
+"\n"
+"Stop taking samples.  No more are taken once this returns.\n");
+
+static PyObject* prof_stop(GSProfiler* p)
+{
+	p->running = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject* prof_enter(GSProfiler* p)
+{
+	PyObject* result = prof_start(p);
+	if (result == NULL)
+		return NULL;
+	Py_DECREF(result);
+	Py_INCREF(p);
+	return (PyObject*) p;
+}
+
+static PyObject* prof_exit(GSProfiler* p, PyObject* args)
+{
+	return prof_stop(p);
+}
+
+PyDoc_STRVAR(prof_sample_doc,
+"sample()\n"
+"\n"
+"Take a sample now, from the calling thread.\n");
+
+static PyObject* prof_sample_method(GSProfiler* p)
+{
+	if (prof_sample(p) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(prof_clear_doc,
+"clear()\n"
+"\n"
+"Forget the samples taken so far.\n");
+
+static PyObject* prof_clear(GSProfiler* p)
+{
+	PyDict_Clear(p->stacks);
+	p->samples = 0;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(prof_collapsed_doc,
+"collapsed() -> str\n"
+"\n"
+"Return the samples in the collapsed stack format of flamegraph.pl and\n"
+"similar tools: a line for each stack, with its frames separated by\n"
+"semicolons and followed by the number of samples it was seen in.  The\n"
+"first frame of each is 'running' or 'parked'.\n");
+
+static PyObject* prof_collapsed(GSProfiler* p)
+{
+	PyObject* lines;
+	PyObject* line;
+	PyObject* key;
+	PyObject* value;
+	PyObject* result;
+	Py_ssize_t pos = 0;
+
+	lines = PyList_New(0);
+	if (lines == NULL)
+		return NULL;
+	while (PyDict_Next(p->stacks, &pos, &key, &value)) {
+#if PY_MAJOR_VERSION >= 3
+		line = PyUnicode_FromFormat("%U %S\n", key, value);
+#else
+		line = PyString_FromFormat("%s %ld\n", PyString_AS_STRING(key),
+		                           PyLong_AsLong(value));
+#endif
+		if (line == NULL || PyList_Append(lines, line) < 0) {
+			Py_XDECREF(line);
+			Py_DECREF(lines);
+			return NULL;
+		}
+		Py_DECREF(line);
+	}
+	if (PyList_Sort(lines) < 0) {
+		Py_DECREF(lines);
+		return NULL;
+	}
+	result = PyObject_CallMethod(prof_empty, "join", "(O)", lines);
+	Py_DECREF(lines);
+	return result;
+}
+
+static PyObject* prof_get_stacks(GSProfiler* p, void* context)
+{
+	return PyDict_Copy(p->stacks);
+}
+
+static PyObject* prof_get_samples(GSProfiler* p, void* context)
+{
+	return PyLong_FromUnsignedLong(p->samples);
+}
+
+static PyObject* prof_get_running(GSProfiler* p, void* context)
+{
+	return PyBool_FromLong(p->running);
+}
+
+static PyMethodDef prof_methods[] = {
+	{"start", (PyCFunction)prof_start, METH_NOARGS, prof_start_doc},
+	{"stop", (PyCFunction)prof_stop, METH_NOARGS, prof_stop_doc},
+	{"sample", (PyCFunction)prof_sample_method, METH_NOARGS, prof_sample_doc},
+	{"clear", (PyCFunction)prof_clear, METH_NOARGS, prof_clear_doc},
+	{"collapsed", (PyCFunction)prof_collapsed, METH_NOARGS, prof_collapsed_doc},
+	{"__enter__", (PyCFunction)prof_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)prof_exit, METH_VARARGS, NULL},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef prof_getsets[] = {
+	{"stacks", (getter)prof_get_stacks, NULL,
+	 "A dict of the number of samples of each collapsed stack."},
+	{"samples", (getter)prof_get_samples, NULL,
+	 "How many samples were taken."},
+	{"running", (getter)prof_get_running, NULL,
+	 "Whether it is taking samples."},
+	{NULL}
+};
+
+static PyTypeObject GSProfiler_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Profiler",                  /* tp_name */
+	sizeof(GSProfiler),                     /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)prof_dealloc,               /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	"Profiler(interval=0.01) -> Profiler\n\n"
+	"A sampling profiler that counts the stacks of both the running and the\n"
+	"parked greenstacks of all threads.  Use start() and stop(), or use it\n"
+	"as a context manager.",               /* tp_doc */
+	0,                                      /* tp_traverse */
+	0,                                      /* tp_clear */
+	0,                                      /* tp_richcompare */
+	0,                                      /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	prof_methods,                           /* tp_methods */
+	0,                                      /* tp_members */
+	prof_getsets,                           /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	prof_new,                               /* tp_new */
+};
+
+int _greenstack_profile_init(PyObject* m)
+{
+	if (PyType_Ready(&GSProfiler_Type) < 0)
+		return -1;
+	prof_running = GS_InternFromString("running");
+	prof_parked = GS_InternFromString("parked");
+	prof_separator = GS_InternFromString(";");
+	prof_empty = GS_InternFromString("");
+	prof_truncated = GS_InternFromString("[truncated]");
+	if (prof_running == NULL || prof_parked == NULL ||
+	    prof_separator == NULL || prof_empty == NULL ||
+	    prof_truncated == NULL)
+		return -1;
+	Py_INCREF(&GSProfiler_Type);
+	return PyModule_AddObject(m, "Profiler", (PyObject*) &GSProfiler_Type);
+}
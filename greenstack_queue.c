@@ -0,0 +1,673 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* A bounded FIFO queue between greenstacks run by the scheduler.
+
+   Items are kept in a ring buffer that grows by doubling up to maxsize,
+   so putting and getting do not allocate once it has warmed up.  A getter
+   only waits while the buffer is empty and a putter only while it is full,
+   so whoever finds a counterpart waiting deals with it directly: items are
+   handed straight to a waiting getter, and a getter that frees some room
+   moves the items of the first waiting putter into the buffer itself.
+   Either way the waiting greenstack is done by the time it is woken.
+
+   put_many() and get_many() move whole batches this way, so a stream of
+   items costs one switch per batch rather than one per item.
+
+   Waiters live on the C stacks of the parked greenstacks.  A getter that
+   is interrupted (by a Timeout for example) after being handed items puts
+   them back at the front of the queue.
+*/
+
+#include "greenstack_private.h"
+
+typedef struct {
+	gs_link link;
+	PyGreenstack* g;        /* strong reference while waiting */
+	GSScheduler* sched;     /* the one g is parked in, kept alive by g */
+	int fired;              /* set once the wait is over */
+	/* putters: items still to put, borrowed from the caller */
+	PyObject** items;
+	Py_ssize_t n;
+	Py_ssize_t done;
+	/* getters: the item, or the list for get_many() */
+	PyObject* item;
+	PyObject* list;
+	Py_ssize_t want;
+	Py_ssize_t got;
+} queue_waiter;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject** buf;
+	size_t mask;            /* capacity - 1, the capacity being a power of 2 */
+	size_t head;
+	size_t tail;
+	Py_ssize_t maxsize;     /* 0 for no limit */
+	gs_link putters;
+	gs_link getters;
+	PyObject* weakreflist;
+} GSQueue;
+
+#define QUEUE_LEN(q)  ((Py_ssize_t) ((q)->tail - (q)->head))
+#define QUEUE_FULL(q) ((q)->maxsize > 0 && QUEUE_LEN(q) >= (q)->maxsize)
+
+#define QUEUE_MIN_CAPACITY 8
+
+static PyObject* QueueFull;
+static PyObject* QueueEmpty;
+
+/* Makes room for one more item */
+static int queue_grow(GSQueue* q)
+{
+	size_t cap = q->buf == NULL ? 0 : q->mask + 1;
+	size_t newcap = cap == 0 ? QUEUE_MIN_CAPACITY : cap * 2;
+	size_t i, len = q->tail - q->head;
+	PyObject** buf;
+
+	if (len < cap)
+		return 0;
+	buf = PyMem_New(PyObject*, newcap);
+	if (buf == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	for (i = 0; i < len; i++)
+		buf[i] = q->buf[(q->head + i) & q->mask];
+	PyMem_Free(q->buf);
+	q->buf = buf;
+	q->mask = newcap - 1;
+	q->head = 0;
+	q->tail = len;
+	return 0;
+}
+
+/* Appends item, taking a new reference */
+static int queue_push(GSQueue* q, PyObject* item)
+{
+	if (queue_grow(q) < 0)
+		return -1;
+	Py_INCREF(item);
+	q->buf[q->tail++ & q->mask] = item;
+	return 0;
+}
+
+/* Puts item back at the front, taking a new reference */
+static int queue_push_front(GSQueue* q, PyObject* item)
+{
+	if (queue_grow(q) < 0)
+		return -1;
+	Py_INCREF(item);
+	q->buf[--q->head & q->mask] = item;
+	return 0;
+}
+
+/* Returns a new reference to the first item, which must exist */
+static PyObject* queue_pop(GSQueue* q)
+{
+	return q->buf[q->head++ & q->mask];
+}
+
+/* Ends the wait of w and queues it to run */
+static int queue_fire(queue_waiter* w)
+{
+	if (gs_sched_wake(w->sched, w->g, Py_None, GS_ENTRY_RESUME) < 0)
+		return -1;
+	gs_list_remove(&w->link);
+	w->fired = 1;
+	return 0;
+}
+
+static queue_waiter* queue_first(gs_link* head)
+{
+	queue_waiter* w;
+	if (GS_LIST_EMPTY(head))
+		return NULL;
+	w = (queue_waiter*) head->next;
+	if (w->g->run_info != ts_current->run_info) {
+		PyErr_SetString(PyExc_GreenstackError,
+		                "cannot use a queue from a different thread");
+		return NULL;
+	}
+	return w;
+}
+
+/* Gives item to a waiting getter */
+static int queue_give(queue_waiter* w, PyObject* item)
+{
+	if (w->list != NULL) {
+		if (PyList_Append(w->list, item) < 0)
+			return -1;
+	} else {
+		Py_INCREF(item);
+		w->item = item;
+	}
+	w->got++;
+	return 0;
+}
+
+/* Moves the items of waiting putters into the room there is */
+static int queue_refill(GSQueue* q)
+{
+	queue_waiter* w;
+	while (!QUEUE_FULL(q)) {
+		w = queue_first(&q->putters);
+		if (w == NULL)
+			return PyErr_Occurred() ? -1 : 0;
+		if (queue_push(q, w->items[w->done]) < 0)
+			return -1;
+		if (++w->done == w->n && queue_fire(w) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Parks the current greenstack with w at the end of head until it is
+ * fired or timeout seconds pass, if timeout is not negative.  Returns 1
+ * if fired, 0 on timeout and -1 on error. */
+static int queue_wait(gs_link* head, queue_waiter* w, double timeout)
+{
+	GSScheduler* s;
+	gs_timer t;
+	PyObject* r;
+
+	s = gs_sched_current();
+	if (s == NULL)
+		return -1;
+	Py_INCREF(ts_current);
+	w->g = ts_current;
+	w->sched = s;
+	w->fired = 0;
+	gs_list_append(head, &w->link);
+	gs_timer_init(&t);
+	if (timeout >= 0)
+		gs_timer_arm(s, &t, timeout, ts_current, Py_None, GS_ENTRY_RESUME);
+	for (;;) {
+		r = gs_sched_park(s);
+		if (r == NULL)
+			break;
+		Py_DECREF(r);
+		if (w->fired || (timeout >= 0 && !GS_TIMER_ARMED(&t)))
+			break;
+		/* woken by someone else; keep waiting */
+	}
+	gs_timer_cancel(s, &t);
+	if (!w->fired)
+		gs_list_remove(&w->link);
+	Py_CLEAR(w->g);
+	Py_DECREF(s);
+	return r == NULL ? -1 : w->fired;
+}
+
+/* Puts up to n items, waiting for room for up to timeout seconds (forever
+ * if negative).  Returns how many were put, or -1 on error. */
+static Py_ssize_t queue_put_items(GSQueue* q, PyObject** items, Py_ssize_t n,
+                                  double timeout)
+{
+	queue_waiter w;
+	Py_ssize_t i = 0;
+	queue_waiter* getter;
+	int err;
+
+	while (i < n) {
+		getter = queue_first(&q->getters);
+		if (getter != NULL) {
+			/* the buffer is empty: hand over as much as it wants */
+			do {
+				if (queue_give(getter, items[i]) < 0)
+					return -1;
+				i++;
+			} while (i < n && getter->got < getter->want);
+			if (queue_fire(getter) < 0)
+				return -1;
+			continue;
+		}
+		if (PyErr_Occurred())
+			return -1;
+		if (QUEUE_FULL(q))
+			break;
+		if (queue_push(q, items[i]) < 0)
+			return -1;
+		i++;
+	}
+	if (i == n || timeout == 0)
+		return i;
+
+	/* getters will move the rest into the buffer as room frees up */
+	w.items = items + i;
+	w.n = n - i;
+	w.done = 0;
+	w.item = w.list = NULL;
+	err = queue_wait(&q->putters, &w, timeout);
+	if (err < 0)
+		return -1;
+	return i + w.done;
+}
+
+/* Gets up to want items, into list if given and else into *item, waiting
+ * up to timeout seconds (forever if negative) for the first one.  Returns
+ * how many were got, or -1 on error. */
+static Py_ssize_t queue_get_items(GSQueue* q, PyObject* list, Py_ssize_t want,
+                                  double timeout, PyObject** item)
+{
+	queue_waiter w;
+	Py_ssize_t got = 0, i;
+	PyObject* x;
+	int err;
+
+	while (got < want && QUEUE_LEN(q) > 0) {
+		x = queue_pop(q);
+		if (list == NULL) {
+			*item = x;
+		} else {
+			err = PyList_Append(list, x);
+			Py_DECREF(x);
+			if (err < 0)
+				return -1;
+		}
+		got++;
+		if (queue_refill(q) < 0)
+			return -1;
+	}
+	if (got > 0 || timeout == 0)
+		return got;
+
+	w.item = NULL;
+	w.list = list;
+	w.want = want;
+	w.got = 0;
+	err = queue_wait(&q->getters, &w, timeout);
+	if (err < 0) {
+		/* put back what was handed over, in order */
+		PyObject *typ, *val, *tb;
+		PyErr_Fetch(&typ, &val, &tb);
+		if (list == NULL && w.item != NULL) {
+			if (queue_push_front(q, w.item) < 0)
+				PyErr_WriteUnraisable((PyObject*) q);
+			Py_DECREF(w.item);
+		}
+		for (i = w.got; list != NULL && i > 0; i--) {
+			if (queue_push_front(q, PyList_GET_ITEM(list, i - 1)) < 0)
+				PyErr_WriteUnraisable((PyObject*) q);
+		}
+		PyErr_Restore(typ, val, tb);
+		return -1;
+	}
+	if (list == NULL)
+		*item = w.item;
+	return w.got;
+}
+
+/* Converts block and timeout arguments into seconds to wait, 0 for not
+ * blocking and -1 for forever */
+static int queue_timeout(int block, PyObject* timeout, double* seconds)
+{
+	*seconds = -1;
+	if (timeout != Py_None) {
+		*seconds = PyFloat_AsDouble(timeout);
+		if (*seconds == -1 && PyErr_Occurred())
+			return -1;
+		if (*seconds < 0) {
+			PyErr_SetString(PyExc_ValueError,
+			                "'timeout' must be a non-negative number");
+			return -1;
+		}
+	}
+	if (!block)
+		*seconds = 0;
+	return 0;
+}
+
+/***********************************************************/
+/* Queue type */
+
+static PyObject* queue_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSQueue* q;
+	Py_ssize_t maxsize = 0;
+	static char* kwlist[] = {"maxsize", 0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n:Queue", kwlist, &maxsize))
+		return NULL;
+	q = (GSQueue*) type->tp_alloc(type, 0);
+	if (q == NULL)
+		return NULL;
+	q->maxsize = maxsize > 0 ? maxsize : 0;
+	GS_LIST_INIT(&q->putters);
+	GS_LIST_INIT(&q->getters);
+	return (PyObject*) q;
+}
+
+static int queue_traverse(GSQueue* q, visitproc visit, void* arg)
+{
+	size_t i;
+	gs_link* l;
+	for (i = q->head; i != q->tail; i++)
+		Py_VISIT(q->buf[i & q->mask]);
+	for (l = q->putters.next; l != &q->putters; l = l->next)
+		Py_VISIT((PyObject*) ((queue_waiter*) l)->g);
+	for (l = q->getters.next; l != &q->getters; l = l->next)
+		Py_VISIT((PyObject*) ((queue_waiter*) l)->g);
+	return 0;
+}
+
+/* Unlinks every waiter.  Only reached when the waiting greenstacks are
+ * garbage themselves. */
+static void queue_unlink_all(gs_link* head)
+{
+	while (!GS_LIST_EMPTY(head)) {
+		queue_waiter* w = (queue_waiter*) head->next;
+		gs_list_remove(&w->link);
+		Py_CLEAR(w->g);
+	}
+}
+
+static int queue_clear(GSQueue* q)
+{
+	queue_unlink_all(&q->putters);
+	queue_unlink_all(&q->getters);
+	while (q->head != q->tail) {
+		PyObject* x = queue_pop(q);
+		Py_DECREF(x);
+	}
+	return 0;
+}
+
+static void queue_dealloc(GSQueue* q)
+{
+	PyObject_GC_UnTrack((PyObject*) q);
+	if (q->weakreflist != NULL)
+		PyObject_ClearWeakRefs((PyObject*) q);
+	queue_clear(q);
+	PyMem_Free(q->buf);
+	Py_TYPE(q)->tp_free((PyObject*) q);
+}
+
+static Py_ssize_t queue_len(GSQueue* q)
+{
+	return QUEUE_LEN(q);
+}
+
+PyDoc_STRVAR(queue_put_doc,
+"put(item, block=True, timeout=None)\n"
+"\n"
+"Put item at the end of the queue, waiting for room if it is full.\n"
+"Raises queue.Full if there is no room without blocking, when block is\n"
+"false, or within timeout seconds.\n");
+
+static PyObject* queue_put(GSQueue* q, PyObject* args, PyObject* kwargs)
+{
+	PyObject* item;
+	int block = 1;
+	PyObject* timeout = Py_None;
+	double seconds;
+	Py_ssize_t n;
+	static char* kwlist[] = {"item", "block", "timeout", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO:put", kwlist,
+	                                 &item, &block, &timeout))
+		return NULL;
+	if (queue_timeout(block, timeout, &seconds) < 0)
+		return NULL;
+	n = queue_put_items(q, &item, 1, seconds);
+	if (n < 0)
+		return NULL;
+	if (n == 0) {
+		PyErr_SetNone(QueueFull);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(queue_put_nowait_doc,
+"put_nowait(item)\n"
+"\n"
+"Same as put(item, False).\n");
+
+static PyObject* queue_put_nowait(GSQueue* q, PyObject* item)
+{
+	Py_ssize_t n = queue_put_items(q, &item, 1, 0);
+	if (n < 0)
+		return NULL;
+	if (n == 0) {
+		PyErr_SetNone(QueueFull);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(queue_get_doc,
+"get(block=True, timeout=None) -> item\n"
+"\n"
+"Remove and return the first item, waiting for one if the queue is\n"
+"empty.  Raises queue.Empty if there is none without blocking, when\n"
+"block is false, or within timeout seconds.\n");
+
+static PyObject* queue_get(GSQueue* q, PyObject* args, PyObject* kwargs)
+{
+	int block = 1;
+	PyObject* timeout = Py_None;
+	PyObject* item = NULL;
+	double seconds;
+	Py_ssize_t n;
+	static char* kwlist[] = {"block", "timeout", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iO:get", kwlist,
+	                                 &block, &timeout))
+		return NULL;
+	if (queue_timeout(block, timeout, &seconds) < 0)
+		return NULL;
+	n = queue_get_items(q, NULL, 1, seconds, &item);
+	if (n < 0) {
+		Py_XDECREF(item);
+		return NULL;
+	}
+	if (n == 0) {
+		PyErr_SetNone(QueueEmpty);
+		return NULL;
+	}
+	return item;
+}
+
+PyDoc_STRVAR(queue_get_nowait_doc,
+"get_nowait() -> item\n"
+"\n"
+"Same as get(False).\n");
+
+static PyObject* queue_get_nowait(GSQueue* q)
+{
+	PyObject* item = NULL;
+	Py_ssize_t n = queue_get_items(q, NULL, 1, 0, &item);
+	if (n < 0) {
+		Py_XDECREF(item);
+		return NULL;
+	}
+	if (n == 0) {
+		PyErr_SetNone(QueueEmpty);
+		return NULL;
+	}
+	return item;
+}
+
+PyDoc_STRVAR(queue_put_many_doc,
+"put_many(items, timeout=None) -> int\n"
+"\n"
+"Put every item of items at the end of the queue, waiting for room as\n"
+"needed, and return how many were put.  That is fewer than all of them\n"
+"only if timeout seconds passed first.\n");
+
+static PyObject* queue_put_many(GSQueue* q, PyObject* args, PyObject* kwargs)
+{
+	PyObject* items;
+	PyObject* timeout = Py_None;
+	PyObject* seq;
+	double seconds;
+	Py_ssize_t n;
+	static char* kwlist[] = {"items", "timeout", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:put_many", kwlist,
+	                                 &items, &timeout))
+		return NULL;
+	if (queue_timeout(1, timeout, &seconds) < 0)
+		return NULL;
+	seq = PySequence_Fast(items, "put_many() needs an iterable");
+	if (seq == NULL)
+		return NULL;
+	n = queue_put_items(q, PySequence_Fast_ITEMS(seq),
+	                    PySequence_Fast_GET_SIZE(seq), seconds);
+	Py_DECREF(seq);
+	if (n < 0)
+		return NULL;
+	return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(queue_get_many_doc,
+"get_many(max_items, timeout=None) -> list\n"
+"\n"
+"Remove and return up to max_items items from the front of the queue,\n"
+"waiting for the first one if the queue is empty.  Returns an empty list\n"
+"only if timeout seconds passed first.\n");
+
+static PyObject* queue_get_many(GSQueue* q, PyObject* args, PyObject* kwargs)
+{
+	Py_ssize_t want;
+	PyObject* timeout = Py_None;
+	PyObject* list;
+	double seconds;
+	static char* kwlist[] = {"max_items", "timeout", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n|O:get_many", kwlist,
+	                                 &want, &timeout))
+		return NULL;
+	if (want < 1) {
+		PyErr_SetString(PyExc_ValueError, "max_items must be positive");
+		return NULL;
+	}
+	if (queue_timeout(1, timeout, &seconds) < 0)
+		return NULL;
+	list = PyList_New(0);
+	if (list == NULL)
+		return NULL;
+	if (queue_get_items(q, list, want, seconds, NULL) < 0) {
+		Py_DECREF(list);
+		return NULL;
+	}
+	return list;
+}
+
+PyDoc_STRVAR(queue_qsize_doc,
+"qsize() -> int\n"
+"\n"
+"Return the number of items in the queue.\n");
+
+static PyObject* queue_qsize(GSQueue* q)
+{
+	return PyLong_FromSsize_t(QUEUE_LEN(q));
+}
+
+PyDoc_STRVAR(queue_empty_doc,
+"empty() -> bool\n"
+"\n"
+"Return whether the queue is empty.\n");
+
+static PyObject* queue_empty(GSQueue* q)
+{
+	return PyBool_FromLong(QUEUE_LEN(q) == 0);
+}
+
+PyDoc_STRVAR(queue_full_doc,
+"full() -> bool\n"
+"\n"
+"Return whether the queue is full.\n");
+
+static PyObject* queue_full(GSQueue* q)
+{
+	return PyBool_FromLong(QUEUE_FULL(q));
+}
+
+static PyMethodDef queue_methods[] = {
+	{"put", (PyCFunction)queue_put, METH_VARARGS | METH_KEYWORDS, queue_put_doc},
+	{"put_nowait", (PyCFunction)queue_put_nowait, METH_O, queue_put_nowait_doc},
+	{"get", (PyCFunction)queue_get, METH_VARARGS | METH_KEYWORDS, queue_get_doc},
+	{"get_nowait", (PyCFunction)queue_get_nowait, METH_NOARGS, queue_get_nowait_doc},
+	{"put_many", (PyCFunction)queue_put_many, METH_VARARGS | METH_KEYWORDS, queue_put_many_doc},
+	{"get_many", (PyCFunction)queue_get_many, METH_VARARGS | METH_KEYWORDS, queue_get_many_doc},
+	{"qsize", (PyCFunction)queue_qsize, METH_NOARGS, queue_qsize_doc},
+	{"empty", (PyCFunction)queue_empty, METH_NOARGS, queue_empty_doc},
+	{"full", (PyCFunction)queue_full, METH_NOARGS, queue_full_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyMemberDef queue_members[] = {
+	{"maxsize", T_PYSSIZET, offsetof(GSQueue, maxsize), READONLY,
+	 "The most items the queue holds, or 0 for no limit."},
+	{NULL}
+};
+
+static PySequenceMethods queue_as_sequence = {
+	(lenfunc)queue_len,  /* sq_length */
+};
+
+static PyTypeObject GSQueue_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Queue",                     /* tp_name */
+	sizeof(GSQueue),                        /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)queue_dealloc,              /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	&queue_as_sequence,                     /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Queue(maxsize=0) -> Queue\n\n"
+	"A FIFO queue for greenstacks that makes putters wait while it holds\n"
+	"maxsize items, if maxsize is positive, and getters wait while it is\n"
+	"empty.  Its length is the number of items in it.", /* tp_doc */
+	(traverseproc)queue_traverse,           /* tp_traverse */
+	(inquiry)queue_clear,                   /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSQueue, weakreflist),         /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	queue_methods,                          /* tp_methods */
+	queue_members,                          /* tp_members */
+	0,                                      /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	queue_new,                              /* tp_new */
+};
+
+int _greenstack_queue_init(PyObject* m)
+{
+	PyObject* mod;
+#if PY_MAJOR_VERSION >= 3
+	mod = PyImport_ImportModule("queue");
+#else
+	mod = PyImport_ImportModule("Queue");
+#endif
+	if (mod == NULL)
+		return -1;
+	QueueFull = PyObject_GetAttrString(mod, "Full");
+	QueueEmpty = PyObject_GetAttrString(mod, "Empty");
+	Py_DECREF(mod);
+	if (QueueFull == NULL || QueueEmpty == NULL)
+		return -1;
+	if (PyType_Ready(&GSQueue_Type) < 0)
+		return -1;
+	Py_INCREF(&GSQueue_Type);
+	return PyModule_AddObject(m, "Queue", (PyObject*) &GSQueue_Type);
+}
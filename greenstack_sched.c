@@ -0,0 +1,1311 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* A run queue scheduler for greenstacks.
+
+   Each scheduler belongs to one thread and keeps a ring buffer of ready
+   greenstacks.  The greenstack that calls run() becomes the hub: it pops
+   entries and switches to them.  When a greenstack blocks it does not go
+   back to the hub, it pops the next ready entry itself and switches
+   straight to it; the hub only gets control back when nothing is ready
+   or when a greenstack dies with an exception.  Spawned greenstacks that
+   return normally also hand the thread directly to the next entry.
+
+   A greenstack that blocks while no loop is running becomes the hub
+   itself until it is woken again, so blocking calls work the same from
+   the main greenstack as from spawned ones.
+
+   There is a ring buffer for each priority class, served strictly in
+   order of priority, and ahead of them a heap of the greenstacks that
+   have a deadline, served earliest deadline first.  Entries are stamped
+   when they are queued so that the time each class spends waiting can be
+   counted.
+
+   Optionally the ready greenstacks of each class are grouped into cohorts
+   at the start of every pass, by the code they are about to run or by a
+   key of their own, so that greenstacks running the same code run one
+   after another while it is still in the caches.  A cohort only gets a
+   window of turns in a row before the next one has its go.
+
+   For simulations the timers can run on a virtual clock, and the order
+   of each pass can be shuffled by a seeded generator so that different
+   interleavings can be tried and each one reproduced.
+*/
+
+#include "greenstack_private.h"
+#include "frameobject.h"
+
+static PyObject* ts_schedkey;
+
+/***********************************************************/
+/* Ready queue */
+
+#define READYQ_INITIAL_SIZE 64
+#define READYQ_LEN(q) ((q)->tail - (q)->head)
+
+static int readyq_grow(gs_readyq* q)
+{
+	size_t n = READYQ_LEN(q);
+	size_t size = q->buf ? (q->mask + 1) * 2 : READYQ_INITIAL_SIZE;
+	size_t i;
+	gs_entry* buf = (gs_entry*) PyMem_Malloc(size * sizeof(gs_entry));
+	if (buf == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		buf[i] = q->buf[(q->head + i) & q->mask];
+	PyMem_Free(q->buf);
+	q->buf = buf;
+	q->mask = size - 1;
+	q->head = 0;
+	q->tail = n;
+	return 0;
+}
+
+static int readyq_push(gs_readyq* q, gs_entry* e)
+{
+	if (q->buf == NULL || READYQ_LEN(q) > q->mask) {
+		if (readyq_grow(q) < 0)
+			return -1;
+	}
+	q->buf[q->tail++ & q->mask] = *e;
+	return 0;
+}
+
+static int readyq_pop(gs_readyq* q, gs_entry* e)
+{
+	if (q->head == q->tail)
+		return 0;
+	*e = q->buf[q->head++ & q->mask];
+	return 1;
+}
+
+/* Puts back an entry that was just popped */
+static void readyq_unpop(gs_readyq* q, gs_entry* e)
+{
+	q->buf[--q->head & q->mask] = *e;
+}
+
+static void entry_clear(gs_entry* e)
+{
+	e->g->sched_flags &= ~GS_READY;
+	Py_CLEAR(e->g);
+	Py_CLEAR(e->value);
+	Py_CLEAR(e->kwargs);
+}
+
+static void readyq_clear(gs_readyq* q)
+{
+	gs_entry e;
+	while (readyq_pop(q, &e))
+		entry_clear(&e);
+	PyMem_Free(q->buf);
+	q->buf = NULL;
+	q->mask = q->head = q->tail = 0;
+}
+
+/***********************************************************/
+/* Deadline queue */
+
+static int deadlineq_push(gs_deadlineq* q, gs_entry* e)
+{
+	size_t i, parent;
+	if (q->n == q->size) {
+		size_t size = q->size ? q->size * 2 : READYQ_INITIAL_SIZE;
+		gs_entry* heap = PyMem_Resize(q->heap, gs_entry, size);
+		if (heap == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		q->heap = heap;
+		q->size = size;
+	}
+	for (i = q->n++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (q->heap[parent].deadline <= e->deadline)
+			break;
+		q->heap[i] = q->heap[parent];
+	}
+	q->heap[i] = *e;
+	return 0;
+}
+
+static int deadlineq_pop(gs_deadlineq* q, gs_entry* e)
+{
+	size_t i, child;
+	gs_entry* last;
+	if (q->n == 0)
+		return 0;
+	*e = q->heap[0];
+	last = &q->heap[--q->n];
+	for (i = 0; (child = 2 * i + 1) < q->n; i = child) {
+		if (child + 1 < q->n && q->heap[child + 1].deadline < q->heap[child].deadline)
+			child++;
+		if (last->deadline <= q->heap[child].deadline)
+			break;
+		q->heap[i] = q->heap[child];
+	}
+	q->heap[i] = *last;
+	return 1;
+}
+
+static void deadlineq_clear(gs_deadlineq* q)
+{
+	gs_entry e;
+	while (deadlineq_pop(q, &e))
+		entry_clear(&e);
+	PyMem_Free(q->heap);
+	q->heap = NULL;
+	q->size = 0;
+}
+
+/***********************************************************/
+/* Cohorts */
+
+/* What g is going to run: the code it is suspended in, or the function it
+ * starts with.  Keys are compared by identity.  Borrowed. */
+static PyObject* cohort_key(PyGreenstack* g)
+{
+	PyFrameObject* f;
+	PyObject* run;
+	if (g->sched_cohort != NULL)
+		return g->sched_cohort;
+	if (PyGreenstack_STARTED(g)) {
+		f = g == ts_current ? PyThreadState_GET()->frame : g->top_frame;
+		return f != NULL ? (PyObject*) f->f_code : Py_None;
+	}
+	run = g->run_info;
+	if (run != NULL && PyMethod_Check(run))
+		run = PyMethod_GET_FUNCTION(run);
+	if (run != NULL && PyFunction_Check(run))
+		return PyFunction_GET_CODE(run);
+	return run != NULL ? run : Py_None;
+}
+
+/* Reorders q so that its entries are grouped by cohort, in the order each
+ * cohort first appears, taking turns of up to window entries.  Order is
+ * kept within a cohort.  Nothing changes if memory runs out. */
+static void readyq_regroup(gs_readyq* q, size_t window)
+{
+	size_t n = READYQ_LEN(q);
+	size_t tsize, i, j, k, ngroups, nalive, take;
+	PyObject** keys;
+	size_t *slots, *gid, *start, *end, *cur, *alive;
+	gs_entry* tmp;
+	char* mem;
+
+	if (n < 3)
+		return;
+	for (tsize = 4; tsize < 2 * n; tsize *= 2)
+		;
+	mem = PyMem_Malloc(n * sizeof(gs_entry) +
+	                   tsize * (sizeof(PyObject*) + sizeof(size_t)) +
+	                   n * 5 * sizeof(size_t));
+	if (mem == NULL)
+		return;
+	tmp = (gs_entry*) mem;
+	keys = (PyObject**) (tmp + n);
+	slots = (size_t*) (keys + tsize);
+	gid = slots + tsize;
+	start = gid + n;
+	end = start + n;
+	cur = end + n;
+	alive = cur + n;
+	memset(keys, 0, tsize * sizeof(PyObject*));
+
+	/* number the cohorts with an open addressing table */
+	ngroups = 0;
+	for (i = 0; i < n; i++) {
+		PyObject* key = cohort_key(q->buf[(q->head + i) & q->mask].g);
+		j = (((size_t) key >> 4) * 2654435761u) & (tsize - 1);
+		while (keys[j] != NULL && keys[j] != key)
+			j = (j + 1) & (tsize - 1);
+		if (keys[j] == NULL) {
+			keys[j] = key;
+			slots[j] = ngroups;
+			end[ngroups++] = 0;
+		}
+		gid[i] = slots[j];
+		end[gid[i]]++;
+	}
+	if (ngroups == 1 || ngroups == n)
+		goto done;
+
+	/* sort them by cohort, keeping their order */
+	for (i = 0, k = 0; i < ngroups; i++) {
+		start[i] = cur[i] = k;
+		k += end[i];
+		end[i] = k;
+	}
+	for (i = 0; i < n; i++)
+		tmp[cur[gid[i]]++] = q->buf[(q->head + i) & q->mask];
+
+	/* and deal them back out in turns */
+	for (i = 0; i < ngroups; i++)
+		alive[i] = i;
+	nalive = ngroups;
+	k = 0;
+	while (nalive > 0) {
+		for (i = 0, j = 0; i < nalive; i++) {
+			size_t c = alive[i];
+			take = end[c] - start[c];
+			if (take > window)
+				take = window;
+			while (take-- > 0)
+				q->buf[(q->head + k++) & q->mask] = tmp[start[c]++];
+			if (start[c] < end[c])
+				alive[j++] = c;
+		}
+		nalive = j;
+	}
+done:
+	PyMem_Free(mem);
+}
+
+/***********************************************************/
+/* Shuffling */
+
+/* xorshift64*, whose state must not be 0 */
+static PY_UINT64_T shuffle_next(PY_UINT64_T* state)
+{
+	PY_UINT64_T x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 2685821657736338717ULL;
+}
+
+static void readyq_shuffle(gs_readyq* q, PY_UINT64_T* state)
+{
+	size_t n = READYQ_LEN(q);
+	size_t i, j;
+	gs_entry tmp;
+	for (i = n; i > 1; i--) {
+		j = (size_t) (shuffle_next(state) % i);
+		tmp = q->buf[(q->head + i - 1) & q->mask];
+		q->buf[(q->head + i - 1) & q->mask] = q->buf[(q->head + j) & q->mask];
+		q->buf[(q->head + j) & q->mask] = tmp;
+	}
+}
+
+/***********************************************************/
+/* All the queues */
+
+/* Calls func on each queued entry, stopping if it returns nonzero */
+static int sched_foreach(GSScheduler* s, int (*func)(gs_entry*, void*), void* arg)
+{
+	size_t i;
+	int cls, r;
+	for (cls = 0; cls < GS_PRIORITIES; cls++) {
+		gs_readyq* q = &s->ready[cls];
+		for (i = q->head; i != q->tail; i++) {
+			if ((r = func(&q->buf[i & q->mask], arg)) != 0)
+				return r;
+		}
+	}
+	for (i = 0; i < s->deadlines.n; i++) {
+		if ((r = func(&s->deadlines.heap[i], arg)) != 0)
+			return r;
+	}
+	return 0;
+}
+
+static int sched_push(GSScheduler* s, gs_entry* e)
+{
+	PyGreenstack* g = e->g;
+	int err;
+	e->queued = gs_clock_ns();
+	if (g->sched_flags & GS_DEADLINE) {
+		e->cls = GS_CLASS_DEADLINE;
+		e->deadline = g->sched_deadline;
+		err = deadlineq_push(&s->deadlines, e);
+	} else {
+		e->cls = GS_CLASS(g->sched_priority);
+		err = readyq_push(&s->ready[e->cls], e);
+	}
+	if (err == 0)
+		s->nready++;
+	return err;
+}
+
+/* The queues are run in passes: timers are only checked once as many
+ * entries as were ready at the start of a pass have been popped, so that
+ * greenstacks which keep waking each other cannot starve them. */
+static int sched_pop(GSScheduler* s, gs_entry* e)
+{
+	int cls;
+	if (s->nready == 0)
+		return 0;
+	if (!deadlineq_pop(&s->deadlines, e)) {
+		for (cls = 0; !readyq_pop(&s->ready[cls], e); cls++)
+			;
+	}
+	s->nready--;
+	if (s->pass_left > 0)
+		s->pass_left--;
+	return 1;
+}
+
+/* Puts back an entry that was just popped */
+static void sched_unpop(GSScheduler* s, gs_entry* e)
+{
+	if (e->cls == GS_CLASS_DEADLINE) {
+		/* there is room, since it was just popped */
+		deadlineq_push(&s->deadlines, e);
+	} else {
+		readyq_unpop(&s->ready[e->cls], e);
+	}
+	s->nready++;
+	s->pass_left++;
+}
+
+/* Whether anything could wake a greenstack later */
+#define SCHED_PENDING(s) ((s)->timers.count > 0 || GS_IO_PENDING(&(s)->io))
+
+/* Wakes the greenstacks whose timers have expired or whose descriptors are
+ * ready, first waiting for one of them if block is set, and starts a new
+ * pass. */
+static int sched_poll(GSScheduler* s, int block)
+{
+	/* in a forked child this wakes what waited on the parent's
+	 * descriptors, so there is no blocking this time */
+	int forked = gs_io_check_fork(s);
+	long timeout = block && forked == 0 ? gs_timers_timeout(s) : 0;
+	int cls, jump = 0;
+	int blocking;
+	if (forked < 0)
+		return -1;
+	/* virtual time passes once nothing else can happen, but
+	 * descriptors and threads are waited for in real time */
+	if (s->timers.virtual_time && timeout > 0) {
+		if (GS_IO_PENDING(&s->io)) {
+			timeout = -1;
+		} else {
+			timeout = 0;
+			jump = 1;
+		}
+	}
+	blocking = timeout > 0 || (timeout < 0 && GS_IO_PENDING(&s->io));
+	if (blocking) {
+		/* sleep where other threads can interrupt it */
+		if (gs_io_wake_init(s) < 0)
+			return -1;
+		/* what was sent before the eventfd was there did not write to it */
+		if (gs_inbox_pending(s))
+			timeout = 0;
+	}
+	if (GS_IO_PENDING(&s->io) || (timeout > 0 && s->io.wakefd >= 0)) {
+		if (gs_io_poll(s, timeout) < 0)
+			return -1;
+	} else if (timeout > 0 && gs_timers_sleep(timeout) < 0) {
+		return -1;
+	}
+	if (gs_inbox_pending(s) && gs_inbox_drain(s) < 0)
+		return -1;
+	if (jump && s->nready == 0)
+		gs_timers_jump(s);
+	if (gs_timers_expire(s) < 0)
+		return -1;
+	for (cls = 0; cls < GS_PRIORITIES; cls++) {
+		if (s->shuffle != 0)
+			readyq_shuffle(&s->ready[cls], &s->shuffle);
+		if (s->cohort_window > 0)
+			readyq_regroup(&s->ready[cls], s->cohort_window);
+	}
+	s->pass_left = s->nready;
+	/* other threads may have run greenstacks while this one waited or
+	 * ran destructors, so ts_current has to be brought back */
+	if (!STATE_OK)
+		return -1;
+	return 0;
+}
+
+/***********************************************************/
+/* Switching */
+
+int gs_sched_check_thread(GSScheduler* s)
+{
+	if (!STATE_OK)
+		return -1;
+	if (ts_current->run_info != s->run_info) {
+		PyErr_SetString(PyExc_GreenstackError,
+		                "cannot use a scheduler from a different thread");
+		return -1;
+	}
+	return 0;
+}
+
+#define ENTRY_IS_DEAD(e) \
+	(PyGreenstack_STARTED((e)->g) && !PyGreenstack_ACTIVE((e)->g))
+
+/* The reference of a popped entry cannot be dropped after switching to its
+ * greenstack, since the switching greenstack may be dying and never get
+ * control back.  It is parked here instead and dropped the next time any
+ * greenstack goes through the scheduler. */
+static void sched_drop_resumed(GSScheduler* s)
+{
+	PyGreenstack* g = s->resumed;
+	s->resumed = NULL;
+	Py_XDECREF(g);
+}
+
+/* Runs the greenstack of a popped entry, consuming the entry.  Returns what
+ * the current greenstack is switched back with, as a single value. */
+static PyObject* sched_resume(GSScheduler* s, gs_entry* e)
+{
+	PyGreenstack* g = e->g;
+	PyObject* args;
+	PyObject* result;
+
+	if (e->cls >= 0) {
+		gs_waitstats* w = &s->waits[e->cls];
+		PY_UINT64_T wait = gs_clock_ns() - e->queued;
+		w->count++;
+		w->total += wait;
+		if (wait > w->max)
+			w->max = wait;
+	}
+	g->sched_flags &= ~GS_READY;
+	if (s->time_slice != 0)
+		gs_preempt_resumed(s);
+	if (g == ts_current) {
+		/* woken before it had to switch away */
+		if (e->kind == GS_ENTRY_THROW) {
+			PyErr_SetObject((PyObject*) Py_TYPE(e->value), e->value);
+			result = NULL;
+		} else {
+			result = e->value;
+			e->value = NULL;
+		}
+		Py_CLEAR(e->value);
+		Py_DECREF(g);
+		return result;
+	}
+
+	sched_drop_resumed(s);
+	s->resumed = g;
+	switch (e->kind) {
+	case GS_ENTRY_START:
+		/* g_switch consumes args and kwargs */
+		result = single_result(g_switch(g, e->value, e->kwargs));
+		break;
+	case GS_ENTRY_THROW:
+		Py_INCREF(Py_TYPE(e->value));
+		result = throw_greenstack(g, (PyObject*) Py_TYPE(e->value),
+		                          e->value, NULL);
+		break;
+	default:
+		args = PyTuple_Pack(1, e->value);
+		Py_DECREF(e->value);
+		result = args ? single_result(g_switch(g, args, NULL)) : NULL;
+		break;
+	}
+	sched_drop_resumed(s);
+	return result;
+}
+
+/* Hands the thread to the next ready greenstack, or to the hub if there is
+ * none.  Must not be called from the hub. */
+static PyObject* sched_switch_next(GSScheduler* s)
+{
+	gs_entry e;
+	PyObject* result;
+	if (s->pass_left == 0 && s->nready > 0) {
+		if (sched_poll(s, 0) < 0)
+			return NULL;
+	}
+	while (sched_pop(s, &e)) {
+		if (e.g == s->hub) {
+			/* the hub picks up its own wakeups from its loop */
+			sched_unpop(s, &e);
+			break;
+		}
+		if (ENTRY_IS_DEAD(&e)) {
+			entry_clear(&e);
+			continue;
+		}
+		return sched_resume(s, &e);
+	}
+	Py_INCREF(ts_empty_tuple);
+	result = single_result(g_switch(s->hub, ts_empty_tuple, NULL));
+	sched_drop_resumed(s);
+	return result;
+}
+
+/* Makes the current greenstack the hub and runs ready greenstacks.  With
+ * until set, returns the value the current greenstack is woken with;
+ * otherwise returns None once nothing is left to run. */
+static PyObject* sched_loop(GSScheduler* s, PyGreenstack* until)
+{
+	PyGreenstack* prev_hub = s->hub;
+	PyObject* prev_sched;
+	PyObject* result = NULL;
+	PyObject* r;
+	gs_entry e;
+
+	/* make this the scheduler of the thread while it runs */
+	prev_sched = PyDict_GetItem(s->run_info, ts_schedkey);
+	Py_XINCREF(prev_sched);
+	if (PyDict_SetItem(s->run_info, ts_schedkey, (PyObject*) s) < 0) {
+		Py_XDECREF(prev_sched);
+		return NULL;
+	}
+	Py_INCREF(ts_current);
+	s->hub = ts_current;
+
+	for (;;) {
+		if (s->pass_left == 0) {
+			if (sched_poll(s, s->nready == 0) < 0)
+				break;
+		}
+		if (!sched_pop(s, &e)) {
+			if (SCHED_PENDING(s))
+				continue;
+			if (until != NULL) {
+				PyErr_SetString(PyExc_GreenstackError,
+				                "no greenstack left to wake up the current one");
+				break;
+			}
+			Py_INCREF(Py_None);
+			result = Py_None;
+			break;
+		}
+		if (e.g == ts_current) {
+			if (until == NULL) {
+				/* nothing is waiting for this */
+				entry_clear(&e);
+				continue;
+			}
+			result = sched_resume(s, &e);
+			break;
+		}
+		if (ENTRY_IS_DEAD(&e)) {
+			entry_clear(&e);
+			continue;
+		}
+		r = sched_resume(s, &e);
+		if (r == NULL) {
+			if (until == NULL)
+				break;
+			/* whoever is blocking here has nothing to do with it */
+			PyErr_WriteUnraisable((PyObject*) s);
+			continue;
+		}
+		Py_DECREF(r);
+	}
+
+	sched_drop_resumed(s);
+	r = (PyObject*) s->hub;
+	s->hub = prev_hub;
+	Py_DECREF(r);
+	if (prev_sched != NULL) {
+		if (PyDict_SetItem(s->run_info, ts_schedkey, prev_sched) < 0)
+			Py_CLEAR(result);
+		Py_DECREF(prev_sched);
+	} else if (PyDict_DelItem(s->run_info, ts_schedkey) < 0) {
+		Py_CLEAR(result);
+	}
+	return result;
+}
+
+/***********************************************************/
+/* Interface for other modules */
+
+GSScheduler* gs_sched_current(void)
+{
+	PyObject* s;
+	if (!STATE_OK)
+		return NULL;
+	s = PyDict_GetItem(ts_current->run_info, ts_schedkey);
+	if (s != NULL) {
+		Py_INCREF(s);
+		return (GSScheduler*) s;
+	}
+	s = PyObject_CallObject((PyObject*) &GSScheduler_Type, NULL);
+	if (s == NULL)
+		return NULL;
+	if (PyDict_SetItem(ts_current->run_info, ts_schedkey, s) < 0) {
+		Py_DECREF(s);
+		return NULL;
+	}
+	return (GSScheduler*) s;
+}
+
+int gs_sched_idle(PyObject* dict)
+{
+	GSScheduler* s = gs_sched_of_thread(dict);
+	return s != NULL && s->hub != NULL && s->nready == 0 &&
+	       s->hub == gs_thread_current(dict);
+}
+
+GSScheduler* gs_sched_of_thread(PyObject* dict)
+{
+	return (GSScheduler*) PyDict_GetItem(dict, ts_schedkey);
+}
+
+int gs_sched_wake(GSScheduler* s, PyGreenstack* g, PyObject* value, int kind)
+{
+	gs_entry e;
+	if (g->sched_flags & GS_READY)
+		return 0;
+	e.g = g;
+	e.value = value;
+	e.kwargs = NULL;
+	e.kind = kind;
+	if (sched_push(s, &e) < 0)
+		return -1;
+	Py_INCREF(g);
+	Py_XINCREF(value);
+	g->sched_flags |= GS_READY;
+	return 1;
+}
+
+static int entry_throw(gs_entry* e, void* exc)
+{
+	if (e->g->sched_flags & GS_THROWING) {
+		Py_CLEAR(e->value);
+		Py_CLEAR(e->kwargs);
+		Py_INCREF((PyObject*) exc);
+		e->value = (PyObject*) exc;
+		e->kind = GS_ENTRY_THROW;
+	}
+	return 0;
+}
+
+int gs_sched_throw_all(GSScheduler* s, PyObject** gs, Py_ssize_t n, PyObject* exc)
+{
+	Py_ssize_t i;
+	PyGreenstack* g;
+	int err = 0;
+
+	for (i = 0; i < n; i++) {
+		g = (PyGreenstack*) gs[i];
+		if (g != ts_current && !(PyGreenstack_STARTED(g) && !PyGreenstack_ACTIVE(g)))
+			g->sched_flags |= GS_THROWING;
+	}
+	/* one pass turns the entries of the ready ones into throws */
+	sched_foreach(s, entry_throw, exc);
+	/* and the parked ones are queued */
+	for (i = 0; i < n; i++) {
+		g = (PyGreenstack*) gs[i];
+		if (!(g->sched_flags & GS_THROWING))
+			continue;
+		g->sched_flags &= ~GS_THROWING;
+		if (gs_sched_wake(s, g, exc, GS_ENTRY_THROW) < 0)
+			err = -1;
+	}
+	return err;
+}
+
+int gs_sched_throw(GSScheduler* s, PyGreenstack* g, PyObject* exc)
+{
+	if (!(g->sched_flags & GS_READY))
+		return gs_sched_wake(s, g, exc, GS_ENTRY_THROW);
+	g->sched_flags |= GS_THROWING;
+	sched_foreach(s, entry_throw, exc);
+	g->sched_flags &= ~GS_THROWING;
+	return 0;
+}
+
+PyGreenstack* gs_sched_spawn(GSScheduler* s, PyObject* args, PyObject* kwargs)
+{
+	PyGreenstack* g;
+	gs_entry e;
+
+	g = PyGreenstack_New(PyTuple_GET_ITEM(args, 0), s->hub);
+	if (g == NULL)
+		return NULL;
+	Py_INCREF(s);
+	g->sched = (PyObject*) s;
+	g->sched_priority = ts_current->sched_priority;
+
+	e.g = g;
+	e.value = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+	e.kwargs = kwargs;
+	e.kind = GS_ENTRY_START;
+	if (e.value == NULL || sched_push(s, &e) < 0) {
+		Py_XDECREF(e.value);
+		Py_DECREF(g);
+		return NULL;
+	}
+	Py_INCREF(g);
+	Py_XINCREF(kwargs);
+	g->sched_flags |= GS_READY;
+	return g;
+}
+
+PyObject* gs_sched_switch(GSScheduler* s, PyGreenstack* g, PyObject* value)
+{
+	gs_entry e;
+	Py_INCREF(g);
+	Py_INCREF(value);
+	e.g = g;
+	e.value = value;
+	e.kwargs = NULL;
+	e.kind = GS_ENTRY_RESUME;
+	e.cls = -1;
+	return sched_resume(s, &e);
+}
+
+PyObject* gs_sched_park(GSScheduler* s)
+{
+	if (s->hub == NULL || s->hub == ts_current)
+		return sched_loop(s, ts_current);
+	return sched_switch_next(s);
+}
+
+PyObject* gs_sched_exit(PyGreenstack* self, PyObject* result)
+{
+	GSScheduler* s = (GSScheduler*) self->sched;
+	if (self->nursery != NULL)
+		result = gs_nursery_exit(self, result);
+	if (s->hub == NULL || s->run_info != self->run_info) {
+		/* not running under the loop */
+		return result;
+	}
+	if (result == NULL) {
+		/* let the loop deal with the exception */
+		return g_switch(s->hub, NULL, NULL);
+	}
+	Py_DECREF(result);
+	return sched_switch_next(s);
+}
+
+/***********************************************************/
+/* Scheduler type */
+
+static PyObject* sched_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSScheduler* s;
+	static char* kwlist[] = {"virtual", "seed", 0};
+	int virtual_time = 0;
+	PyObject* seed = Py_None;
+	PyObject* seed_long;
+	PY_UINT64_T state = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iO:Scheduler", kwlist,
+	                                 &virtual_time, &seed))
+		return NULL;
+	if (seed != Py_None) {
+		/* spread the bits of small seeds with a step of splitmix64 */
+		seed_long = PyNumber_Long(seed);
+		if (seed_long == NULL)
+			return NULL;
+		state = PyLong_AsUnsignedLongLongMask(seed_long);
+		Py_DECREF(seed_long);
+		if (state == (PY_UINT64_T) -1 && PyErr_Occurred())
+			return NULL;
+		state += 0x9e3779b97f4a7c15ULL;
+		state = (state ^ (state >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		state = (state ^ (state >> 27)) * 0x94d049bb133111ebULL;
+		state ^= state >> 31;
+		if (state == 0)
+			state = 1;
+	}
+	if (!STATE_OK)
+		return NULL;
+	s = (GSScheduler*) type->tp_alloc(type, 0);
+	if (s == NULL)
+		return NULL;
+	s->run_info = ts_current->run_info;
+	Py_INCREF(s->run_info);
+	gs_wheel_init(&s->timers);
+	if (virtual_time)
+		gs_wheel_set_virtual(&s->timers);
+	s->shuffle = state;
+	gs_io_init(&s->io);
+	return (PyObject*) s;
+}
+
+struct entry_visit {
+	visitproc visit;
+	void* arg;
+};
+
+static int entry_traverse(gs_entry* e, void* v)
+{
+	visitproc visit = ((struct entry_visit*) v)->visit;
+	void* arg = ((struct entry_visit*) v)->arg;
+	Py_VISIT((PyObject*) e->g);
+	Py_VISIT(e->value);
+	Py_VISIT(e->kwargs);
+	return 0;
+}
+
+/* Visits what the armed timers in list hold.  Timers with a fire function
+ * are part of a Timeout, which visits them itself. */
+static int timers_traverse(gs_link* head, visitproc visit, void* arg)
+{
+	gs_link* l;
+	for (l = head->next; l != head; l = l->next) {
+		gs_timer* t = (gs_timer*) l;
+		if (t->fire != NULL)
+			continue;
+		Py_VISIT((PyObject*) t->g);
+		Py_VISIT(t->value);
+	}
+	return 0;
+}
+
+static int sched_traverse(GSScheduler* s, visitproc visit, void* arg)
+{
+	int level, slot, r;
+	struct entry_visit v;
+	Py_VISIT(s->run_info);
+	Py_VISIT((PyObject*) s->hub);
+	Py_VISIT((PyObject*) s->resumed);
+	v.visit = visit;
+	v.arg = arg;
+	if ((r = sched_foreach(s, entry_traverse, &v)) != 0)
+		return r;
+	for (level = 0; level < GS_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < GS_WHEEL_SLOTS; slot++) {
+			r = timers_traverse(&s->timers.slots[level][slot], visit, arg);
+			if (r != 0)
+				return r;
+		}
+	}
+	if ((r = timers_traverse(&s->timers.due, visit, arg)) != 0)
+		return r;
+	return gs_io_traverse(&s->io, visit, arg);
+}
+
+static int sched_clear(GSScheduler* s)
+{
+	int cls;
+	if (s->time_slice != 0)
+		gs_preempt_set_slice(s, 0);
+	for (cls = 0; cls < GS_PRIORITIES; cls++)
+		readyq_clear(&s->ready[cls]);
+	deadlineq_clear(&s->deadlines);
+	s->nready = 0;
+	gs_wheel_clear(&s->timers);
+	gs_io_clear(&s->io);
+	Py_CLEAR(s->hub);
+	Py_CLEAR(s->resumed);
+	Py_CLEAR(s->run_info);
+	return 0;
+}
+
+static void sched_dealloc(GSScheduler* s)
+{
+	PyObject_GC_UnTrack((PyObject*) s);
+	if (s->weakreflist != NULL)
+		PyObject_ClearWeakRefs((PyObject*) s);
+	sched_clear(s);
+	Py_TYPE(s)->tp_free((PyObject*) s);
+}
+
+static Py_ssize_t sched_len(GSScheduler* s)
+{
+	return (Py_ssize_t) s->nready;
+}
+
+PyDoc_STRVAR(sched_spawn_doc,
+"spawn(run, *args, **kwargs) -> greenstack\n"
+"\n"
+"Create a greenstack that calls run(*args, **kwargs) and put it at the\n"
+"end of the ready queue.  When run returns, the thread goes straight to\n"
+"the next ready greenstack.  Exceptions escaping run are raised from\n"
+"run().\n");
+
+static PyObject* sched_spawn(GSScheduler* s, PyObject* args, PyObject* kwargs)
+{
+	if (PyTuple_GET_SIZE(args) < 1) {
+		PyErr_SetString(PyExc_TypeError, "spawn() takes at least 1 argument");
+		return NULL;
+	}
+	if (gs_sched_check_thread(s) < 0)
+		return NULL;
+	return (PyObject*) gs_sched_spawn(s, args, kwargs);
+}
+
+PyDoc_STRVAR(sched_yield_doc,
+"yield_()\n"
+"\n"
+"Put the current greenstack at the end of the ready queue and run the\n"
+"ones ahead of it.\n");
+
+static PyObject* sched_yield(GSScheduler* s)
+{
+	if (gs_sched_check_thread(s) < 0)
+		return NULL;
+	if (gs_sched_wake(s, ts_current, Py_None, GS_ENTRY_RESUME) < 0)
+		return NULL;
+	return gs_sched_park(s);
+}
+
+PyDoc_STRVAR(sched_wake_doc,
+"wake(g, value=None) -> bool\n"
+"\n"
+"Put g at the end of the ready queue so that it resumes with value.\n"
+"Returns False without doing anything if g is already ready or dead.\n");
+
+static PyObject* sched_wake(GSScheduler* s, PyObject* args)
+{
+	PyGreenstack* g;
+	PyObject* value = Py_None;
+	int err;
+
+	if (!PyArg_ParseTuple(args, "O!|O:wake", &PyGreenstack_Type, &g, &value))
+		return NULL;
+	if (gs_sched_check_thread(s) < 0)
+		return NULL;
+	if (PyGreenstack_STARTED(g) && !PyGreenstack_ACTIVE(g))
+		Py_RETURN_FALSE;
+	if (PyGreenstack_STARTED(g) && g->run_info != s->run_info) {
+		PyErr_SetString(PyExc_GreenstackError,
+		                "cannot wake a greenstack of a different thread");
+		return NULL;
+	}
+	err = gs_sched_wake(s, g, value, GS_ENTRY_RESUME);
+	if (err < 0)
+		return NULL;
+	return PyBool_FromLong(err);
+}
+
+PyDoc_STRVAR(sched_park_doc,
+"park(threadsafe=False) -> value\n"
+"\n"
+"Suspend the current greenstack until wake() is called on it, and return\n"
+"the value passed to wake().  With threadsafe set, the greenstack expects\n"
+"wake_threadsafe() from another thread, and run() waits for it instead\n"
+"of returning once nothing else is left to run.\n");
+
+static PyObject* sched_park(GSScheduler* s, PyObject* args, PyObject* kwargs)
+{
+	int threadsafe = 0;
+	PyObject* r;
+	static char* kwlist[] = {"threadsafe", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:park", kwlist, &threadsafe))
+		return NULL;
+	if (gs_sched_check_thread(s) < 0)
+		return NULL;
+	if (!threadsafe)
+		return gs_sched_park(s);
+	/* keeps the loop blocked on the eventfd while nothing else is left */
+	s->io.remote++;
+	r = gs_sched_park(s);
+	s->io.remote--;
+	return r;
+}
+
+PyDoc_STRVAR(sched_run_doc,
+"run()\n"
+"\n"
+"Run ready greenstacks until there are none left.  The calling\n"
+"greenstack acts as the hub while this runs.\n");
+
+static PyObject* sched_run(GSScheduler* s)
+{
+	if (gs_sched_check_thread(s) < 0)
+		return NULL;
+	if (s->hub != NULL) {
+		PyErr_SetString(PyExc_GreenstackError, "scheduler is already running");
+		return NULL;
+	}
+	return sched_loop(s, NULL);
+}
+
+PyDoc_STRVAR(sched_set_priority_doc,
+"set_priority(g, priority) -> int\n"
+"\n"
+"Set the priority class of g to PRIORITY_HIGH, PRIORITY_NORMAL or\n"
+"PRIORITY_LOW, and return the previous one.  Ready greenstacks of a\n"
+"higher class always run first.  The change takes effect the next time\n"
+"g is woken.  Spawned greenstacks start with the priority of the one\n"
+"that spawned them.\n");
+
+static PyObject* sched_set_priority(GSScheduler* s, PyObject* args)
+{
+	PyGreenstack* g;
+	int priority, prev;
+
+	if (!PyArg_ParseTuple(args, "O!i:set_priority",
+	                      &PyGreenstack_Type, &g, &priority))
+		return NULL;
+	if (priority < GS_PRIORITY_HIGH || priority > GS_PRIORITY_LOW) {
+		PyErr_SetString(PyExc_ValueError, "invalid priority");
+		return NULL;
+	}
+	prev = g->sched_priority;
+	g->sched_priority = priority;
+	return PyLong_FromLong(prev);
+}
+
+/* Deadlines further away are moved in to this many seconds, about 30
+ * years, which keeps them in the range of the clock */
+#define SCHED_MAX_DEADLINE 1e9
+
+PyDoc_STRVAR(sched_set_deadline_doc,
+"set_deadline(g, seconds)\n"
+"\n"
+"Give g a deadline the given number of seconds from now.  Ready\n"
+"greenstacks with a deadline run before all the others, earliest\n"
+"deadline first.  None removes the deadline.  The change takes effect\n"
+"the next time g is woken.\n");
+
+static PyObject* sched_set_deadline(GSScheduler* s, PyObject* args)
+{
+	PyGreenstack* g;
+	PyObject* seconds_obj;
+	double seconds;
+
+	if (!PyArg_ParseTuple(args, "O!O:set_deadline",
+	                      &PyGreenstack_Type, &g, &seconds_obj))
+		return NULL;
+	if (seconds_obj == Py_None) {
+		g->sched_flags &= ~GS_DEADLINE;
+		Py_RETURN_NONE;
+	}
+	seconds = PyFloat_AsDouble(seconds_obj);
+	if (seconds == -1 && PyErr_Occurred())
+		return NULL;
+	if (!(seconds > 0))
+		seconds = 0;
+	else if (seconds > SCHED_MAX_DEADLINE)
+		seconds = SCHED_MAX_DEADLINE;
+	g->sched_deadline = gs_clock_ns() + (PY_UINT64_T) (seconds * 1e9);
+	g->sched_flags |= GS_DEADLINE;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(sched_wait_stats_doc,
+"wait_stats(reset=False) -> dict\n"
+"\n"
+"Return how long greenstacks have waited in the ready queue, as a dict\n"
+"mapping each of 'high', 'normal', 'low' and 'deadline' to a tuple of\n"
+"the number of waits, their total in seconds and the longest in\n"
+"seconds.  If reset is true the counters are cleared afterwards.\n");
+
+static PyObject* sched_wait_stats(GSScheduler* s, PyObject* args, PyObject* kwargs)
+{
+	static char* kwlist[] = {"reset", NULL};
+	static const char* names[GS_CLASSES] = {"high", "normal", "low", "deadline"};
+	int reset = 0;
+	int cls;
+	PyObject* result;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:wait_stats", kwlist, &reset))
+		return NULL;
+	result = PyDict_New();
+	if (result == NULL)
+		return NULL;
+	for (cls = 0; cls < GS_CLASSES; cls++) {
+		gs_waitstats* w = &s->waits[cls];
+		PyObject* item = Py_BuildValue("(Kdd)", (unsigned PY_LONG_LONG) w->count,
+		                               (double) w->total / 1e9,
+		                               (double) w->max / 1e9);
+		if (item == NULL || PyDict_SetItemString(result, names[cls], item) < 0) {
+			Py_XDECREF(item);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+	if (reset)
+		memset(s->waits, 0, sizeof(s->waits));
+	return result;
+}
+
+PyDoc_STRVAR(sched_set_time_slice_doc,
+"set_time_slice(seconds) -> float or None\n"
+"\n"
+"Preempt greenstacks that run for longer than seconds without switching,\n"
+"putting them back in the ready queue at the start of their next line of\n"
+"Python code.  None turns preemption off.  Returns the previous time\n"
+"slice.  Only schedulers of the main thread can preempt.\n");
+
+static PyObject* sched_set_time_slice(GSScheduler* s, PyObject* seconds_obj)
+{
+	PY_UINT64_T prev = s->time_slice;
+	double seconds = 0;
+
+	if (seconds_obj != Py_None) {
+		seconds = PyFloat_AsDouble(seconds_obj);
+		if (seconds == -1 && PyErr_Occurred())
+			return NULL;
+		if (!(seconds > 0)) {
+			PyErr_SetString(PyExc_ValueError,
+			                "time slice must be a positive number");
+			return NULL;
+		}
+	}
+	if (gs_preempt_set_slice(s, (PY_UINT64_T) (seconds * 1e9)) < 0)
+		return NULL;
+	if (prev == 0)
+		Py_RETURN_NONE;
+	return PyFloat_FromDouble((double) prev / 1e9);
+}
+
+PyDoc_STRVAR(sched_set_cohort_window_doc,
+"set_cohort_window(n) -> int\n"
+"\n"
+"Group ready greenstacks into cohorts that run together, taking turns of\n"
+"up to n greenstacks of a cohort in a row.  0 turns grouping off and\n"
+"runs greenstacks in the order they were woken.  Returns the previous\n"
+"value.\n");
+
+static PyObject* sched_set_cohort_window(GSScheduler* s, PyObject* arg)
+{
+	Py_ssize_t n = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+	size_t prev = s->cohort_window;
+	if (n == -1 && PyErr_Occurred())
+		return NULL;
+	if (n < 0) {
+		PyErr_SetString(PyExc_ValueError, "window must not be negative");
+		return NULL;
+	}
+	s->cohort_window = (size_t) n;
+	return PyLong_FromSize_t(prev);
+}
+
+PyDoc_STRVAR(sched_set_cohort_doc,
+"set_cohort(g, key)\n"
+"\n"
+"Put g in the cohort of key, compared by identity, instead of grouping it\n"
+"by the code it is about to run.  None goes back to that.\n");
+
+static PyObject* sched_set_cohort(GSScheduler* s, PyObject* args)
+{
+	PyGreenstack* g;
+	PyObject* key;
+	PyObject* old;
+
+	if (!PyArg_ParseTuple(args, "O!O:set_cohort", &PyGreenstack_Type, &g, &key))
+		return NULL;
+	old = g->sched_cohort;
+	if (key == Py_None) {
+		g->sched_cohort = NULL;
+	} else {
+		Py_INCREF(key);
+		g->sched_cohort = key;
+	}
+	Py_XDECREF(old);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(sched_time_doc,
+"time() -> float\n"
+"\n"
+"Return the time in seconds on the clock of the scheduler's timers: the\n"
+"virtual clock of a virtual scheduler, which starts at 0, or else the\n"
+"monotonic clock.\n");
+
+static PyObject* sched_time(GSScheduler* s)
+{
+	return PyFloat_FromDouble((double) gs_timers_now(s) / 1e9);
+}
+
+static PyMethodDef sched_methods[] = {
+	{"spawn", (PyCFunction)sched_spawn,
+	 METH_VARARGS | METH_KEYWORDS, sched_spawn_doc},
+	{"yield_", (PyCFunction)sched_yield, METH_NOARGS, sched_yield_doc},
+	{"wake", (PyCFunction)sched_wake, METH_VARARGS, sched_wake_doc},
+	{"park", (PyCFunction)sched_park,
+	 METH_VARARGS | METH_KEYWORDS, sched_park_doc},
+	{"run", (PyCFunction)sched_run, METH_NOARGS, sched_run_doc},
+	{"set_priority", (PyCFunction)sched_set_priority,
+	 METH_VARARGS, sched_set_priority_doc},
+	{"set_deadline", (PyCFunction)sched_set_deadline,
+	 METH_VARARGS, sched_set_deadline_doc},
+	{"wait_stats", (PyCFunction)sched_wait_stats,
+	 METH_VARARGS | METH_KEYWORDS, sched_wait_stats_doc},
+	{"set_time_slice", (PyCFunction)sched_set_time_slice,
+	 METH_O, sched_set_time_slice_doc},
+	{"set_cohort_window", (PyCFunction)sched_set_cohort_window,
+	 METH_O, sched_set_cohort_window_doc},
+	{"set_cohort", (PyCFunction)sched_set_cohort,
+	 METH_VARARGS, sched_set_cohort_doc},
+	{"time", (PyCFunction)sched_time, METH_NOARGS, sched_time_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+static PySequenceMethods sched_as_sequence = {
+	(lenfunc)sched_len,  /* sq_length */
+};
+
+PyTypeObject GSScheduler_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Scheduler",                 /* tp_name */
+	sizeof(GSScheduler),                    /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)sched_dealloc,              /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	&sched_as_sequence,                     /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Scheduler(virtual=False, seed=None) -> Scheduler\n\n"
+	"A ready queue of greenstacks belonging to the current thread.  Its\n"
+	"length is the number of ready greenstacks.  A virtual scheduler runs\n"
+	"its timers on a clock that jumps to the next timer whenever nothing\n"
+	"else is ready.  With a seed, the order of the ready greenstacks is\n"
+	"shuffled reproducibly.", /* tp_doc */
+	(traverseproc)sched_traverse,           /* tp_traverse */
+	(inquiry)sched_clear,                   /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSScheduler, weakreflist),     /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	sched_methods,                          /* tp_methods */
+	0,                                      /* tp_members */
+	0,                                      /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	sched_new,                              /* tp_new */
+};
+
+/***********************************************************/
+/* Module functions */
+
+PyDoc_STRVAR(mod_getscheduler_doc,
+"getscheduler() -> Scheduler\n"
+"\n"
+"Return the scheduler of the current thread: the one whose run() is in\n"
+"progress, or else a default one created on first use.\n");
+
+static PyObject* mod_getscheduler(PyObject* self)
+{
+	return (PyObject*) gs_sched_current();
+}
+
+static PyMethodDef sched_functions[] = {
+	{"getscheduler", (PyCFunction)mod_getscheduler, METH_NOARGS, mod_getscheduler_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_sched_init(PyObject* m)
+{
+	ts_schedkey = GS_InternFromString("__greenstack_ts_schedkey");
+	if (ts_schedkey == NULL)
+		return -1;
+	if (PyType_Ready(&GSScheduler_Type) < 0)
+		return -1;
+	Py_INCREF(&GSScheduler_Type);
+	if (PyModule_AddObject(m, "Scheduler", (PyObject*) &GSScheduler_Type) < 0)
+		return -1;
+	if (PyModule_AddIntConstant(m, "PRIORITY_HIGH", GS_PRIORITY_HIGH) < 0 ||
+	    PyModule_AddIntConstant(m, "PRIORITY_NORMAL", GS_PRIORITY_NORMAL) < 0 ||
+	    PyModule_AddIntConstant(m, "PRIORITY_LOW", GS_PRIORITY_LOW) < 0)
+		return -1;
+	return _greenstack_add_functions(m, sched_functions);
+}
@@ -0,0 +1,641 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* ShmChannel: a channel between two processes over shared memory.
+
+   The channel is a ring of fixed-size slots in a memfd mapping, with one
+   sending and one receiving process (usually the two sides of a fork).
+   The sender copies a message into the slot at the tail, or writes it
+   there itself through reserve() and commit(), and publishes it by moving
+   the tail; the receiver gets a memoryview of the slot at the head, which
+   it keeps until it receives the next message or calls release(), and
+   hands the slot back by moving the head.  Head and tail are each written
+   by one side only, so the ring needs no locks.
+
+   A side that finds the ring empty (or full) sets a flag in the shared
+   header and parks its greenstack on an eventfd, which the other side
+   signals only when it sees the flag.  While both sides keep up with each
+   other nobody waits, so messages go through without any system calls;
+   under load a single wakeup covers every message published until the
+   receiver gets to run again.
+*/
+
+#include "greenstack_private.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#define SHM_MAGIC       0x67736368U     /* "gsch" */
+#define SHM_LINE        64
+
+/* Side of a channel */
+#define SHM_SEND        0
+#define SHM_RECV        1
+
+/* The start of the mapping.  Each side's fields get a cache line of
+ * their own, so that the two processes do not keep stealing it from each
+ * other. */
+typedef struct {
+	PY_UINT32_T magic;
+	PY_UINT32_T nslots;
+	PY_UINT32_T slot_size;
+	char pad0[SHM_LINE - 3 * sizeof(PY_UINT32_T)];
+	/* written by the receiver */
+	PY_UINT64_T head;
+	PY_UINT32_T recv_waiting;
+	char pad1[SHM_LINE - sizeof(PY_UINT64_T) - sizeof(PY_UINT32_T)];
+	/* written by the sender */
+	PY_UINT64_T tail;
+	PY_UINT32_T send_waiting;
+	char pad2[SHM_LINE - sizeof(PY_UINT64_T) - sizeof(PY_UINT32_T)];
+} shm_header;
+
+/* Each slot starts with the length of its message */
+#define SLOT_DATA       8
+
+typedef struct {
+	PyObject_HEAD
+	shm_header* hdr;
+	size_t size;            /* of the mapping */
+	size_t stride;          /* bytes from one slot to the next */
+	int memfd;
+	int efd[2];             /* eventfds waking each side, by SHM_* */
+	int held;               /* the receiver still has the slot at head */
+	int reserved;           /* the sender has the slot at tail */
+	int closed;
+	PyObject* weakreflist;
+} GSShmChannel;
+
+/* Exports a message in a slot, keeping the mapping alive */
+typedef struct {
+	PyObject_HEAD
+	GSShmChannel* ch;
+	char* data;
+	Py_ssize_t len;
+	int readonly;
+} GSShmSlot;
+
+static PyTypeObject GSShmChannel_Type;
+static PyTypeObject GSShmSlot_Type;
+
+static int memfd_create_compat(const char* name, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+	return (int) syscall(__NR_memfd_create, name, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static char* slot_at(GSShmChannel* ch, PY_UINT64_T index)
+{
+	return (char*) ch->hdr + sizeof(shm_header)
+	       + (size_t) (index % ch->hdr->nslots) * ch->stride;
+}
+
+/***********************************************************/
+/* Slots */
+
+static PyObject* slot_view(GSShmChannel* ch, char* data, Py_ssize_t len, int readonly)
+{
+	GSShmSlot* slot;
+	PyObject* view;
+
+	slot = PyObject_New(GSShmSlot, &GSShmSlot_Type);
+	if (slot == NULL)
+		return NULL;
+	Py_INCREF(ch);
+	slot->ch = ch;
+	slot->data = data;
+	slot->len = len;
+	slot->readonly = readonly;
+	view = PyMemoryView_FromObject((PyObject*) slot);
+	Py_DECREF(slot);
+	return view;
+}
+
+static void slot_dealloc(GSShmSlot* slot)
+{
+	Py_DECREF(slot->ch);
+	PyObject_Del(slot);
+}
+
+static int slot_getbuffer(GSShmSlot* slot, Py_buffer* view, int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject*) slot, slot->data, slot->len,
+	                         slot->readonly, flags);
+}
+
+static PyBufferProcs slot_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+	0,                                      /* bf_getreadbuffer */
+	0,                                      /* bf_getwritebuffer */
+	0,                                      /* bf_getsegcount */
+	0,                                      /* bf_getcharbuffer */
+#endif
+	(getbufferproc)slot_getbuffer,          /* bf_getbuffer */
+	0,                                      /* bf_releasebuffer */
+};
+
+static PyTypeObject GSShmSlot_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack._ShmSlot",                  /* tp_name */
+	sizeof(GSShmSlot),                      /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)slot_dealloc,               /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	&slot_as_buffer,                        /* tp_as_buffer*/
+#if PY_MAJOR_VERSION < 3
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+#else
+	Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+#endif
+};
+
+/***********************************************************/
+/* Waiting and waking */
+
+static int shm_check(GSShmChannel* ch)
+{
+	if (ch->closed) {
+		PyErr_SetString(PyExc_ValueError, "channel is closed");
+		return -1;
+	}
+	return 0;
+}
+
+/* Wakes the other side if it said it is waiting */
+static int shm_signal(GSShmChannel* ch, int side)
+{
+	PY_UINT32_T* waiting;
+	PY_UINT64_T one = 1;
+
+	waiting = side == SHM_RECV ? &ch->hdr->recv_waiting : &ch->hdr->send_waiting;
+	/* pairs with the fence in shm_wait(): either it sees what we
+	 * published, or we see its flag */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(waiting, __ATOMIC_RELAXED))
+		return 0;
+	if (!__atomic_exchange_n(waiting, 0, __ATOMIC_ACQ_REL))
+		return 0;
+	if (write(ch->efd[side], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	return 0;
+}
+
+/* Whether side can go on: the ring has a message for the receiver, or a
+ * free slot for the sender */
+static int shm_ready(GSShmChannel* ch, int side)
+{
+	PY_UINT64_T head, tail;
+	if (side == SHM_RECV) {
+		head = ch->hdr->head;
+		tail = __atomic_load_n(&ch->hdr->tail, __ATOMIC_ACQUIRE);
+		return tail != head;
+	}
+	head = __atomic_load_n(&ch->hdr->head, __ATOMIC_ACQUIRE);
+	tail = ch->hdr->tail;
+	return tail - head < ch->hdr->nslots;
+}
+
+/* Parks the current greenstack until side can go on */
+static int shm_wait(GSShmChannel* ch, int side)
+{
+	GSScheduler* s;
+	PY_UINT32_T* waiting;
+	PY_UINT64_T count;
+	int err;
+
+	if (shm_ready(ch, side))
+		return 0;
+	s = gs_sched_current();
+	if (s == NULL)
+		return -1;
+	for (;;) {
+		waiting = side == SHM_RECV ? &ch->hdr->recv_waiting : &ch->hdr->send_waiting;
+		__atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (shm_ready(ch, side))
+			break;
+		err = gs_io_wait(s, ch->efd[side], GS_IO_READ, -1);
+		if (err < 0 || shm_check(ch) < 0) {
+			Py_DECREF(s);
+			return -1;
+		}
+		/* consume the signal; it may also be a stale one */
+		while (read(ch->efd[side], &count, sizeof(count)) < 0 && errno == EINTR)
+			;
+		if (shm_ready(ch, side))
+			break;
+	}
+	Py_DECREF(s);
+	return 0;
+}
+
+/* Gives the slot at head back to the sender */
+static int shm_release(GSShmChannel* ch)
+{
+	if (!ch->held)
+		return 0;
+	ch->held = 0;
+	__atomic_store_n(&ch->hdr->head, ch->hdr->head + 1, __ATOMIC_RELEASE);
+	return shm_signal(ch, SHM_SEND);
+}
+
+/* Publishes len bytes written to the slot at tail */
+static int shm_commit(GSShmChannel* ch, Py_ssize_t len)
+{
+	*(PY_UINT32_T*) slot_at(ch, ch->hdr->tail) = (PY_UINT32_T) len;
+	ch->reserved = 0;
+	__atomic_store_n(&ch->hdr->tail, ch->hdr->tail + 1, __ATOMIC_RELEASE);
+	return shm_signal(ch, SHM_RECV);
+}
+
+/***********************************************************/
+/* ShmChannel methods */
+
+static PyObject* shm_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSShmChannel* ch;
+	PyObject* fds = Py_None;
+	Py_ssize_t nslots = 64, slot_size = 4096;
+	size_t stride, size;
+	int i, memfd, efd[2];
+	shm_header* hdr;
+	static char* kwlist[] = {"slots", "slot_size", "fds", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|nnO:ShmChannel", kwlist,
+	                                 &nslots, &slot_size, &fds))
+		return NULL;
+	if (fds == Py_None) {
+		if (nslots < 1 || nslots > 0x7fffffff ||
+		    slot_size < 1 || slot_size > 0x7fffffff - SLOT_DATA - SHM_LINE) {
+			PyErr_SetString(PyExc_ValueError, "invalid channel size");
+			return NULL;
+		}
+		memfd = memfd_create_compat("greenstack-channel", MFD_CLOEXEC);
+		if (memfd < 0)
+			return PyErr_SetFromErrno(PyExc_OSError);
+		efd[SHM_SEND] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		efd[SHM_RECV] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	} else {
+		if (!PyArg_ParseTuple(fds, "iii:ShmChannel", &memfd, &efd[SHM_SEND],
+		                      &efd[SHM_RECV]))
+			return NULL;
+		memfd = dup(memfd);
+		efd[SHM_SEND] = dup(efd[SHM_SEND]);
+		efd[SHM_RECV] = dup(efd[SHM_RECV]);
+	}
+	hdr = NULL;
+	if (memfd < 0 || efd[SHM_SEND] < 0 || efd[SHM_RECV] < 0)
+		goto error;
+
+	if (fds == Py_None) {
+		stride = (SLOT_DATA + (size_t) slot_size + SHM_LINE - 1) & ~(size_t) (SHM_LINE - 1);
+		size = sizeof(shm_header) + (size_t) nslots * stride;
+		if (ftruncate(memfd, (off_t) size) < 0)
+			goto error;
+	} else {
+		shm_header h;
+		if (pread(memfd, &h, sizeof(h), 0) != (ssize_t) sizeof(h) ||
+		    h.magic != SHM_MAGIC) {
+			errno = EINVAL;
+			goto error;
+		}
+		nslots = h.nslots;
+		slot_size = h.slot_size;
+		stride = (SLOT_DATA + (size_t) slot_size + SHM_LINE - 1) & ~(size_t) (SHM_LINE - 1);
+		size = sizeof(shm_header) + (size_t) nslots * stride;
+	}
+	hdr = (shm_header*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (hdr == (shm_header*) MAP_FAILED) {
+		hdr = NULL;
+		goto error;
+	}
+	if (fds == Py_None) {
+		hdr->nslots = (PY_UINT32_T) nslots;
+		hdr->slot_size = (PY_UINT32_T) slot_size;
+		hdr->magic = SHM_MAGIC;
+	}
+
+	ch = (GSShmChannel*) type->tp_alloc(type, 0);
+	if (ch == NULL) {
+		munmap(hdr, size);
+		for (i = 0; i < 2; i++)
+			close(efd[i]);
+		close(memfd);
+		return NULL;
+	}
+	ch->hdr = hdr;
+	ch->size = size;
+	ch->stride = stride;
+	ch->memfd = memfd;
+	ch->efd[SHM_SEND] = efd[SHM_SEND];
+	ch->efd[SHM_RECV] = efd[SHM_RECV];
+	return (PyObject*) ch;
+
+error:
+	PyErr_SetFromErrno(PyExc_OSError);
+	for (i = 0; i < 2; i++) {
+		if (efd[i] >= 0)
+			close(efd[i]);
+	}
+	if (memfd >= 0)
+		close(memfd);
+	return NULL;
+}
+
+static void shm_close_fds(GSShmChannel* ch)
+{
+	int i;
+	if (ch->closed)
+		return;
+	ch->closed = 1;
+	for (i = 0; i < 2; i++)
+		close(ch->efd[i]);
+	close(ch->memfd);
+}
+
+static void shm_dealloc(GSShmChannel* ch)
+{
+	if (ch->weakreflist != NULL)
+		PyObject_ClearWeakRefs((PyObject*) ch);
+	shm_close_fds(ch);
+	/* views of slots keep us alive, so nobody can see this */
+	munmap(ch->hdr, ch->size);
+	Py_TYPE(ch)->tp_free((PyObject*) ch);
+}
+
+PyDoc_STRVAR(shm_send_doc,
+"send(data)\n"
+"\n"
+"Copy data into the next free slot and publish it, suspending the\n"
+"current greenstack while the ring is full.\n");
+
+static PyObject* shm_send(GSShmChannel* ch, PyObject* args)
+{
+	Py_buffer data;
+	int err = -1;
+
+	if (!PyArg_ParseTuple(args, "s*:send", &data))
+		return NULL;
+	if (shm_check(ch) < 0)
+		goto done;
+	if (ch->reserved) {
+		PyErr_SetString(PyExc_ValueError, "a slot is reserved; commit() it first");
+		goto done;
+	}
+	if (data.len > (Py_ssize_t) ch->hdr->slot_size) {
+		PyErr_Format(PyExc_ValueError, "message of %zd bytes does not fit "
+		             "in a slot of %u", data.len, (unsigned int) ch->hdr->slot_size);
+		goto done;
+	}
+	if (shm_wait(ch, SHM_SEND) < 0)
+		goto done;
+	memcpy(slot_at(ch, ch->hdr->tail) + SLOT_DATA, data.buf, data.len);
+	err = shm_commit(ch, data.len);
+done:
+	PyBuffer_Release(&data);
+	if (err < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(shm_reserve_doc,
+"reserve() -> memoryview\n"
+"\n"
+"Return a writable view of the next free slot, suspending the current\n"
+"greenstack while the ring is full.  The message written there is sent\n"
+"by commit().\n");
+
+static PyObject* shm_reserve(GSShmChannel* ch)
+{
+	if (shm_check(ch) < 0)
+		return NULL;
+	if (!ch->reserved) {
+		if (shm_wait(ch, SHM_SEND) < 0)
+			return NULL;
+		ch->reserved = 1;
+	}
+	return slot_view(ch, slot_at(ch, ch->hdr->tail) + SLOT_DATA,
+	                 ch->hdr->slot_size, 0);
+}
+
+PyDoc_STRVAR(shm_commit_doc,
+"commit(n)\n"
+"\n"
+"Send the first n bytes of the slot returned by reserve().\n");
+
+static PyObject* shm_commit_method(GSShmChannel* ch, PyObject* arg)
+{
+	Py_ssize_t len = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+	if (len == -1 && PyErr_Occurred())
+		return NULL;
+	if (shm_check(ch) < 0)
+		return NULL;
+	if (!ch->reserved) {
+		PyErr_SetString(PyExc_ValueError, "no slot is reserved");
+		return NULL;
+	}
+	if (len < 0 || len > (Py_ssize_t) ch->hdr->slot_size) {
+		PyErr_SetString(PyExc_ValueError, "length out of range");
+		return NULL;
+	}
+	if (shm_commit(ch, len) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(shm_receive_doc,
+"receive() -> memoryview\n"
+"\n"
+"Release the previous message and return a read-only view of the next,\n"
+"suspending the current greenstack until one arrives.  The view is only\n"
+"valid until the message is released.\n");
+
+static PyObject* shm_receive(GSShmChannel* ch)
+{
+	char* slot;
+	PY_UINT32_T len;
+
+	if (shm_check(ch) < 0 || shm_release(ch) < 0)
+		return NULL;
+	if (shm_wait(ch, SHM_RECV) < 0)
+		return NULL;
+	slot = slot_at(ch, ch->hdr->head);
+	len = *(PY_UINT32_T*) slot;
+	if (len > ch->hdr->slot_size)
+		len = ch->hdr->slot_size;
+	ch->held = 1;
+	return slot_view(ch, slot + SLOT_DATA, (Py_ssize_t) len, 1);
+}
+
+PyDoc_STRVAR(shm_release_doc,
+"release()\n"
+"\n"
+"Give the slot of the last message received back to the sender.\n");
+
+static PyObject* shm_release_method(GSShmChannel* ch)
+{
+	if (shm_check(ch) < 0 || shm_release(ch) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(shm_close_doc,
+"close()\n"
+"\n"
+"Close the descriptors of this side.  The ring stays mapped until the\n"
+"channel and every view of its slots are gone.\n");
+
+static PyObject* shm_close(GSShmChannel* ch)
+{
+	GSScheduler* s;
+	int i;
+
+	if (ch->closed)
+		Py_RETURN_NONE;
+	s = gs_sched_current();
+	if (s == NULL)
+		return NULL;
+	for (i = 0; i < 2; i++) {
+		if (gs_io_notify_close(s, ch->efd[i]) < 0) {
+			Py_DECREF(s);
+			return NULL;
+		}
+	}
+	Py_DECREF(s);
+	shm_close_fds(ch);
+	Py_RETURN_NONE;
+}
+
+static PyObject* shm_get_fds(GSShmChannel* ch, void* context)
+{
+	if (shm_check(ch) < 0)
+		return NULL;
+	return Py_BuildValue("(iii)", ch->memfd, ch->efd[SHM_SEND], ch->efd[SHM_RECV]);
+}
+
+static PyObject* shm_get_pending(GSShmChannel* ch, void* context)
+{
+	if (shm_check(ch) < 0)
+		return NULL;
+	return PyLong_FromUnsignedLongLong(
+		__atomic_load_n(&ch->hdr->tail, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&ch->hdr->head, __ATOMIC_ACQUIRE));
+}
+
+static PyObject* shm_get_slot_size(GSShmChannel* ch, void* context)
+{
+	if (shm_check(ch) < 0)
+		return NULL;
+	return PyLong_FromLong((long) ch->hdr->slot_size);
+}
+
+static PyMethodDef shm_methods[] = {
+	{"send", (PyCFunction)shm_send, METH_VARARGS, shm_send_doc},
+	{"reserve", (PyCFunction)shm_reserve, METH_NOARGS, shm_reserve_doc},
+	{"commit", (PyCFunction)shm_commit_method, METH_O, shm_commit_doc},
+	{"receive", (PyCFunction)shm_receive, METH_NOARGS, shm_receive_doc},
+	{"release", (PyCFunction)shm_release_method, METH_NOARGS, shm_release_doc},
+	{"close", (PyCFunction)shm_close, METH_NOARGS, shm_close_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef shm_getsets[] = {
+	{"fds", (getter)shm_get_fds, NULL,
+	 "The descriptors to attach to the channel with ShmChannel(fds=...)."},
+	{"pending", (getter)shm_get_pending, NULL,
+	 "The number of messages sent but not released yet."},
+	{"slot_size", (getter)shm_get_slot_size, NULL,
+	 "The largest message that fits in a slot."},
+	{NULL}
+};
+
+static PyTypeObject GSShmChannel_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.ShmChannel",                /* tp_name */
+	sizeof(GSShmChannel),                   /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)shm_dealloc,                /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	"ShmChannel(slots=64, slot_size=4096, fds=None) -> ShmChannel\n\n"
+	"A channel from one process to another through a ring of slots in\n"
+	"shared memory.  Either create one and fork, or attach to one created\n"
+	"by another process with its fds.", /* tp_doc */
+	0,                                      /* tp_traverse */
+	0,                                      /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSShmChannel, weakreflist),    /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	shm_methods,                            /* tp_methods */
+	0,                                      /* tp_members */
+	shm_getsets,                            /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	shm_new,                                /* tp_new */
+};
+
+int _greenstack_shm_init(PyObject* m)
+{
+	if (PyType_Ready(&GSShmSlot_Type) < 0 ||
+	    PyType_Ready(&GSShmChannel_Type) < 0)
+		return -1;
+	Py_INCREF(&GSShmChannel_Type);
+	return PyModule_AddObject(m, "ShmChannel", (PyObject*) &GSShmChannel_Type);
+}
+
+#else /* !__linux__ */
+
+int _greenstack_shm_init(PyObject* m)
+{
+	return 0;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,844 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Sockets for greenstacks: the Socket type and pooled receive buffers.
+
+   A Socket wraps the file descriptor of a connected stream socket.  Every
+   operation is a non-blocking system call (MSG_DONTWAIT, so the socket
+   itself may be left blocking) that parks the greenstack in the
+   scheduler's epoll set when it fails with EAGAIN, and tries again when
+   the descriptor becomes ready.
+
+   Data is received into buffers of BUFFER_SIZE bytes, which each thread
+   keeps in a pool: a Socket takes one for readline() and read_exactly(),
+   and gives it back as soon as everything buffered in it was consumed, so
+   idle connections do not hold any.  recv_view() and pooled_buffer()
+   hand them out as memoryviews of a small object that puts its buffer
+   back into the pool when the last view of it goes away.  The pool of a
+   thread lives in its greenstack run_info, like its scheduler.
+*/
+
+#include "greenstack_private.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE     ((Py_ssize_t) 1 << 16)
+
+/* Buffers kept in each pool; more are freed when they come back */
+#define POOL_MAX        64
+
+typedef struct {
+	PyObject_HEAD
+	char* free[POOL_MAX];
+	int nfree;
+} GSBufferPool;
+
+/* Exports len bytes of a pooled buffer */
+typedef struct {
+	PyObject_HEAD
+	GSBufferPool* pool;
+	char* data;
+	Py_ssize_t len;
+} GSBuffer;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject* file;         /* what we were made from, or NULL if closed */
+	int fd;
+	GSBufferPool* pool;     /* where rbuf goes back to, if we have one */
+	char* rbuf;             /* data received but not consumed yet */
+	Py_ssize_t rpos, rend;
+	PyObject* weakreflist;
+} GSSocket;
+
+static PyTypeObject GSBufferPool_Type;
+static PyTypeObject GSBuffer_Type;
+static PyTypeObject GSSocket_Type;
+
+static PyObject* ts_poolkey;
+
+/***********************************************************/
+/* Buffer pools */
+
+/* Returns a borrowed reference to the pool of the current thread */
+static GSBufferPool* pool_current(void)
+{
+	PyObject* p;
+	if (!STATE_OK)
+		return NULL;
+	p = PyDict_GetItem(ts_current->run_info, ts_poolkey);
+	if (p != NULL)
+		return (GSBufferPool*) p;
+	p = (PyObject*) PyObject_New(GSBufferPool, &GSBufferPool_Type);
+	if (p == NULL)
+		return NULL;
+	((GSBufferPool*) p)->nfree = 0;
+	if (PyDict_SetItem(ts_current->run_info, ts_poolkey, p) < 0) {
+		Py_DECREF(p);
+		return NULL;
+	}
+	Py_DECREF(p);
+	return (GSBufferPool*) p;
+}
+
+static char* pool_get(GSBufferPool* pool)
+{
+	char* data;
+	if (pool->nfree > 0)
+		return pool->free[--pool->nfree];
+	data = (char*) PyMem_Malloc(BUFFER_SIZE);
+	if (data == NULL)
+		PyErr_NoMemory();
+	return data;
+}
+
+static void pool_put(GSBufferPool* pool, char* data)
+{
+	if (pool->nfree < POOL_MAX)
+		pool->free[pool->nfree++] = data;
+	else
+		PyMem_Free(data);
+}
+
+static void pool_dealloc(GSBufferPool* pool)
+{
+	while (pool->nfree > 0)
+		PyMem_Free(pool->free[--pool->nfree]);
+	PyObject_Del(pool);
+}
+
+static PyTypeObject GSBufferPool_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack._BufferPool",               /* tp_name */
+	sizeof(GSBufferPool),                   /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)pool_dealloc,               /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+};
+
+/* Returns a new buffer from the pool of the current thread */
+static GSBuffer* buffer_new(void)
+{
+	GSBufferPool* pool;
+	GSBuffer* b;
+
+	pool = pool_current();
+	if (pool == NULL)
+		return NULL;
+	b = PyObject_New(GSBuffer, &GSBuffer_Type);
+	if (b == NULL)
+		return NULL;
+	b->data = pool_get(pool);
+	if (b->data == NULL) {
+		b->pool = NULL;
+		Py_DECREF(b);
+		return NULL;
+	}
+	Py_INCREF(pool);
+	b->pool = pool;
+	b->len = BUFFER_SIZE;
+	return b;
+}
+
+static void buffer_dealloc(GSBuffer* b)
+{
+	if (b->pool != NULL) {
+		pool_put(b->pool, b->data);
+		Py_DECREF(b->pool);
+	}
+	PyObject_Del(b);
+}
+
+static int buffer_getbuffer(GSBuffer* b, Py_buffer* view, int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject*) b, b->data, b->len, 0, flags);
+}
+
+static PyBufferProcs buffer_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+	0,                                      /* bf_getreadbuffer */
+	0,                                      /* bf_getwritebuffer */
+	0,                                      /* bf_getsegcount */
+	0,                                      /* bf_getcharbuffer */
+#endif
+	(getbufferproc)buffer_getbuffer,        /* bf_getbuffer */
+	0,                                      /* bf_releasebuffer */
+};
+
+static PyTypeObject GSBuffer_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack._Buffer",                   /* tp_name */
+	sizeof(GSBuffer),                       /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)buffer_dealloc,             /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	&buffer_as_buffer,                      /* tp_as_buffer*/
+#if PY_MAJOR_VERSION < 3
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+#else
+	Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+#endif
+};
+
+/* Returns a memoryview of the first len bytes of b and drops b */
+static PyObject* buffer_view(GSBuffer* b, Py_ssize_t len)
+{
+	PyObject* view;
+	b->len = len;
+	view = PyMemoryView_FromObject((PyObject*) b);
+	Py_DECREF(b);
+	return view;
+}
+
+/***********************************************************/
+/* Socket I/O */
+
+static int sock_check(GSSocket* self)
+{
+	if (self->file == NULL) {
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed socket");
+		return -1;
+	}
+	return 0;
+}
+
+/* Waits until the socket may be ready in direction dir */
+static int sock_wait(GSSocket* self, int dir)
+{
+	GSScheduler* s;
+	int err;
+
+	s = gs_sched_current();
+	if (s == NULL)
+		return -1;
+	err = gs_io_wait(s, self->fd, dir, -1);
+	Py_DECREF(s);
+	return err < 0 ? -1 : 0;
+}
+
+/* Handles the failure of a system call in direction dir, waiting if it
+ * would have blocked.  Returns 0 if it should be tried again, or -1 with
+ * an exception. */
+static int sock_retry(GSSocket* self, int dir)
+{
+	if (errno == EINTR) {
+		if (PyErr_CheckSignals() < 0)
+			return -1;
+	} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (sock_wait(self, dir) < 0)
+			return -1;
+	} else {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	/* the wait may have run something that closed us */
+	return sock_check(self);
+}
+
+/* Receives up to len bytes into buf, suspending the current greenstack
+ * until some arrive.  Returns the number received, 0 at the end of the
+ * stream, or -1 with an exception. */
+static Py_ssize_t sock_recv(GSSocket* self, char* buf, Py_ssize_t len)
+{
+	Py_ssize_t n;
+	for (;;) {
+		n = recv(self->fd, buf, (size_t) len, MSG_DONTWAIT);
+		if (n >= 0)
+			return n;
+		if (sock_retry(self, GS_IO_READ) < 0)
+			return -1;
+	}
+}
+
+/* Sends up to len bytes from buf, suspending the current greenstack until
+ * some can be sent.  Returns the number sent or -1 with an exception. */
+static Py_ssize_t sock_send(GSSocket* self, const char* buf, Py_ssize_t len)
+{
+	Py_ssize_t n;
+	for (;;) {
+		n = send(self->fd, buf, (size_t) len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n >= 0)
+			return n;
+		if (sock_retry(self, GS_IO_WRITE) < 0)
+			return -1;
+	}
+}
+
+static void sock_release(GSSocket* self)
+{
+	if (self->rbuf != NULL) {
+		pool_put(self->pool, self->rbuf);
+		self->rbuf = NULL;
+		Py_CLEAR(self->pool);
+	}
+	self->rpos = self->rend = 0;
+}
+
+/* Receives more data into the read buffer.  Returns the number of bytes
+ * received, 0 at the end of the stream, or -1 with an exception.  Another
+ * greenstack may consume the buffer while this one waits, so where to
+ * receive into is worked out again after every wait. */
+static Py_ssize_t sock_fill(GSSocket* self)
+{
+	GSBufferPool* pool;
+	Py_ssize_t n;
+
+	for (;;) {
+		if (self->rbuf == NULL) {
+			pool = pool_current();
+			if (pool == NULL)
+				return -1;
+			self->rbuf = pool_get(pool);
+			if (self->rbuf == NULL)
+				return -1;
+			Py_INCREF(pool);
+			self->pool = pool;
+			self->rpos = self->rend = 0;
+		} else if (self->rend == BUFFER_SIZE) {
+			memmove(self->rbuf, self->rbuf + self->rpos,
+			        self->rend - self->rpos);
+			self->rend -= self->rpos;
+			self->rpos = 0;
+		}
+		n = recv(self->fd, self->rbuf + self->rend,
+		         (size_t) (BUFFER_SIZE - self->rend), MSG_DONTWAIT);
+		if (n > 0) {
+			self->rend += n;
+			return n;
+		}
+		if (self->rpos == self->rend)
+			sock_release(self);
+		if (n == 0)
+			return 0;
+		if (sock_retry(self, GS_IO_READ) < 0)
+			return -1;
+	}
+}
+
+/* Copies up to len buffered bytes to buf and returns how many */
+static Py_ssize_t sock_take(GSSocket* self, char* buf, Py_ssize_t len)
+{
+	if (len > self->rend - self->rpos)
+		len = self->rend - self->rpos;
+	memcpy(buf, self->rbuf + self->rpos, len);
+	self->rpos += len;
+	if (self->rpos == self->rend)
+		sock_release(self);
+	return len;
+}
+
+/* Receives up to len bytes into buf, from the read buffer if it has any */
+static Py_ssize_t sock_read(GSSocket* self, char* buf, Py_ssize_t len)
+{
+	if (self->rpos < self->rend)
+		return sock_take(self, buf, len);
+	return sock_recv(self, buf, len);
+}
+
+/***********************************************************/
+/* Socket methods */
+
+static PyObject* sock_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSSocket* self;
+	PyObject* file;
+	int fd;
+	static char* kwlist[] = {"sock", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:Socket", kwlist, &file))
+		return NULL;
+	fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0)
+		return NULL;
+	self = (GSSocket*) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+	Py_INCREF(file);
+	self->file = file;
+	self->fd = fd;
+	return (PyObject*) self;
+}
+
+static int sock_traverse(GSSocket* self, visitproc visit, void* arg)
+{
+	Py_VISIT(self->file);
+	return 0;
+}
+
+static int sock_clear(GSSocket* self)
+{
+	Py_CLEAR(self->file);
+	return 0;
+}
+
+static void sock_dealloc(GSSocket* self)
+{
+	PyObject_GC_UnTrack(self);
+	if (self->weakreflist != NULL)
+		PyObject_ClearWeakRefs((PyObject*) self);
+	sock_release(self);
+	sock_clear(self);
+	Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+PyDoc_STRVAR(sock_fileno_doc,
+"fileno() -> int\n"
+"\n"
+"Return the file descriptor of the socket.\n");
+
+static PyObject* sock_fileno(GSSocket* self)
+{
+	if (sock_check(self) < 0)
+		return NULL;
+	return PyLong_FromLong(self->fd);
+}
+
+PyDoc_STRVAR(sock_recv_doc,
+"recv(n) -> bytes\n"
+"\n"
+"Receive up to n bytes, suspending the current greenstack until some\n"
+"arrive.  Returns b'' at the end of the stream.\n");
+
+static PyObject* sock_recv_method(GSSocket* self, PyObject* args)
+{
+	PyObject* result;
+	Py_ssize_t len, n;
+
+	if (!PyArg_ParseTuple(args, "n:recv", &len))
+		return NULL;
+	if (len < 0) {
+		PyErr_SetString(PyExc_ValueError, "negative buffersize");
+		return NULL;
+	}
+	if (sock_check(self) < 0)
+		return NULL;
+	if (self->rpos < self->rend) {
+		if (len > self->rend - self->rpos)
+			len = self->rend - self->rpos;
+		result = PyBytes_FromStringAndSize(self->rbuf + self->rpos, len);
+		if (result != NULL)
+			sock_take(self, PyBytes_AS_STRING(result), len);
+		return result;
+	}
+	result = PyBytes_FromStringAndSize(NULL, len);
+	if (result == NULL)
+		return NULL;
+	n = sock_recv(self, PyBytes_AS_STRING(result), len);
+	if (n < 0 || (n < len && _PyBytes_Resize(&result, n) < 0)) {
+		Py_XDECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+PyDoc_STRVAR(sock_recv_into_doc,
+"recv_into(buffer, nbytes=0) -> int\n"
+"\n"
+"Receive up to nbytes bytes, or as many as fit if nbytes is 0, into a\n"
+"writable buffer.  Returns how many were received.\n");
+
+static PyObject* sock_recv_into(GSSocket* self, PyObject* args)
+{
+	Py_buffer buf;
+	Py_ssize_t len = 0, n;
+
+	if (!PyArg_ParseTuple(args, "w*|n:recv_into", &buf, &len))
+		return NULL;
+	if (len < 0) {
+		PyBuffer_Release(&buf);
+		PyErr_SetString(PyExc_ValueError, "negative buffersize");
+		return NULL;
+	}
+	if (len == 0 || len > buf.len)
+		len = buf.len;
+	n = sock_check(self) < 0 ? -1 : sock_read(self, (char*) buf.buf, len);
+	PyBuffer_Release(&buf);
+	if (n < 0)
+		return NULL;
+	return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(sock_recv_view_doc,
+"recv_view(n=-1) -> memoryview\n"
+"\n"
+"Receive up to n bytes, at most BUFFER_SIZE, into a pooled buffer and\n"
+"return a memoryview of them.  The buffer goes back to the pool when the\n"
+"view is released.\n");
+
+static PyObject* sock_recv_view(GSSocket* self, PyObject* args)
+{
+	GSBuffer* b;
+	Py_ssize_t len = -1, n;
+
+	if (!PyArg_ParseTuple(args, "|n:recv_view", &len))
+		return NULL;
+	if (len < 0 || len > BUFFER_SIZE)
+		len = BUFFER_SIZE;
+	if (sock_check(self) < 0)
+		return NULL;
+	b = buffer_new();
+	if (b == NULL)
+		return NULL;
+	n = sock_read(self, b->data, len);
+	if (n < 0) {
+		Py_DECREF(b);
+		return NULL;
+	}
+	return buffer_view(b, n);
+}
+
+/* Appends len bytes from buf to *out, which may be NULL */
+static int bytes_append(PyObject** out, const char* buf, Py_ssize_t len)
+{
+	Py_ssize_t size;
+	if (*out == NULL) {
+		*out = PyBytes_FromStringAndSize(buf, len);
+		return *out == NULL ? -1 : 0;
+	}
+	size = PyBytes_GET_SIZE(*out);
+	if (_PyBytes_Resize(out, size + len) < 0)
+		return -1;
+	memcpy(PyBytes_AS_STRING(*out) + size, buf, len);
+	return 0;
+}
+
+PyDoc_STRVAR(sock_readline_doc,
+"readline(limit=-1) -> bytes\n"
+"\n"
+"Receive a line, including its b'\\n', or at most limit bytes if limit\n"
+"is not negative.  The line is shorter and has no b'\\n' at the end of the\n"
+"stream, which is where b'' is returned.  Data after the line stays\n"
+"buffered for the next call.\n");
+
+static PyObject* sock_readline(GSSocket* self, PyObject* args)
+{
+	PyObject* out = NULL;
+	Py_ssize_t limit = -1, got = 0, avail, n;
+	char* start;
+	char* nl;
+
+	if (!PyArg_ParseTuple(args, "|n:readline", &limit))
+		return NULL;
+	if (sock_check(self) < 0)
+		return NULL;
+	while (limit < 0 || got < limit) {
+		if (self->rpos == self->rend) {
+			n = sock_fill(self);
+			if (n < 0)
+				goto fail;
+			if (n == 0)
+				break;
+		}
+		start = self->rbuf + self->rpos;
+		avail = self->rend - self->rpos;
+		if (limit >= 0 && avail > limit - got)
+			avail = limit - got;
+		nl = (char*) memchr(start, '\n', avail);
+		if (nl != NULL)
+			avail = nl - start + 1;
+		if (bytes_append(&out, start, avail) < 0)
+			goto fail;
+		got += avail;
+		self->rpos += avail;
+		if (self->rpos == self->rend)
+			sock_release(self);
+		if (nl != NULL)
+			break;
+	}
+	if (out == NULL)
+		return PyBytes_FromStringAndSize(NULL, 0);
+	return out;
+fail:
+	Py_XDECREF(out);
+	return NULL;
+}
+
+PyDoc_STRVAR(sock_read_exactly_doc,
+"read_exactly(n) -> bytes\n"
+"\n"
+"Receive exactly n bytes.  Raises EOFError if the stream ends first.\n");
+
+static PyObject* sock_read_exactly(GSSocket* self, PyObject* args)
+{
+	PyObject* out;
+	Py_ssize_t len, got = 0, n;
+	char* buf;
+	int direct;
+
+	if (!PyArg_ParseTuple(args, "n:read_exactly", &len))
+		return NULL;
+	if (len < 0) {
+		PyErr_SetString(PyExc_ValueError, "negative size");
+		return NULL;
+	}
+	if (sock_check(self) < 0)
+		return NULL;
+	out = PyBytes_FromStringAndSize(NULL, len);
+	if (out == NULL)
+		return NULL;
+	buf = PyBytes_AS_STRING(out);
+	while (got < len) {
+		if (self->rpos < self->rend) {
+			got += sock_take(self, buf + got, len - got);
+			continue;
+		}
+		/* Short reads go through the buffer, so that whatever arrived
+		 * after them is picked up by the same system call; long ones
+		 * go straight into the result. */
+		direct = len - got >= BUFFER_SIZE;
+		if (direct)
+			n = sock_recv(self, buf + got, len - got);
+		else
+			n = sock_fill(self);
+		if (n < 0)
+			goto fail;
+		if (n == 0) {
+			PyErr_Format(PyExc_EOFError,
+			             "stream ended after %zd of %zd bytes", got, len);
+			goto fail;
+		}
+		if (direct)
+			got += n;
+	}
+	return out;
+fail:
+	Py_DECREF(out);
+	return NULL;
+}
+
+PyDoc_STRVAR(sock_send_doc,
+"send(data) -> int\n"
+"\n"
+"Send data, suspending the current greenstack until some of it can be\n"
+"sent.  Returns the number of bytes sent.\n");
+
+static PyObject* sock_send_method(GSSocket* self, PyObject* args)
+{
+	Py_buffer data;
+	Py_ssize_t n;
+
+	if (!PyArg_ParseTuple(args, "s*:send", &data))
+		return NULL;
+	n = sock_check(self) < 0 ? -1 : sock_send(self, (const char*) data.buf, data.len);
+	PyBuffer_Release(&data);
+	if (n < 0)
+		return NULL;
+	return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(sock_sendall_doc,
+"sendall(data)\n"
+"\n"
+"Send all of data, suspending the current greenstack as often as needed.\n");
+
+static PyObject* sock_sendall(GSSocket* self, PyObject* args)
+{
+	Py_buffer data;
+	Py_ssize_t sent = 0, n = 0;
+
+	if (!PyArg_ParseTuple(args, "s*:sendall", &data))
+		return NULL;
+	if (sock_check(self) < 0)
+		n = -1;
+	while (n >= 0 && sent < data.len) {
+		n = sock_send(self, (const char*) data.buf + sent, data.len - sent);
+		sent += n;
+	}
+	PyBuffer_Release(&data);
+	if (n < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(sock_close_doc,
+"close()\n"
+"\n"
+"Wake any greenstack waiting on the socket, drop buffered data and close\n"
+"what the Socket was made from: its close() method is called, or the\n"
+"file descriptor is closed if it was made from one.\n");
+
+static PyObject* sock_close(GSSocket* self)
+{
+	GSScheduler* s;
+	PyObject* file;
+	PyObject* r;
+	int err;
+
+	if (self->file == NULL)
+		Py_RETURN_NONE;
+	s = gs_sched_current();
+	if (s == NULL)
+		return NULL;
+	err = gs_io_notify_close(s, self->fd);
+	Py_DECREF(s);
+	if (err < 0)
+		return NULL;
+	sock_release(self);
+	file = self->file;
+	self->file = NULL;
+	if (PyObject_HasAttrString(file, "close")) {
+		r = PyObject_CallMethod(file, "close", NULL);
+		Py_DECREF(file);
+		return r;
+	}
+	Py_DECREF(file);
+	if (close(self->fd) < 0)
+		return PyErr_SetFromErrno(PyExc_OSError);
+	Py_RETURN_NONE;
+}
+
+static PyObject* sock_get_closed(GSSocket* self, void* context)
+{
+	return PyBool_FromLong(self->file == NULL);
+}
+
+static PyObject* sock_get_buffered(GSSocket* self, void* context)
+{
+	return PyLong_FromSsize_t(self->rend - self->rpos);
+}
+
+static PyMethodDef sock_methods[] = {
+	{"fileno", (PyCFunction)sock_fileno, METH_NOARGS, sock_fileno_doc},
+	{"recv", (PyCFunction)sock_recv_method, METH_VARARGS, sock_recv_doc},
+	{"recv_into", (PyCFunction)sock_recv_into, METH_VARARGS, sock_recv_into_doc},
+	{"recv_view", (PyCFunction)sock_recv_view, METH_VARARGS, sock_recv_view_doc},
+	{"readline", (PyCFunction)sock_readline, METH_VARARGS, sock_readline_doc},
+	{"read_exactly", (PyCFunction)sock_read_exactly, METH_VARARGS, sock_read_exactly_doc},
+	{"send", (PyCFunction)sock_send_method, METH_VARARGS, sock_send_doc},
+	{"sendall", (PyCFunction)sock_sendall, METH_VARARGS, sock_sendall_doc},
+	{"close", (PyCFunction)sock_close, METH_NOARGS, sock_close_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef sock_getsets[] = {
+	{"closed", (getter)sock_get_closed, NULL, NULL},
+	{"buffered", (getter)sock_get_buffered, NULL,
+	 "The number of bytes received but not consumed yet."},
+	{NULL}
+};
+
+static PyTypeObject GSSocket_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Socket",                    /* tp_name */
+	sizeof(GSSocket),                       /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)sock_dealloc,               /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Socket(sock) -> Socket\n\n"
+	"Wrap a connected stream socket, or its file descriptor, for use by\n"
+	"greenstacks run by the scheduler.", /* tp_doc */
+	(traverseproc)sock_traverse,            /* tp_traverse */
+	(inquiry)sock_clear,                    /* tp_clear */
+	0,                                      /* tp_richcompare */
+	offsetof(GSSocket, weakreflist),        /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	sock_methods,                           /* tp_methods */
+	0,                                      /* tp_members */
+	sock_getsets,                           /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	sock_new,                               /* tp_new */
+};
+
+/***********************************************************/
+/* Module functions */
+
+PyDoc_STRVAR(mod_pooled_buffer_doc,
+"pooled_buffer() -> memoryview\n"
+"\n"
+"Return a writable memoryview of BUFFER_SIZE bytes from the pool of the\n"
+"current thread, for recv_into().  The buffer goes back to the pool when\n"
+"the view is released.\n");
+
+static PyObject* mod_pooled_buffer(PyObject* self)
+{
+	GSBuffer* b = buffer_new();
+	if (b == NULL)
+		return NULL;
+	return buffer_view(b, BUFFER_SIZE);
+}
+
+static PyMethodDef socket_functions[] = {
+	{"pooled_buffer", (PyCFunction)mod_pooled_buffer, METH_NOARGS,
+	 mod_pooled_buffer_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_socket_init(PyObject* m)
+{
+	ts_poolkey = GS_InternFromString("__greenstack_ts_poolkey");
+	if (ts_poolkey == NULL)
+		return -1;
+	if (PyType_Ready(&GSBufferPool_Type) < 0 ||
+	    PyType_Ready(&GSBuffer_Type) < 0 ||
+	    PyType_Ready(&GSSocket_Type) < 0)
+		return -1;
+	Py_INCREF(&GSSocket_Type);
+	if (PyModule_AddObject(m, "Socket", (PyObject*) &GSSocket_Type) < 0)
+		return -1;
+	if (PyModule_AddIntConstant(m, "BUFFER_SIZE", (long) BUFFER_SIZE) < 0)
+		return -1;
+	return _greenstack_add_functions(m, socket_functions);
+}
+
+#else /* !__linux__ */
+
+int _greenstack_socket_init(PyObject* m)
+{
+	return 0;
+}
+
+#endif /* __linux__ */
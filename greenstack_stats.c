@@ -0,0 +1,729 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Statistics: stats() and PyGreenstack_GetStats().
+
+   Each thread has its own counters, kept in an object in its thread state
+   dict.  ts_stats points at the counters of the thread ts_current belongs
+   to and is moved along with it by green_updatecurrent(), so the switch
+   and creation paths only have to bump a field.  The counters are plain
+   integers; they are only touched with the GIL held.
+
+   The same object holds the list of live greenstacks of the thread: its
+   main greenstack, and every greenstack from when g_create() gives it a
+   stack until g_trampoline() is done with it, or it is deallocated.
+   Greenstacks can outlive their thread, so when the object goes away
+   with the thread state it unlinks what is left.
+
+   How much of the stacks is resident is worked out on demand with
+   mincore(), one system call per stack.
+
+   Every greenstack counts how many times it was switched to.  With CPU
+   accounting on, g_realswitchstack() also reads the CPU clock of the
+   thread when it switches to a greenstack and again when it switches
+   away, and charges the difference to it.  Reading that clock is a
+   system call, which costs more than a switch, so only one switch in
+   gs_cpu_sample is timed and what it measures is multiplied by
+   gs_cpu_sample; over many switches this adds up to the right total.
+   The gaps between timed switches are random, or a program that switches
+   between a few greenstacks in a fixed order would always have the same
+   one timed.
+
+   Built with GREENSTACK_USE_SWITCH_TIMING, each thread also keeps
+   histograms of how long switches, starting greenstacks and tearing them
+   down take.  Times are taken with the time stamp counter on x86, and
+   with CLOCK_MONOTONIC_RAW elsewhere; ticks are converted to nanoseconds
+   only when the histograms are read, using the rate the counter advanced
+   at since the module was loaded.  Each histogram has four buckets per
+   power of two, so a reported percentile is within 25% of the truth.
+   Without the flag none of this is compiled in.
+*/
+
+#include "greenstack_private.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <time.h>
+
+#if GREENSTACK_USE_SWITCH_TIMING
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__)
+#define TIMING_TSC
+#endif
+#endif
+
+typedef struct {
+	PyObject_HEAD
+	PyGreenstack_Stats stats;
+#if GREENSTACK_USE_SWITCH_TIMING
+	gs_histogram timing[GS_TIMING_KINDS];
+#endif
+	gs_link live;
+} GSThreadStats;
+
+static PyTypeObject GSThreadStats_Type;
+
+/* Counts what happens while no counters could be made for a thread */
+static PyGreenstack_Stats stats_lost;
+
+PyGreenstack_Stats* ts_stats = &stats_lost;
+
+#if GREENSTACK_USE_SWITCH_TIMING
+static gs_histogram timing_lost[GS_TIMING_KINDS];
+
+gs_histogram* ts_timing = timing_lost;
+#endif
+
+static gs_link live_lost = {&live_lost, &live_lost};
+
+gs_link* ts_live = &live_lost;
+
+/* Keeps the counters ts_stats points at alive */
+static PyObject* ts_stats_owner;
+
+static PyObject* ts_statskey;
+
+void gs_stats_attach(PyObject* dict)
+{
+	PyObject* owner;
+
+	if (ts_statskey == NULL)
+		return;         /* not initialized yet */
+	owner = PyDict_GetItem(dict, ts_statskey);
+	if (owner == NULL) {
+		owner = (PyObject*) PyObject_New(GSThreadStats, &GSThreadStats_Type);
+		if (owner == NULL || PyDict_SetItem(dict, ts_statskey, owner) < 0) {
+			Py_XDECREF(owner);
+			PyErr_Clear();
+			ts_stats = &stats_lost;
+#if GREENSTACK_USE_SWITCH_TIMING
+			ts_timing = timing_lost;
+#endif
+			ts_live = &live_lost;
+			Py_CLEAR(ts_stats_owner);
+			return;
+		}
+		memset(&((GSThreadStats*) owner)->stats, 0,
+		       sizeof(GSThreadStats) - offsetof(GSThreadStats, stats));
+		GS_LIST_INIT(&((GSThreadStats*) owner)->live);
+		/* this is the first time the thread is seen, so ts_current is
+		 * its main greenstack */
+		if (ts_current->run_info == dict)
+			gs_list_append(&((GSThreadStats*) owner)->live, &ts_current->live);
+		Py_DECREF(owner);
+	}
+	Py_INCREF(owner);
+	Py_XDECREF(ts_stats_owner);
+	ts_stats_owner = owner;
+	ts_stats = &((GSThreadStats*) owner)->stats;
+#if GREENSTACK_USE_SWITCH_TIMING
+	ts_timing = ((GSThreadStats*) owner)->timing;
+#endif
+	ts_live = &((GSThreadStats*) owner)->live;
+}
+
+static void stats_dealloc(GSThreadStats* owner)
+{
+	while (!GS_LIST_EMPTY(&owner->live))
+		gs_list_remove(owner->live.next);
+	PyObject_Del(owner);
+}
+
+PyObject* gs_stats_of(PyObject* dict, PyGreenstack_Stats** stats)
+{
+	PyObject* owner = PyDict_GetItem(dict, ts_statskey);
+	if (owner == NULL || !PyObject_TypeCheck(owner, &GSThreadStats_Type))
+		return NULL;
+	*stats = &((GSThreadStats*) owner)->stats;
+	Py_INCREF(owner);
+	return owner;
+}
+
+gs_link* gs_live_list(PyObject* dict)
+{
+	PyObject* owner = PyDict_GetItem(dict, ts_statskey);
+	if (owner == NULL || !PyObject_TypeCheck(owner, &GSThreadStats_Type))
+		return NULL;
+	return &((GSThreadStats*) owner)->live;
+}
+
+Py_ssize_t gs_live_greenstacks(gs_link* head, PyGreenstack*** greenstacks)
+{
+	Py_ssize_t n = 0;
+	gs_link* l;
+
+	for (l = head->next; l != head; l = l->next)
+		n++;
+	*greenstacks = PyMem_New(PyGreenstack*, n + 1);
+	if (*greenstacks == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	n = 0;
+	for (l = head->next; l != head; l = l->next) {
+		(*greenstacks)[n] = GS_LIVE_GREENSTACK(l);
+		Py_INCREF((*greenstacks)[n]);
+		n++;
+	}
+	return n;
+}
+
+static PyTypeObject GSThreadStats_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack._ThreadStats",              /* tp_name */
+	sizeof(GSThreadStats),                  /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)stats_dealloc,              /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+};
+
+/***********************************************************/
+/* Resident memory */
+
+#ifdef __linux__
+
+/* Returns how many bytes of [start, start + size) are resident, or
+ * (size_t) -1 with an exception */
+static size_t resident_bytes(void* start, size_t size)
+{
+	unsigned char vec[256];
+	size_t page, first, npages, chunk, i, total = 0;
+	char* p;
+
+	page = (size_t) sysconf(_SC_PAGESIZE);
+	first = (size_t) start & ~(page - 1);
+	npages = ((size_t) start + size - first + page - 1) / page;
+	p = (char*) first;
+	while (npages > 0) {
+		chunk = npages < sizeof(vec) ? npages : sizeof(vec);
+		if (mincore(p, chunk * page, vec) < 0) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return (size_t) -1;
+		}
+		for (i = 0; i < chunk; i++) {
+			if (vec[i] & 1)
+				total += page;
+		}
+		p += chunk * page;
+		npages -= chunk;
+	}
+	return total;
+}
+
+/* Fills in the resident fields of stats */
+static int stats_resident(PyGreenstack_Stats* stats)
+{
+	struct coro_stack* stacks;
+	PyGreenstack* g;
+	gs_link* l;
+	size_t n;
+	int count, i;
+
+	stats->resident_bytes_cached = 0;
+	count = gs_stack_cache(&stacks);
+	for (i = 0; i < count; i++) {
+		n = resident_bytes(stacks[i].sptr, stacks[i].ssze);
+		if (n == (size_t) -1)
+			return -1;
+		stats->resident_bytes_cached += n;
+	}
+
+	stats->resident_bytes_live = 0;
+	for (l = ts_live->next; l != ts_live; l = l->next) {
+		g = GS_LIVE_GREENSTACK(l);
+		if (PyGreenstack_MAIN(g))
+			continue;
+		n = resident_bytes(g->stack, g->stack_size);
+		if (n == (size_t) -1)
+			return -1;
+		stats->resident_bytes_live += n;
+	}
+	return 0;
+}
+
+#else /* !__linux__ */
+
+static int stats_resident(PyGreenstack_Stats* stats)
+{
+	PyErr_SetString(PyExc_NotImplementedError,
+	                "resident memory is not known on this platform");
+	return -1;
+}
+
+#endif /* __linux__ */
+
+/***********************************************************/
+
+int PyGreenstack_GetStats(PyGreenstack_Stats* stats, int resident)
+{
+	struct coro_stack* stacks;
+	int count, i;
+
+	if (!STATE_OK)
+		return -1;
+	*stats = *ts_stats;
+	stats->stack_bytes_cached = 0;
+	count = gs_stack_cache(&stacks);
+	for (i = 0; i < count; i++)
+		stats->stack_bytes_cached += stacks[i].ssze;
+	stats->stacks_cached = (size_t) count;
+	stats->resident_bytes_live = 0;
+	stats->resident_bytes_cached = 0;
+	if (resident)
+		return stats_resident(stats);
+	return 0;
+}
+
+static int dict_set_size(PyObject* dict, const char* key, size_t value)
+{
+	PyObject* v = PyLong_FromSize_t(value);
+	int err;
+	if (v == NULL)
+		return -1;
+	err = PyDict_SetItemString(dict, key, v);
+	Py_DECREF(v);
+	return err;
+}
+
+PyDoc_STRVAR(mod_stats_doc,
+"stats(resident=False) -> dict\n"
+"\n"
+"Return the counters of the current thread: switches, creations, deaths,\n"
+"stack_cache_hits, stack_cache_misses, stack_allocs and stack_frees, and\n"
+"how many bytes of stack its live greenstacks reserve.  stacks_cached and\n"
+"stack_bytes_cached describe the stack cache, which all threads share.\n"
+"If resident is true, resident_bytes_live and resident_bytes_cached tell\n"
+"how much of the live and the cached stacks is actually in memory.\n");
+
+static PyObject* mod_stats(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	PyGreenstack_Stats stats;
+	PyObject* resident = Py_False;
+	PyObject* result;
+	int want;
+	static char* kwlist[] = {"resident", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:stats", kwlist, &resident))
+		return NULL;
+	want = PyObject_IsTrue(resident);
+	if (want < 0)
+		return NULL;
+	if (PyGreenstack_GetStats(&stats, want) < 0)
+		return NULL;
+	result = Py_BuildValue("{sKsKsKsKsKsKsKsnsnsn}",
+		"switches", (unsigned PY_LONG_LONG) stats.switches,
+		"creations", (unsigned PY_LONG_LONG) stats.creations,
+		"deaths", (unsigned PY_LONG_LONG) stats.deaths,
+		"stack_cache_hits", (unsigned PY_LONG_LONG) stats.stack_cache_hits,
+		"stack_cache_misses", (unsigned PY_LONG_LONG) stats.stack_cache_misses,
+		"stack_allocs", (unsigned PY_LONG_LONG) stats.stack_allocs,
+		"stack_frees", (unsigned PY_LONG_LONG) stats.stack_frees,
+		"stack_bytes_live", (Py_ssize_t) stats.stack_bytes_live,
+		"stack_bytes_cached", (Py_ssize_t) stats.stack_bytes_cached,
+		"stacks_cached", (Py_ssize_t) stats.stacks_cached);
+	if (result == NULL || !want)
+		return result;
+	if (dict_set_size(result, "resident_bytes_live", stats.resident_bytes_live) < 0 ||
+	    dict_set_size(result, "resident_bytes_cached", stats.resident_bytes_cached) < 0) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+/***********************************************************/
+/* Live greenstacks */
+
+PyDoc_STRVAR(mod_enumerate_doc,
+"enumerate(thread=None, state=None) -> list\n"
+"\n"
+"Return the live greenstacks of a thread: its main greenstack and those\n"
+"that started and have not finished, oldest first.  thread is the ident\n"
+"of the thread, as threading.get_ident() returns it, or None for the\n"
+"current thread.  With state='running' only the greenstack the thread\n"
+"runs is returned, and with state='parked' only the others.\n");
+
+static PyObject* mod_enumerate(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	PyObject* thread = Py_None;
+	const char* state = NULL;
+	PyObject* dict = NULL;
+	PyObject* result;
+	PyThreadState* t;
+	PyGreenstack** found;
+	PyGreenstack* running;
+	gs_link* head;
+	Py_ssize_t count, i;
+	unsigned long ident;
+	int want = 0;
+	static char* kwlist[] = {"thread", "state", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Oz:enumerate", kwlist,
+	                                 &thread, &state))
+		return NULL;
+	if (state != NULL) {
+		if (strcmp(state, "running") == 0)
+			want = 1;
+		else if (strcmp(state, "parked") == 0)
+			want = 2;
+		else {
+			PyErr_SetString(PyExc_ValueError,
+			                "state must be 'running', 'parked' or None");
+			return NULL;
+		}
+	}
+	if (!STATE_OK)
+		return NULL;
+	if (thread == Py_None) {
+		dict = ts_current->run_info;
+	} else {
+		ident = PyLong_AsUnsignedLongMask(thread);
+		if (ident == (unsigned long) -1 && PyErr_Occurred())
+			return NULL;
+		for (t = PyInterpreterState_ThreadHead(PyThreadState_GET()->interp);
+		     t != NULL; t = PyThreadState_Next(t)) {
+			if ((unsigned long) t->thread_id == ident) {
+				dict = t->dict;
+				break;
+			}
+		}
+	}
+	head = dict != NULL ? gs_live_list(dict) : NULL;
+	if (head == NULL)
+		return PyList_New(0);
+	running = gs_thread_current(dict);
+	count = gs_live_greenstacks(head, &found);
+	if (count < 0)
+		return NULL;
+	result = PyList_New(0);
+	for (i = 0; i < count; i++) {
+		if (result != NULL && (want == 0 || (want == 1) == (found[i] == running)) &&
+		    PyList_Append(result, (PyObject*) found[i]) < 0)
+			Py_CLEAR(result);
+		Py_DECREF(found[i]);
+	}
+	PyMem_Free(found);
+	return result;
+}
+
+/***********************************************************/
+/* CPU accounting */
+
+unsigned int gs_cpu_sample;
+unsigned int gs_cpu_countdown;
+
+static PY_UINT32_T cpu_random = 2463534242U;
+
+unsigned int gs_cpu_next_sample(void)
+{
+	/* xorshift, for gaps evenly spread from 1 to 2 * gs_cpu_sample - 1 */
+	cpu_random ^= cpu_random << 13;
+	cpu_random ^= cpu_random >> 17;
+	cpu_random ^= cpu_random << 5;
+	if (gs_cpu_sample <= 1)
+		return 1;
+	return 1 + cpu_random % (2 * gs_cpu_sample - 1);
+}
+
+PY_UINT64_T gs_cpu_now(void)
+{
+	struct timespec ts;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (PY_UINT64_T) ts.tv_sec * 1000000000 + (PY_UINT64_T) ts.tv_nsec;
+}
+
+PyDoc_STRVAR(mod_set_cpu_accounting_doc,
+"set_cpu_accounting(every) -> int\n"
+"\n"
+"Time one switch in every for the cpu_time of greenstacks, or none if\n"
+"every is 0, and return the previous setting.  Timing every switch is\n"
+"exact but makes switching several times slower; timing one in 16 or so\n"
+"is cheap and accurate over more than a few hundred switches.\n");
+
+static PyObject* mod_set_cpu_accounting(PyObject* self, PyObject* args)
+{
+	long every;
+	unsigned int old;
+
+	if (!PyArg_ParseTuple(args, "l:set_cpu_accounting", &every))
+		return NULL;
+	if (every < 0 || every > 0xffff) {
+		PyErr_SetString(PyExc_ValueError, "every must be between 0 and 65535");
+		return NULL;
+	}
+	old = gs_cpu_sample;
+	gs_cpu_sample = (unsigned int) every;
+	gs_cpu_countdown = gs_cpu_next_sample();
+	return PyLong_FromUnsignedLong(old);
+}
+
+static int cpu_compare(const void* a, const void* b)
+{
+	PY_UINT64_T x = (*(PyGreenstack* const*) a)->cpu_time;
+	PY_UINT64_T y = (*(PyGreenstack* const*) b)->cpu_time;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+PyDoc_STRVAR(mod_top_cpu_doc,
+"top_cpu(n=10) -> list\n"
+"\n"
+"Return the n live greenstacks of the current thread that used the most\n"
+"CPU time, as (cpu_time, greenstack) pairs with the largest first.\n");
+
+static PyObject* mod_top_cpu(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	Py_ssize_t n = 10, count, i;
+	PyObject* result;
+	PyObject* item;
+	PyGreenstack** found;
+	static char* kwlist[] = {"n", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n:top_cpu", kwlist, &n))
+		return NULL;
+	if (!STATE_OK)
+		return NULL;
+	count = gs_live_greenstacks(ts_live, &found);
+	if (count < 0)
+		return NULL;
+	qsort(found, count, sizeof(PyGreenstack*), cpu_compare);
+	for (i = 0; i < count && found[i]->cpu_time != 0; i++)
+		;
+	if (n > i)
+		n = i;
+	if (n < 0)
+		n = 0;
+	result = PyList_New(n);
+	for (i = 0; result != NULL && i < n; i++) {
+		item = Py_BuildValue("(dO)", found[i]->cpu_time / 1e9, found[i]);
+		if (item == NULL)
+			Py_CLEAR(result);
+		else
+			PyList_SET_ITEM(result, i, item);
+	}
+	for (i = 0; i < count; i++)
+		Py_DECREF(found[i]);
+	PyMem_Free(found);
+	return result;
+}
+
+/***********************************************************/
+/* Switch timing */
+
+#if GREENSTACK_USE_SWITCH_TIMING
+
+/* The clock and the monotonic time in nanoseconds when the module was
+ * loaded, to work out the rate of the clock from */
+static PY_UINT64_T timing_ticks0, timing_ns0;
+
+static PY_UINT64_T monotonic_ns(void)
+{
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (PY_UINT64_T) ts.tv_sec * 1000000000 + (PY_UINT64_T) ts.tv_nsec;
+}
+
+PY_UINT64_T gs_timing_now(void)
+{
+#ifdef TIMING_TSC
+	unsigned int lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((PY_UINT64_T) hi << 32) | lo;
+#else
+	return monotonic_ns();
+#endif
+}
+
+static int timing_bucket(PY_UINT64_T ticks)
+{
+	int e;
+	if (ticks < 4)
+		return (int) ticks;
+#ifdef __GNUC__
+	e = 63 - __builtin_clzll((unsigned long long) ticks);
+#else
+	for (e = 2; (ticks >> (e + 1)) != 0; e++)
+		;
+#endif
+	return 4 * (e - 1) + (int) ((ticks >> (e - 2)) & 3);
+}
+
+/* The largest number of ticks that falls in bucket i */
+static PY_UINT64_T timing_bucket_max(int i)
+{
+	int e;
+	if (i < 4)
+		return (PY_UINT64_T) i;
+	e = i / 4 + 1;
+	return ((PY_UINT64_T) (4 + i % 4) << (e - 2)) + ((PY_UINT64_T) 1 << (e - 2)) - 1;
+}
+
+void gs_timing_record(gs_histogram* h, PY_UINT64_T ticks)
+{
+	h->count++;
+	h->total += ticks;
+	if (ticks > h->max)
+		h->max = ticks;
+	h->buckets[timing_bucket(ticks)]++;
+}
+
+/* Nanoseconds per tick of gs_timing_now() */
+static double timing_scale(void)
+{
+#ifdef TIMING_TSC
+	PY_UINT64_T ticks = gs_timing_now() - timing_ticks0;
+	PY_UINT64_T ns = monotonic_ns() - timing_ns0;
+	if (ticks == 0 || ns == 0)
+		return 1.0;
+	return (double) ns / (double) ticks;
+#else
+	return 1.0;
+#endif
+}
+
+/* Returns the tick count under which a fraction q of h falls */
+static PY_UINT64_T timing_percentile(gs_histogram* h, double q)
+{
+	PY_UINT64_T seen = 0, want;
+	int i;
+	want = (PY_UINT64_T) (q * (double) h->count);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < GS_TIMING_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want)
+			return timing_bucket_max(i) < h->max ? timing_bucket_max(i) : h->max;
+	}
+	return h->max;
+}
+
+static PyObject* timing_dict(gs_histogram* h, double scale)
+{
+	PyObject* result;
+	PyObject* buckets;
+	PyObject* item;
+	int i;
+
+	buckets = PyList_New(0);
+	if (buckets == NULL)
+		return NULL;
+	for (i = 0; i < GS_TIMING_BUCKETS; i++) {
+		if (h->buckets[i] == 0)
+			continue;
+		item = Py_BuildValue("(dK)", (double) timing_bucket_max(i) * scale,
+		                     (unsigned PY_LONG_LONG) h->buckets[i]);
+		if (item == NULL || PyList_Append(buckets, item) < 0) {
+			Py_XDECREF(item);
+			Py_DECREF(buckets);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+	result = Py_BuildValue("{sKsdsdsdsdsdsdsN}",
+		"count", (unsigned PY_LONG_LONG) h->count,
+		"mean_ns", h->count ? (double) h->total * scale / (double) h->count : 0.0,
+		"max_ns", (double) h->max * scale,
+		"p50_ns", (double) timing_percentile(h, 0.5) * scale,
+		"p90_ns", (double) timing_percentile(h, 0.9) * scale,
+		"p99_ns", (double) timing_percentile(h, 0.99) * scale,
+		"p999_ns", (double) timing_percentile(h, 0.999) * scale,
+		"buckets", buckets);
+	return result;
+}
+
+PyDoc_STRVAR(mod_switch_timing_doc,
+"switch_timing(reset=False) -> dict\n"
+"\n"
+"Return the latency histograms of the current thread, under the keys\n"
+"'switch', 'create' and 'teardown'.  Each is a dict with the count, the\n"
+"mean, maximum and 50th, 90th, 99th and 99.9th percentiles in\n"
+"nanoseconds, and the non-empty buckets as (upper bound, count) pairs.\n"
+"If reset is true, the histograms are cleared after reading.\n");
+
+static PyObject* mod_switch_timing(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* names[GS_TIMING_KINDS] = {"switch", "create", "teardown"};
+	PyObject* reset = Py_False;
+	PyObject* result;
+	PyObject* item;
+	double scale;
+	int i, clear;
+	static char* kwlist[] = {"reset", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:switch_timing", kwlist, &reset))
+		return NULL;
+	clear = PyObject_IsTrue(reset);
+	if (clear < 0 || !STATE_OK)
+		return NULL;
+	scale = timing_scale();
+	result = PyDict_New();
+	if (result == NULL)
+		return NULL;
+	for (i = 0; i < GS_TIMING_KINDS; i++) {
+		item = timing_dict(&ts_timing[i], scale);
+		if (item == NULL || PyDict_SetItemString(result, names[i], item) < 0) {
+			Py_XDECREF(item);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+	if (clear)
+		memset(ts_timing, 0, GS_TIMING_KINDS * sizeof(gs_histogram));
+	return result;
+}
+
+#endif /* GREENSTACK_USE_SWITCH_TIMING */
+
+static PyMethodDef stats_functions[] = {
+	{"stats", (PyCFunction)mod_stats, METH_VARARGS | METH_KEYWORDS, mod_stats_doc},
+	{"enumerate", (PyCFunction)mod_enumerate,
+	 METH_VARARGS | METH_KEYWORDS, mod_enumerate_doc},
+	{"set_cpu_accounting", (PyCFunction)mod_set_cpu_accounting,
+	 METH_VARARGS, mod_set_cpu_accounting_doc},
+	{"top_cpu", (PyCFunction)mod_top_cpu,
+	 METH_VARARGS | METH_KEYWORDS, mod_top_cpu_doc},
+#if GREENSTACK_USE_SWITCH_TIMING
+	{"switch_timing", (PyCFunction)mod_switch_timing,
+	 METH_VARARGS | METH_KEYWORDS, mod_switch_timing_doc},
+#endif
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_stats_init(PyObject* m)
+{
+	if (PyType_Ready(&GSThreadStats_Type) < 0)
+		return -1;
+	ts_statskey = GS_InternFromString("__greenstack_ts_statskey");
+	if (ts_statskey == NULL)
+		return -1;
+	gs_stats_attach(ts_current->run_info);
+#if GREENSTACK_USE_SWITCH_TIMING
+	timing_ticks0 = gs_timing_now();
+	timing_ns0 = monotonic_ns();
+#endif
+	return _greenstack_add_functions(m, stats_functions);
+}
@@ -0,0 +1,426 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Running blocking calls on other threads, run_in_thread(), and waking
+   greenstacks from other threads, wake_threadsafe().
+
+   The calling greenstack is parked while a pool of native worker threads
+   runs the function, so the other greenstacks of its thread keep running.
+   Workers are started as needed, up to a limit, and park on a lock of
+   their own while there is nothing to do.  The function runs with the GIL
+   held, like any Python code, so the thread only runs in parallel while
+   the function is in C code that releases the GIL, which blocking calls
+   into the standard library and most extensions do.
+
+   A finished job goes into the inbox of the scheduler it came from, and
+   so does a wakeup sent from another thread, as a job with nothing to run.
+   The inbox is a lock-free stack: whoever pushes onto an empty one writes
+   to the scheduler's eventfd, which wakes it out of epoll_wait(), and the
+   scheduler takes the whole stack at once the next time it polls.  The
+   eventfd is set up by the thread of the scheduler before it first blocks,
+   and a greenstack parked with park(threadsafe=True) keeps it blocked
+   there until the wakeup arrives.  The pool itself is only touched with
+   the GIL held, which is all the locking it needs.
+
+   A greenstack that stops waiting for its job, because of a Timeout or
+   throw(), cancels it.  A worker skips a cancelled job it has not started,
+   and a job that was already running has its result dropped.
+*/
+
+#include "greenstack_private.h"
+#include "pythread.h"
+
+/* Where the result of a job goes, on the C stack of the waiting greenstack */
+typedef struct {
+	int done;
+	PyObject* result;
+	PyObject* exc_type;
+	PyObject* exc_value;
+	PyObject* exc_tb;
+} job_wait;
+
+typedef struct _gs_job {
+	struct _gs_job* next;
+	PyObject* func;
+	PyObject* args;
+	PyObject* kwargs;
+	PyObject* result;
+	PyObject* exc_type;
+	PyObject* exc_value;
+	PyObject* exc_tb;
+	PyGreenstack* g;
+	GSScheduler* sched;
+	job_wait* wait;         /* NULL once cancelled */
+	int kind;
+} gs_job;
+
+#define JOB_CALL 0              /* run func, and resume g with the result */
+#define JOB_WAKE 1              /* resume g with result */
+
+typedef struct _pool_worker {
+	struct _pool_worker* next;
+	PyThread_type_lock wake;  /* held while the worker has nothing to do */
+} pool_worker;
+
+#define POOL_DEFAULT_THREADS 8
+
+/* Protected by the GIL */
+static struct {
+	gs_job* head;           /* jobs waiting for a worker */
+	gs_job* tail;
+	pool_worker* idle;      /* workers waiting for a job */
+	int threads;
+	int max_threads;
+} pool = {NULL, NULL, NULL, 0, POOL_DEFAULT_THREADS};
+
+static void job_free(gs_job* job)
+{
+	Py_XDECREF(job->func);
+	Py_XDECREF(job->args);
+	Py_XDECREF(job->kwargs);
+	Py_XDECREF(job->result);
+	Py_XDECREF(job->exc_type);
+	Py_XDECREF(job->exc_value);
+	Py_XDECREF(job->exc_tb);
+	Py_XDECREF(job->g);
+	Py_XDECREF(job->sched);
+	PyMem_Free(job);
+}
+
+/* Pushes a job onto the inbox of its scheduler, from any thread */
+static void inbox_push(gs_job* job)
+{
+	GSScheduler* s = job->sched;
+	gs_job* head;
+#ifdef __GNUC__
+	head = __atomic_load_n(&s->inbox.head, __ATOMIC_RELAXED);
+	do {
+		job->next = head;
+	} while (!__atomic_compare_exchange_n(&s->inbox.head, &head, job, 1,
+	                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+#else
+	/* without atomics, pushing needs the GIL */
+	head = s->inbox.head;
+	job->next = head;
+	s->inbox.head = job;
+#endif
+	/* the scheduler has already been told about a nonempty inbox */
+	if (head == NULL)
+		gs_io_wake(&s->io);
+}
+
+static gs_job* inbox_take(GSScheduler* s)
+{
+#ifdef __GNUC__
+	return __atomic_exchange_n(&s->inbox.head, NULL, __ATOMIC_ACQUIRE);
+#else
+	gs_job* head = s->inbox.head;
+	s->inbox.head = NULL;
+	return head;
+#endif
+}
+
+/* Runs a job on a worker and hands it back to its scheduler */
+static void job_run(gs_job* job)
+{
+	job->result = PyObject_Call(job->func, job->args, job->kwargs);
+	if (job->result == NULL)
+		PyErr_Fetch(&job->exc_type, &job->exc_value, &job->exc_tb);
+	Py_CLEAR(job->func);
+	Py_CLEAR(job->args);
+	Py_CLEAR(job->kwargs);
+	inbox_push(job);
+}
+
+static void pool_worker_main(void* arg)
+{
+	pool_worker* w = (pool_worker*) arg;
+	PyThreadState* ts;
+	gs_job* job;
+
+	PyGILState_Ensure();
+	for (;;) {
+		job = pool.head;
+		if (job != NULL) {
+			pool.head = job->next;
+			if (pool.head == NULL)
+				pool.tail = NULL;
+			if (job->wait == NULL) {
+				/* nobody is waiting for it any more */
+				job_free(job);
+				continue;
+			}
+			job_run(job);
+			continue;
+		}
+		w->next = pool.idle;
+		pool.idle = w;
+		ts = PyEval_SaveThread();
+		PyThread_acquire_lock(w->wake, WAIT_LOCK);
+		PyEval_RestoreThread(ts);
+	}
+}
+
+static int pool_start_worker(void)
+{
+	pool_worker* w = PyMem_New(pool_worker, 1);
+	if (w == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	w->wake = PyThread_allocate_lock();
+	if (w->wake == NULL) {
+		PyMem_Free(w);
+		PyErr_NoMemory();
+		return -1;
+	}
+	PyThread_acquire_lock(w->wake, WAIT_LOCK);
+	PyEval_InitThreads();
+	if ((unsigned long) PyThread_start_new_thread(pool_worker_main, w)
+	    == (unsigned long) -1) {
+		PyThread_free_lock(w->wake);
+		PyMem_Free(w);
+		PyErr_SetString(PyExc_RuntimeError, "can't start new thread");
+		return -1;
+	}
+	pool.threads++;
+	return 0;
+}
+
+static int pool_submit(gs_job* job)
+{
+	pool_worker* w;
+	if (pool.idle == NULL && pool.threads < pool.max_threads) {
+		/* without a worker at all the job would never run */
+		if (pool_start_worker() < 0 && pool.threads == 0)
+			return -1;
+		PyErr_Clear();
+	}
+	job->next = NULL;
+	if (pool.tail != NULL)
+		pool.tail->next = job;
+	else
+		pool.head = job;
+	pool.tail = job;
+	w = pool.idle;
+	if (w != NULL) {
+		pool.idle = w->next;
+		PyThread_release_lock(w->wake);
+	}
+	return 0;
+}
+
+/***********************************************************/
+/* Interface for other modules */
+
+int gs_inbox_pending(GSScheduler* s)
+{
+#ifdef __GNUC__
+	return __atomic_load_n(&s->inbox.head, __ATOMIC_SEQ_CST) != NULL;
+#else
+	return s->inbox.head != NULL;
+#endif
+}
+
+int gs_inbox_drain(GSScheduler* s)
+{
+	gs_job* job = inbox_take(s);
+	gs_job* prev = NULL;
+	gs_job* next;
+	int err = 0;
+
+	/* newest first, so reverse it */
+	for (; job != NULL; job = next) {
+		next = job->next;
+		job->next = prev;
+		prev = job;
+	}
+	for (job = prev; job != NULL; job = next) {
+		next = job->next;
+		if (job->kind == JOB_WAKE) {
+			if (gs_sched_wake(s, job->g, job->result, GS_ENTRY_RESUME) < 0)
+				err = -1;
+			job_free(job);
+			continue;
+		}
+		if (job->wait != NULL) {
+			job_wait* wait = job->wait;
+			s->io.remote--;
+			wait->done = 1;
+			wait->result = job->result;
+			wait->exc_type = job->exc_type;
+			wait->exc_value = job->exc_value;
+			wait->exc_tb = job->exc_tb;
+			job->result = job->exc_type = job->exc_value = job->exc_tb = NULL;
+			if (gs_sched_wake(s, job->g, Py_None, GS_ENTRY_RESUME) < 0)
+				err = -1;
+		}
+		job_free(job);
+	}
+	return err;
+}
+
+/***********************************************************/
+/* Module functions */
+
+PyDoc_STRVAR(mod_run_in_thread_doc,
+"run_in_thread(func, *args, **kwargs) -> result\n"
+"\n"
+"Call func(*args, **kwargs) on a worker thread and return its result,\n"
+"or raise its exception.  Only the current greenstack waits for it; the\n"
+"scheduler runs the others meanwhile.  If the caller stops waiting, the\n"
+"job is skipped unless it already started.\n");
+
+static PyObject* mod_run_in_thread(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	GSScheduler* s;
+	gs_job* job;
+	job_wait wait;
+	PyObject* r;
+
+	if (PyTuple_GET_SIZE(args) < 1) {
+		PyErr_SetString(PyExc_TypeError,
+		                "run_in_thread() takes at least 1 argument");
+		return NULL;
+	}
+	s = gs_sched_current();
+	if (s == NULL)
+		return NULL;
+	if (gs_io_wake_init(s) < 0) {
+		Py_DECREF(s);
+		return NULL;
+	}
+	job = PyMem_New(gs_job, 1);
+	if (job == NULL) {
+		Py_DECREF(s);
+		return PyErr_NoMemory();
+	}
+	memset(job, 0, sizeof(gs_job));
+	job->args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+	if (job->args == NULL) {
+		job_free(job);
+		Py_DECREF(s);
+		return NULL;
+	}
+	job->func = PyTuple_GET_ITEM(args, 0);
+	Py_INCREF(job->func);
+	job->kwargs = kwargs;
+	Py_XINCREF(kwargs);
+	job->g = ts_current;
+	Py_INCREF(job->g);
+	job->sched = s;
+	Py_INCREF(s);
+	memset(&wait, 0, sizeof(wait));
+	job->wait = &wait;
+	if (pool_submit(job) < 0) {
+		job_free(job);
+		Py_DECREF(s);
+		return NULL;
+	}
+	s->io.remote++;
+
+	for (;;) {
+		r = gs_sched_park(s);
+		if (r == NULL || wait.done)
+			break;
+		/* woken by someone else; keep waiting */
+		Py_DECREF(r);
+	}
+	if (!wait.done) {
+		/* cancel it: a worker skips it, or drops its result if it is
+		 * already running */
+		job->wait = NULL;
+		s->io.remote--;
+	}
+	Py_DECREF(s);
+	if (r == NULL) {
+		Py_XDECREF(wait.result);
+		Py_XDECREF(wait.exc_type);
+		Py_XDECREF(wait.exc_value);
+		Py_XDECREF(wait.exc_tb);
+		return NULL;
+	}
+	Py_DECREF(r);
+	if (wait.result == NULL)
+		PyErr_Restore(wait.exc_type, wait.exc_value, wait.exc_tb);
+	return wait.result;
+}
+
+PyDoc_STRVAR(mod_wake_threadsafe_doc,
+"wake_threadsafe(g, value=None)\n"
+"\n"
+"Wake g so that it resumes with value, from any thread.  g is either a\n"
+"spawned greenstack or one parked in the scheduler its thread is running,\n"
+"such as the main greenstack.  When called from another thread than g's,\n"
+"the wakeup is queued for that scheduler, which picks it up the next time\n"
+"it polls; see Scheduler.park(threadsafe=True).\n");
+
+static PyObject* mod_wake_threadsafe(PyObject* self, PyObject* args)
+{
+	PyGreenstack* g;
+	PyObject* value = Py_None;
+	GSScheduler* s;
+	gs_job* job;
+
+	if (!PyArg_ParseTuple(args, "O!|O:wake_threadsafe",
+	                      &PyGreenstack_Type, &g, &value))
+		return NULL;
+	if (!STATE_OK)
+		return NULL;
+	s = (GSScheduler*) g->sched;
+	if (s == NULL && PyGreenstack_ACTIVE(g))
+		s = gs_sched_of_thread(g->run_info);
+	if (s == NULL) {
+		PyErr_SetString(PyExc_ValueError,
+		                "greenstack does not belong to a scheduler");
+		return NULL;
+	}
+	if (s->run_info == ts_current->run_info) {
+		if (gs_sched_wake(s, g, value, GS_ENTRY_RESUME) < 0)
+			return NULL;
+		Py_RETURN_NONE;
+	}
+	job = PyMem_New(gs_job, 1);
+	if (job == NULL)
+		return PyErr_NoMemory();
+	memset(job, 0, sizeof(gs_job));
+	job->kind = JOB_WAKE;
+	job->g = g;
+	Py_INCREF(g);
+	job->result = value;
+	Py_INCREF(value);
+	job->sched = s;
+	Py_INCREF(s);
+	inbox_push(job);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_set_thread_pool_size_doc,
+"set_thread_pool_size(n) -> int\n"
+"\n"
+"Set the most worker threads run_in_thread() uses at once, and return\n"
+"the previous limit.  Workers already started are kept.\n");
+
+static PyObject* mod_set_thread_pool_size(PyObject* self, PyObject* args)
+{
+	int n, prev = pool.max_threads;
+	if (!PyArg_ParseTuple(args, "i:set_thread_pool_size", &n))
+		return NULL;
+	if (n < 1) {
+		PyErr_SetString(PyExc_ValueError, "the pool needs at least one thread");
+		return NULL;
+	}
+	pool.max_threads = n;
+	return PyLong_FromLong(prev);
+}
+
+static PyMethodDef thread_functions[] = {
+	{"run_in_thread", (PyCFunction)mod_run_in_thread, METH_VARARGS | METH_KEYWORDS, mod_run_in_thread_doc},
+	{"wake_threadsafe", (PyCFunction)mod_wake_threadsafe, METH_VARARGS, mod_wake_threadsafe_doc},
+	{"set_thread_pool_size", (PyCFunction)mod_set_thread_pool_size, METH_VARARGS, mod_set_thread_pool_size_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_thread_init(PyObject* m)
+{
+	return _greenstack_add_functions(m, thread_functions);
+}
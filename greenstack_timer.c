@@ -0,0 +1,650 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Timers for the scheduler: sleep() and Timeout.
+
+   Timers are kept in a hierarchical timing wheel, so arming and cancelling
+   one is O(1) no matter how many are armed.  A timer is embedded in
+   whatever needs it (the C stack of a sleeping greenstack, a Timeout
+   object), so arming one does not allocate either.
+
+   The wheel only advances when the scheduler polls it, at which point
+   every timer that has expired is moved to a batch and the batch is
+   pushed onto the ready queue in one go.
+
+   A wheel can also run on a virtual clock, which stands still until the
+   scheduler has nothing left to do but wait for a timer, and then jumps
+   straight to it.
+*/
+
+#include "greenstack_private.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+#endif
+
+PY_UINT64_T gs_clock_ns(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (PY_UINT64_T) ((double) now.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (PY_UINT64_T) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+PY_UINT64_T gs_coarse_clock_ns(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (PY_UINT64_T) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return gs_clock_ns();
+#endif
+}
+
+/***********************************************************/
+/* Timing wheel */
+
+#define SLOT_MASK   (GS_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * GS_WHEEL_BITS)
+#define WHEEL_RANGE ((PY_UINT64_T) 1 << LEVEL_SHIFT(GS_WHEEL_LEVELS))
+#define BIT(i)      ((PY_UINT64_T) 1 << (i))
+
+static int lowest_bit(PY_UINT64_T x)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(x);
+#else
+	int i = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+/* Distance from slot idx to the next occupied slot after it, going round
+ * the wheel, or 0 if there is none.  Slot idx itself counts as a full turn
+ * away because its current turn has already been processed. */
+static int next_slot(PY_UINT64_T bits, int idx)
+{
+	PY_UINT64_T above;
+	if (bits == 0)
+		return 0;
+	above = idx == SLOT_MASK ? 0 : bits >> (idx + 1);
+	if (above)
+		return lowest_bit(above) + 1;
+	return lowest_bit(bits) + GS_WHEEL_SLOTS - idx;
+}
+
+/* Moves all of from to the end of to */
+static void list_splice(gs_link* from, gs_link* to)
+{
+	if (GS_LIST_EMPTY(from))
+		return;
+	from->next->prev = to->prev;
+	to->prev->next = from->next;
+	from->prev->next = to;
+	to->prev = from->prev;
+	GS_LIST_INIT(from);
+}
+
+void gs_wheel_init(gs_wheel* w)
+{
+	int level, slot;
+	for (level = 0; level < GS_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < GS_WHEEL_SLOTS; slot++)
+			GS_LIST_INIT(&w->slots[level][slot]);
+		w->occupied[level] = 0;
+	}
+	GS_LIST_INIT(&w->due);
+	w->now = gs_clock_ns() / GS_TICK_NS;
+	w->count = 0;
+	w->virtual_time = 0;
+	w->vclock = 0;
+}
+
+void gs_wheel_set_virtual(gs_wheel* w)
+{
+	w->virtual_time = 1;
+	w->vclock = 0;
+	w->now = 0;
+}
+
+#define WHEEL_NOW(w) ((w)->virtual_time ? (w)->vclock : gs_clock_ns())
+
+static void wheel_insert(gs_wheel* w, gs_timer* t)
+{
+	PY_UINT64_T when = t->deadline;
+	int level, slot;
+
+	if (when <= w->now) {
+		gs_list_append(&w->due, &t->link);
+		t->slot = GS_TIMER_DUE;
+		return;
+	}
+	for (level = 0; level < GS_WHEEL_LEVELS; level++) {
+		if (when - w->now < ((PY_UINT64_T) 1 << LEVEL_SHIFT(level + 1)))
+			break;
+	}
+	if (level == GS_WHEEL_LEVELS) {
+		/* too far out: park it in the last slot and reinsert it from there */
+		level = GS_WHEEL_LEVELS - 1;
+		when = w->now + WHEEL_RANGE - 1;
+	}
+	slot = (int) ((when >> LEVEL_SHIFT(level)) & SLOT_MASK);
+	gs_list_append(&w->slots[level][slot], &t->link);
+	w->occupied[level] |= BIT(slot);
+	t->slot = level * GS_WHEEL_SLOTS + slot;
+}
+
+static void wheel_remove(gs_wheel* w, gs_timer* t)
+{
+	gs_list_remove(&t->link);
+	if (t->slot >= 0) {
+		int level = t->slot / GS_WHEEL_SLOTS;
+		int slot = t->slot % GS_WHEEL_SLOTS;
+		if (GS_LIST_EMPTY(&w->slots[level][slot]))
+			w->occupied[level] &= ~BIT(slot);
+	}
+	t->slot = GS_TIMER_IDLE;
+}
+
+/* The earliest tick at which something in the wheel has to be done: a
+ * level 0 slot expiring or a higher slot being spread out below. */
+static PY_UINT64_T wheel_next_tick(gs_wheel* w)
+{
+	PY_UINT64_T best = 0;
+	int level;
+	for (level = 0; level < GS_WHEEL_LEVELS; level++) {
+		PY_UINT64_T base = w->now >> LEVEL_SHIFT(level);
+		int dist = next_slot(w->occupied[level], (int) (base & SLOT_MASK));
+		PY_UINT64_T tick;
+		if (dist == 0)
+			continue;
+		tick = (base + dist) << LEVEL_SHIFT(level);
+		if (best == 0 || tick < best)
+			best = tick;
+	}
+	return best;
+}
+
+/* Spreads out the higher level slots that start at the current tick */
+static void wheel_cascade(gs_wheel* w)
+{
+	int level;
+	for (level = 1; level < GS_WHEEL_LEVELS; level++) {
+		int slot = (int) ((w->now >> LEVEL_SHIFT(level)) & SLOT_MASK);
+		gs_link list;
+		GS_LIST_INIT(&list);
+		list_splice(&w->slots[level][slot], &list);
+		w->occupied[level] &= ~BIT(slot);
+		while (!GS_LIST_EMPTY(&list)) {
+			gs_timer* t = (gs_timer*) list.next;
+			gs_list_remove(&t->link);
+			wheel_insert(w, t);
+		}
+		if (slot != 0)
+			break;
+	}
+}
+
+/* Moves every timer due by tick `to` into batch */
+static void wheel_advance(gs_wheel* w, PY_UINT64_T to, gs_link* batch)
+{
+	gs_link* l;
+	while (w->count > 0) {
+		PY_UINT64_T tick = wheel_next_tick(w);
+		int slot;
+		if (tick == 0 || tick > to)
+			break;
+		w->now = tick;
+		if ((tick & SLOT_MASK) == 0)
+			wheel_cascade(w);
+		slot = (int) (tick & SLOT_MASK);
+		list_splice(&w->slots[0][slot], &w->due);
+		w->occupied[0] &= ~BIT(slot);
+	}
+	if (to > w->now)
+		w->now = to;
+	for (l = w->due.next; l != &w->due; l = l->next)
+		((gs_timer*) l)->slot = GS_TIMER_DUE;
+	list_splice(&w->due, batch);
+}
+
+void gs_wheel_clear(gs_wheel* w)
+{
+	int level, slot;
+	gs_link all;
+	GS_LIST_INIT(&all);
+	for (level = 0; level < GS_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < GS_WHEEL_SLOTS; slot++)
+			list_splice(&w->slots[level][slot], &all);
+		w->occupied[level] = 0;
+	}
+	list_splice(&w->due, &all);
+	w->count = 0;
+	while (!GS_LIST_EMPTY(&all)) {
+		gs_timer* t = (gs_timer*) all.next;
+		gs_list_remove(&t->link);
+		t->slot = GS_TIMER_IDLE;
+		Py_CLEAR(t->g);
+		Py_CLEAR(t->value);
+	}
+}
+
+/***********************************************************/
+/* Timers */
+
+void gs_timer_init(gs_timer* t)
+{
+	GS_LIST_INIT(&t->link);
+	t->deadline = 0;
+	t->slot = GS_TIMER_IDLE;
+	t->g = NULL;
+	t->value = NULL;
+	t->kind = GS_ENTRY_RESUME;
+	t->fire = NULL;
+}
+
+void gs_timer_arm(GSScheduler* s, gs_timer* t, double seconds,
+                  PyGreenstack* g, PyObject* value, int kind)
+{
+	gs_wheel* w = &s->timers;
+	PY_UINT64_T now = WHEEL_NOW(w);
+	double ns = seconds * 1e9;
+
+	if (GS_TIMER_ARMED(t))
+		gs_timer_cancel(s, t);
+	if (!(ns > 0))
+		ns = 0;
+	else if (ns > (double) WHEEL_RANGE * GS_TICK_NS * GS_WHEEL_SLOTS)
+		ns = (double) WHEEL_RANGE * GS_TICK_NS * GS_WHEEL_SLOTS;
+	if (w->count == 0)
+		w->now = now / GS_TICK_NS;
+	/* round up so that a timer never fires early */
+	t->deadline = (now + (PY_UINT64_T) ns + GS_TICK_NS - 1) / GS_TICK_NS;
+	Py_INCREF(g);
+	Py_XINCREF(value);
+	t->g = g;
+	t->value = value;
+	t->kind = kind;
+	wheel_insert(w, t);
+	w->count++;
+}
+
+void gs_timer_cancel(GSScheduler* s, gs_timer* t)
+{
+	PyGreenstack* g = t->g;
+	PyObject* value = t->value;
+	if (!GS_TIMER_ARMED(t))
+		return;
+	wheel_remove(&s->timers, t);
+	s->timers.count--;
+	t->g = NULL;
+	t->value = NULL;
+	Py_XDECREF(g);
+	Py_XDECREF(value);
+}
+
+long gs_timers_timeout(GSScheduler* s)
+{
+	gs_wheel* w = &s->timers;
+	PY_UINT64_T next, now;
+	if (w->count == 0)
+		return -1;
+	if (!GS_LIST_EMPTY(&w->due))
+		return 0;
+	next = wheel_next_tick(w) * GS_TICK_NS;
+	now = WHEEL_NOW(w);
+	if (next <= now)
+		return 0;
+	return (long) ((next - now + 999999) / 1000000);
+}
+
+PY_UINT64_T gs_timers_now(GSScheduler* s)
+{
+	return WHEEL_NOW(&s->timers);
+}
+
+void gs_timers_jump(GSScheduler* s)
+{
+	gs_wheel* w = &s->timers;
+	PY_UINT64_T next;
+	if (w->count == 0 || !GS_LIST_EMPTY(&w->due))
+		return;
+	next = wheel_next_tick(w) * GS_TICK_NS;
+	if (next > w->vclock)
+		w->vclock = next;
+}
+
+int gs_timers_expire(GSScheduler* s)
+{
+	gs_wheel* w = &s->timers;
+	gs_link batch;
+	int err = 0;
+
+	if (w->count == 0)
+		return 0;
+	GS_LIST_INIT(&batch);
+	wheel_advance(w, WHEEL_NOW(w) / GS_TICK_NS, &batch);
+	while (!GS_LIST_EMPTY(&batch)) {
+		gs_timer* t = (gs_timer*) batch.next;
+		PyGreenstack* g = t->g;
+		PyObject* value = t->value;
+		if (err < 0) {
+			/* leave the rest for next time */
+			list_splice(&batch, &w->due);
+			break;
+		}
+		gs_list_remove(&t->link);
+		t->slot = GS_TIMER_IDLE;
+		t->g = NULL;
+		t->value = NULL;
+		w->count--;
+		if (t->fire != NULL)
+			err = t->fire(s, t, g);
+		else
+			err = gs_sched_wake(s, g, value, t->kind);
+		if (err < 0 && !GS_TIMER_ARMED(t)) {
+			gs_list_append(&w->due, &t->link);
+			t->slot = GS_TIMER_DUE;
+			t->g = g;
+			t->value = value;
+			w->count++;
+			continue;
+		}
+		Py_DECREF(g);
+		Py_XDECREF(value);
+	}
+	return err < 0 ? -1 : 0;
+}
+
+int gs_timers_sleep(long ms)
+{
+#ifdef _WIN32
+	Py_BEGIN_ALLOW_THREADS
+	Sleep((DWORD) ms);
+	Py_END_ALLOW_THREADS
+	return 0;
+#else
+	struct timeval tv;
+	int err;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	Py_BEGIN_ALLOW_THREADS
+	err = select(0, NULL, NULL, NULL, &tv);
+	Py_END_ALLOW_THREADS
+	if (err < 0 && errno == EINTR)
+		return PyErr_CheckSignals();
+	return 0;
+#endif
+}
+
+/***********************************************************/
+/* Timeout */
+
+typedef struct {
+	PyBaseExceptionObject base;
+	gs_timer timer;
+	GSScheduler* sched;
+	double seconds;         /* negative if never */
+} GSTimeout;
+
+#define TIMEOUT_OF(t) ((GSTimeout*) ((char*) (t) - offsetof(GSTimeout, timer)))
+
+static PyTypeObject GSTimeout_Type;
+
+/* A greenstack that is ready, for instance because it keeps yielding, has
+ * its entry turned into the throw */
+static int timeout_fire(GSScheduler* s, gs_timer* t, PyGreenstack* g)
+{
+	return gs_sched_throw(s, g, (PyObject*) TIMEOUT_OF(t)) < 0 ? -1 : 0;
+}
+
+static void timeout_cancel_timer(GSTimeout* self)
+{
+	if (GS_TIMER_ARMED(&self->timer))
+		gs_timer_cancel(self->sched, &self->timer);
+	Py_CLEAR(self->sched);
+}
+
+static int timeout_init(GSTimeout* self, PyObject* args, PyObject* kwargs)
+{
+	PyObject* seconds = Py_None;
+	static char* kwlist[] = {"seconds", 0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:Timeout", kwlist, &seconds))
+		return -1;
+	if (seconds == Py_None) {
+		self->seconds = -1;
+	} else {
+		self->seconds = PyFloat_AsDouble(seconds);
+		if (self->seconds == -1 && PyErr_Occurred())
+			return -1;
+		if (self->seconds < 0)
+			self->seconds = 0;
+	}
+	gs_timer_init(&self->timer);
+	self->timer.fire = timeout_fire;
+	return ((PyTypeObject*) PyExc_BaseException)->tp_init((PyObject*) self, args, NULL);
+}
+
+static int timeout_traverse(GSTimeout* self, visitproc visit, void* arg)
+{
+	Py_VISIT((PyObject*) self->sched);
+	Py_VISIT((PyObject*) self->timer.g);
+	Py_VISIT(self->timer.value);
+	return ((PyTypeObject*) PyExc_BaseException)->tp_traverse((PyObject*) self, visit, arg);
+}
+
+static int timeout_clear(GSTimeout* self)
+{
+	timeout_cancel_timer(self);
+	return ((PyTypeObject*) PyExc_BaseException)->tp_clear((PyObject*) self);
+}
+
+static void timeout_dealloc(GSTimeout* self)
+{
+	/* drop our references only after the object is gone, they could
+	 * run arbitrary code */
+	PyObject* g = (PyObject*) self->timer.g;
+	PyObject* sched = (PyObject*) self->sched;
+	Py_XINCREF(g);
+	Py_XINCREF(sched);
+	timeout_cancel_timer(self);
+	((PyTypeObject*) PyExc_BaseException)->tp_dealloc((PyObject*) self);
+	Py_XDECREF(g);
+	Py_XDECREF(sched);
+}
+
+PyDoc_STRVAR(timeout_start_doc,
+"start()\n"
+"\n"
+"Arm the timeout for the current greenstack, restarting it if it was\n"
+"already armed.\n");
+
+static PyObject* timeout_start(GSTimeout* self)
+{
+	GSScheduler* s;
+	timeout_cancel_timer(self);
+	if (self->seconds < 0)
+		Py_RETURN_NONE;
+	s = gs_sched_current();
+	if (s == NULL)
+		return NULL;
+	self->sched = s;
+	gs_timer_arm(s, &self->timer, self->seconds, ts_current,
+	             (PyObject*) self, GS_ENTRY_THROW);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(timeout_cancel_doc,
+"cancel()\n"
+"\n"
+"Disarm the timeout if it has not expired yet.\n");
+
+static PyObject* timeout_cancel(GSTimeout* self)
+{
+	if (self->sched != NULL && gs_sched_check_thread(self->sched) < 0)
+		return NULL;
+	timeout_cancel_timer(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject* timeout_enter(GSTimeout* self)
+{
+	PyObject* r = timeout_start(self);
+	if (r == NULL)
+		return NULL;
+	Py_DECREF(r);
+	Py_INCREF(self);
+	return (PyObject*) self;
+}
+
+static PyObject* timeout_exit(GSTimeout* self, PyObject* args)
+{
+	PyObject* r = timeout_cancel(self);
+	if (r == NULL)
+		return NULL;
+	Py_DECREF(r);
+	Py_RETURN_FALSE;
+}
+
+static PyObject* timeout_getpending(GSTimeout* self, void* c)
+{
+	return PyBool_FromLong(GS_TIMER_ARMED(&self->timer));
+}
+
+static PyObject* timeout_getseconds(GSTimeout* self, void* c)
+{
+	if (self->seconds < 0)
+		Py_RETURN_NONE;
+	return PyFloat_FromDouble(self->seconds);
+}
+
+static PyMethodDef timeout_methods[] = {
+	{"start", (PyCFunction)timeout_start, METH_NOARGS, timeout_start_doc},
+	{"cancel", (PyCFunction)timeout_cancel, METH_NOARGS, timeout_cancel_doc},
+	{"__enter__", (PyCFunction)timeout_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)timeout_exit, METH_VARARGS, NULL},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef timeout_getsets[] = {
+	{"pending", (getter)timeout_getpending, NULL,
+	 "Whether the timeout is armed and has not expired yet."},
+	{"seconds", (getter)timeout_getseconds, NULL,
+	 "The number of seconds given to the constructor."},
+	{NULL}
+};
+
+static PyTypeObject GSTimeout_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Timeout",                   /* tp_name */
+	sizeof(GSTimeout),                      /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)timeout_dealloc,            /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Timeout(seconds=None)\n\n"
+	"An exception that is raised in the greenstack that started it once\n"
+	"the given number of seconds have passed, unless it is cancelled\n"
+	"first.  As a context manager it is started on entry and cancelled on\n"
+	"exit; the exception itself is not suppressed.  None never expires.", /* tp_doc */
+	(traverseproc)timeout_traverse,         /* tp_traverse */
+	(inquiry)timeout_clear,                 /* tp_clear */
+	0,                                      /* tp_richcompare */
+	0,                                      /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	timeout_methods,                        /* tp_methods */
+	0,                                      /* tp_members */
+	timeout_getsets,                        /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	(initproc)timeout_init,                 /* tp_init */
+};
+
+/***********************************************************/
+/* Module functions */
+
+PyDoc_STRVAR(mod_sleep_doc,
+"sleep(seconds=0)\n"
+"\n"
+"Suspend the current greenstack for the given number of seconds while\n"
+"the scheduler runs others.  With no delay, just yield to the greenstacks\n"
+"that are ready.\n");
+
+static PyObject* mod_sleep(PyObject* self, PyObject* args)
+{
+	double seconds = 0;
+	GSScheduler* s;
+	gs_timer t;
+	PyObject* r;
+
+	if (!PyArg_ParseTuple(args, "|d:sleep", &seconds))
+		return NULL;
+	s = gs_sched_current();
+	if (s == NULL)
+		return NULL;
+	if (seconds > 0) {
+		gs_timer_init(&t);
+		gs_timer_arm(s, &t, seconds, ts_current, Py_None, GS_ENTRY_RESUME);
+		r = gs_sched_park(s);
+		gs_timer_cancel(s, &t);
+	} else if (gs_sched_wake(s, ts_current, Py_None, GS_ENTRY_RESUME) < 0) {
+		r = NULL;
+	} else {
+		r = gs_sched_park(s);
+	}
+	Py_DECREF(s);
+	if (r == NULL)
+		return NULL;
+	Py_DECREF(r);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef timer_functions[] = {
+	{"sleep", (PyCFunction)mod_sleep, METH_VARARGS, mod_sleep_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_timer_init(PyObject* m)
+{
+	GSTimeout_Type.tp_base = (PyTypeObject*) PyExc_BaseException;
+	if (PyType_Ready(&GSTimeout_Type) < 0)
+		return -1;
+	Py_INCREF(&GSTimeout_Type);
+	if (PyModule_AddObject(m, "Timeout", (PyObject*) &GSTimeout_Type) < 0)
+		return -1;
+	return _greenstack_add_functions(m, timer_functions);
+}
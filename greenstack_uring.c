@@ -0,0 +1,860 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* Completion-based I/O: read(), write(), recv(), send() and accept().
+
+   Where the kernel allows it, each scheduler sets up an io_uring on first
+   use.  An operation fills in a submission queue entry and parks the
+   greenstack; nothing is submitted until the scheduler polls at the end
+   of a pass over the ready queue, so the entries queued by every
+   greenstack that ran in the pass go to the kernel in one io_uring_enter().
+   The same call reaps completions and, when nothing is ready, waits for
+   them (or for the next timer).  If epoll waiters exist as well, the ring
+   is added to the epoll set and the wait happens there instead.
+
+   io_uring is probed at runtime.  If it is missing, forbidden (seccomp,
+   containers) or older than the features used here, or if the
+   GREENSTACK_NO_IO_URING environment variable is set, the operations fall
+   back to waiting for readiness with epoll and then doing the system call.
+
+   Operations are allocated from a free list rather than on the stack: a
+   greenstack that is interrupted (by a Timeout, say) while its operation
+   is in flight cancels it and leaves the operation behind, and the kernel
+   may still write into its buffer until the cancellation completes.
+*/
+
+#include "greenstack_private.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* EXT_ARG (Linux 5.11) is needed to wait with a timeout */
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define GS_HAVE_IO_URING
+#endif
+
+static int uring_disabled;
+
+/***********************************************************/
+/* Operations */
+
+typedef struct _uring_op {
+	gs_link link;           /* in the ring's list of operations in flight */
+	PyGreenstack* g;        /* strong reference; NULL once abandoned */
+	PyObject* buf;          /* bytes object being read into */
+	Py_buffer view;         /* data being written */
+	int has_view;
+	int res;
+	int done;
+} uring_op;
+
+#ifdef GS_HAVE_IO_URING
+
+#define URING_ENTRIES 256
+#define URING_MAX_FREE 64
+
+typedef struct _gs_uring {
+	int fd;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe* sqes;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ptr;
+	size_t sq_size;
+	void* cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned int tail;      /* our tail, published on submission */
+	unsigned int queued;    /* entries not submitted yet */
+	int watched;            /* added to the epoll set */
+	gs_link active;
+	uring_op* free_ops;     /* chained through link.next */
+	int nfree;
+} gs_uring;
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                           unsigned int flags, void* arg, size_t argsz)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	                     flags, arg, argsz);
+}
+
+static void uring_unmap(gs_uring* r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+		munmap(r->sq_ptr, r->sq_size);
+	if (r->fd >= 0)
+		close(r->fd);
+}
+
+/* Returns the ring of s, setting it up on first use, or NULL if io_uring
+ * cannot be used.  Never raises. */
+static gs_uring* uring_get(GSScheduler* s)
+{
+	gs_io* io = &s->io;
+	struct io_uring_params p;
+	gs_uring* r;
+	char* base;
+
+	if (io->ring_state == GS_URING_AVAILABLE)
+		return io->ring;
+	if (io->ring_state == GS_URING_UNAVAILABLE || uring_disabled) {
+		io->ring_state = GS_URING_UNAVAILABLE;
+		return NULL;
+	}
+	io->ring_state = GS_URING_UNAVAILABLE;
+
+	r = (gs_uring*) PyMem_Malloc(sizeof(gs_uring));
+	if (r == NULL)
+		return NULL;
+	memset(r, 0, sizeof(gs_uring));
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_uring_setup(URING_ENTRIES, &p);
+	if (r->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+		                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe*) mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+	                                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	base = (char*) r->sq_ptr;
+	r->sq_head = (unsigned int*) (base + p.sq_off.head);
+	r->sq_tail = (unsigned int*) (base + p.sq_off.tail);
+	r->sq_array = (unsigned int*) (base + p.sq_off.array);
+	r->sq_mask = *(unsigned int*) (base + p.sq_off.ring_mask);
+	r->sq_entries = *(unsigned int*) (base + p.sq_off.ring_entries);
+	base = (char*) r->cq_ptr;
+	r->cq_head = (unsigned int*) (base + p.cq_off.head);
+	r->cq_tail = (unsigned int*) (base + p.cq_off.tail);
+	r->cq_mask = *(unsigned int*) (base + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (base + p.cq_off.cqes);
+	r->tail = *r->sq_tail;
+	GS_LIST_INIT(&r->active);
+
+	io->ring = r;
+	io->ring_state = GS_URING_AVAILABLE;
+	return r;
+
+fail:
+	uring_unmap(r);
+	PyMem_Free(r);
+	return NULL;
+}
+
+/* Hands the queued entries to the kernel and optionally waits */
+static int uring_enter(gs_uring* r, unsigned int min_complete, long timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = 0;
+	int n;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	if (min_complete > 0) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		memset(&arg, 0, sizeof(arg));
+		arg.sigmask_sz = _NSIG / 8;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			arg.ts = (PY_UINT64_T) (Py_uintptr_t) &ts;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		n = sys_uring_enter(r->fd, r->queued, min_complete, flags, &arg, sizeof(arg));
+		Py_END_ALLOW_THREADS
+	} else if (r->queued > 0) {
+		n = sys_uring_enter(r->fd, r->queued, 0, 0, NULL, 0);
+	} else {
+		return 0;
+	}
+	if (n < 0) {
+		if (errno == ETIME || errno == EBUSY || errno == EAGAIN)
+			return 0;
+		if (errno == EINTR)
+			return PyErr_CheckSignals();
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	r->queued = (unsigned int) n >= r->queued ? 0 : r->queued - n;
+	return 0;
+}
+
+/* Returns a cleared entry at the tail of the queue, submitting the queue
+ * first if it is full */
+static struct io_uring_sqe* uring_get_sqe(gs_uring* r)
+{
+	struct io_uring_sqe* sqe;
+	unsigned int idx;
+
+	if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		if (uring_enter(r, 0, 0) < 0)
+			return NULL;
+		if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+			PyErr_SetString(PyExc_GreenstackError, "io_uring submission queue is full");
+			return NULL;
+		}
+	}
+	idx = r->tail & r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->tail++;
+	r->queued++;
+	return sqe;
+}
+
+static uring_op* op_new(gs_uring* r)
+{
+	uring_op* op = r->free_ops;
+	if (op != NULL) {
+		r->free_ops = (uring_op*) op->link.next;
+		r->nfree--;
+	} else {
+		op = (uring_op*) PyMem_Malloc(sizeof(uring_op));
+		if (op == NULL) {
+			PyErr_NoMemory();
+			return NULL;
+		}
+	}
+	GS_LIST_INIT(&op->link);
+	op->g = NULL;
+	op->buf = NULL;
+	op->has_view = 0;
+	op->res = 0;
+	op->done = 0;
+	return op;
+}
+
+static void op_free(gs_uring* r, uring_op* op)
+{
+	Py_CLEAR(op->buf);
+	if (op->has_view) {
+		op->has_view = 0;
+		PyBuffer_Release(&op->view);
+	}
+	if (r->nfree < URING_MAX_FREE) {
+		op->link.next = (gs_link*) r->free_ops;
+		r->free_ops = op;
+		r->nfree++;
+	} else {
+		PyMem_Free(op);
+	}
+}
+
+int gs_uring_reap(GSScheduler* s)
+{
+	gs_uring* r = s->io.ring;
+	unsigned int head, tail;
+	int err = 0;
+
+	if (r == NULL)
+		return 0;
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+		uring_op* op = (uring_op*) (Py_uintptr_t) cqe->user_data;
+		head++;
+		if (op == NULL)
+			continue;   /* a cancellation */
+		op->res = cqe->res;
+		op->done = 1;
+		gs_list_remove(&op->link);
+		s->io.inflight--;
+		if (op->g == NULL) {
+			/* abandoned */
+			op_free(r, op);
+			continue;
+		}
+		if (err == 0 && gs_sched_wake(s, op->g, Py_None, GS_ENTRY_RESUME) < 0)
+			err = -1;
+		Py_CLEAR(op->g);
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return err;
+}
+
+int gs_uring_submit(GSScheduler* s)
+{
+	if (s->io.ring == NULL)
+		return 0;
+	return uring_enter(s->io.ring, 0, 0);
+}
+
+int gs_uring_poll(GSScheduler* s, long timeout)
+{
+	gs_uring* r = s->io.ring;
+	if (r == NULL)
+		return 0;
+	if (uring_enter(r, timeout == 0 ? 0 : 1, timeout) < 0)
+		return -1;
+	return gs_uring_reap(s);
+}
+
+int gs_uring_watch(GSScheduler* s, int epfd)
+{
+	gs_uring* r = s->io.ring;
+	if (r == NULL)
+		return 0;
+	if (!r->watched) {
+		/* the ring is not in the descriptor table, so its events only
+		 * end the wait */
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		ev.data.fd = r->fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, r->fd, &ev) < 0) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+		r->watched = 1;
+	}
+	return *r->cq_head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+void gs_uring_clear(gs_io* io)
+{
+	gs_uring* r = io->ring;
+	if (r == NULL)
+		return;
+	/* The kernel may still write into the buffers of operations in
+	 * flight after the ring is closed, so those are leaked rather than
+	 * freed.  This only happens to schedulers torn down mid-operation. */
+	while (!GS_LIST_EMPTY(&r->active)) {
+		uring_op* op = (uring_op*) r->active.next;
+		gs_list_remove(&op->link);
+		Py_CLEAR(op->g);
+	}
+	while (r->free_ops != NULL) {
+		uring_op* op = r->free_ops;
+		r->free_ops = (uring_op*) op->link.next;
+		PyMem_Free(op);
+	}
+	uring_unmap(r);
+	PyMem_Free(r);
+	io->ring = NULL;
+	io->inflight = 0;
+}
+
+int gs_uring_forked(GSScheduler* s)
+{
+	gs_io* io = &s->io;
+	gs_uring* r = io->ring;
+	int err = 0, orphans = 0;
+
+	if (io->ring_state == GS_URING_AVAILABLE)
+		io->ring_state = GS_URING_UNTRIED;
+	if (r == NULL)
+		return 0;
+	io->ring = NULL;
+	/* The operations complete in the parent, whose memory the kernel
+	 * writes to, so here they fail right away.  Their greenstacks still
+	 * free them into r, which is leaked along with them. */
+	while (!GS_LIST_EMPTY(&r->active)) {
+		uring_op* op = (uring_op*) r->active.next;
+		gs_list_remove(&op->link);
+		io->inflight--;
+		if (op->g == NULL) {
+			op_free(r, op);
+			continue;
+		}
+		op->res = -ECANCELED;
+		op->done = 1;
+		if (err == 0 && gs_sched_wake(s, op->g, Py_None, GS_ENTRY_RESUME) < 0)
+			err = -1;
+		Py_CLEAR(op->g);
+		orphans = 1;
+	}
+	/* unmapping only takes the mappings away from this process */
+	uring_unmap(r);
+	if (!orphans) {
+		while (r->free_ops != NULL) {
+			uring_op* op = r->free_ops;
+			r->free_ops = (uring_op*) op->link.next;
+			PyMem_Free(op);
+		}
+		PyMem_Free(r);
+	}
+	return err;
+}
+
+int gs_uring_traverse(gs_io* io, visitproc visit, void* arg)
+{
+	gs_uring* r = io->ring;
+	gs_link* l;
+	if (r == NULL)
+		return 0;
+	for (l = r->active.next; l != &r->active; l = l->next)
+		Py_VISIT((PyObject*) ((uring_op*) l)->g);
+	return 0;
+}
+
+/* Parks the current greenstack until op completes.  Returns -1 if it was
+ * interrupted, in which case op is cancelled (if still in flight) and must
+ * not be touched any more; if op completed anyway, op->done is set and the
+ * caller has to clean up after it. */
+static int uring_run(GSScheduler* s, gs_uring* r, uring_op* op, int* abandoned)
+{
+	struct io_uring_sqe* sqe;
+	PyObject *v, *typ, *val, *tb;
+	int err = 0;
+
+	Py_INCREF(ts_current);
+	op->g = ts_current;
+	gs_list_append(&r->active, &op->link);
+	s->io.inflight++;
+	*abandoned = 0;
+	for (;;) {
+		v = gs_sched_park(s);
+		if (v == NULL || op->done)
+			break;
+		/* woken by somebody else */
+		Py_DECREF(v);
+	}
+	if (v != NULL) {
+		Py_DECREF(v);
+		return 0;
+	}
+	if (op->done)
+		return -1;
+
+	/* leave op for gs_uring_reap() to free */
+	Py_CLEAR(op->g);
+	*abandoned = 1;
+	PyErr_Fetch(&typ, &val, &tb);
+	sqe = uring_get_sqe(r);
+	if (sqe != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (PY_UINT64_T) (Py_uintptr_t) op;
+		sqe->user_data = 0;
+		/* right away, before the operation can take data that is meant
+		 * for somebody else */
+		err = uring_enter(r, 0, 0);
+	}
+	if (sqe == NULL || err < 0) {
+		/* the operation finishes by itself eventually */
+		PyErr_WriteUnraisable((PyObject*) s);
+	}
+	PyErr_Restore(typ, val, tb);
+	return -1;
+}
+
+#else /* !GS_HAVE_IO_URING */
+
+typedef struct _gs_uring gs_uring;
+
+static gs_uring* uring_get(GSScheduler* s)
+{
+	s->io.ring_state = GS_URING_UNAVAILABLE;
+	return NULL;
+}
+
+int gs_uring_reap(GSScheduler* s) { return 0; }
+int gs_uring_submit(GSScheduler* s) { return 0; }
+int gs_uring_poll(GSScheduler* s, long timeout) { return 0; }
+int gs_uring_watch(GSScheduler* s, int epfd) { return 0; }
+void gs_uring_clear(gs_io* io) { }
+int gs_uring_forked(GSScheduler* s) { return 0; }
+int gs_uring_traverse(gs_io* io, visitproc visit, void* arg) { return 0; }
+
+#endif /* GS_HAVE_IO_URING */
+
+/***********************************************************/
+/* Readiness fallback */
+
+/* Waits until fd is ready for dir, checking first since a cached epoll
+ * registration only reports new edges */
+static int fallback_wait(GSScheduler* s, int fd, int dir)
+{
+	struct pollfd p;
+	int n;
+	for (;;) {
+		p.fd = fd;
+		p.events = dir == GS_IO_READ ? POLLIN : POLLOUT;
+		p.revents = 0;
+		n = poll(&p, 1, 0);
+		if (n > 0)
+			return 0;
+		if (n < 0 && errno != EINTR) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+		if (gs_io_wait(s, fd, dir, -1) < 0)
+			return -1;
+	}
+}
+
+#define OP_READ   0
+#define OP_WRITE  1
+#define OP_RECV   2
+#define OP_SEND   3
+#define OP_ACCEPT 4
+
+/* Runs an operation with the fallback.  Returns the result of the system
+ * call, or -1 with a Python exception. */
+static Py_ssize_t fallback_op(GSScheduler* s, int kind, int fd, void* buf,
+                              size_t len, int flags)
+{
+	Py_ssize_t n;
+	for (;;) {
+		int dir = (kind == OP_WRITE || kind == OP_SEND) ? GS_IO_WRITE : GS_IO_READ;
+		if (fallback_wait(s, fd, dir) < 0)
+			return -1;
+		switch (kind) {
+		case OP_READ:
+			n = read(fd, buf, len);
+			break;
+		case OP_WRITE:
+			n = write(fd, buf, len);
+			break;
+		case OP_RECV:
+			n = recv(fd, buf, len, flags | MSG_DONTWAIT);
+			break;
+		case OP_SEND:
+			n = send(fd, buf, len, flags | MSG_DONTWAIT);
+			break;
+		default:
+			n = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+			break;
+		}
+		if (n >= 0)
+			return n;
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+		if (errno == EINTR && PyErr_CheckSignals() < 0)
+			return -1;
+	}
+}
+
+/***********************************************************/
+/* Module functions */
+
+/* Runs one operation on whichever backend s has.  data is the buffer to
+ * write, or NULL; it may be taken over, leaving data->obj NULL.  For reads
+ * *result is set to a new bytes object.  Returns the result of the
+ * operation or -1 with an exception. */
+static Py_ssize_t do_op(int kind, int fd, Py_ssize_t len, Py_buffer* data,
+                        int flags, PyObject** result)
+{
+	GSScheduler* s;
+	gs_uring* r;
+	PyObject* buf = NULL;
+	Py_ssize_t n;
+
+	if (len < 0) {
+		PyErr_SetString(PyExc_ValueError, "negative buffersize");
+		return -1;
+	}
+	s = gs_sched_current();
+	if (s == NULL)
+		return -1;
+	if (gs_io_check_fork(s) < 0) {
+		Py_DECREF(s);
+		return -1;
+	}
+	if (result != NULL) {
+		buf = PyBytes_FromStringAndSize(NULL, len);
+		if (buf == NULL) {
+			Py_DECREF(s);
+			return -1;
+		}
+	}
+
+	r = uring_get(s);
+	if (r == NULL) {
+		n = fallback_op(s, kind, fd,
+		                buf ? PyBytes_AS_STRING(buf) : (data ? data->buf : NULL),
+		                buf ? (size_t) len : (data ? (size_t) data->len : 0), flags);
+	}
+#ifdef GS_HAVE_IO_URING
+	else {
+		struct io_uring_sqe* sqe;
+		uring_op* op;
+		int abandoned;
+
+		n = -1;
+		op = op_new(r);
+		sqe = op ? uring_get_sqe(r) : NULL;
+		if (sqe == NULL) {
+			if (op != NULL)
+				op_free(r, op);
+			goto done;
+		}
+		sqe->fd = fd;
+		sqe->user_data = (PY_UINT64_T) (Py_uintptr_t) op;
+		switch (kind) {
+		case OP_READ:
+		case OP_RECV:
+			op->buf = buf;
+			Py_INCREF(buf);
+			sqe->opcode = kind == OP_READ ? IORING_OP_READ : IORING_OP_RECV;
+			sqe->addr = (PY_UINT64_T) (Py_uintptr_t) PyBytes_AS_STRING(buf);
+			sqe->len = (unsigned int) len;
+			if (kind == OP_READ)
+				sqe->off = (PY_UINT64_T) -1;    /* the file position */
+			else
+				sqe->msg_flags = flags;
+			break;
+		case OP_WRITE:
+		case OP_SEND:
+			/* keep the data alive until the kernel is done with it */
+			op->view = *data;
+			data->obj = NULL;
+			op->has_view = 1;
+			sqe->opcode = kind == OP_WRITE ? IORING_OP_WRITE : IORING_OP_SEND;
+			sqe->addr = (PY_UINT64_T) (Py_uintptr_t) op->view.buf;
+			sqe->len = (unsigned int) op->view.len;
+			if (kind == OP_WRITE)
+				sqe->off = (PY_UINT64_T) -1;
+			else
+				sqe->msg_flags = flags;
+			break;
+		default:
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->accept_flags = SOCK_CLOEXEC;
+			break;
+		}
+
+		if (uring_run(s, r, op, &abandoned) < 0) {
+			if (!abandoned) {
+				if (kind == OP_ACCEPT && op->res >= 0)
+					close(op->res);
+				op_free(r, op);
+			}
+			goto done;
+		}
+		n = op->res;
+		op_free(r, op);
+		if (n < 0) {
+			errno = (int) -n;
+			PyErr_SetFromErrno(PyExc_OSError);
+			n = -1;
+		}
+	}
+done:
+#endif
+	Py_DECREF(s);
+	if (buf != NULL) {
+		if (n < 0 || (n < len && _PyBytes_Resize(&buf, n) < 0)) {
+			Py_XDECREF(buf);
+			return -1;
+		}
+		*result = buf;
+	}
+	return n;
+}
+
+PyDoc_STRVAR(mod_read_doc,
+"read(fd, n) -> bytes\n"
+"\n"
+"Read up to n bytes from fd, suspending the current greenstack until\n"
+"they are available.\n");
+
+static PyObject* mod_read(PyObject* self, PyObject* args)
+{
+	PyObject* file;
+	PyObject* result;
+	Py_ssize_t len;
+	int fd;
+
+	if (!PyArg_ParseTuple(args, "On:read", &file, &len))
+		return NULL;
+	fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0)
+		return NULL;
+	if (do_op(OP_READ, fd, len, NULL, 0, &result) < 0)
+		return NULL;
+	return result;
+}
+
+PyDoc_STRVAR(mod_recv_doc,
+"recv(sock, n, flags=0) -> bytes\n"
+"\n"
+"Receive up to n bytes from a socket, suspending the current greenstack\n"
+"until they are available.\n");
+
+static PyObject* mod_recv(PyObject* self, PyObject* args)
+{
+	PyObject* file;
+	PyObject* result;
+	Py_ssize_t len;
+	int fd, flags = 0;
+
+	if (!PyArg_ParseTuple(args, "On|i:recv", &file, &len, &flags))
+		return NULL;
+	fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0)
+		return NULL;
+	if (do_op(OP_RECV, fd, len, NULL, flags, &result) < 0)
+		return NULL;
+	return result;
+}
+
+static PyObject* write_op(PyObject* args, int kind, const char* format)
+{
+	PyObject* file;
+	Py_buffer data;
+	Py_ssize_t n;
+	int fd, flags = 0;
+
+	if (!PyArg_ParseTuple(args, format, &file, &data, &flags))
+		return NULL;
+	fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0) {
+		PyBuffer_Release(&data);
+		return NULL;
+	}
+	n = do_op(kind, fd, 0, &data, flags, NULL);
+	PyBuffer_Release(&data);
+	if (n < 0)
+		return NULL;
+	return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(mod_write_doc,
+"write(fd, data) -> int\n"
+"\n"
+"Write data to fd, suspending the current greenstack until it can be\n"
+"written.  Returns the number of bytes written, which may be fewer than\n"
+"len(data).\n");
+
+static PyObject* mod_write(PyObject* self, PyObject* args)
+{
+	return write_op(args, OP_WRITE, "Os*:write");
+}
+
+PyDoc_STRVAR(mod_send_doc,
+"send(sock, data, flags=0) -> int\n"
+"\n"
+"Send data on a socket, suspending the current greenstack until it can\n"
+"be sent.  Returns the number of bytes sent.\n");
+
+static PyObject* mod_send(PyObject* self, PyObject* args)
+{
+	return write_op(args, OP_SEND, "Os*|i:send");
+}
+
+PyDoc_STRVAR(mod_accept_doc,
+"accept(sock) -> int\n"
+"\n"
+"Accept a connection on a listening socket, suspending the current\n"
+"greenstack until one arrives.  Returns the new file descriptor.\n");
+
+static PyObject* mod_accept(PyObject* self, PyObject* file)
+{
+	Py_ssize_t n;
+	int fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0)
+		return NULL;
+	n = do_op(OP_ACCEPT, fd, 0, NULL, 0, NULL);
+	if (n < 0)
+		return NULL;
+	return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(mod_io_backend_doc,
+"io_backend() -> str\n"
+"\n"
+"Return 'io_uring' or 'epoll', whichever read() and friends use in the\n"
+"current thread.\n");
+
+static PyObject* mod_io_backend(PyObject* self)
+{
+	GSScheduler* s = gs_sched_current();
+	gs_uring* r;
+	if (s == NULL)
+		return NULL;
+	r = uring_get(s);
+	Py_DECREF(s);
+#if PY_MAJOR_VERSION >= 3
+	return PyUnicode_FromString(r != NULL ? "io_uring" : "epoll");
+#else
+	return PyString_FromString(r != NULL ? "io_uring" : "epoll");
+#endif
+}
+
+static PyMethodDef uring_functions[] = {
+	{"read", (PyCFunction)mod_read, METH_VARARGS, mod_read_doc},
+	{"write", (PyCFunction)mod_write, METH_VARARGS, mod_write_doc},
+	{"recv", (PyCFunction)mod_recv, METH_VARARGS, mod_recv_doc},
+	{"send", (PyCFunction)mod_send, METH_VARARGS, mod_send_doc},
+	{"accept", (PyCFunction)mod_accept, METH_O, mod_accept_doc},
+	{"io_backend", (PyCFunction)mod_io_backend, METH_NOARGS, mod_io_backend_doc},
+	{NULL, NULL} /* sentinel */
+};
+
+int _greenstack_uring_init(PyObject* m)
+{
+	const char* env = getenv("GREENSTACK_NO_IO_URING");
+	uring_disabled = env != NULL && env[0] != '\0' && strcmp(env, "0") != 0;
+	return _greenstack_add_functions(m, uring_functions);
+}
+
+#else /* !__linux__ */
+
+int gs_uring_reap(GSScheduler* s) { return 0; }
+int gs_uring_submit(GSScheduler* s) { return 0; }
+int gs_uring_poll(GSScheduler* s, long timeout) { return 0; }
+int gs_uring_watch(GSScheduler* s, int epfd) { return 0; }
+void gs_uring_clear(gs_io* io) { }
+int gs_uring_forked(GSScheduler* s) { return 0; }
+int gs_uring_traverse(gs_io* io, visitproc visit, void* arg) { return 0; }
+
+int _greenstack_uring_init(PyObject* m)
+{
+	return 0;
+}
+
+#endif /* __linux__ */
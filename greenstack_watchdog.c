@@ -0,0 +1,365 @@
+/* vim:set noet ts=8 sw=8 : */
+
+/* A watchdog for greenstacks that block their thread.
+
+   While greenstacks are busy, the thread switches between them all the
+   time, so the switch counter of the thread (see greenstack_stats.c)
+   keeps going up.  A watchdog looks at it from a native thread of its
+   own, without the GIL, a few times per threshold.  Once it has not moved
+   for the threshold, the watchdog takes the GIL, which the interpreter
+   hands over between two bytecodes, and reports the greenstack the thread
+   is running along with its innermost frame.  It reports once for every
+   time the counter stops.
+
+   A thread in the loop of a scheduler that has nothing ready is waiting
+   for I/O or a timer and is not reported.  Code that blocks in C with the
+   GIL held is only reported once it lets go of it.  The counter is read
+   without locking; a torn read can only make the watchdog look again with
+   the GIL held.
+*/
+
+#include "greenstack_private.h"
+#include "pythread.h"
+#include "frameobject.h"
+
+typedef struct {
+	PyObject_HEAD
+	PyObject* callback;       /* NULL to write to sys.stderr */
+	PY_UINT64_T threshold;    /* nanoseconds */
+	unsigned long reports;
+	/* only written with the GIL held */
+	volatile int running;
+	volatile unsigned long generation; /* bumped by every start() */
+} GSWatchdog;
+
+/* What a watchdog thread watches, owned by the thread */
+typedef struct {
+	GSWatchdog* w;
+	unsigned long generation;
+	PyObject* owner;          /* keeps switches valid */
+	volatile PY_UINT64_T* switches;
+	PyObject* dict;           /* state dict of the watched thread */
+	unsigned long thread_id;
+} wd_target;
+
+static PyTypeObject GSWatchdog_Type;
+
+/* Writes a report to sys.stderr */
+static int wd_print(PyGreenstack* g, PyObject* frame, double seconds)
+{
+	PyObject* f;
+	PyObject* traceback;
+	PyObject* lines;
+	char buf[80];
+	Py_ssize_t i;
+	int err = 0;
+
+	f = PySys_GetObject("stderr");
+	if (f == NULL || f == Py_None)
+		return 0;
+	PyOS_snprintf(buf, sizeof(buf), " did not switch for %.3f seconds\n", seconds);
+	if (PyFile_WriteString("greenstack: ", f) < 0 ||
+	    PyFile_WriteObject((PyObject*) g, f, 0) < 0 ||
+	    PyFile_WriteString(buf, f) < 0)
+		return -1;
+	if (frame == Py_None)
+		return 0;
+	traceback = PyImport_ImportModule("traceback");
+	if (traceback == NULL)
+		return -1;
+	lines = PyObject_CallMethod(traceback, "format_stack", "(O)", frame);
+	Py_DECREF(traceback);
+	if (lines == NULL)
+		return -1;
+	for (i = 0; err == 0 && i < PyList_GET_SIZE(lines); i++)
+		err = PyFile_WriteObject(PyList_GET_ITEM(lines, i), f, Py_PRINT_RAW);
+	Py_DECREF(lines);
+	return err;
+}
+
+static int wd_report(wd_target* t, double seconds)
+{
+	GSWatchdog* w = t->w;
+	PyThreadState* ts;
+	PyGreenstack* g;
+	PyObject* frame = NULL;
+	PyObject* result;
+	int err;
+
+	for (ts = PyInterpreterState_ThreadHead(PyThreadState_GET()->interp);
+	     ts != NULL; ts = PyThreadState_Next(ts)) {
+		if ((unsigned long) ts->thread_id == t->thread_id)
+			break;
+	}
+	/* gone, or just waiting for something to do */
+	if (ts == NULL || ts->dict != t->dict || gs_sched_idle(t->dict))
+		return 0;
+	g = gs_thread_current(t->dict);
+	if (g == NULL)
+		return 0;
+	frame = ts->frame != NULL ? (PyObject*) ts->frame : Py_None;
+	Py_INCREF(g);
+	Py_INCREF(frame);
+	w->reports++;
+	if (w->callback == NULL) {
+		err = wd_print(g, frame, seconds);
+	} else {
+		result = PyObject_CallFunction(w->callback, "(OOd)", g, frame, seconds);
+		Py_XDECREF(result);
+		err = result == NULL ? -1 : 0;
+	}
+	Py_DECREF(g);
+	Py_DECREF(frame);
+	return err;
+}
+
+static void wd_thread(void* arg)
+{
+	wd_target* t = (wd_target*) arg;
+	GSWatchdog* w = t->w;
+	PyGILState_STATE state;
+	PY_UINT64_T seen, since, interval;
+	int checked = 0;
+
+	interval = w->threshold / 4 > 1000000 ? w->threshold / 4 : 1000000;
+	seen = *t->switches;
+	since = gs_clock_ns();
+	for (;;) {
+		gs_sleep_nogil(interval);
+		if (!w->running || w->generation != t->generation)
+			break;
+		if (*t->switches != seen) {
+			seen = *t->switches;
+			since = gs_clock_ns();
+			checked = 0;
+			continue;
+		}
+		if (checked || gs_clock_ns() - since < w->threshold)
+			continue;
+		state = PyGILState_Ensure();
+		if (w->running && w->generation == t->generation &&
+		    *t->switches == seen) {
+			checked = 1;
+			if (wd_report(t, (gs_clock_ns() - since) / 1e9) < 0)
+				PyErr_WriteUnraisable((PyObject*) w);
+		}
+		PyGILState_Release(state);
+	}
+	state = PyGILState_Ensure();
+	Py_DECREF(t->owner);
+	Py_DECREF(t->dict);
+	Py_DECREF(w);
+	PyGILState_Release(state);
+	free(t);
+}
+
+/***********************************************************/
+
+static PyObject* wd_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+	GSWatchdog* w;
+	double threshold = 0.1;
+	PyObject* callback = Py_None;
+	static char* kwlist[] = {"threshold", "callback", 0};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|dO:Watchdog", kwlist,
+	                                 &threshold, &callback))
+		return NULL;
+	if (!(threshold >= 0.001 && threshold <= 3600)) {
+		PyErr_SetString(PyExc_ValueError,
+		                "threshold must be between 0.001 and 3600 seconds");
+		return NULL;
+	}
+	if (callback != Py_None && !PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "callback must be callable");
+		return NULL;
+	}
+	w = (GSWatchdog*) type->tp_alloc(type, 0);
+	if (w == NULL)
+		return NULL;
+	if (callback != Py_None) {
+		Py_INCREF(callback);
+		w->callback = callback;
+	}
+	w->threshold = (PY_UINT64_T) (threshold * 1e9);
+	return (PyObject*) w;
+}
+
+static int wd_traverse(GSWatchdog* w, visitproc visit, void* arg)
+{
+	Py_VISIT(w->callback);
+	return 0;
+}
+
+static int wd_clear(GSWatchdog* w)
+{
+	Py_CLEAR(w->callback);
+	return 0;
+}
+
+static void wd_dealloc(GSWatchdog* w)
+{
+	PyObject_GC_UnTrack(w);
+	Py_CLEAR(w->callback);
+	Py_TYPE(w)->tp_free((PyObject*) w);
+}
+
+PyDoc_STRVAR(wd_start_doc,
+"start()\n"
+"\n"
+"Start watching the calling thread.\n");
+
+static PyObject* wd_start(GSWatchdog* w)
+{
+	wd_target* t;
+	PyGreenstack_Stats* stats;
+
+	if (w->running)
+		Py_RETURN_NONE;
+	if (!STATE_OK)
+		return NULL;
+	t = (wd_target*) malloc(sizeof(wd_target));
+	if (t == NULL)
+		return PyErr_NoMemory();
+	t->owner = gs_stats_of(ts_current->run_info, &stats);
+	if (t->owner == NULL) {
+		free(t);
+		PyErr_SetString(PyExc_GreenstackError,
+		                "the switches of this thread are not counted");
+		return NULL;
+	}
+	t->switches = &stats->switches;
+	t->dict = ts_current->run_info;
+	Py_INCREF(t->dict);
+	t->thread_id = (unsigned long) PyThread_get_thread_ident();
+	t->w = w;
+	Py_INCREF(w);
+	w->generation++;
+	t->generation = w->generation;
+	w->running = 1;
+	PyEval_InitThreads();
+	if ((unsigned long) PyThread_start_new_thread(wd_thread, t)
+	    == (unsigned long) -1) {
+		w->running = 0;
+		Py_DECREF(t->owner);
+		Py_DECREF(t->dict);
+		Py_DECREF(w);
+		free(t);
+		PyErr_SetString(PyExc_RuntimeError, "can't start new thread");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(wd_stop_doc,
+"stop()\n"
+"\n"
+"Stop watching.  Nothing more is reported once this returns.\n");
+
+static PyObject* wd_stop(GSWatchdog* w)
+{
+	w->running = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject* wd_enter(GSWatchdog* w)
+{
+	PyObject* result = wd_start(w);
+	if (result == NULL)
+		return NULL;
+	Py_DECREF(result);
+	Py_INCREF(w);
+	return (PyObject*) w;
+}
+
+static PyObject* wd_exit(GSWatchdog* w, PyObject* args)
+{
+	return wd_stop(w);
+}
+
+static PyObject* wd_get_reports(GSWatchdog* w, void* context)
+{
+	return PyLong_FromUnsignedLong(w->reports);
+}
+
+static PyObject* wd_get_running(GSWatchdog* w, void* context)
+{
+	return PyBool_FromLong(w->running);
+}
+
+static PyObject* wd_get_threshold(GSWatchdog* w, void* context)
+{
+	return PyFloat_FromDouble(w->threshold / 1e9);
+}
+
+static PyMethodDef wd_methods[] = {
+	{"start", (PyCFunction)wd_start, METH_NOARGS, wd_start_doc},
+	{"stop", (PyCFunction)wd_stop, METH_NOARGS, wd_stop_doc},
+	{"__enter__", (PyCFunction)wd_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)wd_exit, METH_VARARGS, NULL},
+	{NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef wd_getsets[] = {
+	{"reports", (getter)wd_get_reports, NULL,
+	 "How many times a blocked thread was reported."},
+	{"running", (getter)wd_get_running, NULL,
+	 "Whether it is watching a thread."},
+	{"threshold", (getter)wd_get_threshold, NULL,
+	 "How many seconds without a switch are reported."},
+	{NULL}
+};
+
+static PyTypeObject GSWatchdog_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"greenstack.Watchdog",                  /* tp_name */
+	sizeof(GSWatchdog),                     /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	/* methods */
+	(destructor)wd_dealloc,                 /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as _number*/
+	0,                                      /* tp_as _sequence*/
+	0,                                      /* tp_as _mapping*/
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+	"Watchdog(threshold=0.1, callback=None) -> Watchdog\n\n"
+	"Reports the greenstack that keeps a thread from switching for more\n"
+	"than threshold seconds, by calling callback(greenstack, frame,\n"
+	"seconds) or else by writing its stack to sys.stderr.  Use start() and\n"
+	"stop(), or use it as a context manager.", /* tp_doc */
+	(traverseproc)wd_traverse,              /* tp_traverse */
+	(inquiry)wd_clear,                      /* tp_clear */
+	0,                                      /* tp_richcompare */
+	0,                                      /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	wd_methods,                             /* tp_methods */
+	0,                                      /* tp_members */
+	wd_getsets,                             /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	0,                                      /* tp_alloc */
+	wd_new,                                 /* tp_new */
+};
+
+int _greenstack_watchdog_init(PyObject* m)
+{
+	if (PyType_Ready(&GSWatchdog_Type) < 0)
+		return -1;
+	Py_INCREF(&GSWatchdog_Type);
+	return PyModule_AddObject(m, "Watchdog", (PyObject*) &GSWatchdog_Type);
+}
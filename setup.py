@@ -34,11 +34,24 @@ else:
     else:
         extra_compile_args = []
 
+    define_macros = []
+    if os.environ.get('GREENSTACK_SWITCH_TIMING') in ('1', 'yes'):
+        define_macros.append(('GREENSTACK_USE_SWITCH_TIMING', '1'))
+
     ext_modules = [Extension(
         name='greenstack',
-        sources=['greenstack.c', 'libcoro/coro.c'],
+        sources=['greenstack.c', 'greenstack_sched.c', 'greenstack_timer.c',
+                 'greenstack_io.c', 'greenstack_uring.c',
+                 'greenstack_channel.c', 'greenstack_lock.c',
+                 'greenstack_queue.c', 'greenstack_thread.c',
+                 'greenstack_nursery.c', 'greenstack_preempt.c',
+                 'greenstack_asyncio.c', 'greenstack_socket.c',
+                 'greenstack_shm.c', 'greenstack_stats.c',
+                 'greenstack_profile.c', 'greenstack_watchdog.c',
+                 'libcoro/coro.c'],
         extra_compile_args=extra_compile_args,
-        depends=['greenstack.h', 'libcoro/coro.h'])]
+        define_macros=define_macros,
+        depends=['greenstack.h', 'greenstack_private.h', 'libcoro/coro.h'])]
 
 from distutils.core import Command
 from my_build_ext import build_ext
@@ -143,6 +143,18 @@ test_throw(PyObject *self, PyGreenstack *g)
 	Py_RETURN_NONE;
 }
 
+static PyObject *
+test_stats(PyObject *self)
+{
+	PyGreenstack_Stats stats;
+	if (PyGreenstack_GetStats(&stats, 0) < 0)
+		return NULL;
+	return Py_BuildValue("(KKK)",
+	                     (unsigned PY_LONG_LONG) stats.switches,
+	                     (unsigned PY_LONG_LONG) stats.creations,
+	                     (unsigned PY_LONG_LONG) stats.deaths);
+}
+
 static PyMethodDef test_methods[] = {
 	{"test_switch", (PyCFunction) test_switch, METH_O,
 	 "Switch to the provided greenstack sending provided arguments, and \n"
@@ -162,6 +174,8 @@ static PyMethodDef test_methods[] = {
 	 METH_NOARGS, "Just raise greenstack.error"},
 	{"test_throw", (PyCFunction) test_throw, METH_O,
 	 "Throw a ValueError at the provided greenstack"},
+	{"test_stats", (PyCFunction) test_stats, METH_NOARGS,
+	 "Return (switches, creations, deaths) from PyGreenstack_GetStats()"},
 	{NULL, NULL, 0, NULL}
 };
 
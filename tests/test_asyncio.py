@@ -0,0 +1,105 @@
+import unittest
+
+import greenstack
+
+try:
+    import asyncio
+except ImportError:
+    asyncio = None
+
+
+@unittest.skipIf(asyncio is None, 'asyncio is not available')
+class AsyncioTests(unittest.TestCase):
+    def setUp(self):
+        self.loop = asyncio.new_event_loop()
+        asyncio.set_event_loop(self.loop)
+
+    def tearDown(self):
+        self.loop.close()
+        asyncio.set_event_loop(None)
+
+    def run_until_complete(self, fut):
+        return self.loop.run_until_complete(fut)
+
+    def test_await(self):
+        seen = []
+
+        def body(a, b=None):
+            seen.append('start')
+            x = greenstack.await_(asyncio.sleep(0.001, result=a))
+            seen.append(x)
+            return x + b
+
+        g = greenstack.greenstack(body)
+        self.assertEqual(self.run_until_complete(
+            greenstack.as_awaitable(g, 1, b=2)), 3)
+        self.assertEqual(seen, ['start', 1])
+        self.assertTrue(g.dead)
+
+    def test_loop_keeps_running(self):
+        seen = []
+
+        def body():
+            for i in range(3):
+                greenstack.await_(asyncio.sleep(0.005))
+                seen.append('g')
+
+        for i in range(12):
+            self.loop.call_later(0.001 * i, seen.append, 't')
+        fut = greenstack.as_awaitable(greenstack.greenstack(body))
+        self.run_until_complete(fut)
+        self.assertEqual(seen.count('g'), 3)
+        # the loop ran its callbacks while the greenstack waited
+        self.assertEqual(seen[0], 't')
+        self.assertTrue('t' in seen[seen.index('g'):])
+
+    def test_exceptions(self):
+        def body():
+            fut = self.loop.create_future()
+            fut.set_exception(KeyError('x'))
+            try:
+                greenstack.await_(fut)
+            except KeyError:
+                pass
+            raise ValueError('y')
+
+        fut = greenstack.as_awaitable(greenstack.greenstack(body))
+        self.assertRaises(ValueError, self.run_until_complete, fut)
+
+    def test_cancel(self):
+        seen = []
+
+        def body():
+            try:
+                greenstack.await_(asyncio.sleep(10))
+            except asyncio.CancelledError:
+                seen.append('cancelled')
+                raise
+
+        g = greenstack.greenstack(body)
+        fut = greenstack.as_awaitable(g)
+        self.loop.call_later(0.01, fut.cancel)
+        self.assertRaises(asyncio.CancelledError, self.run_until_complete, fut)
+        self.run_until_complete(asyncio.sleep(0))
+        self.assertEqual(seen, ['cancelled'])
+        self.assertTrue(g.dead)
+
+    def test_switch_to_loop_without_await(self):
+        def body():
+            greenstack.getcurrent().parent.switch()
+
+        g = greenstack.greenstack(body)
+        fut = greenstack.as_awaitable(g)
+        self.assertRaises(greenstack.error, self.run_until_complete, fut)
+        self.assertFalse(g.dead)
+        # it is no longer run by the bridge
+        g.switch()
+        self.assertTrue(g.dead)
+
+    def test_await_outside_bridge(self):
+        self.assertRaises(greenstack.error, greenstack.await_,
+                          asyncio.sleep(0))
+        g = greenstack.greenstack(lambda: None)
+        g.switch()
+        self.assertRaises(greenstack.error, greenstack.as_awaitable, g)
+        self.assertRaises(TypeError, greenstack.as_awaitable, None)
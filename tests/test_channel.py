@@ -0,0 +1,339 @@
+import unittest
+
+import greenstack
+
+
+class ChannelTests(unittest.TestCase):
+    def test_send_to_waiting_receiver(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        seen = []
+
+        def receiver():
+            seen.append(('got', ch.receive()))
+
+        def sender():
+            seen.append('send')
+            ch.send(42)
+            seen.append('sent')
+
+        sched.spawn(receiver)
+        sched.spawn(sender)
+        sched.run()
+        # the receiver runs as soon as the value is handed over
+        self.assertEqual(seen, ['send', ('got', 42), 'sent'])
+
+    def test_receive_from_waiting_sender(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        seen = []
+
+        def sender():
+            ch.send('x')
+            seen.append('sent')
+
+        def receiver():
+            seen.append(('got', ch.receive()))
+
+        sched.spawn(sender)
+        sched.spawn(receiver)
+        sched.run()
+        self.assertEqual(seen, [('got', 'x'), 'sent'])
+
+    def test_prefer_sender(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        ch.preference = 1
+        seen = []
+
+        def receiver():
+            seen.append(('got', ch.receive()))
+
+        def sender():
+            ch.send(1)
+            seen.append('sent')
+
+        sched.spawn(receiver)
+        sched.spawn(sender)
+        sched.run()
+        self.assertEqual(seen, ['sent', ('got', 1)])
+        self.assertEqual(ch.preference, 1)
+
+    def test_balance(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        self.assertEqual(ch.balance, 0)
+        for i in range(3):
+            sched.spawn(ch.send, i)
+        sched.run()
+        self.assertEqual(ch.balance, 3)
+        self.assertEqual([ch.receive() for i in range(3)], [0, 1, 2])
+        self.assertEqual(ch.balance, 0)
+
+        got = []
+        for i in range(2):
+            sched.spawn(lambda: got.append(ch.receive()))
+        sched.run()
+        self.assertEqual(ch.balance, -2)
+        ch.send('a')
+        ch.send('b')
+        self.assertEqual(ch.balance, 0)
+        sched.run()
+        self.assertEqual(got, ['a', 'b'])
+
+    def test_main_greenstack_send(self):
+        # without a loop running, send() runs the loop until it is done
+        sched = greenstack.getscheduler()
+        ch = greenstack.channel()
+        got = []
+        sched.spawn(lambda: got.append(ch.receive()))
+        sched.run()
+        ch.send(7)
+        self.assertEqual(got, [7])
+
+    def test_send_to_other_scheduler(self):
+        # the receiver is left to the scheduler it is parked in
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        got = []
+        sched.spawn(lambda: got.append(ch.receive()))
+        sched.run()
+        ch.send(7)
+        self.assertEqual(got, [])
+        sched.run()
+        self.assertEqual(got, [7])
+
+    def test_send_exception(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        caught = []
+
+        def receiver():
+            try:
+                ch.receive()
+            except ValueError as e:
+                caught.append(e.args)
+
+        sched.spawn(receiver)
+        sched.spawn(ch.send_exception, ValueError, 'a', 1)
+        sched.run()
+        self.assertEqual(caught, [('a', 1)])
+        self.assertRaises(TypeError, ch.send_exception, 42)
+
+    def test_send_sequence(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        got = []
+        result = []
+
+        def sender():
+            result.append(ch.send_sequence(range(5)))
+            ch.close()
+
+        def receiver():
+            for x in ch:
+                got.append(x)
+
+        sched.spawn(receiver)
+        sched.spawn(sender)
+        sched.run()
+        self.assertEqual(got, [0, 1, 2, 3, 4])
+        self.assertEqual(result, [5])
+        self.assertTrue(ch.closed)
+
+    def test_pipeline(self):
+        sched = greenstack.Scheduler()
+        first = ch = greenstack.channel()
+        out = []
+
+        def link(src, dst):
+            for x in src:
+                dst.send(x + 1)
+            dst.close()
+
+        for i in range(50):
+            nxt = greenstack.channel()
+            sched.spawn(link, ch, nxt)
+            ch = nxt
+        last = ch
+        sched.spawn(lambda: out.extend(last))
+        sched.spawn(lambda: (first.send_sequence(range(10)), first.close()))
+        sched.run()
+        self.assertEqual(out, list(range(50, 60)))
+
+    def test_close(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        sched.spawn(ch.send, 1)
+        sched.run()
+        ch.close()
+        self.assertTrue(ch.closing)
+        self.assertFalse(ch.closed)
+        self.assertRaises(ValueError, ch.send, 2)
+        self.assertEqual(ch.receive(), 1)
+        self.assertTrue(ch.closed)
+        self.assertRaises(ValueError, ch.receive)
+        self.assertEqual(list(ch), [])
+        ch.open()
+        self.assertFalse(ch.closing)
+
+    def test_close_wakes_receivers(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        seen = []
+
+        def receiver():
+            try:
+                ch.receive()
+            except ValueError:
+                seen.append('closed')
+
+        def iterate():
+            seen.append(list(ch))
+
+        sched.spawn(receiver)
+        sched.spawn(iterate)
+        sched.run()
+        self.assertEqual(ch.balance, -2)
+        ch.close()
+        self.assertEqual(ch.balance, 0)
+        sched.run()
+        self.assertEqual(seen, ['closed', []])
+
+    def test_timeout_while_receiving(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        seen = []
+
+        def receiver():
+            try:
+                with greenstack.Timeout(0.01):
+                    ch.receive()
+            except greenstack.Timeout:
+                seen.append('timeout')
+            seen.append(ch.balance)
+
+        sched.spawn(receiver)
+        sched.run()
+        self.assertEqual(seen, ['timeout', 0])
+
+    def test_spurious_wake_keeps_waiting(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        got = []
+        g = sched.spawn(lambda: got.append(ch.receive()))
+        sched.run()
+        sched.wake(g)
+        sched.run()
+        self.assertEqual(got, [])
+        self.assertEqual(ch.balance, -1)
+        ch.send(3)
+        sched.run()
+        self.assertEqual(got, [3])
+
+
+class SelectTests(unittest.TestCase):
+    def test_ready_case(self):
+        sched = greenstack.Scheduler()
+        a = greenstack.channel()
+        b = greenstack.channel()
+        sched.spawn(b.send, 'b')
+        sched.run()
+        result = []
+        sched.spawn(lambda: result.append(
+            greenstack.select([a.recv_op(), b.recv_op()])))
+        sched.run()
+        self.assertEqual(result, [(1, 'b')])
+        self.assertEqual(a.balance, 0)
+        self.assertEqual(b.balance, 0)
+
+    def test_blocks_until_one_case_fires(self):
+        sched = greenstack.Scheduler()
+        data = greenstack.channel()
+        control = greenstack.channel()
+        out = greenstack.channel()
+        result = []
+        got = []
+
+        def router():
+            result.append(greenstack.select(
+                [data.recv_op(), control.recv_op(), out.send_op('x')]))
+            result.append((data.balance, control.balance, out.balance))
+
+        sched.spawn(router)
+        sched.run()
+        self.assertEqual((data.balance, control.balance, out.balance),
+                         (-1, -1, 1))
+        sched.spawn(control.send, 'stop')
+        sched.run()
+        self.assertEqual(result, [(1, 'stop'), (0, 0, 0)])
+
+        result[:] = []
+        sched.spawn(router)
+        sched.spawn(lambda: got.append(out.receive()))
+        sched.run()
+        self.assertEqual(result, [(2, None), (0, 0, 0)])
+        self.assertEqual(got, ['x'])
+
+    def test_only_one_case_fires(self):
+        sched = greenstack.Scheduler()
+        chans = [greenstack.channel() for i in range(3)]
+        result = []
+        sched.spawn(lambda: result.append(
+            greenstack.select([ch.recv_op() for ch in chans])))
+        sched.run()
+        for i, ch in enumerate(chans):
+            sched.spawn(ch.send, i)
+        sched.run()
+        self.assertEqual(result, [(0, 0)])
+        self.assertEqual([ch.balance for ch in chans], [0, 1, 1])
+
+    def test_many_cases(self):
+        sched = greenstack.Scheduler()
+        chans = [greenstack.channel() for i in range(20)]
+        result = []
+        sched.spawn(lambda: result.append(
+            greenstack.select([ch.recv_op() for ch in chans])))
+        sched.run()
+        chans[17].send('v')
+        sched.run()
+        self.assertEqual(result, [(17, 'v')])
+        self.assertEqual([ch.balance for ch in chans], [0] * 20)
+
+    def test_timeout(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        result = []
+        sched.spawn(lambda: result.append(
+            greenstack.select([ch.recv_op()], timeout=0.01)))
+        sched.run()
+        self.assertEqual(result, [None])
+        self.assertEqual(ch.balance, 0)
+        self.assertEqual(greenstack.select([ch.recv_op()], timeout=0), None)
+
+    def test_closed_channel(self):
+        sched = greenstack.Scheduler()
+        ch = greenstack.channel()
+        errors = []
+
+        def f():
+            try:
+                greenstack.select([ch.recv_op()])
+            except ValueError:
+                errors.append(ch.balance)
+
+        sched.spawn(f)
+        sched.run()
+        ch.close()
+        sched.run()
+        self.assertEqual(errors, [0])
+        self.assertRaises(ValueError, greenstack.select, [ch.send_op(1)])
+
+    def test_bad_cases(self):
+        self.assertRaises(TypeError, greenstack.select, [1])
+        self.assertRaises(TypeError, greenstack.select, 1)
+        self.assertRaises(ValueError, greenstack.select, [])
+        self.assertEqual(greenstack.select([], timeout=0), None)
+        op = greenstack.channel().send_op(1)
+        self.assertTrue(op.is_send)
+        self.assertTrue(isinstance(op.channel, greenstack.channel))
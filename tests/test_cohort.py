@@ -0,0 +1,52 @@
+import unittest
+
+import greenstack
+
+
+class CohortTests(unittest.TestCase):
+    def run_interleaved(self, sched, rounds=2):
+        seen = []
+
+        def a(i):
+            for r in range(rounds):
+                seen.append(('a', i))
+                sched.yield_()
+
+        def b(i):
+            for r in range(rounds):
+                seen.append(('b', i))
+                sched.yield_()
+
+        for i in range(3):
+            sched.spawn(a, i)
+            sched.spawn(b, i)
+        sched.run()
+        return [name for name, i in seen]
+
+    def test_fifo_by_default(self):
+        sched = greenstack.Scheduler()
+        self.assertEqual(self.run_interleaved(sched), list('ababab') * 2)
+
+    def test_grouped_by_code(self):
+        sched = greenstack.Scheduler()
+        self.assertEqual(sched.set_cohort_window(10), 0)
+        self.assertEqual(self.run_interleaved(sched), list('aaabbb') * 2)
+
+    def test_window(self):
+        sched = greenstack.Scheduler()
+        sched.set_cohort_window(2)
+        self.assertEqual(self.run_interleaved(sched, 1), list('aabbab'))
+        self.assertEqual(sched.set_cohort_window(0), 2)
+        self.assertRaises(ValueError, sched.set_cohort_window, -1)
+
+    def test_user_key(self):
+        sched = greenstack.Scheduler()
+        sched.set_cohort_window(10)
+        seen = []
+        gs = [sched.spawn(seen.append, i) for i in range(6)]
+        for g in gs:
+            sched.set_cohort(g, g in gs[::2] and 'even' or 'odd')
+        sched.set_cohort(gs[5], None)
+        sched.run()
+        # the first pass is grouped
+        self.assertEqual(seen, [0, 2, 4, 1, 3, 5])
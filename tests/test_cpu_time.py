@@ -0,0 +1,73 @@
+import unittest
+
+import greenstack
+
+
+def spin(n):
+    x = 0
+    for i in range(n):
+        x += i
+    return x
+
+
+def worker(n):
+    while True:
+        spin(n)
+        greenstack.getcurrent().parent.switch()
+
+
+class CpuTimeTests(unittest.TestCase):
+    def setUp(self):
+        self.old = greenstack.set_cpu_accounting(1)
+
+    def tearDown(self):
+        greenstack.set_cpu_accounting(self.old)
+
+    def test_switch_count(self):
+        g = greenstack.greenstack(worker)
+        self.assertEqual(g.switch_count, 0)
+        for i in range(5):
+            g.switch(1)
+        self.assertEqual(g.switch_count, 5)
+
+    def test_cpu_time(self):
+        busy = greenstack.greenstack(worker)
+        idle = greenstack.greenstack(worker)
+        for i in range(50):
+            busy.switch(20000)
+            idle.switch(10)
+        self.assertTrue(busy.cpu_time > 0)
+        self.assertTrue(busy.cpu_time > 10 * idle.cpu_time)
+        top = greenstack.top_cpu(2)
+        self.assertEqual([g for t, g in top], [busy, idle])
+        self.assertEqual(top[0][0], busy.cpu_time)
+        self.assertTrue(busy in [g for t, g in greenstack.top_cpu(100)])
+
+    def test_current(self):
+        # the time of the running greenstack includes what it used so far
+        def body():
+            before = greenstack.getcurrent().cpu_time
+            spin(100000)
+            return greenstack.getcurrent().cpu_time - before
+
+        self.assertTrue(greenstack.greenstack(body).switch() > 0)
+
+    def test_sampling(self):
+        greenstack.set_cpu_accounting(16)
+        busy = greenstack.greenstack(worker)
+        idle = greenstack.greenstack(worker)
+        for i in range(2000):
+            busy.switch(2000)
+            idle.switch(10)
+        self.assertTrue(busy.cpu_time > 5 * idle.cpu_time)
+        self.assertEqual(busy.switch_count, 2000)
+
+    def test_off(self):
+        greenstack.set_cpu_accounting(0)
+        g = greenstack.greenstack(worker)
+        for i in range(10):
+            g.switch(1000)
+        self.assertEqual(g.cpu_time, 0)
+        self.assertEqual(g.switch_count, 10)
+        self.assertEqual(greenstack.set_cpu_accounting(0), 0)
+        self.assertRaises(ValueError, greenstack.set_cpu_accounting, -1)
@@ -0,0 +1,106 @@
+import threading
+import time
+import unittest
+
+import greenstack
+
+
+def parked():
+    greenstack.getcurrent().parent.switch()
+
+
+class EnumerateTests(unittest.TestCase):
+    def test_lifecycle(self):
+        before = greenstack.enumerate()
+        g = greenstack.greenstack(parked)
+        self.assertFalse(g in greenstack.enumerate())
+        g.switch()
+        self.assertEqual(greenstack.enumerate(), before + [g])
+        g.switch()
+        self.assertTrue(g.dead)
+        self.assertEqual(greenstack.enumerate(), before)
+
+    def test_dealloc(self):
+        before = len(greenstack.enumerate())
+        g = greenstack.greenstack(parked)
+        g.switch()
+        self.assertEqual(len(greenstack.enumerate()), before + 1)
+        del g
+        self.assertEqual(len(greenstack.enumerate()), before)
+
+    def test_state(self):
+        main = greenstack.getcurrent()
+        while main.parent is not None:
+            main = main.parent
+        g = greenstack.greenstack(parked)
+        g.switch()
+        self.assertEqual(greenstack.enumerate(state='running'),
+                         [greenstack.getcurrent()])
+        parked_ones = greenstack.enumerate(state='parked')
+        self.assertTrue(g in parked_ones)
+        self.assertFalse(greenstack.getcurrent() in parked_ones)
+        self.assertTrue(main in greenstack.enumerate())
+
+        def inside():
+            self.assertEqual(greenstack.enumerate(state='running'), [h])
+            self.assertTrue(greenstack.getcurrent().parent in
+                            greenstack.enumerate(state='parked'))
+
+        h = greenstack.greenstack(inside)
+        h.switch()
+        g.switch()
+        self.assertRaises(ValueError, greenstack.enumerate, state='dead')
+
+    def test_other_thread(self):
+        ready = threading.Event()
+        done = threading.Event()
+        result = []
+
+        def other():
+            g = greenstack.greenstack(parked)
+            g.switch()
+            result.append(g)
+            ready.set()
+            done.wait()
+            g.switch()
+
+        t = threading.Thread(target=other)
+        t.start()
+        ready.wait()
+        try:
+            theirs = greenstack.enumerate(thread=t.ident)
+            self.assertTrue(result[0] in theirs)
+            self.assertEqual(greenstack.enumerate(thread=t.ident, state='parked'),
+                             result)
+            self.assertFalse(result[0] in greenstack.enumerate())
+        finally:
+            done.set()
+            t.join()
+        self.assertEqual(greenstack.enumerate(thread=t.ident), [])
+
+    def test_age_and_idle(self):
+        g = greenstack.greenstack(parked)
+        self.assertEqual(g.age, 0)
+        self.assertEqual(g.idle, 0)
+        g.switch()
+        time.sleep(0.05)
+        self.assertTrue(g.age >= 0.03)
+        self.assertTrue(g.idle >= 0.03)
+        self.assertEqual(greenstack.getcurrent().idle, 0)
+        self.assertTrue([h for h in greenstack.enumerate(state='parked')
+                         if h.idle > 0.03])
+        g.switch()
+
+    def test_idle_restarts_after_running(self):
+        def loop():
+            while True:
+                greenstack.getcurrent().parent.switch()
+
+        g = greenstack.greenstack(loop)
+        g.switch()
+        time.sleep(0.05)
+        self.assertTrue(g.idle >= 0.03)
+        self.assertTrue(g.idle >= 0.03)
+        g.switch()
+        self.assertTrue(g.idle < 0.03)
+        g.throw(greenstack.GreenstackExit)
@@ -68,3 +68,11 @@ class CAPITests(unittest.TestCase):
             str(seen[0]),
             'take that sucka!',
             "message doesn't match")
+
+    def test_stats(self):
+        stats = greenstack.stats()
+        greenstack.greenstack(lambda: None).switch()
+        self.assertEqual(
+            _test_extension.test_stats(),
+            (stats['switches'] + 2, stats['creations'] + 1,
+             stats['deaths'] + 1))
@@ -0,0 +1,178 @@
+import errno
+import os
+import socket
+import sys
+import time
+import unittest
+
+import greenstack
+
+
+def read_nonblocking(fd):
+    try:
+        return os.read(fd, 4096)
+    except OSError:
+        if sys.exc_info()[1].errno != errno.EAGAIN:
+            raise
+        return None
+
+
+def nonblocking_pipe():
+    import fcntl
+    r, w = os.pipe()
+    for fd in (r, w):
+        flags = fcntl.fcntl(fd, fcntl.F_GETFL)
+        fcntl.fcntl(fd, fcntl.F_SETFL, flags | os.O_NONBLOCK)
+    return r, w
+
+
+class IOTests(unittest.TestCase):
+    def setUp(self):
+        if not hasattr(greenstack, 'wait_readable'):
+            self.skipTest('no fd support on this platform')
+        self.fds = []
+
+    def tearDown(self):
+        for fd in self.fds:
+            greenstack.notify_close(fd)
+            os.close(fd)
+
+    def pipe(self):
+        r, w = nonblocking_pipe()
+        self.fds += [r, w]
+        return r, w
+
+    def test_pipe(self):
+        sched = greenstack.Scheduler()
+        r, w = self.pipe()
+        seen = []
+
+        def reader():
+            while True:
+                data = read_nonblocking(r)
+                if data is None:
+                    self.assertTrue(greenstack.wait_readable(r))
+                    continue
+                seen.append(data)
+                if data.endswith(b'.'):
+                    break
+
+        def writer():
+            for chunk in (b'a', b'b', b'c.'):
+                greenstack.sleep(0.005)
+                os.write(w, chunk)
+
+        sched.spawn(reader)
+        sched.spawn(writer)
+        sched.run()
+        self.assertEqual(b''.join(seen), b'abc.')
+
+    def test_timeout(self):
+        r, w = self.pipe()
+        start = time.time()
+        self.assertFalse(greenstack.wait_readable(r, timeout=0.02))
+        self.assertTrue(time.time() - start >= 0.015)
+
+    def test_writable(self):
+        r, w = self.pipe()
+        self.assertTrue(greenstack.wait_writable(w, timeout=1))
+
+    def test_edge_is_remembered(self):
+        # the edge arrives while nobody waits; the next wait returns at once
+        sched = greenstack.Scheduler()
+        r, w = self.pipe()
+        seen = []
+
+        def f():
+            self.assertTrue(greenstack.wait_readable(r, timeout=1))
+            os.read(r, 1)
+            os.write(w, b'y')
+            greenstack.sleep(0.01)
+            start = time.time()
+            self.assertTrue(greenstack.wait_readable(r, timeout=1))
+            seen.append(time.time() - start)
+
+        os.write(w, b'x')
+        sched.spawn(f)
+        sched.run()
+        self.assertTrue(seen[0] < 0.005)
+
+    def test_socketpair(self):
+        sched = greenstack.Scheduler()
+        a, b = socket.socketpair()
+        a.setblocking(False)
+        b.setblocking(False)
+        seen = []
+
+        def server():
+            while True:
+                try:
+                    data = b.recv(100)
+                except socket.error:
+                    greenstack.wait_readable(b)
+                    continue
+                b.send(data.upper())
+                return
+
+        def client():
+            a.send(b'ping')
+            greenstack.wait_readable(a)
+            seen.append(a.recv(100))
+
+        sched.spawn(server)
+        sched.spawn(client)
+        sched.run()
+        for s in (a, b):
+            greenstack.notify_close(s)
+            s.close()
+        self.assertEqual(seen, [b'PING'])
+
+    def test_many_waiters(self):
+        sched = greenstack.Scheduler()
+        pipes = [self.pipe() for i in range(50)]
+        done = []
+
+        def reader(r):
+            greenstack.wait_readable(r)
+            done.append(os.read(r, 10))
+
+        def writer():
+            for r, w in pipes:
+                os.write(w, b'x')
+
+        for r, w in pipes:
+            sched.spawn(reader, r)
+        sched.spawn(writer)
+        sched.run()
+        self.assertEqual(done, [b'x'] * 50)
+
+    def test_notify_close_wakes_waiters(self):
+        sched = greenstack.Scheduler()
+        r, w = self.pipe()
+        seen = []
+
+        def waiter():
+            seen.append(greenstack.wait_readable(r, timeout=5))
+
+        def closer():
+            greenstack.notify_close(r)
+
+        sched.spawn(waiter)
+        sched.spawn(closer)
+        start = time.time()
+        sched.run()
+        self.assertEqual(seen, [True])
+        self.assertTrue(time.time() - start < 1)
+
+    def test_regular_file_is_always_ready(self):
+        import tempfile
+        f = tempfile.TemporaryFile()
+        try:
+            self.assertTrue(greenstack.wait_readable(f))
+            self.assertTrue(greenstack.wait_writable(f.fileno()))
+        finally:
+            f.close()
+
+    def test_bad_fd(self):
+        self.assertRaises(ValueError, greenstack.wait_readable, -1)
+        self.assertRaises(TypeError, greenstack.wait_readable, 'x')
@@ -0,0 +1,178 @@
+import unittest
+
+import greenstack
+
+
+class LockTests(unittest.TestCase):
+    def test_uncontended(self):
+        lock = greenstack.Lock()
+        self.assertFalse(lock.locked())
+        self.assertTrue(lock.acquire())
+        self.assertTrue(lock.locked())
+        self.assertFalse(lock.acquire(False))
+        self.assertFalse(lock.acquire(timeout=0))
+        lock.release()
+        self.assertFalse(lock.locked())
+        self.assertRaises(RuntimeError, lock.release)
+        with lock:
+            self.assertTrue(lock.locked())
+        self.assertFalse(lock.locked())
+
+    def test_fifo_handoff(self):
+        sched = greenstack.Scheduler()
+        lock = greenstack.Lock()
+        seen = []
+
+        def worker(name):
+            with lock:
+                seen.append(name)
+                sched.yield_()
+
+        def barger():
+            # runs while the lock is being handed over and must not get it
+            self.assertFalse(lock.acquire(False))
+            seen.append('barger')
+
+        lock.acquire()
+        for name in 'abc':
+            sched.spawn(worker, name)
+        sched.run()
+        self.assertEqual(seen, [])
+        lock.release()
+        self.assertTrue(lock.locked())
+        sched.spawn(barger)
+        sched.run()
+        self.assertEqual(seen, ['a', 'barger', 'b', 'c'])
+        self.assertFalse(lock.locked())
+
+    def test_timeout(self):
+        sched = greenstack.Scheduler()
+        lock = greenstack.Lock()
+        result = []
+        lock.acquire()
+        sched.spawn(lambda: result.append(lock.acquire(timeout=0.01)))
+        sched.run()
+        self.assertEqual(result, [False])
+        lock.release()
+        self.assertFalse(lock.locked())
+
+    def test_interrupted_waiter_passes_lock_on(self):
+        sched = greenstack.Scheduler()
+        lock = greenstack.Lock()
+        seen = []
+
+        def interrupted():
+            try:
+                lock.acquire()
+            except greenstack.GreenstackExit:
+                seen.append('interrupted')
+
+        def waiter():
+            lock.acquire()
+            seen.append('waiter')
+            lock.release()
+
+        lock.acquire()
+        g = sched.spawn(interrupted)
+        sched.spawn(waiter)
+        sched.run()
+        # the lock goes to g, which is killed before it runs
+        lock.release()
+        g.throw()
+        sched.run()
+        self.assertEqual(seen, ['interrupted', 'waiter'])
+        self.assertFalse(lock.locked())
+
+
+class RLockTests(unittest.TestCase):
+    def test_recursion(self):
+        sched = greenstack.Scheduler()
+        lock = greenstack.RLock()
+        seen = []
+
+        def other():
+            with lock:
+                seen.append('other')
+
+        with lock:
+            with lock:
+                sched.spawn(other)
+                sched.run()
+            self.assertEqual(seen, [])
+        sched.run()
+        self.assertEqual(seen, ['other'])
+
+    def test_release_by_non_owner(self):
+        sched = greenstack.Scheduler()
+        lock = greenstack.RLock()
+        errors = []
+
+        def other():
+            try:
+                lock.release()
+            except RuntimeError:
+                errors.append(1)
+
+        self.assertRaises(RuntimeError, lock.release)
+        lock.acquire()
+        sched.spawn(other)
+        sched.run()
+        lock.release()
+        self.assertEqual(errors, [1])
+
+
+class SemaphoreTests(unittest.TestCase):
+    def test_counting(self):
+        sched = greenstack.Scheduler()
+        sem = greenstack.Semaphore(2)
+        active = []
+        peak = []
+
+        def worker():
+            with sem:
+                active.append(1)
+                peak.append(len(active))
+                greenstack.sleep(0)
+                active.pop()
+
+        for i in range(5):
+            sched.spawn(worker)
+        sched.run()
+        self.assertEqual(max(peak), 2)
+        self.assertEqual(sem.value, 2)
+
+    def test_bad_value(self):
+        self.assertRaises(ValueError, greenstack.Semaphore, -1)
+
+
+class EventTests(unittest.TestCase):
+    def test_set_wakes_all(self):
+        sched = greenstack.Scheduler()
+        event = greenstack.Event()
+        seen = []
+
+        def waiter(i):
+            seen.append(event.wait())
+            seen.append(i)
+
+        for i in range(3):
+            sched.spawn(waiter, i)
+        sched.run()
+        self.assertEqual(seen, [])
+        self.assertEqual(len(sched), 0)
+        event.set()
+        self.assertEqual(len(sched), 3)
+        sched.run()
+        self.assertEqual(seen, [True, 0, True, 1, True, 2])
+        self.assertTrue(event.wait())
+        event.clear()
+        self.assertFalse(event.is_set())
+
+    def test_wait_timeout(self):
+        sched = greenstack.Scheduler()
+        event = greenstack.Event()
+        result = []
+        sched.spawn(lambda: result.append(event.wait(0.01)))
+        sched.run()
+        self.assertEqual(result, [False])
+        self.assertFalse(event.wait(0))
@@ -0,0 +1,130 @@
+import unittest
+
+import greenstack
+
+
+class NurseryTests(unittest.TestCase):
+    def test_join_waits_for_children(self):
+        seen = []
+
+        def child(i):
+            greenstack.sleep(0.001 * (3 - i))
+            seen.append(i)
+
+        with greenstack.Nursery() as n:
+            for i in range(3):
+                n.spawn(child, i)
+            self.assertEqual(len(n.children), 3)
+        self.assertEqual(sorted(seen), [0, 1, 2])
+        self.assertEqual(n.children, [])
+        self.assertRaises(RuntimeError, n.spawn, child, 0)
+
+    def test_one_wakeup(self):
+        sched = greenstack.Scheduler()
+        resumed = []
+
+        def joiner():
+            n = greenstack.Nursery()
+            for i in range(10):
+                n.spawn(sched.yield_)
+            n.join()
+            resumed.append(len(n.children))
+
+        g = sched.spawn(joiner)
+        sched.run()
+        # woken once, by the last child
+        self.assertEqual(resumed, [0])
+        self.assertFalse(g)
+
+    def test_child_error_cancels_siblings(self):
+        seen = []
+
+        def sleeper():
+            try:
+                greenstack.sleep(10)
+            except greenstack.GreenstackExit:
+                seen.append('cancelled')
+                raise
+
+        def failing():
+            greenstack.sleep(0)
+            raise ValueError('boom')
+
+        n = greenstack.Nursery()
+        n.spawn(sleeper)
+        n.spawn(sleeper)
+        n.spawn(failing)
+        self.assertRaises(ValueError, n.join)
+        self.assertEqual(seen, ['cancelled', 'cancelled'])
+        self.assertTrue(n.cancelled)
+        self.assertEqual(n.children, [])
+
+    def test_body_error_cancels_children(self):
+        seen = []
+
+        def sleeper():
+            try:
+                greenstack.sleep(10)
+            except greenstack.GreenstackExit:
+                seen.append('cancelled')
+
+        def body():
+            with greenstack.Nursery() as n:
+                n.spawn(sleeper)
+                greenstack.sleep(0)
+                raise KeyError
+
+        self.assertRaises(KeyError, body)
+        self.assertEqual(seen, ['cancelled'])
+
+    def test_cancel_unstarted(self):
+        seen = []
+        n = greenstack.Nursery()
+        for i in range(3):
+            n.spawn(seen.append, i)
+        n.cancel()
+        n.join()
+        self.assertEqual(seen, [])
+        self.assertRaises(RuntimeError, n.spawn, seen.append, 0)
+
+    def test_interrupted_joiner_cancels(self):
+        seen = []
+
+        def sleeper():
+            try:
+                greenstack.sleep(10)
+            except greenstack.GreenstackExit:
+                seen.append('child')
+
+        n = greenstack.Nursery()
+        n.spawn(sleeper)
+        try:
+            with greenstack.Timeout(0.01):
+                n.join()
+        except greenstack.Timeout:
+            seen.append('timeout')
+        self.assertEqual(seen, ['timeout'])
+        self.assertTrue(n.cancelled)
+        n.join()
+        self.assertEqual(seen, ['timeout', 'child'])
+
+    def test_join_from_child(self):
+        errors = []
+        n = greenstack.Nursery()
+
+        def child():
+            try:
+                n.join()
+            except RuntimeError:
+                errors.append(1)
+
+        n.spawn(child)
+        n.join()
+        self.assertEqual(errors, [1])
+
+    def test_many_children(self):
+        n = greenstack.Nursery()
+        for i in range(1000):
+            n.spawn(greenstack.sleep, 0)
+        n.join()
+        self.assertEqual(n.children, [])
@@ -0,0 +1,71 @@
+import threading
+import time
+import unittest
+
+import greenstack
+
+
+class PreemptTests(unittest.TestCase):
+    def spin(self, seen, seconds):
+        end = time.time() + seconds
+        while time.time() < end:
+            pass
+        seen.append('spun')
+
+    def test_hog_is_preempted(self):
+        sched = greenstack.Scheduler()
+        seen = []
+        self.assertEqual(sched.set_time_slice(0.005), None)
+        try:
+            hog = sched.spawn(self.spin, seen, 0.5)
+            sched.spawn(seen.append, 'other')
+            sched.run()
+        finally:
+            self.assertEqual(sched.set_time_slice(None), 0.005)
+        self.assertEqual(seen, ['other', 'spun'])
+        self.assertTrue(hog.preempted > 0)
+
+    def test_off_by_default(self):
+        sched = greenstack.Scheduler()
+        seen = []
+        hog = sched.spawn(self.spin, seen, 0.05)
+        sched.spawn(seen.append, 'other')
+        sched.run()
+        self.assertEqual(seen, ['spun', 'other'])
+        self.assertEqual(hog.preempted, 0)
+
+    def test_cancel_preempted(self):
+        sched = greenstack.getscheduler()
+        seen = []
+
+        def canceller():
+            seen.append('other')
+            n.cancel()
+
+        prev = sched.set_time_slice(0.005)
+        try:
+            n = greenstack.Nursery()
+            hog = n.spawn(self.spin, seen, 10)
+            sched.spawn(canceller)
+            n.join()
+        finally:
+            sched.set_time_slice(prev)
+        self.assertEqual(seen, ['other'])
+        self.assertTrue(hog.dead)
+        self.assertEqual(hog.preempted, 1)
+
+    def test_main_thread_only(self):
+        errors = []
+
+        def other():
+            try:
+                greenstack.Scheduler().set_time_slice(0.01)
+            except greenstack.error:
+                errors.append(1)
+
+        t = threading.Thread(target=other)
+        t.start()
+        t.join()
+        self.assertEqual(errors, [1])
+        self.assertRaises(ValueError,
+                          greenstack.Scheduler().set_time_slice, 0)
@@ -0,0 +1,89 @@
+import unittest
+
+import greenstack
+
+
+class PriorityTests(unittest.TestCase):
+    def test_high_runs_first(self):
+        sched = greenstack.Scheduler()
+        seen = []
+        names = ('low', 'normal', 'high')
+        gs = [sched.spawn(lambda name=name: (sched.park(), seen.append(name)))
+              for name in names]
+        self.assertEqual(sched.set_priority(gs[0], greenstack.PRIORITY_LOW),
+                         greenstack.PRIORITY_NORMAL)
+        sched.set_priority(gs[2], greenstack.PRIORITY_HIGH)
+        # applies from the next wakeup, so they still start in order
+        sched.run()
+        for g in gs:
+            sched.wake(g)
+        sched.run()
+        self.assertEqual(seen, ['high', 'normal', 'low'])
+        self.assertRaises(ValueError, sched.set_priority, gs[0], 2)
+
+    def test_spawn_inherits(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def parent():
+            sched.spawn(seen.append, 'child')
+            sched.spawn(seen.append, 'other')
+            sched.yield_()
+            seen.append('parent')
+
+        g = sched.spawn(parent)
+        sched.set_priority(g, greenstack.PRIORITY_LOW)
+        sched.run()
+        # both children are low too, and queued ahead of the parent
+        self.assertEqual(seen, ['child', 'other', 'parent'])
+
+    def test_deadline_order(self):
+        sched = greenstack.Scheduler()
+        seen = []
+        delays = (0.3, None, 0.1, 0.2)
+        gs = [sched.spawn(lambda delay=delay: (sched.park(),
+                                               seen.append(delay)))
+              for delay in delays]
+        sched.run()
+        for g, delay in zip(gs, delays):
+            if delay is not None:
+                sched.set_deadline(g, delay)
+        sched.set_priority(gs[1], greenstack.PRIORITY_HIGH)
+        for g in gs:
+            sched.wake(g)
+        sched.run()
+        self.assertEqual(seen, [0.1, 0.2, 0.3, None])
+        sched.set_deadline(gs[0], None)
+
+    def test_distant_deadline(self):
+        sched = greenstack.Scheduler()
+        seen = []
+        delays = (float('inf'), None, 1e30, 1.0)
+        gs = [sched.spawn(lambda delay=delay: (sched.park(),
+                                               seen.append(delay)))
+              for delay in delays]
+        sched.run()
+        for g, delay in zip(gs, delays):
+            if delay is not None:
+                sched.set_deadline(g, delay)
+        for g in gs:
+            sched.wake(g)
+        sched.run()
+        # the distant ones are clamped to the same far deadline
+        self.assertEqual(seen[0], 1.0)
+        self.assertEqual(sorted(seen[1:3]), [1e30, float('inf')])
+        self.assertEqual(seen[3], None)
+
+    def test_wait_stats(self):
+        sched = greenstack.Scheduler()
+        sched.wait_stats(reset=True)
+        for i in range(5):
+            sched.spawn(sched.yield_)
+        sched.run()
+        stats = sched.wait_stats(reset=True)
+        self.assertEqual(sorted(stats), ['deadline', 'high', 'low', 'normal'])
+        count, total, longest = stats['normal']
+        self.assertEqual(count, 10)
+        self.assertTrue(0 <= longest <= total)
+        self.assertEqual(stats['high'], (0, 0.0, 0.0))
+        self.assertEqual(sched.wait_stats()['normal'], (0, 0.0, 0.0))
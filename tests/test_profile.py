@@ -0,0 +1,121 @@
+import threading
+import time
+import unittest
+
+import greenstack
+
+
+def parked_here():
+    greenstack.getcurrent().parent.switch()
+
+
+def busy(seconds):
+    end = time.time() + seconds
+    while time.time() < end:
+        pass
+
+
+def stacks(p, root, name):
+    return [(stack, n) for stack, n in p.stacks.items()
+            if stack.startswith(root + ';') and (';' + name + ' (') in stack]
+
+
+class ProfilerTests(unittest.TestCase):
+    def test_sample(self):
+        gs = [greenstack.greenstack(parked_here) for i in range(3)]
+        for g in gs:
+            g.switch()
+        p = greenstack.Profiler()
+        for i in range(2):
+            p.sample()
+        self.assertEqual(p.samples, 2)
+        parked = stacks(p, 'parked', 'parked_here')
+        self.assertEqual(len(parked), 1)
+        self.assertEqual(parked[0][1], 6)
+        self.assertEqual(len(stacks(p, 'running', 'test_sample')), 1)
+        # the running greenstack is not counted as parked too
+        self.assertEqual(stacks(p, 'parked', 'test_sample'), [])
+        for g in gs:
+            g.switch()
+        p.clear()
+        p.sample()
+        self.assertEqual(stacks(p, 'parked', 'parked_here'), [])
+
+    def test_collapsed(self):
+        def outer():
+            parked_here()
+
+        g = greenstack.greenstack(outer)
+        g.switch()
+        p = greenstack.Profiler()
+        p.sample()
+        lines = p.collapsed().splitlines()
+        self.assertEqual(len(lines), len(p.stacks))
+        for line in lines:
+            stack, n = line.rsplit(' ', 1)
+            self.assertEqual(p.stacks[stack], int(n))
+        parked = stacks(p, 'parked', 'parked_here')[0][0].split(';')
+        self.assertEqual(parked[0], 'parked')
+        self.assertTrue(parked[1].startswith('outer ('))
+        self.assertTrue(parked[2].startswith('parked_here ('))
+        g.switch()
+
+    def test_deep_stack(self):
+        def recurse(n):
+            if n:
+                recurse(n - 1)
+            else:
+                parked_here()
+
+        g = greenstack.greenstack(recurse)
+        g.switch(300)
+        p = greenstack.Profiler()
+        p.sample()
+        parked = stacks(p, 'parked', 'parked_here')[0][0].split(';')
+        self.assertEqual(parked[:2], ['parked', '[truncated]'])
+        self.assertEqual(len(parked), 2 + 256)
+        self.assertTrue(parked[-1].startswith('parked_here ('))
+        self.assertTrue(parked[-2].startswith('recurse ('))
+        g.switch()
+
+    def test_thread(self):
+        g = greenstack.greenstack(parked_here)
+        g.switch()
+        with greenstack.Profiler(0.001) as p:
+            self.assertTrue(p.running)
+            busy(0.1)
+        self.assertFalse(p.running)
+        n = p.samples
+        self.assertTrue(n > 0)
+        self.assertTrue(stacks(p, 'running', 'busy'))
+        self.assertEqual(stacks(p, 'parked', 'parked_here')[0][1], n)
+        busy(0.02)
+        self.assertEqual(p.samples, n)
+        g.switch()
+
+    def test_other_threads(self):
+        ready = threading.Event()
+        done = threading.Event()
+
+        def other():
+            g = greenstack.greenstack(parked_here)
+            g.switch()
+            ready.set()
+            done.wait()
+            g.switch()
+
+        t = threading.Thread(target=other)
+        t.start()
+        ready.wait()
+        try:
+            p = greenstack.Profiler()
+            p.sample()
+            self.assertTrue(stacks(p, 'running', 'other'))
+            self.assertTrue(stacks(p, 'parked', 'parked_here'))
+        finally:
+            done.set()
+            t.join()
+
+    def test_interval(self):
+        self.assertRaises(ValueError, greenstack.Profiler, 0)
+        self.assertRaises(ValueError, greenstack.Profiler, -1)
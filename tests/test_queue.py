@@ -0,0 +1,132 @@
+import unittest
+
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
+import greenstack
+
+
+class QueueTests(unittest.TestCase):
+    def test_fifo(self):
+        q = greenstack.Queue()
+        for i in range(100):
+            q.put(i)
+        self.assertEqual(len(q), 100)
+        self.assertEqual(q.qsize(), 100)
+        self.assertEqual([q.get() for i in range(100)], list(range(100)))
+        self.assertTrue(q.empty())
+        self.assertFalse(q.full())
+        self.assertEqual(q.maxsize, 0)
+
+    def test_nonblocking(self):
+        q = greenstack.Queue(1)
+        self.assertRaises(queue.Empty, q.get_nowait)
+        self.assertRaises(queue.Empty, q.get, False)
+        q.put_nowait(1)
+        self.assertTrue(q.full())
+        self.assertRaises(queue.Full, q.put_nowait, 2)
+        self.assertRaises(queue.Full, q.put, 2, timeout=0)
+        self.assertEqual(q.get_nowait(), 1)
+        self.assertRaises(ValueError, q.put, 2, timeout=-1)
+
+    def test_backpressure(self):
+        sched = greenstack.Scheduler()
+        q = greenstack.Queue(2)
+        seen = []
+
+        def producer():
+            for i in range(5):
+                q.put(i)
+                seen.append(('put', i))
+
+        def consumer():
+            for i in range(5):
+                seen.append(('got', q.get()))
+
+        sched.spawn(producer)
+        sched.run()
+        self.assertEqual(seen, [('put', 0), ('put', 1)])
+        sched.spawn(consumer)
+        sched.run()
+        got = [x for kind, x in seen if kind == 'got']
+        self.assertEqual(got, list(range(5)))
+        # the producer never got more than two items ahead
+        for i in range(5):
+            if i >= 2:
+                self.assertTrue(seen.index(('put', i)) >
+                                seen.index(('got', i - 2)))
+
+    def test_handoff_to_waiting_getter(self):
+        sched = greenstack.Scheduler()
+        q = greenstack.Queue()
+        got = []
+        sched.spawn(lambda: got.append(q.get()))
+        sched.run()
+        q.put('x')
+        # handed straight to the getter, not buffered
+        self.assertEqual(len(q), 0)
+        sched.run()
+        self.assertEqual(got, ['x'])
+
+    def test_get_timeout(self):
+        sched = greenstack.Scheduler()
+        q = greenstack.Queue()
+        errors = []
+
+        def getter():
+            try:
+                q.get(timeout=0.01)
+            except queue.Empty:
+                errors.append(1)
+
+        sched.spawn(getter)
+        sched.run()
+        self.assertEqual(errors, [1])
+
+    def test_put_many_get_many(self):
+        sched = greenstack.Scheduler()
+        q = greenstack.Queue(10)
+        batches = []
+        count = []
+
+        def producer():
+            count.append(q.put_many(range(35)))
+
+        def consumer():
+            total = 0
+            while total < 35:
+                batch = q.get_many(8)
+                batches.append(batch)
+                total += len(batch)
+
+        sched.spawn(consumer)
+        sched.spawn(producer)
+        sched.run()
+        self.assertEqual(count, [35])
+        self.assertEqual(sum(batches, []), list(range(35)))
+        self.assertTrue(max(len(b) for b in batches) <= 8)
+        # items move in batches, not one per switch
+        self.assertTrue(len(batches) < 10)
+
+    def test_put_many_timeout(self):
+        sched = greenstack.Scheduler()
+        q = greenstack.Queue(3)
+        count = []
+        sched.spawn(lambda: count.append(q.put_many('abcde', timeout=0.01)))
+        sched.run()
+        self.assertEqual(count, [3])
+        self.assertEqual(q.get_many(10), ['a', 'b', 'c'])
+        self.assertEqual(q.get_many(10, timeout=0), [])
+        self.assertRaises(ValueError, q.get_many, 0)
+
+    def test_interrupted_getter_puts_items_back(self):
+        sched = greenstack.Scheduler()
+        q = greenstack.Queue()
+        g = sched.spawn(q.get_many, 5)
+        sched.run()
+        q.put_many([1, 2])
+        # g is killed before it gets to run
+        g.throw()
+        self.assertEqual(q.get_many(5), [1, 2])
@@ -0,0 +1,175 @@
+import gc
+import sys
+import unittest
+
+import greenstack
+
+
+class SomeError(Exception):
+    pass
+
+
+class SchedulerTests(unittest.TestCase):
+    def test_spawn_run_order(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def f(name, count):
+            for i in range(count):
+                seen.append((name, i))
+                sched.yield_()
+
+        sched.spawn(f, 'a', 3)
+        sched.spawn(f, 'b', count=2)
+        self.assertEqual(len(sched), 2)
+        sched.run()
+        self.assertEqual(seen, [('a', 0), ('b', 0), ('a', 1), ('b', 1),
+                                ('a', 2)])
+        self.assertEqual(len(sched), 0)
+
+    def test_spawned_greenstacks_die(self):
+        sched = greenstack.Scheduler()
+        gs = [sched.spawn(lambda: None) for i in range(10)]
+        sched.run()
+        for g in gs:
+            self.assertTrue(g.dead)
+
+    def test_park_and_wake(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def waiter():
+            seen.append(sched.park())
+
+        def waker(g):
+            seen.append('waking')
+            self.assertTrue(sched.wake(g, 42))
+            self.assertFalse(sched.wake(g, 43))
+
+        g = sched.spawn(waiter)
+        sched.spawn(waker, g)
+        sched.run()
+        self.assertEqual(seen, ['waking', 42])
+        self.assertTrue(g.dead)
+
+    def test_wake_dead(self):
+        sched = greenstack.Scheduler()
+        g = sched.spawn(lambda: None)
+        sched.run()
+        self.assertFalse(sched.wake(g))
+
+    def test_wake_before_park(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def f():
+            sched.wake(greenstack.getcurrent(), 'early')
+            seen.append(sched.park())
+
+        sched.spawn(f)
+        sched.run()
+        self.assertEqual(seen, ['early'])
+
+    def test_exception_propagates_from_run(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def bad():
+            raise SomeError()
+
+        def good():
+            seen.append(1)
+
+        sched.spawn(bad)
+        sched.spawn(good)
+        self.assertRaises(SomeError, sched.run)
+        self.assertEqual(seen, [])
+        sched.run()
+        self.assertEqual(seen, [1])
+
+    def test_park_from_main_runs_the_loop(self):
+        sched = greenstack.Scheduler()
+        main = greenstack.getcurrent()
+        seen = []
+
+        def f():
+            seen.append('f')
+            sched.wake(main, 'done')
+
+        sched.spawn(f)
+        self.assertEqual(sched.park(), 'done')
+        self.assertEqual(seen, ['f'])
+
+    def test_park_without_wakeup(self):
+        sched = greenstack.Scheduler()
+        self.assertRaises(greenstack.error, sched.park)
+
+    def test_yield_from_main(self):
+        sched = greenstack.Scheduler()
+        seen = []
+        sched.spawn(seen.append, 1)
+        sched.yield_()
+        self.assertEqual(seen, [1])
+
+    def test_getscheduler(self):
+        default = greenstack.getscheduler()
+        self.assertTrue(isinstance(default, greenstack.Scheduler))
+        self.assertTrue(greenstack.getscheduler() is default)
+        sched = greenstack.Scheduler()
+        seen = []
+        sched.spawn(lambda: seen.append(greenstack.getscheduler()))
+        sched.run()
+        self.assertTrue(seen[0] is sched)
+        self.assertTrue(greenstack.getscheduler() is default)
+
+    def test_many_greenstacks(self):
+        sched = greenstack.Scheduler()
+        total = []
+
+        def f(i):
+            sched.yield_()
+            total.append(i)
+
+        for i in range(1000):
+            sched.spawn(f, i)
+        sched.run()
+        self.assertEqual(total, list(range(1000)))
+
+    def test_run_is_not_reentrant(self):
+        sched = greenstack.Scheduler()
+        sched.spawn(lambda: self.assertRaises(greenstack.error, sched.run))
+        sched.run()
+
+    def test_different_thread(self):
+        import threading
+        sched = greenstack.Scheduler()
+        errors = []
+
+        def other():
+            try:
+                sched.run()
+            except greenstack.error:
+                errors.append(sys.exc_info()[1])
+
+        t = threading.Thread(target=other)
+        t.start()
+        t.join()
+        self.assertEqual(len(errors), 1)
+
+    def test_no_leak(self):
+        sched = greenstack.Scheduler()
+        arg = object()
+        before = sys.getrefcount(arg)
+        for i in range(100):
+            sched.spawn(lambda a: sched.yield_(), arg)
+        sched.run()
+        gc.collect()
+        self.assertEqual(sys.getrefcount(arg), before)
+
+    def test_handoff_does_not_leak_greenstacks(self):
+        import weakref
+        sched = greenstack.Scheduler()
+        refs = [weakref.ref(sched.spawn(sched.yield_)) for i in range(10)]
+        sched.run()
+        gc.collect()
+        self.assertEqual([r() for r in refs], [None] * 10)
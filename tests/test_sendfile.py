@@ -0,0 +1,155 @@
+import errno
+import os
+import socket
+import sys
+import tempfile
+import unittest
+
+import greenstack
+
+from tests.test_io import nonblocking_pipe
+
+DATA = b''.join(bytes(bytearray([i % 251])) * 997 for i in range(1024))
+
+
+class SendfileTests(unittest.TestCase):
+    def setUp(self):
+        if not hasattr(greenstack, 'sendfile'):
+            self.skipTest('no sendfile support on this platform')
+        self.fds = []
+        self.file = tempfile.TemporaryFile()
+        self.file.write(DATA)
+        self.file.flush()
+
+    def tearDown(self):
+        for fd in self.fds:
+            greenstack.notify_close(fd)
+            os.close(fd)
+        self.file.close()
+
+    def socketpair(self):
+        a, b = socket.socketpair()
+        for sock in (a, b):
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, 4096)
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+            sock.setblocking(False)
+            self.fds.append(os.dup(sock.fileno()))
+            sock.close()
+        return self.fds[-2:]
+
+    def pipe(self):
+        r, w = nonblocking_pipe()
+        self.fds += [r, w]
+        return r, w
+
+    def reader(self, fd, seen, expected):
+        def read():
+            while len(seen) < expected:
+                try:
+                    data = os.read(fd, 65536)
+                except OSError:
+                    if sys.exc_info()[1].errno != errno.EAGAIN:
+                        raise
+                    greenstack.wait_readable(fd)
+                    continue
+                if not data:
+                    break
+                seen.extend(bytearray(data))
+        return read
+
+    def test_sendfile(self):
+        sched = greenstack.Scheduler()
+        a, b = self.socketpair()
+        seen = bytearray()
+        result = []
+
+        def send():
+            result.append(greenstack.sendfile(a, self.file, 1000, len(DATA)))
+
+        sched.spawn(send)
+        sched.spawn(self.reader(b, seen, len(DATA) - 1000))
+        sched.run()
+        self.assertEqual(result, [len(DATA) - 1000])
+        self.assertEqual(bytes(seen), DATA[1000:])
+
+    def test_sendfile_position(self):
+        sched = greenstack.Scheduler()
+        a, b = self.socketpair()
+        seen = bytearray()
+        result = []
+        self.file.seek(10)
+
+        def send():
+            result.append(greenstack.sendfile(a, self.file, None, 20000))
+            result.append(greenstack.sendfile(a, self.file, None, 20000))
+
+        sched.spawn(send)
+        sched.spawn(self.reader(b, seen, 40000))
+        sched.run()
+        self.assertEqual(result, [20000, 20000])
+        self.assertEqual(bytes(seen), DATA[10:40010])
+        self.assertEqual(os.lseek(self.file.fileno(), 0, os.SEEK_CUR), 40010)
+
+    def test_splice(self):
+        sched = greenstack.Scheduler()
+        r, w = self.pipe()
+        a, b = self.socketpair()
+        seen = bytearray()
+        result = []
+
+        def write():
+            for i in range(0, len(DATA), 65536):
+                view = DATA[i:i + 65536]
+                while view:
+                    try:
+                        view = view[os.write(w, view):]
+                    except OSError:
+                        if sys.exc_info()[1].errno != errno.EAGAIN:
+                            raise
+                        greenstack.wait_writable(w)
+            greenstack.notify_close(w)
+            os.close(w)
+            self.fds.remove(w)
+
+        def move():
+            result.append(greenstack.splice(r, a, len(DATA) + 100))
+
+        sched.spawn(move)
+        sched.spawn(self.reader(b, seen, len(DATA)))
+        sched.spawn(write)
+        sched.run()
+        self.assertEqual(result, [len(DATA)])
+        self.assertEqual(bytes(seen), DATA)
+
+    def test_splice_from_idle_socket(self):
+        sched = greenstack.Scheduler()
+        r, w = self.pipe()
+        a, b = socket.socketpair()
+        self.addCleanup(a.close)
+        self.addCleanup(b.close)
+        # nothing to read, so a blocking socket would stop the thread
+        self.assertRaises(ValueError, greenstack.splice, a, w, 10)
+        self.assertRaises(ValueError, greenstack.sendfile, a, self.file, 0, 10)
+        a.setblocking(False)
+        result = []
+
+        def move():
+            result.append(greenstack.splice(a, w, 5))
+
+        def send():
+            result.append('sent')
+            b.send(b'hello')
+
+        sched.spawn(move)
+        sched.spawn(send)
+        sched.run()
+        greenstack.notify_close(a.fileno())
+        self.assertEqual(result, ['sent', 5])
+        self.assertEqual(os.read(r, 10), b'hello')
+
+    def test_errors(self):
+        r, w = self.pipe()
+        self.assertRaises(ValueError, greenstack.sendfile, w, self.file, -1, 1)
+        self.assertRaises(ValueError, greenstack.sendfile, w, self.file, 0, -1)
+        self.assertEqual(greenstack.sendfile(w, self.file, len(DATA), 10), 0)
+        self.assertRaises(OSError, greenstack.splice, self.file, self.file, 10)
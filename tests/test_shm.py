@@ -0,0 +1,146 @@
+import os
+import unittest
+
+import greenstack
+
+
+class ShmChannelTests(unittest.TestCase):
+    def setUp(self):
+        if not hasattr(greenstack, 'ShmChannel'):
+            self.skipTest('no shared memory channels on this platform')
+
+    def test_in_process(self):
+        ch = greenstack.ShmChannel(slots=4, slot_size=64)
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def sender():
+            for i in range(20):
+                ch.send(('message %d' % i).encode('ascii'))
+
+        def receiver():
+            for i in range(20):
+                view = ch.receive()
+                seen.append(view.tobytes())
+            ch.release()
+
+        sched.spawn(receiver)
+        sched.spawn(sender)
+        sched.run()
+        self.assertEqual(seen, [('message %d' % i).encode('ascii')
+                                for i in range(20)])
+        self.assertEqual(ch.pending, 0)
+        ch.close()
+
+    def test_reserve(self):
+        ch = greenstack.ShmChannel(slots=2, slot_size=16)
+        view = ch.reserve()
+        self.assertEqual(len(view), 16)
+        view[:5] = b'hello'
+        self.assertRaises(ValueError, ch.send, b'x')
+        ch.commit(5)
+        self.assertRaises(ValueError, ch.commit, 1)
+        received = ch.receive()
+        self.assertTrue(received.readonly)
+        self.assertEqual(received.tobytes(), b'hello')
+        self.assertEqual(ch.pending, 1)
+        ch.release()
+        self.assertEqual(ch.pending, 0)
+
+    def test_too_big(self):
+        ch = greenstack.ShmChannel(slots=2, slot_size=16)
+        self.assertEqual(ch.slot_size, 16)
+        self.assertRaises(ValueError, ch.send, b'x' * 17)
+        self.assertRaises(ValueError, greenstack.ShmChannel, slots=0)
+
+    def test_attach(self):
+        ch = greenstack.ShmChannel(slots=8, slot_size=32)
+        other = greenstack.ShmChannel(fds=ch.fds)
+        self.assertEqual(other.slot_size, 32)
+        ch.send(b'through')
+        self.assertEqual(other.receive().tobytes(), b'through')
+        ch.close()
+        other.close()
+        self.assertRaises(ValueError, other.receive)
+
+    def test_processes(self):
+        ch = greenstack.ShmChannel(slots=8, slot_size=128)
+        count = 2000
+        pid = os.fork()
+        if pid == 0:
+            try:
+                sched = greenstack.Scheduler()
+
+                def sender():
+                    for i in range(count):
+                        ch.send(str(i).encode('ascii'))
+                    view = ch.reserve()
+                    view[:3] = b'end'
+                    ch.commit(3)
+
+                sched.spawn(sender)
+                sched.run()
+            finally:
+                os._exit(0)
+
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def receiver():
+            while True:
+                data = ch.receive().tobytes()
+                if data == b'end':
+                    break
+                seen.append(int(data))
+
+        sched.spawn(receiver)
+        sched.run()
+        os.waitpid(pid, 0)
+        self.assertEqual(seen, list(range(count)))
+        ch.close()
+
+    def test_scheduler_used_before_fork(self):
+        # the child must not share the parent's epoll set
+        sched = greenstack.Scheduler()
+        r, w = os.pipe()
+        self.addCleanup(os.close, r)
+        self.addCleanup(os.close, w)
+        os.write(w, b'x')
+
+        def wait():
+            greenstack.wait_readable(r)
+
+        sched.spawn(wait)
+        sched.run()
+        pings = greenstack.ShmChannel(slots=4, slot_size=16)
+        pongs = greenstack.ShmChannel(slots=4, slot_size=16)
+        count = 300
+        pid = os.fork()
+        if pid == 0:
+            status = 1
+            try:
+                def echo():
+                    with greenstack.Timeout(10):
+                        for i in range(count):
+                            pongs.send(pings.receive().tobytes())
+
+                sched.spawn(echo)
+                sched.run()
+                status = 0
+            finally:
+                os._exit(status)
+
+        seen = []
+
+        def client():
+            with greenstack.Timeout(10):
+                for i in range(count):
+                    pings.send(str(i).encode('ascii'))
+                    seen.append(int(pongs.receive().tobytes()))
+
+        sched.spawn(client)
+        sched.run()
+        self.assertEqual(os.waitpid(pid, 0)[1], 0)
+        self.assertEqual(seen, list(range(count)))
+        pings.close()
+        pongs.close()
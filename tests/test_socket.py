@@ -0,0 +1,154 @@
+import gc
+import os
+import socket
+import unittest
+
+import greenstack
+
+
+class SocketTests(unittest.TestCase):
+    def setUp(self):
+        if not hasattr(greenstack, 'Socket'):
+            self.skipTest('no socket support on this platform')
+        a, b = socket.socketpair()
+        self.a = greenstack.Socket(a)
+        self.b = greenstack.Socket(b)
+
+    def tearDown(self):
+        self.a.close()
+        self.b.close()
+
+    def run_pair(self, reader, writer):
+        sched = greenstack.Scheduler()
+        result = []
+        sched.spawn(lambda: result.append(reader()))
+        sched.spawn(writer)
+        sched.run()
+        return result[0]
+
+    def test_recv(self):
+        def writer():
+            self.a.sendall(b'hello')
+
+        self.assertEqual(self.run_pair(lambda: self.b.recv(100), writer),
+                         b'hello')
+
+    def test_recv_into(self):
+        buf = bytearray(10)
+
+        def writer():
+            self.a.sendall(b'abcdef')
+
+        self.assertEqual(
+            self.run_pair(lambda: self.b.recv_into(buf, 4), writer), 4)
+        self.assertEqual(bytes(buf[:4]), b'abcd')
+
+    def test_readline(self):
+        def writer():
+            for part in (b'one\ntw', b'o\n', b'thr', b'ee\nfour'):
+                self.a.sendall(part)
+                greenstack.getscheduler().yield_()
+            self.a.close()
+
+        def reader():
+            lines = []
+            while True:
+                line = self.b.readline()
+                if not line:
+                    return lines
+                lines.append(line)
+
+        self.assertEqual(self.run_pair(reader, writer),
+                         [b'one\n', b'two\n', b'three\n', b'four'])
+
+    def test_readline_limit(self):
+        def writer():
+            self.a.sendall(b'abcdefgh\nij\n')
+
+        def reader():
+            return [self.b.readline(3), self.b.readline(100),
+                    self.b.readline(0), self.b.readline()]
+
+        self.assertEqual(self.run_pair(reader, writer),
+                         [b'abc', b'defgh\n', b'', b'ij\n'])
+        self.assertEqual(self.b.buffered, 0)
+
+    def test_long_line(self):
+        line = b'x' * (3 * greenstack.BUFFER_SIZE + 5) + b'\n'
+
+        def writer():
+            self.a.sendall(line + b'rest')
+
+        def reader():
+            return self.b.readline(), self.b.read_exactly(4)
+
+        self.assertEqual(self.run_pair(reader, writer), (line, b'rest'))
+
+    def test_read_exactly(self):
+        big = os.urandom(200000)
+
+        def writer():
+            for i in range(0, 100, 7):
+                self.a.sendall(bytes(bytearray(range(i, min(i + 7, 100)))))
+                greenstack.getscheduler().yield_()
+            self.a.sendall(big)
+
+        def reader():
+            return [self.b.read_exactly(n) for n in (1, 2, 97, len(big))]
+
+        result = self.run_pair(reader, writer)
+        self.assertEqual(b''.join(result[:3]), bytes(bytearray(range(100))))
+        self.assertEqual(result[3], big)
+
+    def test_read_exactly_eof(self):
+        def writer():
+            self.a.sendall(b'abc')
+            self.a.close()
+
+        self.assertRaises(EOFError, self.run_pair,
+                          lambda: self.b.read_exactly(4), writer)
+
+    def test_recv_view(self):
+        def writer():
+            self.a.sendall(b'line\nview')
+
+        def reader():
+            return self.b.readline(), self.b.recv_view()
+
+        line, view = self.run_pair(reader, writer)
+        self.assertEqual(line, b'line\n')
+        self.assertTrue(isinstance(view, memoryview))
+        self.assertEqual(view.tobytes(), b'view')
+
+    def test_pooled_buffer(self):
+        view = greenstack.pooled_buffer()
+        self.assertEqual(len(view), greenstack.BUFFER_SIZE)
+        self.assertFalse(view.readonly)
+        view[0:3] = b'abc'
+        del view
+        gc.collect()
+        view = greenstack.pooled_buffer()
+        self.assertEqual(len(view), greenstack.BUFFER_SIZE)
+
+    def test_closed(self):
+        self.assertFalse(self.a.closed)
+        self.a.close()
+        self.assertTrue(self.a.closed)
+        self.assertRaises(ValueError, self.a.recv, 1)
+        self.assertRaises(ValueError, self.a.fileno)
+        self.a.close()
+
+    def test_close_wakes_reader(self):
+        seen = []
+
+        def reader():
+            try:
+                self.b.recv(10)
+            except ValueError:
+                seen.append('closed')
+
+        sched = greenstack.Scheduler()
+        sched.spawn(reader)
+        sched.spawn(self.b.close)
+        sched.run()
+        self.assertEqual(seen, ['closed'])
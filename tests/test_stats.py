@@ -0,0 +1,76 @@
+import threading
+import unittest
+
+import greenstack
+
+
+def delta(before):
+    after = greenstack.stats()
+    return dict((k, after[k] - before[k]) for k in before)
+
+
+class StatsTests(unittest.TestCase):
+    def test_counters(self):
+        before = greenstack.stats()
+
+        def body():
+            greenstack.getcurrent().parent.switch()
+
+        gs = [greenstack.greenstack(body) for i in range(5)]
+        for g in gs:
+            g.switch()
+        d = delta(before)
+        self.assertEqual(d['creations'], 5)
+        self.assertEqual(d['deaths'], 0)
+        self.assertEqual(d['switches'], 10)
+        self.assertEqual(d['stack_cache_hits'] + d['stack_cache_misses'], 5)
+        self.assertEqual(d['stack_allocs'], d['stack_cache_misses'])
+        self.assertTrue(d['stack_bytes_live'] > 0)
+
+        for g in gs:
+            g.switch()
+        d = delta(before)
+        self.assertEqual(d['deaths'], 5)
+        self.assertEqual(d['switches'], 20)
+        self.assertEqual(d['stack_bytes_live'], 0)
+
+    def test_cache(self):
+        greenstack.greenstack(lambda: None).switch()
+        before = greenstack.stats()
+        self.assertTrue(before['stacks_cached'] > 0)
+        greenstack.greenstack(lambda: None).switch()
+        d = delta(before)
+        self.assertEqual(d['stack_cache_hits'], 1)
+        self.assertEqual(d['stack_cache_misses'], 0)
+        self.assertEqual(d['stack_allocs'], 0)
+
+    def test_per_thread(self):
+        before = greenstack.stats()
+        seen = []
+
+        def run():
+            thread_before = greenstack.stats()
+            self.assertEqual(thread_before['creations'], 0)
+            for i in range(3):
+                greenstack.greenstack(lambda: None).switch()
+            seen.append(greenstack.stats()['creations'])
+
+        t = threading.Thread(target=run)
+        t.start()
+        t.join()
+        self.assertEqual(seen, [3])
+        self.assertEqual(delta(before)['creations'], 0)
+
+    def test_resident(self):
+        def body():
+            greenstack.getcurrent().parent.switch()
+
+        g = greenstack.greenstack(body)
+        g.switch()
+        stats = greenstack.stats(resident=True)
+        self.assertTrue(0 < stats['resident_bytes_live'] <=
+                        stats['stack_bytes_live'])
+        self.assertTrue(0 <= stats['resident_bytes_cached'] <=
+                        stats['stack_bytes_cached'])
+        self.assertFalse('resident_bytes_live' in greenstack.stats())
+        g.switch()
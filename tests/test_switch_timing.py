@@ -0,0 +1,49 @@
+import unittest
+
+import greenstack
+
+
+@unittest.skipUnless(greenstack.GREENSTACK_USE_SWITCH_TIMING,
+                     'switch timing is not compiled in')
+class SwitchTimingTests(unittest.TestCase):
+    def setUp(self):
+        greenstack.switch_timing(reset=True)
+
+    def test_counts(self):
+        def body():
+            greenstack.getcurrent().parent.switch()
+
+        gs = [greenstack.greenstack(body) for i in range(5)]
+        for g in gs:
+            g.switch()
+        for g in gs:
+            g.switch()
+        t = greenstack.switch_timing()
+        self.assertEqual(t['create']['count'], 5)
+        self.assertEqual(t['teardown']['count'], 5)
+        # the first entry and the final exit of each are not plain switches
+        self.assertEqual(t['switch']['count'], 10)
+
+    def test_histogram(self):
+        def body():
+            while True:
+                greenstack.getcurrent().parent.switch()
+
+        g = greenstack.greenstack(body)
+        for i in range(1000):
+            g.switch()
+        h = greenstack.switch_timing(reset=True)['switch']
+        self.assertEqual(h['count'], 1999)
+        self.assertEqual(sum(c for b, c in h['buckets']), h['count'])
+        self.assertTrue(0 <= h['p50_ns'] <= h['p90_ns'] <= h['p99_ns']
+                        <= h['p999_ns'] <= h['max_ns'])
+        self.assertTrue(h['mean_ns'] <= h['max_ns'])
+        bounds = [b for b, c in h['buckets']]
+        self.assertEqual(bounds, sorted(bounds))
+        self.assertEqual(greenstack.switch_timing()['switch']['count'], 0)
+
+    def test_empty(self):
+        h = greenstack.switch_timing()['teardown']
+        self.assertEqual(h['count'], 0)
+        self.assertEqual(h['buckets'], [])
+        self.assertEqual(h['p99_ns'], 0)
@@ -0,0 +1,228 @@
+import os
+import threading
+import time
+import unittest
+
+import greenstack
+
+
+class RunInThreadTests(unittest.TestCase):
+    def test_result(self):
+        sched = greenstack.Scheduler()
+        result = []
+        sched.spawn(lambda: result.append(
+            greenstack.run_in_thread(divmod, 7, 2)))
+        sched.run()
+        self.assertEqual(result, [(3, 1)])
+
+    def test_kwargs_and_thread(self):
+        sched = greenstack.Scheduler()
+        result = []
+
+        def func(a, b=None):
+            return a, b, threading.current_thread() is main
+
+        main = threading.current_thread()
+        sched.spawn(lambda: result.append(
+            greenstack.run_in_thread(func, 1, b=2)))
+        sched.run()
+        self.assertEqual(result, [(1, 2, False)])
+
+    def test_exception(self):
+        sched = greenstack.Scheduler()
+        errors = []
+
+        def waiter():
+            try:
+                greenstack.run_in_thread(int, 'x')
+            except ValueError as e:
+                errors.append(e)
+
+        sched.spawn(waiter)
+        sched.run()
+        self.assertEqual(len(errors), 1)
+        self.assertRaises(TypeError, greenstack.run_in_thread)
+
+    def test_others_keep_running(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def blocker():
+            greenstack.run_in_thread(time.sleep, 0.05)
+            seen.append('slept')
+
+        def ticker():
+            for i in range(3):
+                seen.append(i)
+                greenstack.sleep(0.001)
+
+        sched.spawn(blocker)
+        sched.spawn(ticker)
+        sched.run()
+        self.assertEqual(seen, [0, 1, 2, 'slept'])
+
+    def test_parallel_sleeps(self):
+        sched = greenstack.Scheduler()
+        prev = greenstack.set_thread_pool_size(4)
+        try:
+            start = time.time()
+            for i in range(4):
+                sched.spawn(greenstack.run_in_thread, time.sleep, 0.05)
+            sched.run()
+            self.assertTrue(time.time() - start < 0.15)
+        finally:
+            greenstack.set_thread_pool_size(prev)
+        self.assertRaises(ValueError, greenstack.set_thread_pool_size, 0)
+
+    def test_many_jobs(self):
+        sched = greenstack.Scheduler()
+        results = []
+        for i in range(200):
+            sched.spawn(lambda i=i: results.append(
+                greenstack.run_in_thread(abs, -i)))
+        sched.run()
+        self.assertEqual(sorted(results), list(range(200)))
+
+    def test_spurious_wake(self):
+        sched = greenstack.Scheduler()
+        result = []
+        g = sched.spawn(lambda: result.append(
+            greenstack.run_in_thread(lambda: time.sleep(0.01) or 'done')))
+        sched.spawn(lambda: sched.wake(g, 'early'))
+        sched.run()
+        self.assertEqual(result, ['done'])
+
+    def test_cancel_queued(self):
+        sched = greenstack.Scheduler()
+        release = threading.Event()
+        calls = []
+        seen = []
+
+        def blocker():
+            greenstack.run_in_thread(release.wait, 5)
+
+        def cancelled():
+            try:
+                with greenstack.Timeout(0.02):
+                    greenstack.run_in_thread(calls.append, 'ran')
+            except greenstack.Timeout:
+                seen.append('timeout')
+            release.set()
+
+        # more blockers than workers, so that the job has to queue
+        prev = greenstack.set_thread_pool_size(2)
+        try:
+            for i in range(16):
+                sched.spawn(blocker)
+            sched.spawn(cancelled)
+            sched.run()
+            # the queue is first in, first out
+            greenstack.run_in_thread(abs, -1)
+        finally:
+            greenstack.set_thread_pool_size(prev)
+        self.assertEqual(seen, ['timeout'])
+        self.assertEqual(calls, [])
+
+
+class WakeThreadsafeTests(unittest.TestCase):
+    def test_wake_from_thread(self):
+        sched = greenstack.Scheduler()
+        result = []
+        g = sched.spawn(lambda: result.append(sched.park(threadsafe=True)))
+        t = threading.Timer(0.05, greenstack.wake_threadsafe, (g, 'hi'))
+        t.start()
+        # run() waits for the wakeup instead of returning
+        sched.run()
+        t.join()
+        self.assertEqual(result, ['hi'])
+        self.assertTrue(g.dead)
+
+    def test_wake_during_sleep(self):
+        sched = greenstack.Scheduler()
+        result = []
+
+        def waiter():
+            result.append(sched.park(threadsafe=True))
+            result.append(time.time() - start)
+
+        def sleeper():
+            greenstack.sleep(0.5)
+
+        g = sched.spawn(waiter)
+        sched.spawn(sleeper)
+        t = threading.Timer(0.02, greenstack.wake_threadsafe, (g, 'hi'))
+        start = time.time()
+        t.start()
+        sched.run()
+        t.join()
+        self.assertEqual(result[0], 'hi')
+        # the wakeup interrupted the sleep of the hub
+        self.assertTrue(result[1] < 0.4)
+
+    def test_wake_during_io(self):
+        # the hub blocks on a read, possibly in io_uring, with no timers
+        sched = greenstack.Scheduler()
+        r, w = os.pipe()
+        self.addCleanup(os.close, r)
+        self.addCleanup(os.close, w)
+        result = []
+
+        def reader():
+            result.append(greenstack.read(r, 10))
+
+        def waiter():
+            result.append(sched.park(threadsafe=True))
+            os.write(w, b'x')
+
+        sched.spawn(reader)
+        g = sched.spawn(waiter)
+        t = threading.Timer(0.02, greenstack.wake_threadsafe, (g, 'hi'))
+        t.start()
+        sched.run()
+        t.join()
+        self.assertEqual(result, ['hi', b'x'])
+
+    def test_wake_main(self):
+        sched = greenstack.Scheduler()
+        main = greenstack.getcurrent()
+        t = threading.Timer(0.02, greenstack.wake_threadsafe, (main, 'hi'))
+        t.start()
+        self.assertEqual(sched.park(threadsafe=True), 'hi')
+        t.join()
+
+    def test_threadsafe_park_woken_locally(self):
+        sched = greenstack.Scheduler()
+        result = []
+        g = sched.spawn(lambda: result.append(sched.park(threadsafe=True)))
+        sched.spawn(lambda: sched.wake(g, 'local'))
+        sched.run()
+        self.assertEqual(result, ['local'])
+
+    def test_wake_while_not_running(self):
+        sched = greenstack.Scheduler()
+        result = []
+        # parked without threadsafe, so run() does not wait for them
+        gs = [sched.spawn(lambda: result.append(sched.park()))
+              for i in range(3)]
+        sched.run()
+        threads = [threading.Thread(target=greenstack.wake_threadsafe,
+                                    args=(g, i)) for i, g in enumerate(gs)]
+        for t in threads:
+            t.start()
+            t.join()
+        self.assertEqual(result, [])
+        sched.run()
+        # delivered in the order they were sent
+        self.assertEqual(result, [0, 1, 2])
+
+    def test_same_thread(self):
+        sched = greenstack.Scheduler()
+        result = []
+        g = sched.spawn(lambda: result.append(sched.park()))
+        sched.run()
+        greenstack.wake_threadsafe(g)
+        self.assertEqual(len(sched), 1)
+        sched.run()
+        self.assertEqual(result, [None])
+        self.assertRaises(ValueError, greenstack.wake_threadsafe,
+                          greenstack.greenstack())
@@ -0,0 +1,236 @@
+import gc
+import sys
+import time
+import unittest
+
+import greenstack
+
+
+class TimerTests(unittest.TestCase):
+    def test_sleep_order(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def f(delay):
+            greenstack.sleep(delay)
+            seen.append(delay)
+
+        for delay in (0.03, 0.01, 0.02):
+            sched.spawn(f, delay)
+        sched.run()
+        self.assertEqual(seen, [0.01, 0.02, 0.03])
+
+    def test_sleep_duration(self):
+        start = time.time()
+        greenstack.sleep(0.05)
+        self.assertTrue(time.time() - start >= 0.045)
+
+    def test_sleep_zero_yields(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def f(name):
+            seen.append(name)
+            greenstack.sleep(0)
+            seen.append(name)
+
+        sched.spawn(f, 'a')
+        sched.spawn(f, 'b')
+        sched.run()
+        self.assertEqual(seen, ['a', 'b', 'a', 'b'])
+
+    def test_long_timer_does_not_block_run(self):
+        # a long timer that is cancelled must not keep run() waiting
+        sched = greenstack.Scheduler()
+
+        def f():
+            t = greenstack.Timeout(3600)
+            t.start()
+            greenstack.sleep(0.01)
+            t.cancel()
+
+        sched.spawn(f)
+        start = time.time()
+        sched.run()
+        self.assertTrue(time.time() - start < 1)
+
+    def test_timers_beyond_first_level(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def f(delay):
+            greenstack.sleep(delay)
+            seen.append(delay)
+
+        for delay in (0.2, 0.07, 0.13):
+            sched.spawn(f, delay)
+        sched.run()
+        self.assertEqual(seen, [0.07, 0.13, 0.2])
+
+    def test_many_sleepers(self):
+        sched = greenstack.Scheduler()
+        early = []
+
+        def f(i):
+            delay = (i % 10) * 0.001
+            start = time.time()
+            greenstack.sleep(delay)
+            if time.time() - start < delay - 0.0005:
+                early.append(i)
+
+        gs = [sched.spawn(f, i) for i in range(1000)]
+        sched.run()
+        self.assertEqual(early, [])
+        self.assertEqual([g.dead for g in gs], [True] * 1000)
+
+    def test_no_leak(self):
+        import weakref
+        sched = greenstack.Scheduler()
+
+        def f():
+            greenstack.sleep(0.001)
+
+        refs = [weakref.ref(sched.spawn(f)) for i in range(10)]
+        sched.run()
+        gc.collect()
+        self.assertEqual([r() for r in refs], [None] * 10)
+
+    def test_collect_while_armed(self):
+        # greenstacks only the timers hold on to must survive a collection
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def sleeper():
+            greenstack.sleep(0.01)
+            seen.append('sleep')
+
+        def timed():
+            try:
+                with greenstack.Timeout(0.01):
+                    sched.park()
+            except greenstack.Timeout:
+                seen.append('timeout')
+
+        def collector():
+            greenstack.sleep(0)
+            seen.append(ids[0] in map(id, gc.get_referents(sched)))
+            gc.collect()
+
+        ids = [id(sched.spawn(sleeper))]
+        sched.spawn(timed)
+        sched.spawn(collector)
+        sched.run()
+        self.assertEqual(sorted(seen, key=str), [True, 'sleep', 'timeout'])
+
+
+class TimeoutTests(unittest.TestCase):
+    def test_is_base_exception(self):
+        self.assertTrue(issubclass(greenstack.Timeout, BaseException))
+        self.assertFalse(issubclass(greenstack.Timeout, Exception))
+        self.assertEqual(greenstack.Timeout(1).seconds, 1.0)
+        self.assertEqual(greenstack.Timeout().seconds, None)
+
+    def test_expires(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def f():
+            t = greenstack.Timeout(0.01)
+            try:
+                with t:
+                    sched.park()
+            except greenstack.Timeout:
+                seen.append(sys.exc_info()[1] is t)
+            self.assertFalse(t.pending)
+
+        sched.spawn(f)
+        sched.run()
+        self.assertEqual(seen, [True])
+
+    def test_cancelled(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def f():
+            t = greenstack.Timeout(0.05)
+            with t:
+                self.assertTrue(t.pending)
+                greenstack.sleep(0.01)
+            self.assertFalse(t.pending)
+            greenstack.sleep(0.08)
+            seen.append('done')
+
+        sched.spawn(f)
+        sched.run()
+        self.assertEqual(seen, ['done'])
+
+    def test_interrupts_busy_yielding(self):
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def spin(yield_):
+            start = time.time()
+            try:
+                with greenstack.Timeout(0.05):
+                    while time.time() - start < 2:
+                        yield_()
+            except greenstack.Timeout:
+                seen.append(time.time() - start < 1)
+
+        sched.spawn(spin, lambda: greenstack.sleep(0))
+        sched.spawn(spin, sched.yield_)
+        sched.run()
+        self.assertEqual(seen, [True, True])
+        # and with nothing else ready
+        spin(lambda: greenstack.sleep(0))
+        self.assertEqual(seen, [True, True, True])
+
+    def test_interrupts_sleep(self):
+        start = time.time()
+        try:
+            with greenstack.Timeout(0.01):
+                greenstack.sleep(10)
+        except greenstack.Timeout:
+            pass
+        else:
+            self.fail('Timeout not raised')
+        self.assertTrue(time.time() - start < 1)
+
+    def test_never(self):
+        with greenstack.Timeout(None) as t:
+            self.assertFalse(t.pending)
+            greenstack.sleep(0.001)
+
+    def test_while_ready(self):
+        # the timeout is delivered once the greenstack blocks again
+        sched = greenstack.Scheduler()
+        seen = []
+
+        def busy():
+            end = time.time() + 0.02
+            while time.time() < end:
+                pass
+
+        def f():
+            try:
+                with greenstack.Timeout(0.005):
+                    sched.spawn(busy)
+                    sched.yield_()
+                    seen.append('yielded')
+                    sched.park()
+            except greenstack.Timeout:
+                seen.append('timeout')
+
+        sched.spawn(f)
+        sched.run()
+        self.assertEqual(seen, ['yielded', 'timeout'])
+
+    def test_started_without_reference(self):
+        sched = greenstack.Scheduler()
+
+        def f():
+            greenstack.Timeout(0.001).start()
+            greenstack.sleep(0.01)
+
+        sched.spawn(f)
+        self.assertRaises(greenstack.Timeout, sched.run)
@@ -0,0 +1,172 @@
+import os
+import socket
+import subprocess
+import sys
+import time
+import unittest
+
+import greenstack
+
+
+class CompletionIOTests(unittest.TestCase):
+    def setUp(self):
+        if not hasattr(greenstack, 'read'):
+            self.skipTest('no completion I/O on this platform')
+        self.fds = []
+
+    def tearDown(self):
+        for fd in self.fds:
+            greenstack.notify_close(fd)
+            os.close(fd)
+
+    def pipe(self):
+        r, w = os.pipe()
+        self.fds += [r, w]
+        return r, w
+
+    def test_backend(self):
+        self.assertTrue(greenstack.io_backend() in ('io_uring', 'epoll'))
+        self.assertTrue(type(greenstack.io_backend()) is str)
+
+    def test_pipe(self):
+        sched = greenstack.Scheduler()
+        r, w = self.pipe()
+        seen = []
+
+        def reader():
+            data = b''
+            while not data.endswith(b'.'):
+                data += greenstack.read(r, 100)
+            seen.append(data)
+
+        def writer():
+            for chunk in (b'ab', b'cd', b'.'):
+                greenstack.sleep(0.002)
+                self.assertEqual(greenstack.write(w, chunk), len(chunk))
+
+        sched.spawn(reader)
+        sched.spawn(writer)
+        sched.run()
+        self.assertEqual(seen, [b'abcd.'])
+
+    def test_read_from_main(self):
+        r, w = self.pipe()
+        os.write(w, b'xyz')
+        self.assertEqual(greenstack.read(r, 2), b'xy')
+        self.assertEqual(greenstack.read(r, 10), b'z')
+
+    def test_sockets(self):
+        sched = greenstack.Scheduler()
+        listener = socket.socket()
+        listener.bind(('127.0.0.1', 0))
+        listener.listen(5)
+        seen = []
+
+        def server():
+            fd = greenstack.accept(listener)
+            conn = socket.fromfd(fd, socket.AF_INET, socket.SOCK_STREAM)
+            os.close(fd)
+            data = greenstack.recv(conn, 100)
+            greenstack.send(conn, data.upper())
+            conn.close()
+
+        def client():
+            c = socket.socket()
+            c.connect(listener.getsockname())
+            greenstack.send(c, b'hello')
+            seen.append(greenstack.recv(c, 100))
+            c.close()
+
+        sched.spawn(server)
+        sched.spawn(client)
+        sched.run()
+        listener.close()
+        self.assertEqual(seen, [b'HELLO'])
+
+    def test_batched_readers(self):
+        sched = greenstack.Scheduler()
+        pipes = [self.pipe() for i in range(20)]
+        seen = []
+
+        def reader(r):
+            seen.append(greenstack.read(r, 10))
+
+        def writer():
+            for r, w in pipes:
+                os.write(w, b'x')
+
+        for r, w in pipes:
+            sched.spawn(reader, r)
+        sched.spawn(writer)
+        sched.run()
+        self.assertEqual(seen, [b'x'] * 20)
+
+    def test_mixed_with_readiness_waits(self):
+        sched = greenstack.Scheduler()
+        r1, w1 = self.pipe()
+        r2, w2 = self.pipe()
+        seen = []
+
+        def waiter():
+            greenstack.wait_readable(r1)
+            seen.append(os.read(r1, 10))
+
+        def reader():
+            seen.append(greenstack.read(r2, 10))
+            os.write(w1, b'second')
+
+        def writer():
+            greenstack.sleep(0.01)
+            os.write(w2, b'first')
+
+        sched.spawn(waiter)
+        sched.spawn(reader)
+        sched.spawn(writer)
+        sched.run()
+        self.assertEqual(seen, [b'first', b'second'])
+
+    def test_timeout_cancels(self):
+        r, w = self.pipe()
+        start = time.time()
+        try:
+            with greenstack.Timeout(0.02):
+                greenstack.read(r, 10)
+        except greenstack.Timeout:
+            pass
+        else:
+            self.fail('Timeout not raised')
+        self.assertTrue(time.time() - start < 1)
+        # the cancelled read must not swallow later data
+        os.write(w, b'later')
+        self.assertEqual(greenstack.read(r, 10), b'later')
+
+    def test_error(self):
+        r, w = self.pipe()
+        self.assertRaises(OSError, greenstack.write, r, b'x')
+        self.assertRaises(ValueError, greenstack.read, r, -1)
+
+    def test_fallback(self):
+        script = '''if 1:
+            import os, greenstack
+            assert greenstack.io_backend() == 'epoll', greenstack.io_backend()
+            sched = greenstack.Scheduler()
+            r, w = os.pipe()
+            seen = []
+            def reader():
+                seen.append(greenstack.read(r, 10))
+            def writer():
+                greenstack.sleep(0.01)
+                greenstack.write(w, b'abc')
+            sched.spawn(reader)
+            sched.spawn(writer)
+            sched.run()
+            assert seen == [b'abc'], seen
+            print('ok')
+        '''
+        env = dict(os.environ)
+        env['GREENSTACK_NO_IO_URING'] = '1'
+        env['PYTHONPATH'] = os.pathsep.join(
+            [os.path.dirname(os.path.abspath(greenstack.__file__))] +
+            [p for p in sys.path if p])
+        out = subprocess.check_output([sys.executable, '-c', script], env=env)
+        self.assertEqual(out.strip(), b'ok')
@@ -0,0 +1,100 @@
+import socket
+import threading
+import time
+import unittest
+
+import greenstack
+
+
+class VirtualTimeTests(unittest.TestCase):
+    def test_clock_jumps(self):
+        sched = greenstack.Scheduler(virtual=True)
+        seen = []
+
+        def sleeper(seconds):
+            greenstack.sleep(seconds)
+            seen.append((seconds, sched.time()))
+
+        for seconds in (600, 1, 60):
+            sched.spawn(sleeper, seconds)
+        self.assertEqual(sched.time(), 0)
+        start = time.time()
+        sched.run()
+        self.assertTrue(time.time() - start < 1)
+        self.assertEqual([s for s, t in seen], [1, 60, 600])
+        for seconds, now in seen:
+            self.assertTrue(seconds <= now < seconds + 0.01)
+
+    def test_timeout(self):
+        sched = greenstack.Scheduler(virtual=True)
+        seen = []
+
+        def waiter():
+            try:
+                with greenstack.Timeout(30):
+                    sched.park()
+            except greenstack.Timeout:
+                seen.append(sched.time())
+
+        sched.spawn(waiter)
+        sched.run()
+        self.assertEqual(len(seen), 1)
+        self.assertTrue(30 <= seen[0] < 30.01)
+
+    def test_descriptor_in_real_time(self):
+        if not hasattr(greenstack, 'wait_readable'):
+            self.skipTest('no fd support on this platform')
+        sched = greenstack.Scheduler(virtual=True)
+        a, b = socket.socketpair()
+        self.addCleanup(a.close)
+        self.addCleanup(b.close)
+        seen = []
+
+        def reader():
+            seen.append(greenstack.wait_readable(b, timeout=5))
+            seen.append(sched.time())
+
+        writer = threading.Timer(0.2, a.send, (b'x',))
+        writer.start()
+        self.addCleanup(writer.join)
+        sched.spawn(reader)
+        sched.run()
+        self.assertEqual(seen[0], True)
+        self.assertTrue(seen[1] < 5)
+
+    def test_no_jump_while_ready(self):
+        sched = greenstack.Scheduler(virtual=True)
+        seen = []
+
+        def busy():
+            for i in range(100):
+                sched.yield_()
+            seen.append(('busy', sched.time()))
+
+        sched.spawn(greenstack.sleep, 5)
+        sched.spawn(busy)
+        sched.run()
+        self.assertEqual(seen, [('busy', 0)])
+        self.assertTrue(sched.time() >= 5)
+
+    def order(self, seed):
+        sched = greenstack.Scheduler(virtual=True, seed=seed)
+        seen = []
+
+        def worker(i):
+            for r in range(3):
+                greenstack.sleep(1)
+                seen.append(i)
+
+        for i in range(20):
+            sched.spawn(worker, i)
+        sched.run()
+        return seen
+
+    def test_seed_is_reproducible(self):
+        first = self.order(1)
+        self.assertEqual(sorted(first), sorted(list(range(20)) * 3))
+        self.assertEqual(self.order(1), first)
+        self.assertNotEqual(self.order(2), first)
+        self.assertEqual(self.order(None), list(range(20)) * 3)
+        self.assertEqual(self.order(2 ** 70), self.order(2 ** 70))
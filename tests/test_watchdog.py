@@ -0,0 +1,90 @@
+import time
+import unittest
+
+import greenstack
+
+
+def spin(seconds):
+    end = time.time() + seconds
+    while time.time() < end:
+        pass
+
+
+class WatchdogTests(unittest.TestCase):
+    def setUp(self):
+        self.seen = []
+
+    def report(self, g, frame, seconds):
+        self.seen.append((g, frame.f_code.co_name, seconds))
+
+    def test_blocked(self):
+        s = greenstack.Scheduler()
+
+        def blocker():
+            greenstack.sleep(0.01)
+            spin(0.3)
+
+        with greenstack.Watchdog(0.05, self.report) as w:
+            self.assertTrue(w.running)
+            g = s.spawn(blocker)
+            s.run()
+        self.assertFalse(w.running)
+        self.assertEqual(w.reports, 1)
+        self.assertEqual(len(self.seen), 1)
+        self.assertTrue(self.seen[0][0] is g)
+        self.assertEqual(self.seen[0][1], 'spin')
+        self.assertTrue(self.seen[0][2] >= 0.05)
+
+    def test_blocked_in_call(self):
+        s = greenstack.Scheduler()
+
+        def sleeper():
+            time.sleep(0.2)
+
+        with greenstack.Watchdog(0.05, self.report):
+            s.spawn(sleeper)
+            s.run()
+        self.assertEqual(len(self.seen), 1)
+        self.assertEqual(self.seen[0][1], 'sleeper')
+
+    def test_idle(self):
+        s = greenstack.Scheduler()
+
+        def waiter():
+            for i in range(3):
+                greenstack.sleep(0.1)
+
+        with greenstack.Watchdog(0.05, self.report) as w:
+            s.spawn(waiter)
+            s.run()
+        self.assertEqual(w.reports, 0)
+
+    def test_busy_switching(self):
+        s = greenstack.Scheduler()
+
+        def worker():
+            end = time.time() + 0.2
+            while time.time() < end:
+                s.yield_()
+
+        with greenstack.Watchdog(0.05, self.report):
+            s.spawn(worker)
+            s.spawn(worker)
+            s.run()
+        self.assertEqual(self.seen, [])
+
+    def test_stop(self):
+        w = greenstack.Watchdog(0.02, self.report)
+        w.start()
+        w.stop()
+        spin(0.1)
+        self.assertEqual(self.seen, [])
+        w.start()
+        spin(0.1)
+        w.stop()
+        self.assertEqual(len(self.seen), 1)
+
+    def test_arguments(self):
+        self.assertRaises(ValueError, greenstack.Watchdog, 0)
+        self.assertRaises(TypeError, greenstack.Watchdog, 1, 42)
+        self.assertEqual(greenstack.Watchdog(0.25).threshold, 0.25)